@@ -20,6 +20,7 @@
 #include "player.h"
 #include "server_stat.h"
 #include "log.h"
+#include "send_batch.h"
 
 #include <assert.h>
 #include <stdio.h>
@@ -36,7 +37,6 @@ void send_acknowledge(struct player *pl)
 {
 	char *data, *ptr;
 	size_t data_size = 16;
-	ssize_t err;
 
 	data = (void *)calloc(data_size, sizeof(char));
 	if (data == NULL) {
@@ -54,10 +54,7 @@ void send_acknowledge(struct player *pl)
 	/* check we filled the whole packet */
 	assert((ptr - data) == data_size);
 
-	err = sendto(pl->in_chan->in_server->socket_desc, data, data_size, 0, (struct sockaddr *)pl->cli_addr, pl->cli_len);
-	if (err == -1) {
-		logger(LOG_ERR, "send_acknowledge, sending data failed : %s.", strerror(errno));
-	}
+	sb_send(pl->in_chan->in_server, data, data_size, pl->cli_addr, pl->cli_len);
 	pl->f1_s_counter++;
 	free(data);
 }
@@ -25,63 +25,177 @@
 #include <math.h>
 #include <limits.h>
 #include <errno.h>
+#include <stdint.h>
 
 #include "array.h"
 #include "log.h"
 #include "compat.h"
 
+/* smallest table of references */
+#define AR_MIN_REFS 8
+
+static size_t ref_hash(const struct array *a, const void *el)
+{
+	uint64_t h = (uint64_t)(uintptr_t)el;
+
+	return (size_t)((h * 0x9E3779B97F4A7C15ULL) >> 32) & (a->refs_size - 1);
+}
+
 /**
- * Find the next available slot in the array.
+ * Find the position of an element in the table of references.
  *
  * @param a the array
+ * @param el the element
  *
- * @return the first slot available, or -1 if the array is already full
+ * @return the position in a->refs, or -1 if it is not in the array
  */
-static int ar_next_available(const struct array *a)
+static ssize_t ref_find(const struct array *a, const void *el)
 {
-	size_t i;
+	size_t pos = ref_hash(a, el);
 
-	for (i = 0 ; i < a->total_slots ; i++) {
-		if(a->array[i] == NULL)
-			return (int)i;
+	while (a->refs[pos].el != NULL) {
+		if (a->refs[pos].el == el)
+			return (ssize_t)pos;
+		pos = (pos + 1) & (a->refs_size - 1);
 	}
 	return -1;
 }
 
+static void ref_add(struct array *a, void *el, size_t idx)
+{
+	size_t pos = ref_hash(a, el);
+
+	while (a->refs[pos].el != NULL)
+		pos = (pos + 1) & (a->refs_size - 1);
+	a->refs[pos].el = el;
+	a->refs[pos].idx = idx;
+}
+
 /**
- * Grow an array to twice its current size
+ * Remove a reference, moving back the ones after it
+ * so that no lookup stops on the hole.
  *
- * @param a the array that needs to be grown
+ * @param a the array
+ * @param pos the position of the reference in a->refs
  */
-static int ar_grow(struct array *a)
+static void ref_del(struct array *a, size_t pos)
 {
-	size_t old_size, new_size;
-	void **tmp_alloc;
+	size_t mask = a->refs_size - 1;
+	size_t next = (pos + 1) & mask;
+	size_t home;
 
-	if (a == NULL || a->array == NULL) {
-		logger(LOG_WARN, "ar_grow : passed array is not allocated.");
-		return 0;
+	while (a->refs[next].el != NULL) {
+		home = ref_hash(a, a->refs[next].el);
+		/* the entry can move to pos if pos is between its home and next */
+		if (((next - home) & mask) >= ((next - pos) & mask)) {
+			a->refs[pos] = a->refs[next];
+			pos = next;
+		}
+		next = (next + 1) & mask;
 	}
+	a->refs[pos].el = NULL;
+}
 
-	if (a->total_slots < a->max_slots) {
-		old_size = a->total_slots;
-		new_size = MIN(a->total_slots * 2, a->max_slots);
+/**
+ * Rebuild the table of references after the elements
+ * moved, making it at least twice as large as the array.
+ *
+ * @param a the array
+ *
+ * @return AR_OK on success, 0 if the allocation failed
+ */
+static int ref_rebuild(struct array *a)
+{
+	size_t size = AR_MIN_REFS, i;
+	struct ar_ref *tmp_alloc;
 
-		a->total_slots = new_size;
-		tmp_alloc = (void **)realloc(a->array, sizeof(void *) * (a->total_slots));
+	while (size < a->total_slots * 2)
+		size *= 2;
+	if (size != a->refs_size) {
+		tmp_alloc = (struct ar_ref *)realloc(a->refs, size * sizeof(struct ar_ref));
 		if (tmp_alloc == NULL) {
-			logger(LOG_ERR, "ar_grow, realloc failed : %s", strerror(errno));
+			logger(LOG_ERR, "ref_rebuild, realloc failed : %s", strerror(errno));
 			return 0;
 		}
-		a->array = tmp_alloc;
+		a->refs = tmp_alloc;
+		a->refs_size = size;
+	}
+	bzero(a->refs, a->refs_size * sizeof(struct ar_ref));
+	for (i = 0 ; i < a->end ; i++) {
+		if (a->array[i] != NULL)
+			ref_add(a, a->array[i], i);
+	}
+	return AR_OK;
+}
 
-		/* realloc does not set to zero!! */
-		bzero(a->array + old_size, (a->total_slots - old_size) * sizeof(void *));
-		return AR_OK;
+/**
+ * Resize the slots of an array.
+ *
+ * @param a the array
+ * @param new_size the new number of slots
+ *
+ * @return AR_OK on success, 0 if the allocation failed
+ */
+static int ar_resize(struct array *a, size_t new_size)
+{
+	void **tmp_alloc;
+	size_t *tmp_free;
+	size_t old_size = a->total_slots;
+
+	tmp_alloc = (void **)realloc(a->array, sizeof(void *) * new_size);
+	if (tmp_alloc == NULL) {
+		logger(LOG_ERR, "ar_resize, realloc failed : %s", strerror(errno));
+		return 0;
+	}
+	a->array = tmp_alloc;
+	tmp_free = (size_t *)realloc(a->free_slots, sizeof(size_t) * new_size);
+	if (tmp_free == NULL) {
+		logger(LOG_ERR, "ar_resize, realloc failed : %s", strerror(errno));
+		return 0;
 	}
+	a->free_slots = tmp_free;
+	a->total_slots = new_size;
+	/* realloc does not set to zero!! */
+	if (new_size > old_size)
+		bzero(a->array + old_size, (new_size - old_size) * sizeof(void *));
+	return ref_rebuild(a);
+}
+
+/**
+ * Grow an array to twice its current size
+ *
+ * @param a the array that needs to be grown
+ */
+static int ar_grow(struct array *a)
+{
+	if (a == NULL || a->array == NULL) {
+		logger(LOG_WARN, "ar_grow : passed array is not allocated.");
+		return 0;
+	}
+
+	if (a->total_slots < a->max_slots)
+		return ar_resize(a, MIN(a->total_slots * 2, a->max_slots));
 	return 0;
 }
 
+/**
+ * Find the next available slot in the array :
+ * the last hole that was made, or the slot after
+ * the last element.
+ *
+ * @param a the array
+ *
+ * @return the first slot available, or -1 if the array is already full
+ */
+static ssize_t ar_next_available(struct array *a)
+{
+	if (a->nb_free > 0)
+		return (ssize_t)a->free_slots[--a->nb_free];
+	if (a->end < a->total_slots)
+		return (ssize_t)a->end++;
+	return -1;
+}
+
 /**
  * Insert an element into the array, resizing if needed
  *
@@ -92,9 +206,13 @@ static int ar_grow(struct array *a)
  */
 int ar_insert(struct array *a, void *elem)
 {
-	int i;
+	ssize_t i;
 	int err;
 
+	if (elem == NULL) {
+		logger(LOG_WARN, "ar_insert : cannot insert a NULL element.");
+		return 0;
+	}
 	pthread_mutex_lock(&a->lock);
 	if (a->used_slots == a->total_slots) {
 		err = ar_grow(a);
@@ -108,6 +226,7 @@ int ar_insert(struct array *a, void *elem)
 	if (i != -1) {
 		a->array[i] = elem;
 		a->used_slots++;
+		ref_add(a, elem, (size_t)i);
 		pthread_mutex_unlock(&a->lock);
 		return AR_OK;
 	}
@@ -131,12 +250,18 @@ struct array *ar_new(size_t size)
 		logger(LOG_ERR, "ar_new, calloc failed : %s", strerror(errno));
 		return NULL;
 	}
+	if (size == 0)
+		size = 1;
 	a->total_slots = size;
 	a->used_slots = 0;
 	a->max_slots = (size_t) - 1;
 	a->array = (void **)calloc(size, sizeof(void *));
-	if (a->array == NULL) {
+	a->free_slots = (size_t *)calloc(size, sizeof(size_t));
+	if (a->array == NULL || a->free_slots == NULL || ref_rebuild(a) != AR_OK) {
 		logger(LOG_ERR, "ar_new, a->array calloc failed : %s", strerror(errno));
+		free(a->array);
+		free(a->free_slots);
+		free(a->refs);
 		free(a);
 		return NULL;
 	}
@@ -145,9 +270,9 @@ struct array *ar_new(size_t size)
 }
 
 /**
- * Remove the entry at the given index in the array
- * and shrinks the array if necessary.
- * Shrinking is not implemented yet.
+ * Remove the entry at the given index in the array.
+ * The other elements do not move, so the array can
+ * be iterated on at the same time.
  *
  * @param a the array
  * @param index the index of the element that has to be removed
@@ -161,10 +286,11 @@ static void ar_remove_index(struct array *a, size_t idx)
 	if (a->array[idx] != NULL) {
 		a->array[idx] = NULL; /* clear the pointer */
 		a->used_slots--;
+		if (idx == a->end - 1)
+			a->end--;
+		else
+			a->free_slots[a->nb_free++] = idx;
 	}
-	return;
-	/* Add some table shrinking logic 
-	 * if too many slots are unused */
 }
 
 /**
@@ -177,16 +303,15 @@ static void ar_remove_index(struct array *a, size_t idx)
  */
 void ar_remove(struct array *a, void *el) 
 {
-	size_t i;
+	ssize_t pos;
 	char found = 0;
 
 	pthread_mutex_lock(&a->lock);
-
-	for (i=0 ; i < a->total_slots ; i++) {
-		if (a->array[i] == el) {
-			ar_remove_index(a, i);
-			found = 1;
-		}
+	/* the same element can have been inserted several times */
+	while (el != NULL && (pos = ref_find(a, el)) != -1) {
+		ar_remove_index(a, a->refs[pos].idx);
+		ref_del(a, (size_t)pos);
+		found = 1;
 	}
 	pthread_mutex_unlock(&a->lock);
 	if (found == 0)
@@ -216,7 +341,14 @@ int ar_get_n_elems_start_at(struct array *a, int max_elem, size_t start_at, void
 		return 0;
 	}
 
-	for (i=0 ; i < a->total_slots ; i++) {
+	/* no hole : the elements can be copied directly */
+	if (a->nb_free == 0) {
+		el_counter = (int)MIN((size_t)max_elem, a->end - start_at);
+		memcpy(res, a->array + start_at, el_counter * sizeof(void *));
+		pthread_mutex_unlock(&a->lock);
+		return el_counter;
+	}
+	for (i=0 ; i < a->end ; i++) {
 		if (a->array[i] != NULL) {
 			if (nb_elem >= start_at && nb_elem < (start_at + max_elem)) {
 				res[nb_elem - start_at] = a->array[i];
@@ -231,7 +363,6 @@ int ar_get_n_elems_start_at(struct array *a, int max_elem, size_t start_at, void
 
 int ar_free(struct array *a)
 {
-	size_t i;
 	pthread_mutex_lock(&a->lock);
 	/* if the array is not allocated, we cannot free it */
 	if (a == NULL || a->array == NULL) {
@@ -241,14 +372,14 @@ int ar_free(struct array *a)
 	}
 
 	/* if the array is not empty, we cannot free it */
-	for (i = 0 ; i < a->total_slots ; i++) {
-		if (a->array[i] != NULL) {
-			logger(LOG_ERR, "ar_free : Trying to free an array that is not empty.");
-			pthread_mutex_unlock(&a->lock);
-			return 0;
-		}
+	if (a->used_slots != 0) {
+		logger(LOG_ERR, "ar_free : Trying to free an array that is not empty.");
+		pthread_mutex_unlock(&a->lock);
+		return 0;
 	}
 	free(a->array);
+	free(a->free_slots);
+	free(a->refs);
 	pthread_mutex_unlock(&a->lock);
 	pthread_mutex_destroy(&a->lock);
 	free(a);
@@ -257,12 +388,12 @@ int ar_free(struct array *a)
 
 int ar_has(struct array *a, void *el)
 {
-	size_t iter;
-	void *tmp_el;
+	int res;
 
-	ar_each(void *, tmp_el, iter, a)
-		if (tmp_el == el)
-			return 1;
-	ar_end_each;
-	return 0;
+	if (el == NULL)
+		return 0;
+	pthread_mutex_lock(&a->lock);
+	res = (ref_find(a, el) != -1);
+	pthread_mutex_unlock(&a->lock);
+	return res;
 }
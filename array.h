@@ -21,12 +21,24 @@
 
 #include <pthread.h>
 
+/* index of an element, by pointer */
+struct ar_ref {
+	void *el;
+	size_t idx;
+};
+
 struct array {
 	void **array;
 	size_t used_slots;
 	size_t total_slots;
 	size_t max_slots;
 
+	size_t end;		/* one past the last slot in use */
+	size_t *free_slots;	/* stack of the holes before end */
+	size_t nb_free;
+	struct ar_ref *refs;	/* open addressing table of the elements */
+	size_t refs_size;	/* power of two */
+
 	pthread_mutex_t lock;
 };
 
@@ -34,7 +46,7 @@ struct array {
 #define AR_OK 1
 
 #define ar_each(type, el_ptr, iter, a)\
-for(iter=0 ; iter < a->total_slots ; iter++) {\
+for(iter=0 ; iter < a->end ; iter++) {\
 	if(a->array[iter] != NULL) {\
 		el_ptr = (type) a->array[iter];
 
@@ -24,6 +24,8 @@
 #include "array.h"
 #include "server_stat.h"
 #include "log.h"
+#include "send_batch.h"
+#include "voice_plane.h"
 
 #include <inttypes.h>
 #include <string.h>
@@ -41,94 +43,213 @@ size_t codec_nb_frames[13] = { 9, 3, 5, 4,	0, 5, 5, 5, 5, 5, 5, 5, 5};
 size_t codec_offset[13] = {6, 6, 6, 6, 0, 1, 1, 1, 1, 1, 1, 1, 1};
 
 
+/**
+ * Mark the audio plan of a channel as outdated. The control
+ * worker will rebuild it and publish it to the data plane.
+ * Call this whenever the members of the channel, their mutes,
+ * their addresses or the codec of the channel change.
+ *
+ * @param ch the channel
+ */
+void audio_plan_invalidate(struct channel *ch)
+{
+	if (ch == NULL)
+		return;
+	__atomic_store_n(&ch->audio_plan_dirty, 1, __ATOMIC_RELEASE);
+	if (ch->in_server != NULL)
+		voice_changed(ch->in_server);
+}
+
+/**
+ * Free an audio plan.
+ *
+ * @param plan the plan
+ */
+void destroy_audio_plan(struct audio_plan *plan)
+{
+	if (plan == NULL)
+		return;
+	free(plan->players);
+	free(plan->addrs);
+	free(plan->addr_lens);
+	free(plan->hdrs);
+	free(plan->muted_by);
+	free(plan);
+}
+
+/* a member of a plan being built, for add_mute() */
+struct plan_mutes {
+	struct audio_plan *plan;
+	struct channel *ch;
+	unsigned int i;
+};
+
+/**
+ * Mark a player muted by a member of the plan being built,
+ * if he is in the same channel.
+ *
+ * @param tgt the public ID of the muted player
+ * @param arg the plan, the member and its channel
+ */
+static void add_mute(uint32_t tgt, void *arg)
+{
+	struct plan_mutes *pm = (struct plan_mutes *)arg;
+	struct player *muted;
+	unsigned int j;
+
+	muted = get_player_by_public_id(pm->ch->in_server, tgt);
+	if (muted == NULL || muted->in_chan != pm->ch)
+		return;
+	j = muted->audio_idx;
+	pm->plan->muted_by[j * pm->plan->words + pm->i / 64] |= (uint64_t)1 << (pm->i % 64);
+}
+
+/**
+ * Build the audio plan of a channel from its current members.
+ * Once published, a plan is never modified.
+ *
+ * @param ch the channel
+ *
+ * @return the plan, or NULL if an allocation failed
+ */
+struct audio_plan *build_audio_plan(struct channel *ch)
+{
+	struct audio_plan *plan;
+	struct plan_mutes pm;
+	struct player *pl;
+	size_t iter;
+	unsigned int i, n;
+	char *ptr;
+
+	plan = (struct audio_plan *)calloc(1, sizeof(struct audio_plan));
+	if (plan == NULL) {
+		logger(LOG_WARN, "build_audio_plan, calloc failed : %s.", strerror(errno));
+		return NULL;
+	}
+	n = ch->players->used_slots;
+	plan->words = (n + 63) / 64;
+	/* allocate one more member so an empty channel has valid arrays */
+	plan->players = (struct player **)calloc(n + 1, sizeof(struct player *));
+	plan->addrs = (struct sockaddr_in *)calloc(n + 1, sizeof(struct sockaddr_in));
+	plan->addr_lens = (socklen_t *)calloc(n + 1, sizeof(socklen_t));
+	plan->hdrs = (char (*)[8])calloc(n + 1, 8);
+	plan->muted_by = (uint64_t *)calloc(n * plan->words + 1, sizeof(uint64_t));
+	if (plan->players == NULL || plan->addrs == NULL || plan->addr_lens == NULL
+			|| plan->hdrs == NULL || plan->muted_by == NULL) {
+		logger(LOG_WARN, "build_audio_plan, calloc failed : %s.", strerror(errno));
+		destroy_audio_plan(plan);
+		return NULL;
+	}
+
+	/* index the members */
+	i = 0;
+	ar_each(struct player *, pl, iter, ch->players)
+		if (i == n)
+			break;
+		pl->audio_idx = i;
+		plan->players[i] = pl;
+		plan->addr_lens[i] = MIN(pl->cli_len, sizeof(struct sockaddr_in));
+		memcpy(&plan->addrs[i], pl->cli_addr, plan->addr_lens[i]);
+		ptr = plan->hdrs[i];
+		wu32(pl->private_id, &ptr);
+		wu32(pl->public_id, &ptr);
+		i++;
+	ar_end_each;
+	plan->nb = i;
+
+	/* mutes between members */
+	pm.plan = plan;
+	pm.ch = ch;
+	for (pm.i = 0 ; pm.i < plan->nb ; pm.i++)
+		mute_each(&ch->in_server->mutes, plan->players[pm.i]->public_id, &add_mute, &pm);
+	return plan;
+}
+
 /**
  * Handle a received audio packet by sending its audio
  * block to all the players in the same channel.
+ * This runs on the data plane : the sender and its channel
+ * are only known through the voice snapshot.
+ *
+ * The datagram forwarded to each player only differs by the
+ * private/public IDs at offset 4, so it is sent as the 4 first
+ * bytes and the rest shared by all the recipients, around the
+ * IDs taken from the audio plan of the channel.
  *
  * @param in the received packet
  * @param len size of the received packet
+ * @param s the server
+ * @param sender the entry of the player who sent the packet
  *
  * @return 0 on success, -1 on failure.
  */
-int audio_received(char *in, size_t len, struct server *s)
+int audio_received(char *in, size_t len, struct server *s, const struct voice_entry *sender)
 {
-	uint32_t pub_id, priv_id;
 	uint8_t data_codec;
-
-	struct player *sender;
-	struct channel *ch_in;
-	struct player *tmp_pl;
-
-	size_t data_size, audio_block_size, expected_size;
-	ssize_t err;
-	size_t iter;
-	char *data, *ptr, *ptrin;
+	struct audio_plan *plan = sender->plan;
+	size_t audio_block_size, expected_size;
+	unsigned int i, j;
+	size_t w;
+	uint64_t *row, bits;
+	char head[4];
+	char tail[10 + 320];
+	char *ptr, *ptrin;
 	
 	ptrin = in;
 	ptrin += 3;
 	data_codec = ru8(&ptrin);
-	priv_id = ru32(&ptrin);
-	pub_id = ru32(&ptrin);
-	
-	sender = get_player_by_ids(s, pub_id, priv_id);
-
-	if (sender != NULL) {
-		sender->stats->activ_time = time(NULL);	/* update */
-		ch_in = sender->in_chan;
-		/* Security checks */
-		if (data_codec != ch_in->codec) {
-			logger(LOG_ERR, "Player sent a wrong codec ID : %" PRIu8 ", expected : %" PRIu8 ".", data_codec, ch_in->codec);
-			return -1;
-		}
 
-		audio_block_size = codec_offset[(int)data_codec] + codec_audio_size[(int)data_codec];
-		expected_size = 16 + audio_block_size;
-		if (len != expected_size) {
-			logger(LOG_ERR, "Audio packet's size is incorrect : %zu bytes, expected : %zu.", len,
-					expected_size);
-			return -1;
-		}
+	sender->pl->stats->activ_time = time(NULL);	/* update */
+	/* Security checks */
+	if (data_codec != sender->codec || data_codec > CODEC_SPEEX_25_9) {
+		logger(LOG_ERR, "Player sent a wrong codec ID : %" PRIu8 ", expected : %" PRIu8 ".", data_codec, sender->codec);
+		return -1;
+	}
 
-		/* Initialize the packet we want to send */
-		data_size = len + 6; /* we will add the id of player sending */
-		data = (char *)calloc(data_size, sizeof(char));
-		if (data == NULL) {
-			logger(LOG_WARN, "audio_received, could not allocate packet : %s.", strerror(errno));
-			return -1;
-		}
-		ptr = data;
-		wu16(0xbef3, &ptr); 			/* function code */
-		/* 1 byte empty */				ptr += 1;		/* NULL */
-		wu8(ch_in->codec, &ptr);		/* codec */
-		/* private ID */				ptr += 4;		/* empty yet */
-		/* public ID */					ptr += 4;		/* empty yet */
-		wu16(0, &ptr);				/* unknown, maybe server conversation ID? */
-		wu16(*(uint16_t *)(in + 14), &ptr);	/* counter */
-		wu32(sender->public_id, &ptr);		/* ID of sender */
-		wu16(*(uint16_t *)(in + 12), &ptr);	/* conversation counter */
-		/* audio data */
-		memcpy(ptr, in + 16, audio_block_size);
-		ptr += audio_block_size;
-
-		/* assert we filled the whole packet */
-		assert((ptr - data) == data_size);
-
-		ar_each(struct player *, tmp_pl, iter, ch_in->players)
-			if (tmp_pl != sender && !ar_has(tmp_pl->muted, sender)) {
-				ptr = data + 4;
-				wu32(tmp_pl->private_id, &ptr);
-				wu32(tmp_pl->public_id, &ptr);
-				err = sendto(sender->in_chan->in_server->socket_desc, data, data_size, 0,
-						(struct sockaddr *)tmp_pl->cli_addr, tmp_pl->cli_len);
-				if (err == -1) {
-					logger(LOG_WARN, "audio_received, could not send packet : %s.", strerror(errno));
-				}
-			}
-		ar_end_each;
-		free(data);
-		return 0;
-	} else {
-		logger(LOG_ERR, "Wrong public/private ID pair : %x/%x.", pub_id, priv_id);
+	audio_block_size = codec_offset[(int)data_codec] + codec_audio_size[(int)data_codec];
+	expected_size = 16 + audio_block_size;
+	if (len != expected_size) {
+		logger(LOG_ERR, "Audio packet's size is incorrect : %zu bytes, expected : %zu.", len,
+				expected_size);
+		return -1;
+	}
+	if (plan == NULL)
+		return -1;
+	j = sender->audio_idx;
+
+	/* Initialize the parts of the packet shared by all the recipients */
+	ptr = head;
+	wu16(0xbef3, &ptr); 			/* function code */
+	wu8(0, &ptr);				/* NULL */
+	wu8(data_codec, &ptr);			/* codec */
+	/* private ID, public ID : per recipient */
+	ptr = tail;
+	wu16(0, &ptr);				/* unknown, maybe server conversation ID? */
+	wu16(*(uint16_t *)(in + 14), &ptr);	/* counter */
+	wu32(sender->pl->public_id, &ptr);	/* ID of sender */
+	wu16(*(uint16_t *)(in + 12), &ptr);	/* conversation counter */
+	/* audio data */
+	memcpy(ptr, in + 16, audio_block_size);
+	ptr += audio_block_size;
+
+	/* assert we filled the whole packet */
+	assert(sizeof(head) + 8 + (ptr - tail) == len + 6);
+
+	if (!sb_fanout_begin(s, head, sizeof(head), tail, ptr - tail))
 		return -1;
+	/* the recipients are the members that did not mute the sender,
+	 * a word of them at a time */
+	row = plan->muted_by + (size_t)j * plan->words;
+	for (w = 0 ; w * 64 < plan->nb ; w++) {
+		bits = ~row[w];
+		if (w == j / 64)
+			bits &= ~((uint64_t)1 << (j % 64));
+		if (w == plan->nb / 64)
+			bits &= ((uint64_t)1 << (plan->nb % 64)) - 1;
+		for ( ; bits != 0 ; bits &= bits - 1) {
+			i = w * 64 + __builtin_ctzll(bits);
+			sb_fanout_add(plan->hdrs[i], 8, &plan->addrs[i], plan->addr_lens[i]);
+		}
 	}
+	return 0;
 }
@@ -21,6 +21,9 @@
 
 #include "server.h"
 
+#include <stdint.h>
+#include <netinet/in.h>
+
 #define CODEC_CELP_5_1    0
 #define CODEC_CELP_6_3    1
 #define CODEC_GSM_14_8    2
@@ -35,8 +38,31 @@
 #define CODEC_SPEEX_19_6  11
 #define CODEC_SPEEX_25_9  12
 
+struct player;
+struct channel;
+
+/**
+ * What is needed to forward the audio of one member of a
+ * channel to the others, rebuilt by the control worker only
+ * when the members, their mutes or their addresses change.
+ */
+struct audio_plan
+{
+	unsigned int nb;		/* number of members */
+	struct player **players;	/* member i (player->audio_idx == i) */
+	struct sockaddr_in *addrs;	/* address of member i */
+	socklen_t *addr_lens;
+	char (*hdrs)[8];		/* private and public ID of member i */
+	size_t words;			/* size of a muted_by row */
+	uint64_t *muted_by;		/* bit i of row j : member i muted member j */
+};
+
 struct server;
+struct voice_entry;
 
-int audio_received(char *in, size_t len, struct server *s);
+int audio_received(char *in, size_t len, struct server *s, const struct voice_entry *sender);
+struct audio_plan *build_audio_plan(struct channel *ch);
+void audio_plan_invalidate(struct channel *ch);
+void destroy_audio_plan(struct audio_plan *plan);
 
 #endif
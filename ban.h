@@ -22,10 +22,13 @@
 
 #include <netinet/in.h>
 
+#include "timer_wheel.h"
+
 struct ban
 {
 	uint16_t id;
-	uint16_t duration;
+	uint16_t duration;	/* in minutes, 0 = unlimited */
+	struct tw_timer expire_timer;
 	char *ip;
 	char *reason;
 };
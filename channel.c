@@ -20,6 +20,7 @@
 #include "array.h"
 #include "log.h"
 #include "database.h"
+#include "server.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -43,6 +44,11 @@ int destroy_channel(struct channel *chan)
 	free(chan->topic);
 	free(chan->desc);
 	ar_free(chan->players);
+	/* the data plane may still be reading the audio plan */
+	if (chan->audio_plan != NULL && chan->in_server != NULL)
+		voice_retire(chan->in_server, chan->audio_plan, (void (*)(void *))destroy_audio_plan);
+	else
+		destroy_audio_plan(chan->audio_plan);
 
 	/* destroy privileges */
 	ar_each(void *, el, iter, chan->pl_privileges)
@@ -163,6 +169,7 @@ int add_player_to_channel(struct channel *chan, struct player *pl)
 
 	if (ar_insert(chan->players, pl) == AR_OK) {
 		pl->in_chan = chan;
+		audio_plan_invalidate(chan);
 		return 1;
 	}
 	return 0;
@@ -273,6 +280,7 @@ int channel_remove_subchannel(struct channel *ch, struct channel *subchannel)
 	}
 	ar_remove(ch->subchannels, subchannel);
 	subchannel->parent = NULL;
+	chan_list_changed(ch->in_server);
 
 	return 1;
 }
@@ -287,6 +295,7 @@ int channel_add_subchannel(struct channel *ch, struct channel *subchannel)
 		channel_remove_subchannel(subchannel->parent, subchannel);
 	subchannel->parent = ch;
 	ar_insert(ch->subchannels, subchannel);
+	chan_list_changed(ch->in_server);
 	return 1;
 }
 
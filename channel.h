@@ -46,6 +46,9 @@ struct channel {
 
 	struct array *players;
 	struct server *in_server;
+	/* audio forwarding, rebuilt when audio_plan_dirty is set */
+	struct audio_plan *audio_plan;
+	int audio_plan_dirty;
 	/* channel tree */
 	struct array *subchannels;
 	/* player privileges */
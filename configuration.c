@@ -18,6 +18,7 @@
 
 #include "configuration.h"
 #include "log.h"
+#include "config.h"
 
 #include <libconfig.h>
 #include <string.h>
@@ -51,6 +52,8 @@ void destroy_config(struct config *c)
 		}
 		free(c->db_type);
 	}
+	if (c->snapshot.dir != NULL)
+		free(c->snapshot.dir);
 	free(c);
 }
 
@@ -86,6 +89,86 @@ static int config_parse_log(config_setting_t *log, struct config *cfg)
 	return 1;
 }
 
+static int config_parse_net(config_setting_t *net, struct config *cfg)
+{
+	config_setting_t *curr;
+
+	/* defaults, used when there is no net tag */
+	cfg->net.recv_batch = 32;
+	cfg->net.send_window = 8;
+	cfg->net.recv_threads = 1;
+	cfg->net.backend = NET_BACKEND_POLL;
+	if (net == NULL)
+		return 1;
+
+	/* number of datagrams read by a single recvmmsg() */
+	curr = config_setting_get_member(net, "recv_batch");
+	if (curr != NULL)
+		cfg->net.recv_batch = config_setting_get_int(curr);
+	if (cfg->net.recv_batch < 1 || cfg->net.recv_batch > 1024) {
+		logger(LOG_WARN, "config_parse_net : recv_batch must be between 1 and 1024, using 32.");
+		cfg->net.recv_batch = 32;
+	}
+
+	/* number of unacknowledged control packets per player */
+	curr = config_setting_get_member(net, "send_window");
+	if (curr != NULL)
+		cfg->net.send_window = config_setting_get_int(curr);
+	if (cfg->net.send_window < 1 || cfg->net.send_window > 256) {
+		logger(LOG_WARN, "config_parse_net : send_window must be between 1 and 256, using 8.");
+		cfg->net.send_window = 8;
+	}
+
+	/* number of sockets and threads receiving the datagrams of a server */
+	curr = config_setting_get_member(net, "recv_threads");
+	if (curr != NULL)
+		cfg->net.recv_threads = config_setting_get_int(curr);
+	if (cfg->net.recv_threads < 1 || cfg->net.recv_threads > 64) {
+		logger(LOG_WARN, "config_parse_net : recv_threads must be between 1 and 64, using 1.");
+		cfg->net.recv_threads = 1;
+	}
+
+	/* how the datagrams are received */
+	curr = config_setting_get_member(net, "backend");
+	if (curr != NULL && config_setting_get_string(curr) != NULL) {
+		if (strcmp(config_setting_get_string(curr), "io_uring") == 0) {
+#ifdef HAVE_IO_URING
+			cfg->net.backend = NET_BACKEND_URING;
+#else
+			logger(LOG_WARN, "config_parse_net : built without io_uring, using poll.");
+#endif
+		} else if (strcmp(config_setting_get_string(curr), "poll") != 0)
+			logger(LOG_WARN, "config_parse_net : backend must be poll or io_uring, using poll.");
+	}
+	return 1;
+}
+
+static int config_parse_snapshot(config_setting_t *snap, struct config *cfg)
+{
+	config_setting_t *curr;
+
+	/* defaults, used when there is no snapshot tag */
+	cfg->snapshot.dir = NULL;
+	cfg->snapshot.period = 300;
+	if (snap == NULL)
+		return 1;
+
+	/* where the snapshots of the servers are written */
+	curr = config_setting_get_member(snap, "dir");
+	if (curr != NULL && config_setting_get_string(curr) != NULL)
+		cfg->snapshot.dir = strdup(config_setting_get_string(curr));
+
+	/* seconds between two snapshots of a running server */
+	curr = config_setting_get_member(snap, "period");
+	if (curr != NULL)
+		cfg->snapshot.period = config_setting_get_int(curr);
+	if (cfg->snapshot.period < -1) {
+		logger(LOG_WARN, "config_parse_snapshot : period must be -1, 0 or a number of seconds, using 300.");
+		cfg->snapshot.period = 300;
+	}
+	return 1;
+}
+
 static int config_parse_db_sqlite(config_setting_t *db, struct config *cfg)
 {
 	config_setting_t *curr;
@@ -175,6 +258,8 @@ struct config *config_parse(char *cfg_file)
 	config_t cfg;
 	config_setting_t *db;
 	config_setting_t *log;
+	config_setting_t *net;
+	config_setting_t *snap;
 	struct config *cfg_s;
 
 	config_init(&cfg);
@@ -214,6 +299,22 @@ struct config *config_parse(char *cfg_file)
 		return 0;
 	}
 
+	/* the net tag is optional, every setting has a default */
+	net = config_lookup(&cfg, "net");
+	if (config_parse_net(net, cfg_s) == 0) {
+		logger(LOG_ERR, "config_parse_net failed.");
+		config_destroy(&cfg);
+		return 0;
+	}
+
+	/* the snapshot tag is optional too */
+	snap = config_lookup(&cfg, "snapshot");
+	if (config_parse_snapshot(snap, cfg_s) == 0) {
+		logger(LOG_ERR, "config_parse_snapshot failed.");
+		config_destroy(&cfg);
+		return 0;
+	}
+
 	config_destroy(&cfg);
 	return cfg_s;
 }
@@ -23,6 +23,13 @@
 #include <dbi/dbi.h>
 #include <stdio.h>
 
+struct db_queue;
+struct db_stmts;
+
+/* values of net.backend */
+#define NET_BACKEND_POLL 0
+#define NET_BACKEND_URING 1
+
 struct config
 {
 	char *db_type;
@@ -43,7 +50,19 @@ struct config
 		FILE *output;
 		int level;
 	} log;
+	struct {
+		int recv_batch;
+		int send_window;
+		int recv_threads;
+		int backend;
+	} net;
+	struct {
+		char *dir;	/* NULL : the directory of the sqlite database */
+		int period;	/* seconds between snapshots, 0 : at shutdown only, -1 : none */
+	} snapshot;
 	dbi_conn conn;
+	struct db_queue *dbq;	/* writes, done by the persistence worker */
+	struct db_stmts *stmts;	/* statements of the persistence worker */
 };
 
 void destroy_config(struct config *c);
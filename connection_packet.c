@@ -34,6 +34,7 @@
 #include "registration.h"
 #include "server_privileges.h"
 #include "log.h"
+#include "send_batch.h"
 
 
 /**
@@ -89,7 +90,7 @@ static void server_accept_connection(struct player *pl)
 	packet_add_crc(data, 436, 16);
 	/* Send packet */
 	/*send_to(pl->in_chan->in_server, data, 436, 0, pl);*/
-	sendto(pl->in_chan->in_server->socket_desc, data, 436, 0, (struct sockaddr *)pl->cli_addr, pl->cli_len);
+	sb_send(s, data, 436, pl->cli_addr, pl->cli_len);
 	pl->f4_s_counter++;
 	free(data);
 }
@@ -140,7 +141,7 @@ static void server_refuse_connection_ban(struct sockaddr_in *cli_addr, int cli_l
 	/* Add CRC */
 	packet_add_crc(data, 436, 16);
 	/* Send packet */
-	sendto(s->socket_desc, data, 436, 0, (struct sockaddr *)cli_addr, cli_len);
+	sb_send(s, data, 436, cli_addr, cli_len);
 	free(data);
 }
 
@@ -204,7 +205,11 @@ void handle_player_connect(char *data, unsigned int len, struct sockaddr_in *cli
 	}
 
 	/* Add player to the pool */
-	add_player(s, pl);
+	if (!add_player(s, pl) && pl->public_id == 0) {
+		logger(LOG_WARN, "handle_player_connect : the server is full.");
+		destroy_player(pl);
+		return;
+	}
 	/* Send a message to the client indicating he has been accepted */
 
 	/* Send server information to the player (0xf4be0400) */
@@ -250,7 +255,7 @@ static void s_resp_keepalive(struct player *pl, uint32_t ka_id)
 	/* Add CRC */
 	packet_add_crc(data, 24, 16);
 
-	sendto(pl->in_chan->in_server->socket_desc, data, 24, 0, (struct sockaddr *)pl->cli_addr, pl->cli_len);
+	sb_send(pl->in_chan->in_server, data, 24, pl->cli_addr, pl->cli_len);
 	pl->f4_s_counter++;
 	free(data);
 }
@@ -262,23 +267,17 @@ static void s_resp_keepalive(struct player *pl, uint32_t ka_id)
  *
  * @param data the connection packet
  * @param len the length of the connection packet
- * @param cli_addr the adress of the client
- * @param cli_len the length of cli_addr
+ * @param pl the player who sent the keepalive (NULL if unknown)
  */
-void handle_player_keepalive(char *data, unsigned int len, struct server *s)
+void handle_player_keepalive(char *data, unsigned int len, struct player *pl)
 {
-	struct player *pl;
 	char *ptr = data;
-	uint32_t pub_id, priv_id, ka_id;
+	uint32_t ka_id;
 	/* Check crc */
-	if(!packet_check_crc(data, len, 16))
+	if(len < 20 || !packet_check_crc(data, len, 16))
 		return;
-	/* Retrieve the player */
-	ptr += 4;
-	priv_id = ru32(&ptr);
-	pub_id = ru32(&ptr);
+	ptr += 12;	/* private and public ID, already resolved */
 	ka_id = ru32(&ptr); 	/* Get the counter */
-	pl = get_player_by_ids(s, pub_id, priv_id);
 	if (pl == NULL) {
 		logger(LOG_WARN, "handle_player_keepalive : pl == NULL. Why????");
 		return;
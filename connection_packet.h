@@ -24,6 +24,6 @@
 #include "server.h"
 
 void handle_player_connect(char *data, unsigned int len, struct sockaddr_in *cli_addr, unsigned int cli_len, struct server *s);
-void handle_player_keepalive(char *data, unsigned int len, struct server *s);
+void handle_player_keepalive(char *data, unsigned int len, struct player *pl);
 
 #endif
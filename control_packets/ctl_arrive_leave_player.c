@@ -23,6 +23,7 @@
 #include "packet_tools.h"
 #include "acknowledge_packet.h"
 #include "server_stat.h"
+#include "packet_pool.h"
 
 #include <errno.h>
 #include <string.h>
@@ -42,7 +43,7 @@ void s_notify_new_player(struct player *pl)
 	size_t iter;
 
 	data_size = 24 + player_to_data_size(pl);
-	data = (char *)calloc(data_size, sizeof(char));
+	data = (char *)pkt_alloc(data_size);
 	if (data == NULL) {
 		logger(LOG_WARN, "s_notify_new_player, packet allocation failed : %s.", strerror(errno));
 		return;
@@ -58,18 +59,16 @@ void s_notify_new_player(struct player *pl)
 	player_to_data(pl, ptr);
 	
 	/* customize and send for each player on the server */
+	/* checksum once, then patch it for each recipient */
+	packet_add_crc_d(data, data_size);
 	ar_each(struct player *, tmp_pl, iter, s->players)
 		if (tmp_pl != pl) {
-			ptr = data + 4;
-			wu32(tmp_pl->private_id, &ptr);
-			wu32(tmp_pl->public_id, &ptr);
-			wu32(tmp_pl->f0_s_counter, &ptr);
-			packet_add_crc_d(data, data_size);
-			send_to(s, data, data_size, 0, tmp_pl);
+			packet_patch_header_d(data, data_size, tmp_pl->private_id, tmp_pl->public_id, tmp_pl->f0_s_counter);
+			send_to(s, pkt_dup(data, data_size), data_size, 0, tmp_pl);
 			tmp_pl->f0_s_counter++;
 		}
 	ar_end_each;
-	free(data);
+	pkt_free(data);
 }
 
 void s_notify_server_stopping(struct server *s)
@@ -79,7 +78,7 @@ void s_notify_server_stopping(struct server *s)
 	int data_size = 64;
 	size_t iter;
 
-	data = (char *)calloc(data_size, sizeof(char));
+	data = (char *)pkt_alloc(data_size);
 	if (data == NULL) {
 		logger(LOG_WARN, "s_notify_player_left, packet allocation failed : %s.", strerror(errno));
 		return;
@@ -102,10 +101,10 @@ void s_notify_server_stopping(struct server *s)
 		assert((ptr - data) == data_size);
 
 		packet_add_crc_d(data, data_size);
-		send_to(s, data, data_size, 0, tmp_pl);
+		send_to(s, pkt_dup(data, data_size), data_size, 0, tmp_pl);
 		tmp_pl->f0_s_counter++;
 	ar_end_each;
-	free(data);
+	pkt_free(data);
 }
 
 /**
@@ -121,7 +120,7 @@ void s_notify_player_left(struct player *p)
 	struct server *s = p->in_chan->in_server;
 	size_t iter;
 
-	data = (char *)calloc(data_size, sizeof(char));
+	data = (char *)pkt_alloc(data_size);
 	if (data == NULL) {
 		logger(LOG_WARN, "s_notify_player_left, packet allocation failed : %s.", strerror(errno));
 		return;
@@ -142,16 +141,14 @@ void s_notify_player_left(struct player *p)
 	/* check we filled all the packet */
 	assert((ptr - data) == data_size);
 
+	/* checksum once, then patch it for each recipient */
+	packet_add_crc_d(data, data_size);
 	ar_each(struct player *, tmp_pl, iter, s->players)
-			ptr = data + 4;
-			wu32(tmp_pl->private_id, &ptr);
-			wu32(tmp_pl->public_id, &ptr);
-			wu32(tmp_pl->f0_s_counter, &ptr);
-			packet_add_crc_d(data, data_size);
-			send_to(s, data, data_size, 0, tmp_pl);
+			packet_patch_header_d(data, data_size, tmp_pl->private_id, tmp_pl->public_id, tmp_pl->f0_s_counter);
+			send_to(s, pkt_dup(data, data_size), data_size, 0, tmp_pl);
 			tmp_pl->f0_s_counter++;
 	ar_end_each;
-	free(data);
+	pkt_free(data);
 }
 
 
@@ -24,6 +24,7 @@
 #include "log.h"
 #include "packet_tools.h"
 #include "server_stat.h"
+#include "packet_pool.h"
 #include "acknowledge_packet.h"
 #include "database.h"
 
@@ -48,7 +49,7 @@ static void s_resp_chan_name_changed(struct player *pl, struct channel *ch, char
 
 	/* header size (24) + chan_id (4) + user_id (4) + name (?) */
 	data_size = 24 + 4 + 4 + (strlen(name) + 1);
-	data = (char *)calloc(data_size, sizeof(char));
+	data = (char *)pkt_alloc(data_size);
 	if (data == NULL) {
 		logger(LOG_WARN, "s_resp_chan_name_changed, packet allocation failed : %s.", strerror(errno));
 		return;
@@ -66,16 +67,14 @@ static void s_resp_chan_name_changed(struct player *pl, struct channel *ch, char
 	wu32(pl->public_id, &ptr);		/* player who changed */
 	strcpy(ptr, name);
 
+	/* checksum once, then patch it for each recipient */
+	packet_add_crc_d(data, data_size);
 	ar_each(struct player *, tmp_pl, iter, s->players)
-			ptr = data + 4;
-			wu32(tmp_pl->private_id, &ptr);
-			wu32(tmp_pl->public_id, &ptr);
-			wu32(tmp_pl->f0_s_counter, &ptr);
-			packet_add_crc_d(data, data_size);
-			send_to(s, data, data_size, 0, tmp_pl);
+			packet_patch_header_d(data, data_size, tmp_pl->private_id, tmp_pl->public_id, tmp_pl->f0_s_counter);
+			send_to(s, pkt_dup(data, data_size), data_size, 0, tmp_pl);
 			tmp_pl->f0_s_counter++;
 	ar_end_each;
-	free(data);
+	pkt_free(data);
 }
 
 /**
@@ -102,6 +101,7 @@ void *c_req_change_chan_name(char *data, unsigned int len, struct player *pl)
 			name = strdup(data + 28);
 			free(ch->name);
 			ch->name = name;
+			chan_list_changed(ch->in_server);
 			/* Update the channel in the db if it is registered */
 			if ((ch_getflags(ch) & CHANNEL_FLAG_UNREGISTERED) == 0) {
 				db_update_channel(ch->in_server->conf, ch);
@@ -130,7 +130,7 @@ static void s_resp_chan_topic_changed(struct player *pl, struct channel *ch, cha
 
 	/* header size (24) + chan_id (4) + user_id (4) + name (?) */
 	data_size = 24 + 4 + 4 + (strlen(topic) + 1);
-	data = (char *)calloc(data_size, sizeof(char));
+	data = (char *)pkt_alloc(data_size);
 	if (data == NULL) {
 		logger(LOG_WARN, "s_resp_chan_topic_changed, packet allocation failed : %s.", strerror(errno));
 		return;
@@ -148,16 +148,14 @@ static void s_resp_chan_topic_changed(struct player *pl, struct channel *ch, cha
 	wu32(pl->public_id, &ptr);		/* player who changed */
 	strcpy(ptr, topic);
 
+	/* checksum once, then patch it for each recipient */
+	packet_add_crc_d(data, data_size);
 	ar_each(struct player *, tmp_pl, iter, s->players)
-			ptr = data + 4;
-			wu32(tmp_pl->private_id, &ptr);
-			wu32(tmp_pl->public_id, &ptr);
-			wu32(tmp_pl->f0_s_counter, &ptr);
-			packet_add_crc_d(data, data_size);
-			send_to(s, data, data_size, 0, tmp_pl);
+			packet_patch_header_d(data, data_size, tmp_pl->private_id, tmp_pl->public_id, tmp_pl->f0_s_counter);
+			send_to(s, pkt_dup(data, data_size), data_size, 0, tmp_pl);
 			tmp_pl->f0_s_counter++;
 	ar_end_each;
-	free(data);
+	pkt_free(data);
 }
 
 /**
@@ -184,6 +182,7 @@ void *c_req_change_chan_topic(char *data, unsigned int len, struct player *pl)
 			topic = strdup(data + 28); /* FIXME : possible exploit */
 			free(ch->topic);
 			ch->topic = topic;
+			chan_list_changed(ch->in_server);
 			/* Update the channel in the db if it is registered */
 			if ((ch_getflags(ch) & CHANNEL_FLAG_UNREGISTERED) == 0) {
 				db_update_channel(ch->in_server->conf, ch);
@@ -212,7 +211,7 @@ static void s_resp_chan_desc_changed(struct player *pl, struct channel *ch, char
 
 	/* header size (24) + chan_id (4) + user_id (4) + name (?) */
 	data_size = 24 + 4 + 4 + (strlen(desc) + 1);
-	data = (char *)calloc(data_size, sizeof(char));
+	data = (char *)pkt_alloc(data_size);
 	if (data == NULL) {
 		logger(LOG_WARN, "s_resp_chan_desc_changed, packet allocation failed : %s.", strerror(errno));
 		return;
@@ -230,17 +229,15 @@ static void s_resp_chan_desc_changed(struct player *pl, struct channel *ch, char
 	wu32(pl->public_id, &ptr);		/* player who changed */
 	strcpy(ptr, desc);
 
+	/* checksum once, then patch it for each recipient */
+	packet_add_crc_d(data, data_size);
 	ar_each(struct player *, tmp_pl, iter, s->players)
-			ptr = data + 4;
-			wu32(tmp_pl->private_id, &ptr);
-			wu32(tmp_pl->public_id, &ptr);
-			wu32(tmp_pl->f0_s_counter, &ptr);
-			packet_add_crc_d(data, data_size);
-			send_to(s, data, data_size, 0, tmp_pl);
+			packet_patch_header_d(data, data_size, tmp_pl->private_id, tmp_pl->public_id, tmp_pl->f0_s_counter);
+			send_to(s, pkt_dup(data, data_size), data_size, 0, tmp_pl);
 			tmp_pl->f0_s_counter++;
 	ar_end_each;
 
-	free(data);
+	pkt_free(data);
 }
 
 /**
@@ -267,6 +264,7 @@ void *c_req_change_chan_desc(char *data, unsigned int len, struct player *pl)
 			desc = strdup(data + 28);	/* FIXME : possible exploit */
 			free(ch->desc);
 			ch->desc = desc;
+			chan_list_changed(ch->in_server);
 			/* Update the channel in the db if it is registered */
 			if ((ch_getflags(ch) & CHANNEL_FLAG_UNREGISTERED) == 0) {
 				db_update_channel(ch->in_server->conf, ch);
@@ -287,7 +285,7 @@ static void s_notify_channel_flags_codec_changed(struct player *pl, struct chann
 
 	/* header size (24) + chan_id (4) + user_id (4) + name (?) */
 	data_size = 24 + 4 + 4 + 2 + 2;
-	data = (char *)calloc(data_size, sizeof(char));
+	data = (char *)pkt_alloc(data_size);
 	if (data == NULL) {
 		logger(LOG_WARN, "s_notify_channel_flags_codec_changed, packet allocation failed : %s.", strerror(errno));
 		return;
@@ -309,16 +307,14 @@ static void s_notify_channel_flags_codec_changed(struct player *pl, struct chann
 	/* check we filled all the packet */
 	assert((ptr - data) == data_size);
 
+	/* checksum once, then patch it for each recipient */
+	packet_add_crc_d(data, data_size);
 	ar_each(struct player *, tmp_pl, iter, s->players)
-			ptr = data + 4;
-			wu32(tmp_pl->private_id, &ptr);
-			wu32(tmp_pl->public_id, &ptr);
-			wu32(tmp_pl->f0_s_counter, &ptr);
-			packet_add_crc_d(data, data_size);
-			send_to(s, data, data_size, 0, tmp_pl);
+			packet_patch_header_d(data, data_size, tmp_pl->private_id, tmp_pl->public_id, tmp_pl->f0_s_counter);
+			send_to(s, pkt_dup(data, data_size), data_size, 0, tmp_pl);
 			tmp_pl->f0_s_counter++;
 	ar_end_each;
-	free(data);
+	pkt_free(data);
 }
 
 /**
@@ -393,6 +389,8 @@ void *c_req_change_chan_flag_codec(char *data, unsigned int len, struct player *
 				bzero(ch_getpass(ch), 30 * sizeof(char));
 		}
 		ch->codec = new_codec;
+		audio_plan_invalidate(ch);
+		chan_list_changed(s);
 		/* If the channel changed registered or unregistered */
 		if ( (flags & CHANNEL_FLAG_UNREGISTERED) != (new_flags & CHANNEL_FLAG_UNREGISTERED)) {
 			if (new_flags & CHANNEL_FLAG_UNREGISTERED) {
@@ -453,6 +451,7 @@ void *c_req_change_chan_pass(char *data, unsigned int len, struct player *pl)
 		/* If we change the password when there is already one, the channel
 		 * flags do not change, no need to notify. */
 		if (old_flags != ch_getflags(ch)) {
+			chan_list_changed(s);
 			s_notify_channel_flags_codec_changed(pl, ch);
 		}
 		/* Update the channel in the db if it is registered */
@@ -479,7 +478,7 @@ static void s_notify_channel_order_changed(struct player *pl, struct channel *ch
 
 	/* header size (24) + chan_id (4) + user_id (4) + sort order (2) */
 	data_size = 24 + 4 + 2 + 4;
-	data = (char *)calloc(data_size, sizeof(char));
+	data = (char *)pkt_alloc(data_size);
 	if (data == NULL) {
 		logger(LOG_WARN, "s_notify_channel_order_changed, packet allocation failed : %s.", strerror(errno));
 		return;
@@ -500,16 +499,14 @@ static void s_notify_channel_order_changed(struct player *pl, struct channel *ch
 	/* check we filled all the packet */
 	assert((ptr - data) == data_size);
 
+	/* checksum once, then patch it for each recipient */
+	packet_add_crc_d(data, data_size);
 	ar_each(struct player *, tmp_pl, iter, s->players)
-			ptr = data + 4;
-			wu32(tmp_pl->private_id, &ptr);
-			wu32(tmp_pl->public_id, &ptr);
-			wu32(tmp_pl->f0_s_counter, &ptr);
-			packet_add_crc_d(data, data_size);
-			send_to(s, data, data_size, 0, tmp_pl);
+			packet_patch_header_d(data, data_size, tmp_pl->private_id, tmp_pl->public_id, tmp_pl->f0_s_counter);
+			send_to(s, pkt_dup(data, data_size), data_size, 0, tmp_pl);
 			tmp_pl->f0_s_counter++;
 	ar_end_each;
-	free(data);
+	pkt_free(data);
 }
 
 /**
@@ -537,6 +534,7 @@ void *c_req_change_chan_order(char *data, unsigned int len, struct player *pl)
 	send_acknowledge(pl);
 	if (ch != NULL && player_has_privilege(pl, SP_CHA_CHANGE_ORDER, ch)) {
 		ch->sort_order = order;
+		chan_list_changed(s);
 		if ((ch_getflags(ch) & CHANNEL_FLAG_UNREGISTERED) == 0) {
 			db_update_channel(s->conf, ch);
 		}
@@ -561,7 +559,7 @@ static void s_notify_channel_max_users_changed(struct player *pl, struct channel
 
 	/* header size (24) + chan_id (4) + user_id (4) + nb users (2) */
 	data_size = 24 + 4 + 2 + 4;
-	data = (char *)calloc(data_size, sizeof(char));
+	data = (char *)pkt_alloc(data_size);
 	if (data == NULL) {
 		logger(LOG_WARN, "s_notify_channel_max_users_changed, packet allocation failed : %s.", strerror(errno));
 		return;
@@ -582,16 +580,14 @@ static void s_notify_channel_max_users_changed(struct player *pl, struct channel
 	/* check we filled all the packet */
 	assert((ptr - data) == data_size);
 
+	/* checksum once, then patch it for each recipient */
+	packet_add_crc_d(data, data_size);
 	ar_each(struct player *, tmp_pl, iter, s->players)
-			ptr = data + 4;
-			wu32(tmp_pl->private_id, &ptr);
-			wu32(tmp_pl->public_id, &ptr);
-			wu32(tmp_pl->f0_s_counter, &ptr);
-			packet_add_crc_d(data, data_size);
-			send_to(s, data, data_size, 0, tmp_pl);
+			packet_patch_header_d(data, data_size, tmp_pl->private_id, tmp_pl->public_id, tmp_pl->f0_s_counter);
+			send_to(s, pkt_dup(data, data_size), data_size, 0, tmp_pl);
 			tmp_pl->f0_s_counter++;
 	ar_end_each;
-	free(data);
+	pkt_free(data);
 }
 
 /**
@@ -619,6 +615,7 @@ void *c_req_change_chan_max_users(char *data, unsigned int len, struct player *p
 	send_acknowledge(pl);
 	if (ch != NULL && player_has_privilege(pl, SP_CHA_CHANGE_MAXUSERS, ch)) {
 		ch->players->max_slots = max_users;
+		chan_list_changed(s);
 		if ((ch_getflags(ch) & CHANNEL_FLAG_UNREGISTERED) == 0) {
 			db_update_channel(s->conf, ch);
 		}
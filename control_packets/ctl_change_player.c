@@ -22,6 +22,7 @@
 #include "packet_tools.h"
 #include "acknowledge_packet.h"
 #include "server_stat.h"
+#include "packet_pool.h"
 #include "channel.h"
 #include "player.h"
 
@@ -46,7 +47,7 @@ static void s_notify_switch_channel(struct player *pl, struct channel *from, str
 	struct player_channel_privilege *new_priv;
 	size_t iter;
 
-	data = (char *)calloc(data_size, sizeof(char));
+	data = (char *)pkt_alloc(data_size);
 	if (data == NULL) {
 		logger(LOG_WARN, "s_notify_switch_channel, packet allocation failed : %s.", strerror(errno));
 		return;
@@ -69,16 +70,14 @@ static void s_notify_switch_channel(struct player *pl, struct channel *from, str
 	/* check we filled all the packet */
 	assert((ptr - data) == data_size);
 
+	/* checksum once, then patch it for each recipient */
+	packet_add_crc_d(data, data_size);
 	ar_each(struct player *, tmp_pl, iter, s->players)
-			ptr = data + 4;
-			wu32(tmp_pl->private_id, &ptr);
-			wu32(tmp_pl->public_id, &ptr);
-			wu32(tmp_pl->f0_s_counter, &ptr);
-			packet_add_crc_d(data, data_size);
-			send_to(s, data, data_size, 0, tmp_pl);
+			packet_patch_header_d(data, data_size, tmp_pl->private_id, tmp_pl->public_id, tmp_pl->f0_s_counter);
+			send_to(s, pkt_dup(data, data_size), data_size, 0, tmp_pl);
 			tmp_pl->f0_s_counter++;
 	ar_end_each;
-	free(data);
+	pkt_free(data);
 }
 
 /**
@@ -140,7 +139,7 @@ static void s_notify_player_attr_changed(struct player *pl, uint16_t new_attr)
 	struct server *s = pl->in_chan->in_server;
 	size_t iter;
 
-	data = (char *)calloc(data_size, sizeof(char));
+	data = (char *)pkt_alloc(data_size);
 	if (data == NULL) {
 		logger(LOG_WARN, "s_notify_player_attr_changed, packet allocation failed : %s.", strerror(errno));
 		return;
@@ -160,16 +159,14 @@ static void s_notify_player_attr_changed(struct player *pl, uint16_t new_attr)
 	/* check we filled all the packet */
 	assert((ptr - data) == data_size);
 
+	/* checksum once, then patch it for each recipient */
+	packet_add_crc_d(data, data_size);
 	ar_each(struct player *, tmp_pl, iter, s->players)
-			ptr = data + 4;
-			wu32(tmp_pl->private_id, &ptr);
-			wu32(tmp_pl->public_id, &ptr);
-			wu32(tmp_pl->f0_s_counter, &ptr);
-			packet_add_crc_d(data, data_size);
-			send_to(s, data, data_size, 0, tmp_pl);
+			packet_patch_header_d(data, data_size, tmp_pl->private_id, tmp_pl->public_id, tmp_pl->f0_s_counter);
+			send_to(s, pkt_dup(data, data_size), data_size, 0, tmp_pl);
 			tmp_pl->f0_s_counter++;
 	ar_end_each;
-	free(data);
+	pkt_free(data);
 }
 
 /**
@@ -189,7 +186,7 @@ static void s_notify_player_ch_priv_changed(struct player *pl, struct player *tg
 	struct server *s = pl->in_chan->in_server;
 	size_t iter;
 
-	data = (char *)calloc(data_size, sizeof(char));
+	data = (char *)pkt_alloc(data_size);
 	if (data == NULL) {
 		logger(LOG_WARN, "s_notify_player_ch_priv_changed, packet allocation failed : %s.", strerror(errno));
 		return;
@@ -211,16 +208,14 @@ static void s_notify_player_ch_priv_changed(struct player *pl, struct player *tg
 	/* check we filled all the packet */
 	assert((ptr - data) == data_size);
 
+	/* checksum once, then patch it for each recipient */
+	packet_add_crc_d(data, data_size);
 	ar_each(struct player *, tmp_pl, iter, s->players)
-			ptr = data + 4;
-			wu32(tmp_pl->private_id, &ptr);
-			wu32(tmp_pl->public_id, &ptr);
-			wu32(tmp_pl->f0_s_counter, &ptr);
-			packet_add_crc_d(data, data_size);
-			send_to(s, data, data_size, 0, tmp_pl);
+			packet_patch_header_d(data, data_size, tmp_pl->private_id, tmp_pl->public_id, tmp_pl->f0_s_counter);
+			send_to(s, pkt_dup(data, data_size), data_size, 0, tmp_pl);
 			tmp_pl->f0_s_counter++;
 	ar_end_each;
-	free(data);
+	pkt_free(data);
 }
 
 /**
@@ -299,7 +294,7 @@ void s_notify_player_sv_right_changed(struct player *pl, struct player *tgt, cha
 	struct server *s = tgt->in_chan->in_server;
 	size_t iter;
 
-	data = (char *)calloc(data_size, sizeof(char));
+	data = (char *)pkt_alloc(data_size);
 	if (data == NULL) {
 		logger(LOG_WARN, "s_notify_player_sv_right_changed, packet allocation failed : %s.", strerror(errno));
 		return;
@@ -325,16 +320,14 @@ void s_notify_player_sv_right_changed(struct player *pl, struct player *tgt, cha
 	/* check we filled all the packet */
 	assert((ptr - data) == data_size);
 
+	/* checksum once, then patch it for each recipient */
+	packet_add_crc_d(data, data_size);
 	ar_each(struct player *, tmp_pl, iter, s->players)
-			ptr = data + 4;
-			wu32(tmp_pl->private_id, &ptr);
-			wu32(tmp_pl->public_id, &ptr);
-			wu32(tmp_pl->f0_s_counter, &ptr);
-			packet_add_crc_d(data, data_size);
-			send_to(s, data, data_size, 0, tmp_pl);
+			packet_patch_header_d(data, data_size, tmp_pl->private_id, tmp_pl->public_id, tmp_pl->f0_s_counter);
+			send_to(s, pkt_dup(data, data_size), data_size, 0, tmp_pl);
 			tmp_pl->f0_s_counter++;
 	ar_end_each;
-	free(data);
+	pkt_free(data);
 }
 
 /**
@@ -440,7 +433,7 @@ static void s_notify_player_moved(struct player *tgt, struct player *pl, struct
 	struct player_channel_privilege *new_priv;
 	size_t iter;
 
-	data = (char *)calloc(data_size, sizeof(char));
+	data = (char *)pkt_alloc(data_size);
 	if (data == NULL) {
 		logger(LOG_WARN, "s_notify_player_moved, packet allocation failed : %s.", strerror(errno));
 		return;
@@ -464,16 +457,14 @@ static void s_notify_player_moved(struct player *tgt, struct player *pl, struct
 	/* check we filled all the packet */
 	assert((ptr - data) == data_size);
 
+	/* checksum once, then patch it for each recipient */
+	packet_add_crc_d(data, data_size);
 	ar_each(struct player *, tmp_pl, iter, s->players)
-			ptr = data + 4;
-			wu32(tmp_pl->private_id, &ptr);
-			wu32(tmp_pl->public_id, &ptr);
-			wu32(tmp_pl->f0_s_counter, &ptr);
-			packet_add_crc_d(data, data_size);
-			send_to(s, data, data_size, 0, tmp_pl);
+			packet_patch_header_d(data, data_size, tmp_pl->private_id, tmp_pl->public_id, tmp_pl->f0_s_counter);
+			send_to(s, pkt_dup(data, data_size), data_size, 0, tmp_pl);
 			tmp_pl->f0_s_counter++;
 	ar_end_each;
-	free(data);
+	pkt_free(data);
 }
 
 void *c_req_move_player(char *data, unsigned int len, struct player *pl)
@@ -511,7 +502,7 @@ static void s_resp_player_muted(struct player *by, struct player *tgt, uint8_t o
 	char *data, *ptr;
 	size_t data_size = 29;
 
-	data = (char *)calloc(data_size, sizeof(char));
+	data = (char *)pkt_alloc(data_size);
 	if (data == NULL) {
 		logger(LOG_WARN, "s_notify_player_moved, packet allocation failed : %s.", strerror(errno));
 		return;
@@ -536,7 +527,6 @@ static void s_resp_player_muted(struct player *by, struct player *tgt, uint8_t o
 	send_to(by->in_chan->in_server, data, data_size, 0, by);
 	by->f0_s_counter++;
 
-	free(data);
 }
 
 void *c_req_mute_player(char *data, unsigned int len, struct player *pl)
@@ -563,16 +553,16 @@ void *c_req_mute_player(char *data, unsigned int len, struct player *pl)
 
 	if (on_off == 1) {
 		/* MUTE */
-		if (!ar_has(pl->muted, tgt)) {
-			ar_insert(pl->muted, tgt);
+		if (mute_set(&s->mutes, pl->public_id, tgt->public_id)) {
+			audio_plan_invalidate(pl->in_chan);
 			s_resp_player_muted(pl, tgt, on_off);
 		} else {
 			logger(LOG_WARN, "player tried to mute a player he already muted!");
 		}
 	} else if (on_off == 0) {
 		/* UNMUTE */
-		if (ar_has(pl->muted, tgt)) {
-			ar_remove(pl->muted, tgt);
+		if (mute_clear(&s->mutes, pl->public_id, tgt->public_id)) {
+			audio_plan_invalidate(pl->in_chan);
 			s_resp_player_muted(pl, tgt, on_off);
 		} else {
 			logger(LOG_WARN, "player tried to unmute a player he did not mute!");
@@ -592,7 +582,7 @@ void s_notify_player_requested_voice(struct player *pl, struct player *dest)
 	struct server *s = pl->in_chan->in_server;
 	size_t iter;
 
-	data = (char *)calloc(data_size, sizeof(char));
+	data = (char *)pkt_alloc(data_size);
 	if (data == NULL) {
 		logger(LOG_WARN, "s_notify_player_requested_voice, packet allocation failed : %s.", strerror(errno));
 		return;
@@ -611,13 +601,11 @@ void s_notify_player_requested_voice(struct player *pl, struct player *dest)
 
 	assert(ptr - data == data_size);
 	if (dest == NULL) {
+		/* checksum once, then patch it for each recipient */
+		packet_add_crc_d(data, data_size);
 		ar_each(struct player *, tmp_pl, iter, s->players)
-			ptr = data + 4;
-			wu32(tmp_pl->private_id, &ptr);
-			wu32(tmp_pl->public_id, &ptr);
-			wu32(tmp_pl->f0_s_counter, &ptr);
-			packet_add_crc_d(data, data_size);
-			send_to(s, data, data_size, 0, tmp_pl);
+			packet_patch_header_d(data, data_size, tmp_pl->private_id, tmp_pl->public_id, tmp_pl->f0_s_counter);
+			send_to(s, pkt_dup(data, data_size), data_size, 0, tmp_pl);
 			tmp_pl->f0_s_counter++;
 		ar_end_each;
 	} else {
@@ -626,10 +614,10 @@ void s_notify_player_requested_voice(struct player *pl, struct player *dest)
 		wu32(dest->public_id, &ptr);
 		wu32(dest->f0_s_counter, &ptr);
 		packet_add_crc_d(data, data_size);
-		send_to(s, data, data_size, 0, dest);
+		send_to(s, pkt_dup(data, data_size), data_size, 0, dest);
 		dest->f0_s_counter++;
 	}
-	free(data);
+	pkt_free(data);
 }
 
 void *c_req_request_voice(char *data, unsigned int len, struct player *pl)
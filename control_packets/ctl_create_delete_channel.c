@@ -21,6 +21,7 @@
 #include "packet_tools.h"
 #include "acknowledge_packet.h"
 #include "server_stat.h"
+#include "packet_pool.h"
 #include "database.h"
 
 #include <errno.h>
@@ -39,7 +40,7 @@ static void s_notify_channel_deleted(struct server *s, uint32_t del_id)
 	int data_size = 30;
 	size_t iter;
 
-	data = (char *)calloc(data_size, sizeof(char));
+	data = (char *)pkt_alloc(data_size);
 	if (data == NULL) {
 		logger(LOG_WARN, "s_notify_channel_deleted, packet allocation failed : %s.", strerror(errno));
 		return;
@@ -60,16 +61,14 @@ static void s_notify_channel_deleted(struct server *s, uint32_t del_id)
 	/* check we filled all the packet */
 	assert((ptr - data) == data_size);
 
+	/* checksum once, then patch it for each recipient */
+	packet_add_crc_d(data, data_size);
 	ar_each(struct player *, tmp_pl, iter, s->players)
-			ptr = data + 4;
-			wu32(tmp_pl->private_id, &ptr);
-			wu32(tmp_pl->public_id, &ptr);
-			wu32(tmp_pl->f0_s_counter, &ptr);
-			packet_add_crc_d(data, data_size);
-			send_to(s, data, data_size, 0, tmp_pl);
+			packet_patch_header_d(data, data_size, tmp_pl->private_id, tmp_pl->public_id, tmp_pl->f0_s_counter);
+			send_to(s, pkt_dup(data, data_size), data_size, 0, tmp_pl);
 			tmp_pl->f0_s_counter++;
 	ar_end_each;
-	free(data);
+	pkt_free(data);
 }
 
 /**
@@ -85,7 +84,7 @@ static void s_resp_cannot_delete_channel(struct player *pl, uint32_t pkt_cnt)
 	int data_size = 30;
 	struct server *s = pl->in_chan->in_server;
 
-	data = (char *)calloc(data_size, sizeof(char));
+	data = (char *)pkt_alloc(data_size);
 	if (data == NULL) {
 		logger(LOG_WARN, "s_resp_cannot_delete_channel, packet allocation failed : %s.", strerror(errno));
 		return;
@@ -109,7 +108,6 @@ static void s_resp_cannot_delete_channel(struct player *pl, uint32_t pkt_cnt)
 
 	send_to(s, data, data_size, 0, pl);
 	pl->f0_s_counter++;
-	free(data);
 }
 
 /**
@@ -166,7 +164,7 @@ static void s_notify_channel_created(struct channel *ch, struct player *creator)
 	data_size = 24 + 4;
 	data_size += channel_to_data_size(ch);
 
-	data = (char *)calloc(data_size, sizeof(char));
+	data = (char *)pkt_alloc(data_size);
 	if (data == NULL) {
 		logger(LOG_WARN, "s_notify_channel_created, packet allocation failed : %s.", strerror(errno));
 		return;
@@ -184,16 +182,14 @@ static void s_notify_channel_created(struct channel *ch, struct player *creator)
 	wu32(creator->public_id, &ptr);	/* id of creator */
 	channel_to_data(ch, ptr);
 
+	/* checksum once, then patch it for each recipient */
+	packet_add_crc_d(data, data_size);
 	ar_each(struct player *, tmp_pl, iter, s->players)
-			ptr = data + 4;
-			wu32(tmp_pl->private_id, &ptr);
-			wu32(tmp_pl->public_id, &ptr);
-			wu32(tmp_pl->f0_s_counter, &ptr);
-			packet_add_crc_d(data, data_size);
-			send_to(s, data, data_size, 0, tmp_pl);
+			packet_patch_header_d(data, data_size, tmp_pl->private_id, tmp_pl->public_id, tmp_pl->f0_s_counter);
+			send_to(s, pkt_dup(data, data_size), data_size, 0, tmp_pl);
 			tmp_pl->f0_s_counter++;
 	ar_end_each;
-	free(data);
+	pkt_free(data);
 }
 
 /**
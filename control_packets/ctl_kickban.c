@@ -20,6 +20,7 @@
 #include "log.h"
 #include "packet_tools.h"
 #include "server_stat.h"
+#include "packet_pool.h"
 #include "acknowledge_packet.h"
 
 #include <errno.h>
@@ -42,7 +43,7 @@ static void s_notify_kick_server(struct player *kicker, struct player *kicked, c
 	struct server *s = kicker->in_chan->in_server;
 	size_t iter;
 
-	data = (char *)calloc(data_size, sizeof(char));
+	data = (char *)pkt_alloc(data_size);
 	if (data == NULL) {
 		logger(LOG_WARN, "s_notify_kick_server, packet allocation failed : %s.", strerror(errno));
 		return;
@@ -64,16 +65,14 @@ static void s_notify_kick_server(struct player *kicker, struct player *kicked, c
 	/* check we filled all the packet */
 	assert((ptr - data) == data_size);
 
+	/* checksum once, then patch it for each recipient */
+	packet_add_crc_d(data, data_size);
 	ar_each(struct player *, tmp_pl, iter, s->players)
-			ptr = data + 4;
-			wu32(tmp_pl->private_id, &ptr);
-			wu32(tmp_pl->public_id, &ptr);
-			wu32(tmp_pl->f0_s_counter, &ptr);
-			packet_add_crc_d(data, data_size);
-			send_to(s, data, data_size, 0, tmp_pl);
+			packet_patch_header_d(data, data_size, tmp_pl->private_id, tmp_pl->public_id, tmp_pl->f0_s_counter);
+			send_to(s, pkt_dup(data, data_size), data_size, 0, tmp_pl);
 			tmp_pl->f0_s_counter++;
 	ar_end_each;
-	free(data);
+	pkt_free(data);
 }
 
 /**
@@ -133,7 +132,7 @@ static void s_notify_kick_channel(struct player *kicker, struct player *kicked,
 	struct server *s = kicker->in_chan->in_server;
 	size_t iter;
 
-	data = (char *)calloc(data_size, sizeof(char));
+	data = (char *)pkt_alloc(data_size);
 	if (data == NULL) {
 		logger(LOG_WARN, "s_notify_kick_channel, packet allocation failed : %s.", strerror(errno));
 		return;
@@ -156,16 +155,14 @@ static void s_notify_kick_channel(struct player *kicker, struct player *kicked,
 	/* check we filled all the packet */
 	assert((ptr - data) == data_size);
 
+	/* checksum once, then patch it for each recipient */
+	packet_add_crc_d(data, data_size);
 	ar_each(struct player *, tmp_pl, iter, s->players)
-			ptr = data + 4;
-			wu32(tmp_pl->private_id, &ptr);
-			wu32(tmp_pl->public_id, &ptr);
-			wu32(tmp_pl->f0_s_counter, &ptr);
-			packet_add_crc_d(data, data_size);
-			send_to(s, data, data_size, 0, tmp_pl);
+			packet_patch_header_d(data, data_size, tmp_pl->private_id, tmp_pl->public_id, tmp_pl->f0_s_counter);
+			send_to(s, pkt_dup(data, data_size), data_size, 0, tmp_pl);
 			tmp_pl->f0_s_counter++;
 	ar_end_each;
-	free(data);
+	pkt_free(data);
 }
 
 /**
@@ -222,7 +219,7 @@ static void s_notify_ban(struct player *pl, struct player *target, uint16_t dura
 	struct server *s = pl->in_chan->in_server;
 	size_t iter;
 
-	data = (char *)calloc(data_size, sizeof(char));
+	data = (char *)pkt_alloc(data_size);
 	if (data == NULL) {
 		logger(LOG_WARN, "s_notify_ban, packet allocation failed : %s.", strerror(errno));
 		return;
@@ -244,16 +241,14 @@ static void s_notify_ban(struct player *pl, struct player *target, uint16_t dura
 	/* check we filled all the packet */
 	assert((ptr - data) == data_size);
 
+	/* checksum once, then patch it for each recipient */
+	packet_add_crc_d(data, data_size);
 	ar_each(struct player *, tmp_pl, iter, s->players)
-			ptr = data + 4;
-			wu32(tmp_pl->private_id, &ptr);
-			wu32(tmp_pl->public_id, &ptr);
-			wu32(tmp_pl->f0_s_counter, &ptr);
-			packet_add_crc_d(data, data_size);
-			send_to(s, data, data_size, 0, tmp_pl);
+			packet_patch_header_d(data, data_size, tmp_pl->private_id, tmp_pl->public_id, tmp_pl->f0_s_counter);
+			send_to(s, pkt_dup(data, data_size), data_size, 0, tmp_pl);
 			tmp_pl->f0_s_counter++;
 	ar_end_each;
-	free(data);
+	pkt_free(data);
 }
 
 /**
@@ -282,7 +277,7 @@ void *c_req_ban(char *data, unsigned int len, struct player *pl)
 		send_acknowledge(pl);		/* ACK */
 		if(player_has_privilege(pl, SP_ADM_BAN_IP, target->in_chan)) {
 			reason = rstaticstring(29, &ptr);
-			add_ban(s, new_ban(0, target->cli_addr->sin_addr, reason));
+			add_ban(s, new_ban(duration, target->cli_addr->sin_addr, reason));
 			logger(LOG_INFO, "Reason for banning player %s : %s", target->name, reason);
 			s_notify_ban(pl, target, duration, reason);
 			remove_player(s, target);
@@ -314,7 +309,7 @@ static void s_resp_bans(struct player *pl)
 		data_size += ban_to_data_size(b);
 	ar_end_each;
 
-	data = (char *)calloc(data_size, sizeof(char));
+	data = (char *)pkt_alloc(data_size);
 	if (data == NULL) {
 		logger(LOG_WARN, "s_resp_ban, packet allocation failed : %s.", strerror(errno));
 		return;
@@ -340,7 +335,6 @@ static void s_resp_bans(struct player *pl)
 	send_to(s, data, data_size, 0, pl);
 
 	pl->f0_s_counter++;
-	free(data);
 }
 
 /**
@@ -376,8 +370,10 @@ void *c_req_remove_ban(char *data, unsigned int len, struct player *pl)
 		send_acknowledge(pl);		/* ACK */
 		inet_aton(data + 24, &ip);
 		b = get_ban_by_ip(s, ip);
-		if (b != NULL)
+		if (b != NULL) {
 			remove_ban(s, b);
+			destroy_ban(b);
+		}
 	}
 	return NULL;
 }
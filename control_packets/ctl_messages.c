@@ -20,6 +20,7 @@
 #include "log.h"
 #include "packet_tools.h"
 #include "server_stat.h"
+#include "packet_pool.h"
 #include "acknowledge_packet.h"
 
 #include <errno.h>
@@ -42,7 +43,7 @@ void send_message_to_all(struct player *pl, uint32_t color, char *msg)
 
 	/* header size (24) + color (4) + type (1) + name size (1) + name (29) + msg (?) */
 	data_size = 24 + 4 + 1 + 1 + 29 + (strlen(msg) + 1);
-	data = (char *)calloc(data_size, sizeof(char));
+	data = (char *)pkt_alloc(data_size);
 	if (data == NULL) {
 		logger(LOG_WARN, "send_message_to_all, packet allocation failed : %s.", strerror(errno));
 		return;
@@ -65,16 +66,14 @@ void send_message_to_all(struct player *pl, uint32_t color, char *msg)
 	}
 	strcpy(ptr, msg);
 
+	/* checksum once, then patch it for each recipient */
+	packet_add_crc_d(data, data_size);
 	ar_each(struct player *, tmp_pl, iter, s->players)
-			ptr = data + 4;
-			wu32(tmp_pl->private_id, &ptr);
-			wu32(tmp_pl->public_id, &ptr);
-			wu32(tmp_pl->f0_s_counter, &ptr);
-			packet_add_crc_d(data, data_size);
-			send_to(s, data, data_size, 0, tmp_pl);
+			packet_patch_header_d(data, data_size, tmp_pl->private_id, tmp_pl->public_id, tmp_pl->f0_s_counter);
+			send_to(s, pkt_dup(data, data_size), data_size, 0, tmp_pl);
 			tmp_pl->f0_s_counter++;
 	ar_end_each;
-	free(data);
+	pkt_free(data);
 }
 
 /**
@@ -95,7 +94,7 @@ static void send_message_to_channel(struct player *pl, struct channel *ch, uint3
 
 	/* header size (24) + color (4) + type (1) + name size (1) + name (29) + msg (?) */
 	data_size = 24 + 4 + 1 + 1 + 29 + (strlen(msg) + 1);
-	data = (char *)calloc(data_size, sizeof(char));
+	data = (char *)pkt_alloc(data_size);
 	if (data == NULL) {
 		logger(LOG_WARN, "send_message_to_channel, packet allocation failed : %s.", strerror(errno));
 		return;
@@ -114,16 +113,14 @@ static void send_message_to_channel(struct player *pl, struct channel *ch, uint3
 	wstaticstring(pl->name, 29, &ptr);
 	strcpy(ptr, msg);
 
+	/* checksum once, then patch it for each recipient */
+	packet_add_crc_d(data, data_size);
 	ar_each(struct player *, tmp_pl, iter, ch->players)
-		ptr = data + 4;
-		wu32(tmp_pl->private_id, &ptr);
-		wu32(tmp_pl->public_id, &ptr);
-		wu32(tmp_pl->f0_s_counter, &ptr);
-		packet_add_crc_d(data, data_size);
-		send_to(s, data, data_size, 0, tmp_pl);
+		packet_patch_header_d(data, data_size, tmp_pl->private_id, tmp_pl->public_id, tmp_pl->f0_s_counter);
+		send_to(s, pkt_dup(data, data_size), data_size, 0, tmp_pl);
 		tmp_pl->f0_s_counter++;
 	ar_end_each;
-	free(data);
+	pkt_free(data);
 }
 
 /**
@@ -141,7 +138,7 @@ static void send_message_to_player(struct player *pl, struct player *tgt, uint32
 	struct server *s = pl->in_chan->in_server;
 	/* header size (24) + color (4) + type (1) + name size (1) + name (29) + msg (?) */
 	data_size = 24 + 4 + 1 + 1 + 29 + (strlen(msg) + 1);
-	data = (char *)calloc(data_size, sizeof(char));
+	data = (char *)pkt_alloc(data_size);
 	if (data == NULL) {
 		logger(LOG_WARN, "send_message_to_player, packet allocation failed : %s.", strerror(errno));
 		return;
@@ -163,7 +160,6 @@ static void send_message_to_player(struct player *pl, struct player *tgt, uint32
 	packet_add_crc_d(data, data_size);
 	send_to(s, data, data_size, 0, tgt);
 	tgt->f0_s_counter++;
-	free(data);
 }
 
 /**
@@ -20,14 +20,64 @@
 #include "log.h"
 #include "packet_tools.h"
 #include "server_stat.h"
+#include "packet_pool.h"
 #include "acknowledge_packet.h"
+#include "crc.h"
 
 #include <errno.h>
 #include <string.h>
+#include <stdlib.h>
+
+/**
+ * Serialize the channel list of a server again if a channel
+ * changed since it was last built.
+ *
+ * @param s the server
+ *
+ * @return 1 if the cached list is up to date, 0 if it could not be built
+ */
+static int chan_list_refresh(struct server *s)
+{
+	struct chan_list_cache *cl = &s->chan_list;
+	uint64_t version = __atomic_load_n(&cl->version, __ATOMIC_ACQUIRE);
+	struct channel *ch;
+	size_t iter, len;
+	char *body, *ptr;
+
+	if (cl->body != NULL && cl->built == version)
+		return 1;
+
+	/* compute the size of the list */
+	len = 4;		/* number of channels */
+	ar_each(struct channel *, ch, iter, s->chans)
+		len += channel_to_data_size(ch);
+	ar_end_each;
+
+	body = (char *)malloc(len);
+	if (body == NULL) {
+		logger(LOG_WARN, "chan_list_refresh, malloc failed : %s.", strerror(errno));
+		return 0;
+	}
+	ptr = body;
+	wu32(s->chans->used_slots, &ptr);	/* number of channels sent */
+	/* dump the channels */
+	ar_each(struct channel *, ch, iter, s->chans)
+		ptr += channel_to_data(ch, ptr);
+	ar_end_each;
+
+	free(cl->body);
+	cl->body = body;
+	cl->len = len;
+	cl->crc = crc_32(body, len);
+	cl->built = version;
+	logger(LOG_INFO, "Channel list rebuilt : %zu bytes.", len);
+	return 1;
+}
 
 /**
  * Reply to a c_req_chans by sending packets containing
- * a data dump of the channels.
+ * a data dump of the channels. The dump is the cached
+ * channel list, only the header differs between players.
  *
  * @param pl the player we send the channel list to
  * @param s the server we will get the channels from
@@ -38,21 +88,17 @@ static void s_resp_chans(struct player *pl)
 {
 	char *data;
 	int data_size = 0;
-	struct channel *ch;
 	char *ptr;
-	int ch_size;
+	uint32_t crc;
 	struct server *s = pl->in_chan->in_server;
-	size_t iter;
 
-	/* compute the size of the packet */
+	if (!chan_list_refresh(s))
+		return;
 	data_size += 24;	/* header */
-	data_size += 4;		/* number of channels in packet */
-	ar_each(struct channel *, ch, iter, s->chans)
-		data_size += channel_to_data_size(ch);
-	ar_end_each;
+	data_size += s->chan_list.len;
 
 	/* initialize the packet */
-	data = (char *)calloc(data_size, sizeof(char));
+	data = (char *)pkt_alloc(data_size);
 	if (data == NULL) {
 		logger(LOG_WARN, "s_resp_chans, packet allocation failed : %s.", strerror(errno));
 		return;
@@ -65,39 +111,66 @@ static void s_resp_chans(struct player *pl)
 	wu32(pl->f0_s_counter, &ptr);	/* packet counter */
 	/* packet version */				ptr += 4;
 	/* empty checksum */				ptr += 4;
-	wu32(s->chans->used_slots, &ptr);	/* number of channels sent */
-	/* dump the channels to the packet */
-	ar_each(struct channel *, ch, iter, s->chans)
-		ch_size = channel_to_data_size(ch);
-		channel_to_data(ch, ptr);
-		ptr += ch_size;
-	ar_end_each;
+	/* number of channels and channels */
+	memcpy(ptr, s->chan_list.body, s->chan_list.len);
 
-	packet_add_crc_d(data, data_size);
+	/* the crc of the list is known, only the header is read */
+	crc = crc_32_combine(crc_32(data, 24), s->chan_list.crc, s->chan_list.len);
+	crc = GUINT32_TO_LE(crc);
+	memcpy(data + 20, &crc, 4);
 
 	logger(LOG_INFO, "size of all channels : %i", data_size);
 	send_to(s, data, data_size, 0, pl);
 	pl->f0_s_counter++;
-	free(data);
+}
+
+/**
+ * Send a page of the player list : write its header in
+ * front of the players already dumped, and clear the
+ * packet for the next page.
+ *
+ * @param pl the player we send the player list to
+ * @param data the packet
+ * @param data_size the size of the packet
+ * @param nb the number of players in the page
+ */
+static void send_players_page(struct player *pl, char *data, int data_size, int nb)
+{
+	char *ptr = data;
+	struct server *s = pl->in_chan->in_server;
+
+	wu16(PKT_TYPE_CTL, &ptr);	/* */
+	wu16(CTL_LIST_PL, &ptr);	/* */
+	wu32(pl->private_id, &ptr);	/* player private id */
+	wu32(pl->public_id, &ptr);	/* player public id */
+	wu32(pl->f0_s_counter, &ptr);	/* packet counter */
+	ptr += 4;			/* packet version */
+	ptr += 4;			/* empty checksum */
+	wu32(nb, &ptr);
+	packet_add_crc_d(data, data_size);
+
+	logger(LOG_INFO, "size of all players : %i", data_size);
+	send_to(s, pkt_dup(data, data_size), data_size, 0, pl);
+	pl->f0_s_counter++;
+	bzero(data, data_size * sizeof(char));
 }
 
 /**
  * Reply to a c_req_chans by sending packets containing
- * a data dump of the players.
+ * a data dump of the players, 10 per packet. The players
+ * are gone through once, each packet is sent as soon as
+ * it is full.
  *
  * @param pl the player we send the player list to
- * @param s the server we will get the players from
  */
 static void s_resp_players(struct player *pl)
 {
 	char *data;
 	int data_size = 0;
 	char *ptr;
-	int p_size;
-	int nb_players;
-	struct player *pls[10];
-	int i;
-	int players_copied;
+	int nb = 0;
+	size_t iter;
+	struct player *tmp_pl;
 	struct server *s = pl->in_chan->in_server;
 
 	/* compute the size of the packet */
@@ -105,42 +178,25 @@ static void s_resp_players(struct player *pl)
 	data_size += 4;		/* number of players in packet */
 	data_size += 10 * player_to_data_size(NULL); /* players */
 
-	nb_players = s->players->used_slots;
-	data = (char *)calloc(data_size, sizeof(char));
+	data = (char *)pkt_alloc(data_size);
 	if (data == NULL) {
 		logger(LOG_WARN, "s_resp_players, packet allocation failed : %s.", strerror(errno));
 		return;
 	}
-	while (nb_players > 0) {
-		bzero(data, data_size * sizeof(char));
-		ptr = data;
-		/* initialize the packet */
-		wu16(PKT_TYPE_CTL, &ptr);	/* */
-		wu16(CTL_LIST_PL, &ptr);	/* */
-		wu32(pl->private_id, &ptr);	/* player private id */
-		wu32(pl->public_id, &ptr);	/* player public id */
-		wu32(pl->f0_s_counter, &ptr);	/* packet counter */
-		ptr += 4;			/* packet version */
-		ptr += 4;			/* empty checksum */
-		wu32(MIN(10, nb_players), &ptr);
-		/* dump the players to the packet */
-		bzero(pls, 10 * sizeof(struct player *));
-		players_copied = ar_get_n_elems_start_at(s->players, 10,
-				s->players->used_slots-nb_players, (void**)pls);
-		for (i = 0 ; i < players_copied ; i++) {
-			p_size = player_to_data_size(pls[i]);
-			player_to_data(pls[i], ptr);
-			ptr += p_size;
+	bzero(data, data_size * sizeof(char));
+	ptr = data + 28;
+	/* dump the players to the packets */
+	ar_each(struct player *, tmp_pl, iter, s->players)
+		ptr += player_to_data(tmp_pl, ptr);
+		if (++nb == 10) {
+			send_players_page(pl, data, data_size, nb);
+			ptr = data + 28;
+			nb = 0;
 		}
-		packet_add_crc_d(data, data_size);
-
-		logger(LOG_INFO, "size of all players : %i", data_size);
-		send_to(s, data, data_size, 0, pl);
-		pl->f0_s_counter++;
-		/* decrement the number of players to send */
-		nb_players -= MIN(10, nb_players);
-		free(data);
-	}
+	ar_end_each;
+	if (nb > 0)
+		send_players_page(pl, data, data_size, nb);
+	pkt_free(data);
 }
 
 static void s_resp_unknown(struct player *pl)
@@ -150,7 +206,7 @@ static void s_resp_unknown(struct player *pl)
 	int data_size = 283;
 	struct server *s = pl->in_chan->in_server;
 
-	data = (char *)calloc(data_size, sizeof(char));
+	data = (char *)pkt_alloc(data_size);
 	if (data == NULL) {
 		logger(LOG_WARN, "s_resp_unknown, packet allocation failed : %s.", strerror(errno));
 		return;
@@ -175,7 +231,6 @@ static void s_resp_unknown(struct player *pl)
 
 	send_to(s, data, data_size, 0, pl);
 	pl->f0_s_counter++;
-	free(data);
 }
 
 /**
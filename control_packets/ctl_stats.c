@@ -20,6 +20,7 @@
 #include "log.h"
 #include "packet_tools.h"
 #include "server_stat.h"
+#include "packet_pool.h"
 #include "acknowledge_packet.h"
 
 #include <errno.h>
@@ -37,10 +38,12 @@ static void s_resp_server_stats(struct player *pl)
 	char *data, *ptr;
 	struct server *s = pl->in_chan->in_server;
 	uint32_t stats[4] = {0, 0, 0, 0};
+	struct sstat_counters c;
 	
 	compute_timed_stats(s->stats, stats);
+	sstat_sum(s->stats, &c);
 	/* initialize the packet */
-	data = (char *)calloc(data_size, sizeof(char));
+	data = (char *)pkt_alloc(data_size);
 	if (data == NULL) {
 		logger(LOG_WARN, "s_resp_server_stats, packet allocation failed : %s.", strerror(errno));
 		return;
@@ -59,15 +62,15 @@ static void s_resp_server_stats(struct player *pl)
 	wu16(2, &ptr);					/* server version */
 	wu16(0, &ptr);					/* server version */
 	wu32(s->players->used_slots, &ptr);		/* number of players connected */
-	wu64(s->stats->pkt_sent, &ptr);			/* total bytes received */
-	wu64(s->stats->size_sent, &ptr);		/* total bytes sent */
-	wu64(s->stats->pkt_rec, &ptr);			/* total packets received */
-	wu64(s->stats->size_rec, &ptr);			/* total packets sent */
+	wu64(c.pkt_sent, &ptr);				/* total bytes received */
+	wu64(c.size_sent, &ptr);			/* total bytes sent */
+	wu64(c.pkt_rec, &ptr);				/* total packets received */
+	wu64(c.size_rec, &ptr);				/* total packets sent */
 	wu32(stats[0], &ptr);				/* bytes received/sec (last second) */
 	wu32(stats[1], &ptr);				/* bytes sent/sec (last second) */
 	wu32(stats[2]/60, &ptr);			/* bytes received/sec (last minute) */
 	wu32(stats[3]/60, &ptr);			/* bytes sent/sec (last minute) */
-	wu64(s->stats->total_logins, &ptr);		/* total logins */
+	wu64(c.total_logins, &ptr);			/* total logins */
 
 	/* check we filled all the packet */
 	assert((ptr - data) == data_size);
@@ -76,7 +79,6 @@ static void s_resp_server_stats(struct player *pl)
 
 	send_to(s, data, data_size, 0, pl);
 	pl->f0_s_counter++;
-	free(data);
 }
 
 /**
@@ -106,7 +108,7 @@ static void s_res_player_stats(struct player *pl, struct player *tgt)
 	char *ip;
 
 	data_size = 164;
-	data = (char *)calloc(data_size, sizeof(char));
+	data = (char *)pkt_alloc(data_size);
 	if (data == NULL) {
 		logger(LOG_WARN, "s_res_player_stats, packet allocation failed : %s.", strerror(errno));
 		return;
@@ -149,8 +151,6 @@ static void s_res_player_stats(struct player *pl, struct player *tgt)
 	packet_add_crc_d(data, data_size);
 	send_to(pl->in_chan->in_server, data, data_size, 0, pl);
 	pl->f0_s_counter++;
-
-	free(data);
 }
 
 /**
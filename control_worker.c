@@ -0,0 +1,225 @@
+/*
+ * soliloque-server, an open source implementation of the TeamSpeak protocol.
+ * Copyright (C) 2009 Hugo Camboulive <hugo.camboulive AT gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "control_worker.h"
+#include "server.h"
+#include "main_serv.h"
+#include "voice_plane.h"
+#include "send_batch.h"
+#include "db_snapshot.h"
+#include "log.h"
+#include "compat.h"
+#include "configuration.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+/**
+ * Allocate the queues (one per receiver) and the event
+ * of the control worker.
+ *
+ * @param s the server
+ *
+ * @return 1 on success, 0 on failure
+ */
+int init_control_worker(struct server *s)
+{
+	struct ctl_queue *q;
+	unsigned int i;
+
+	for (i = 0 ; i < s->nb_receivers ; i++) {
+		q = &s->receivers[i].ctl_queue;
+		q->head = q->tail = 0;
+		q->dropped = 0;
+		q->slots = (struct ctl_slot *)calloc(CTL_QUEUE_SIZE, sizeof(struct ctl_slot));
+		if (q->slots == NULL) {
+			logger(LOG_ERR, "init_control_worker, calloc failed : %s.", strerror(errno));
+			return 0;
+		}
+	}
+	s->ctl_event = eventfd(0, EFD_NONBLOCK);
+	if (s->ctl_event == -1) {
+		logger(LOG_ERR, "init_control_worker, could not create event : %s.", strerror(errno));
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * Free the queues and close the event of the control worker.
+ * The control worker thread must have been stopped.
+ *
+ * @param s the server
+ */
+void destroy_control_worker(struct server *s)
+{
+	struct ctl_queue *q;
+	unsigned int i;
+
+	for (i = 0 ; i < s->nb_receivers ; i++) {
+		q = &s->receivers[i].ctl_queue;
+		if (q->dropped != 0)
+			logger(LOG_WARN, "Server %i : %llu control datagrams dropped by receiver %u (queue full).",
+					s->id, (unsigned long long)q->dropped, i);
+		free(q->slots);
+		q->slots = NULL;
+	}
+	close(s->ctl_event);
+}
+
+/**
+ * Hand a datagram over to the control worker.
+ * Only the receiver owning the queue may call this.
+ * The worker is not woken up, call ctl_worker_wakeup()
+ * at the end of the pass.
+ *
+ * @param q the queue of the receiver
+ * @param data the datagram
+ * @param len the length of data
+ * @param addr the address of the sender
+ * @param addr_len the length of addr
+ *
+ * @return 1 if the datagram was queued, 0 if it was dropped
+ */
+int ctl_enqueue(struct ctl_queue *q, const char *data, int len,
+		const struct sockaddr_in *addr, socklen_t addr_len)
+{
+	struct ctl_slot *slot;
+	unsigned int head = q->head;
+
+	if (len > CTL_MAX_MSG)
+		len = CTL_MAX_MSG;
+	if (head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) >= CTL_QUEUE_SIZE) {
+		__atomic_store_n(&q->dropped, q->dropped + 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	slot = &q->slots[head % CTL_QUEUE_SIZE];
+	memcpy(slot->data, data, len);
+	slot->len = len;
+	slot->addr_len = MIN(addr_len, sizeof(struct sockaddr_in));
+	memcpy(&slot->addr, addr, slot->addr_len);
+	__atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/**
+ * Wake the control worker up, because datagrams have been
+ * queued or the voice snapshot has to be rebuilt.
+ *
+ * @param s the server
+ */
+void ctl_worker_wakeup(struct server *s)
+{
+	uint64_t one = 1;
+
+	if (write(s->ctl_event, &one, sizeof(one)) == -1 && errno != EAGAIN)
+		logger(LOG_WARN, "ctl_worker_wakeup, write failed : %s.", strerror(errno));
+}
+
+/**
+ * Handle all the datagrams in a queue.
+ *
+ * @param s the server
+ * @param q the queue
+ *
+ * @return the number of datagrams handled
+ */
+static int ctl_drain(struct server *s, struct ctl_queue *q)
+{
+	struct ctl_slot *slot;
+	unsigned int head, tail;
+	int nb = 0;
+
+	head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+	for (tail = q->tail ; tail != head ; tail++, nb++) {
+		slot = &q->slots[tail % CTL_QUEUE_SIZE];
+		handle_packet(slot->data, slot->len, &slot->addr, slot->addr_len, s);
+		/* give the slot back right away */
+		__atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+	}
+	return nb;
+}
+
+/**
+ * Control plane of a server : handles the control, acknowledge
+ * and connection datagrams queued by the receive threads, and
+ * publishes the changes of players and channels to the data plane.
+ * Slow operations here (authentication, building the channel
+ * list, database accesses...) do not delay audio forwarding.
+ *
+ * @param args the server
+ */
+void *control_worker_thread(void *args)
+{
+	struct server *s = (struct server *)args;
+	struct pollfd pfd;
+	uint64_t count, now, next_snap = 0;
+	unsigned int i;
+	int waiting, nb, timeout, period, old;
+
+	/* only cancelled while it sleeps, never in the middle of a
+	 * handler or a snapshot */
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old);
+	pfd.fd = s->ctl_event;
+	pfd.events = POLLIN;
+	period = db_snapshot_enabled(s->conf) ? s->conf->snapshot.period : 0;
+	if (period > 0)
+		next_snap = tw_now() + (uint64_t)period * 1000;
+	while (1) {
+		/* the queues are drained in turn, so no receiver starves the others */
+		do {
+			nb = 0;
+			for (i = 0 ; i < s->nb_receivers ; i++)
+				nb += ctl_drain(s, &s->receivers[i].ctl_queue);
+		} while (nb > 0);
+		if (__atomic_exchange_n(&s->bans_expired, 0, __ATOMIC_ACQ_REL))
+			lift_expired_bans(s);
+		/* end of the pass : send everything the handlers produced */
+		sb_flush();
+		if (__atomic_exchange_n(&s->voice.dirty, 0, __ATOMIC_ACQ_REL))
+			voice_publish(s);
+		waiting = voice_reclaim(s);
+
+		/* snapshot of the server, retried later if the database is busy */
+		timeout = waiting ? 100 : -1;
+		if (period > 0) {
+			now = tw_now();
+			if (now >= next_snap) {
+				next_snap = now + (db_snapshot_write(s, 0) ? (uint64_t)period * 1000 : 1000);
+				now = tw_now();
+			}
+			if (timeout == -1 || next_snap - now < (uint64_t)timeout)
+				timeout = (next_snap > now) ? (int)MIN(next_snap - now, 1000 * 1000) : 0;
+		}
+
+		/* sleep until the receive thread queues something, check
+		 * the readers from time to time if memory waits for them */
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		nb = poll(&pfd, 1, timeout);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		if (nb == -1 && errno != EINTR)
+			logger(LOG_WARN, "control_worker_thread, poll failed : %s.", strerror(errno));
+		if (read(s->ctl_event, &count, sizeof(count)) == -1 && errno != EAGAIN)
+			logger(LOG_WARN, "control_worker_thread, read failed : %s.", strerror(errno));
+	}
+	return NULL;
+}
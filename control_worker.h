@@ -0,0 +1,62 @@
+/*
+ * soliloque-server, an open source implementation of the TeamSpeak protocol.
+ * Copyright (C) 2009 Hugo Camboulive <hugo.camboulive AT gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CONTROL_WORKER_H__
+#define __CONTROL_WORKER_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+struct server;
+
+/* largest datagram the control worker accepts */
+#define CTL_MAX_MSG 1024
+/* number of datagrams waiting for the control worker */
+#define CTL_QUEUE_SIZE 1024
+
+/**
+ * A datagram handed over to the control worker.
+ */
+struct ctl_slot {
+	int len;
+	socklen_t addr_len;
+	struct sockaddr_in addr;
+	char data[CTL_MAX_MSG];
+};
+
+/**
+ * Single producer (a receive thread), single consumer
+ * (the control worker) queue of datagrams.
+ */
+struct ctl_queue {
+	unsigned int head;	/* next slot written by the producer */
+	unsigned int tail;	/* next slot read by the consumer */
+	uint64_t dropped;	/* datagrams lost because the queue was full */
+	struct ctl_slot *slots;
+};
+
+int init_control_worker(struct server *s);
+void destroy_control_worker(struct server *s);
+int ctl_enqueue(struct ctl_queue *q, const char *data, int len,
+		const struct sockaddr_in *addr, socklen_t addr_len);
+void ctl_worker_wakeup(struct server *s);
+void *control_worker_thread(void *args);
+
+#endif
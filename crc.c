@@ -1,43 +1,392 @@
 /**
- * CRC32 implementation, copied from zlib
+ * CRC32 implementation, derived from zlib
  * http://www.zlib.net
+ *
+ * Three engines compute the same (zlib) CRC32 :
+ * - slicing-by-8 with eight 256-entry tables, initialized once,
+ * - PCLMULQDQ folding on x86-64 CPUs that support it (picked
+ *   at runtime), using the constants of Intel's paper "Fast CRC
+ *   Computation for Generic Polynomials Using PCLMULQDQ Instruction",
+ * - the classic byte-at-a-time loop for the odd bytes.
  */
 #include <stdio.h>
 #include <sys/types.h>
-#include <math.h>
 #include <string.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 #include "crc.h"
 #include "compat.h"
 
-static void crc32_table(uint32_t poly, uint32_t *table)
+#if defined(__x86_64__) && defined(__GNUC__)
+#define CRC_HAVE_PCLMUL
+#include <emmintrin.h>
+#include <smmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+#define CRC_POLY 0xEDB88320
+
+/* table[k][n] = crc of byte n followed by k zero bytes */
+static uint32_t crc_table[8][256];
+/* x2n_table[k] = x^(2^k) mod P, to shift crcs over runs of zeros */
+static uint32_t x2n_table[32];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+static uint32_t (*crc_engine)(uint32_t crc, const uint8_t *buf, size_t len);
+static const char *crc_engine_name;
+
+/**
+ * Compute the CRC of a buffer with slicing-by-8.
+ *
+ * @param crc the inverted running crc
+ * @param buf the data
+ * @param len the length of buf
+ *
+ * @return the inverted crc
+ */
+static uint32_t crc_slice8(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	uint32_t lo, hi;
+
+	/* align to 8 bytes */
+	while (len > 0 && ((uintptr_t)buf & 7) != 0) {
+		crc = (crc >> 8) ^ crc_table[0][(crc ^ *buf++) & 0xFF];
+		len--;
+	}
+	while (len >= 8) {
+		memcpy(&lo, buf, 4);
+		memcpy(&hi, buf + 4, 4);
+		lo = GUINT32_FROM_LE(lo) ^ crc;
+		hi = GUINT32_FROM_LE(hi);
+		crc = crc_table[7][lo & 0xFF] ^ crc_table[6][(lo >> 8) & 0xFF]
+			^ crc_table[5][(lo >> 16) & 0xFF] ^ crc_table[4][lo >> 24]
+			^ crc_table[3][hi & 0xFF] ^ crc_table[2][(hi >> 8) & 0xFF]
+			^ crc_table[1][(hi >> 16) & 0xFF] ^ crc_table[0][hi >> 24];
+		buf += 8;
+		len -= 8;
+	}
+	while (len > 0) {
+		crc = (crc >> 8) ^ crc_table[0][(crc ^ *buf++) & 0xFF];
+		len--;
+	}
+	return crc;
+}
+
+#ifdef CRC_HAVE_PCLMUL
+/**
+ * Fold a buffer of at least 64 bytes, whose length is a multiple of 16,
+ * with carry-less multiplications, then Barrett-reduce it to 32 bits.
+ * Same algorithm and constants as Chromium's zlib crc32_sse42_simd_.
+ *
+ * @param crc the inverted running crc
+ * @param buf the data
+ * @param len the length of buf
+ *
+ * @return the inverted crc
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc_fold_pclmul(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	static const uint64_t k1k2[2] __attribute__((aligned(16))) = { 0x0154442bd4ULL, 0x01c6e41596ULL };
+	static const uint64_t k3k4[2] __attribute__((aligned(16))) = { 0x01751997d0ULL, 0x00ccaa009eULL };
+	static const uint64_t k5k0[2] __attribute__((aligned(16))) = { 0x0163cd6124ULL, 0x0000000000ULL };
+	static const uint64_t poly[2] __attribute__((aligned(16))) = { 0x01db710641ULL, 0x01f7011641ULL };
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+	x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	x0 = _mm_load_si128((const __m128i *)k1k2);
+	buf += 64;
+	len -= 64;
+
+	/* fold 4 x 128 bits in parallel */
+	while (len >= 64) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+		y5 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+		y6 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+		y7 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+		y8 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+		buf += 64;
+		len -= 64;
+	}
+
+	/* fold into 128 bits */
+	x0 = _mm_load_si128((const __m128i *)k3k4);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	/* fold the remaining blocks of 16 bytes */
+	while (len >= 16) {
+		x2 = _mm_loadu_si128((const __m128i *)buf);
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+		buf += 16;
+		len -= 16;
+	}
+
+	/* fold 128 bits to 64 bits */
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_srli_si128(x1, 8);
+	x1 = _mm_xor_si128(x1, x2);
+	x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction to 32 bits */
+	x0 = _mm_load_si128((const __m128i *)poly);
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return _mm_extract_epi32(x1, 1);
+}
+
+/**
+ * Compute the CRC of a buffer, folding the largest
+ * multiple of 16 bytes with PCLMULQDQ when it is worth it.
+ *
+ * @param crc the inverted running crc
+ * @param buf the data
+ * @param len the length of buf
+ *
+ * @return the inverted crc
+ */
+static uint32_t crc_pclmul(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	size_t chunk;
+
+	if (len >= 64) {
+		chunk = len & ~(size_t)15;
+		crc = crc_fold_pclmul(crc, buf, chunk);
+		buf += chunk;
+		len -= chunk;
+	}
+	return crc_slice8(crc, buf, len);
+}
+#endif
+
+/**
+ * Multiply two polynomials modulo P (bit-reflected, as in zlib).
+ *
+ * @param a first polynomial
+ * @param b second polynomial
+ *
+ * @return a * b mod P
+ */
+static uint32_t multmodp(uint32_t a, uint32_t b)
+{
+	uint32_t m = 1U << 31;	/* x^0 */
+	uint32_t p = 0;
+
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1)) == 0)
+				break;
+		}
+		m >>= 1;
+		b = (b & 1) ? (b >> 1) ^ CRC_POLY : b >> 1;
+	}
+	return p;
+}
+
+/**
+ * Compute x^(8 * n) mod P, the operator that appends n zero bytes
+ * to a raw (not inverted) crc.
+ *
+ * @param n the number of zero bytes
+ *
+ * @return the operator
+ */
+static uint32_t x8nmodp(size_t n)
 {
-	uint32_t i, j;
+	uint32_t p = 1U << 31;	/* x^0 */
+	unsigned int k = 3;	/* 8 = 2^3 */
+
+	while (n) {
+		if (n & 1)
+			p = multmodp(x2n_table[k & 31], p);
+		n >>= 1;
+		k++;
+	}
+	return p;
+}
+
+/**
+ * Build the slicing tables and pick the fastest engine
+ * this CPU supports. Called once.
+ */
+static void crc_init(void)
+{
+	uint32_t i, j, c;
 
 	for (i = 0 ; i < 256 ; i++) {
-		table[i] = i;
-		for(j = 8 ; j > 0 ; j--) {
-			if((table[i] & 1) != 0)
-				table[i] = (table[i] >> 1) ^ poly;
+		c = i;
+		for (j = 8 ; j > 0 ; j--) {
+			if ((c & 1) != 0)
+				c = (c >> 1) ^ CRC_POLY;
 			else
-				table[i] >>= 1;
+				c >>= 1;
+		}
+		crc_table[0][i] = c;
+	}
+	for (i = 0 ; i < 256 ; i++) {
+		c = crc_table[0][i];
+		for (j = 1 ; j < 8 ; j++) {
+			c = (c >> 8) ^ crc_table[0][c & 0xFF];
+			crc_table[j][i] = c;
 		}
-	}     
+	}
+
+	c = 1U << 30;	/* x^1 */
+	x2n_table[0] = c;
+	for (i = 1 ; i < 32 ; i++)
+		x2n_table[i] = c = multmodp(c, c);
+
+	crc_engine = &crc_slice8;
+	crc_engine_name = "slicing-by-8";
+#ifdef CRC_HAVE_PCLMUL
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) {
+		crc_engine = &crc_pclmul;
+		crc_engine_name = "pclmulqdq";
+	}
+#endif
+}
+
+/**
+ * Continue a CRC32 computation (same convention as zlib's crc32()).
+ *
+ * @param crc the crc of the previous data, 0 to start
+ * @param buf the data
+ * @param len the length of buf
+ *
+ * @return the crc of the previous data followed by buf
+ */
+uint32_t crc_32_update(uint32_t crc, const void *buf, size_t len)
+{
+	pthread_once(&crc_once, &crc_init);
+	return ~crc_engine(~crc, (const uint8_t *)buf, len);
+}
+
+/**
+ * Compute the CRC32 of a buffer.
+ *
+ * @param buf the data
+ * @param len the length of buf
+ *
+ * @return the crc
+ */
+uint32_t crc_32(const void *buf, size_t len)
+{
+	return crc_32_update(0, buf, len);
 }
 
-uint32_t crc_32(void *str, size_t length, uint32_t poly)
+/**
+ * Compute the CRC32 of a packet as if the 4 bytes of its
+ * checksum field were zeros, without copying the packet.
+ *
+ * @param buf the packet
+ * @param len the length of the packet
+ * @param offset the offset of the checksum field (offset + 4 <= len)
+ *
+ * @return the crc
+ */
+uint32_t crc_32_zeroed(const void *buf, size_t len, size_t offset)
 {
-	uint32_t table[256];
+	static const uint8_t zeros[4] = {0, 0, 0, 0};
 	uint32_t crc;
-	size_t i;
 
-	bzero(table, 256);
-	crc32_table(poly, table);
+	crc = crc_32_update(0, buf, offset);
+	crc = crc_32_update(crc, zeros, 4);
+	return crc_32_update(crc, (const uint8_t *)buf + offset + 4, len - offset - 4);
+}
+
+/**
+ * Update the CRC32 of a message after some of its bytes changed, in
+ * O(changed bytes) : the crc of the message is linear in its content,
+ * so the crc of the XOR of the old and new bytes (followed by as many
+ * zeros as there are bytes after them) is the XOR of the two crcs.
+ *
+ * @param crc the crc of the message before the change
+ * @param len the length of the message
+ * @param offset the offset of the changed bytes
+ * @param old_bytes the previous value of the changed bytes
+ * @param new_bytes the new value of the changed bytes
+ * @param n the number of changed bytes
+ *
+ * @return the crc of the message after the change
+ */
+uint32_t crc_32_patch(uint32_t crc, size_t len, size_t offset,
+		const void *old_bytes, const void *new_bytes, size_t n)
+{
+	const uint8_t *o = (const uint8_t *)old_bytes;
+	const uint8_t *b = (const uint8_t *)new_bytes;
+	uint8_t delta[64];
+	uint32_t raw = 0;
+	size_t i, chunk, done;
+
+	pthread_once(&crc_once, &crc_init);
+	/* raw crc of the delta, the zeros before it do not contribute */
+	for (done = 0 ; done < n ; done += chunk) {
+		chunk = MIN(n - done, sizeof(delta));
+		for (i = 0 ; i < chunk ; i++)
+			delta[i] = o[done + i] ^ b[done + i];
+		raw = crc_slice8(raw, delta, chunk);
+	}
+	return crc ^ multmodp(x8nmodp(len - offset - n), raw);
+}
 
-	crc = 0xFFFFFFFF;
-	for (i = 0 ; i < length ; i++)
-		crc = (crc >> 8) ^ table[(((uint8_t *)str)[i] ^ crc) & 0x000000FF];
+/**
+ * Compute the CRC32 of two buffers put end to end from
+ * their own crcs, without reading them (as zlib's crc32_combine()).
+ *
+ * @param crc1 the crc of the first buffer
+ * @param crc2 the crc of the second buffer
+ * @param len2 the length of the second buffer
+ *
+ * @return the crc of the first buffer followed by the second
+ */
+uint32_t crc_32_combine(uint32_t crc1, uint32_t crc2, size_t len2)
+{
+	pthread_once(&crc_once, &crc_init);
+	return multmodp(x8nmodp(len2), crc1) ^ crc2;
+}
 
-	return ~crc;
+/**
+ * Name of the engine that has been picked for this CPU.
+ *
+ * @return a static string
+ */
+const char *crc_32_engine(void)
+{
+	pthread_once(&crc_once, &crc_init);
+	return crc_engine_name;
 }
@@ -9,7 +9,12 @@
 
 #include "compat.h"
 
-uint32_t crc_32(void *str, size_t length, uint32_t poly);
+uint32_t crc_32(const void *buf, size_t len);
+uint32_t crc_32_update(uint32_t crc, const void *buf, size_t len);
+uint32_t crc_32_zeroed(const void *buf, size_t len, size_t offset);
+uint32_t crc_32_patch(uint32_t crc, size_t len, size_t offset,
+		const void *old_bytes, const void *new_bytes, size_t n);
+uint32_t crc_32_combine(uint32_t crc1, uint32_t crc2, size_t len2);
+const char *crc_32_engine(void);
 
 #endif
-
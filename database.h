@@ -22,15 +22,34 @@
 #include "server.h"
 #include "configuration.h"
 #include "player_channel_privilege.h"
+#include "db_queue.h"
+#include "db_stmt.h"
+
+/**
+ * Objects of a server by their id in the database, while
+ * the server is loaded.
+ */
+struct db_id_map {
+	uint32_t *keys;		/* 0 : empty slot */
+	void **objs;
+	size_t mask;
+};
+
+int idm_init(struct db_id_map *m, size_t nb);
+void idm_free(struct db_id_map *m);
+void idm_put(struct db_id_map *m, uint32_t db_id, void *obj);
+void *idm_get(const struct db_id_map *m, uint32_t db_id);
 
 int init_db(struct config *c);
 int connect_db(struct config *c);
+dbi_conn db_open_conn(struct config *c);
 
 void db_create_servers(struct config *c, struct array *ss);
-int db_create_channels(struct config *c, struct server *s);
-int db_create_subchannels(struct config *c, struct server *s);
-int db_create_registrations(struct config *c, struct server *s);
-int db_create_sv_privileges(struct config *c, struct server *s);
+void db_load_servers(struct config *c, struct array *ss);
+int db_load_server(dbi_conn conn, struct server *s);
+int db_create_channels(dbi_conn conn, struct server *s, struct db_id_map *map);
+int db_create_registrations(dbi_conn conn, struct server *s, struct db_id_map *map);
+int db_create_sv_privileges(dbi_conn conn, struct server *s);
 int db_add_registration(struct config *c, struct server *s, struct registration *r);
 int db_del_registration(struct config *c, struct server *s, struct registration *r);
 
@@ -38,8 +57,14 @@ int db_unregister_channel(struct config *c, struct channel *ch);
 int db_register_channel(struct config *c, struct channel *ch);
 int db_update_channel(struct config *c, struct channel *ch);
 void db_update_pl_chan_priv(struct config *c, struct player_channel_privilege *tmp_priv);
-void db_create_pl_ch_privileges(struct config *c, struct server *s);
+unsigned int db_create_pl_ch_privileges(dbi_conn conn, struct server *s,
+		struct db_id_map *chans, struct db_id_map *regs);
 void db_del_pl_chan_priv(struct config *c, struct player_channel_privilege *priv);
 void db_add_pl_chan_priv(struct config *c, struct player_channel_privilege *priv);
 
+/* run by the persistence worker */
+void db_exec_channel(struct config *c, struct db_mutation *m);
+void db_exec_registration(struct config *c, struct db_mutation *m);
+void db_exec_pl_chan_priv(struct config *c, struct db_mutation *m);
+
 #endif
@@ -19,10 +19,54 @@
 #include "database.h"
 #include "log.h"
 
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <dbi/dbi.h>
 
 /**
- * Make a channel persistent by inserting it into the database
+ * Copy the fields of a channel stored in the database.
+ *
+ * @param ch the channel
+ * @param type DBM_CHAN_INSERT or DBM_CHAN_UPDATE
+ *
+ * @return the mutation, or NULL if an allocation failed
+ */
+static struct db_mutation *channel_mutation(struct channel *ch, int type)
+{
+	struct db_mutation *m;
+
+	m = dbq_new(type);
+	if (m == NULL)
+		return NULL;
+	m->key[0] = ch->db_id;
+	m->server_id = ch->in_server->id;
+	m->str[0] = strdup(ch->name);
+	m->str[1] = strdup(ch->topic);
+	m->str[2] = strdup(ch->desc);
+	m->str[3] = strdup(ch->password);
+	m->codec = ch->codec;
+	m->max_users = ch->players->max_slots;
+	m->sort_order = ch->sort_order;
+	m->flags = ch->flags;
+	/* Add the ID of the parent or -1 */
+	if (ch->parent == NULL)
+		m->parent_id = 0xFFFFFFFF;
+	else
+		m->parent_id = ch->parent->db_id;
+	if (m->str[0] == NULL || m->str[1] == NULL || m->str[2] == NULL || m->str[3] == NULL) {
+		logger(LOG_ERR, "channel_mutation, strdup failed : %s.", strerror(errno));
+		free(m->str[0]); free(m->str[1]); free(m->str[2]); free(m->str[3]);
+		free(m);
+		return NULL;
+	}
+	return m;
+}
+
+/**
+ * Make a channel persistent by inserting it into the database.
+ * Its id is known at once, the insertion is done by the
+ * persistence worker.
  *
  * @param c the db config
  * @param ch the channel to register
@@ -31,59 +75,15 @@
  */
 int db_register_channel(struct config *c, struct channel *ch)
 {
-	char *q = "INSERT INTO channels \
-		   (server_id, name, topic, description, \
-		    codec, maxusers, ordr, \
-		    flag_default, flag_hierarchical, flag_moderated, \
-		    parent_id, password) \
-		   VALUES \
-		   (%i, %s, %s, %s, \
-		    %i, %i, %i, \
-		    %i, %i, %i, \
-		    %i, %s);";
-	char *name_clean, *topic_clean, *desc_clean, *pass_clean;
-	int flag_default, flag_hierar, flag_mod;
-	int insert_id, parent_id;
 	size_t iter;
 	struct channel *tmp_ch;
 	struct player_channel_privilege *priv;
-	dbi_result res;
 
 	if (ch->db_id != 0) /* already exists in the db */
 		return 0;
 
-	/* Secure the input before inserting */
-	dbi_conn_quote_string_copy(c->conn, ch->name, &name_clean);
-	dbi_conn_quote_string_copy(c->conn, ch->topic, &topic_clean);
-	dbi_conn_quote_string_copy(c->conn, ch->desc, &desc_clean);
-	dbi_conn_quote_string_copy(c->conn, ch->password, &pass_clean);
-
-	/* better here than in the query function */
-	flag_default = (ch->flags & CHANNEL_FLAG_DEFAULT);
-	flag_hierar = (ch->flags & CHANNEL_FLAG_SUBCHANNELS);
-	flag_mod = (ch->flags & CHANNEL_FLAG_MODERATED);
-	
-	/* Add the ID of the parent or -1 */
-	if (ch->parent == NULL)
-		parent_id = 0xFFFFFFFF;
-	else
-		parent_id = ch->parent->db_id;
-
-	res = dbi_conn_queryf(c->conn, q,
-			ch->in_server->id, name_clean, topic_clean, desc_clean,
-			ch->codec, ch->players->max_slots, ch->sort_order,
-			flag_default, flag_hierar, flag_mod,
-			parent_id, pass_clean);
-	if (res == NULL) {
-		logger(LOG_ERR, "Insertion request failed : ");
-		logger(LOG_ERR, q, ch->in_server->id, name_clean, topic_clean, desc_clean,
-			ch->codec, ch->players->max_slots, ch->sort_order,
-			flag_default, flag_hierar, flag_mod,
-			parent_id, pass_clean);
-	}
-
-	insert_id = dbi_conn_sequence_last(c->conn, NULL);
-	ch->db_id = insert_id;
+	ch->db_id = dbq_next_chan_id(c);
+	dbq_push(c, channel_mutation(ch, DBM_CHAN_INSERT));
 
 	/* Register all the subchannels */
 	if (ch_getflags(ch) & CHANNEL_FLAG_SUBCHANNELS) {
@@ -98,9 +98,6 @@ int db_register_channel(struct config *c, struct channel *ch)
 			db_add_pl_chan_priv(c, priv);
 	ar_end_each;
 
-	/* free allocated data */
-	free(name_clean); free(topic_clean); free(desc_clean); free(pass_clean);
-
 	return 1;
 }
 
@@ -115,14 +112,15 @@ int db_register_channel(struct config *c, struct channel *ch)
  */
 int db_unregister_channel(struct config *c, struct channel *ch)
 {
-	char *q = "DELETE FROM channels WHERE id = %i;";
-	char *q2 = "DELETE FROM player_channel_privileges WHERE channel_id = %i;";
 	size_t iter;
 	struct channel *tmp_ch;
+	struct db_mutation *m;
 
-	dbi_conn_queryf(c->conn, q, ch->db_id);
-	/* remove all the player privileges for this channel */
-	dbi_conn_queryf(c->conn, q2, ch->db_id);
+	m = dbq_new(DBM_CHAN_DELETE);
+	if (m != NULL) {
+		m->key[0] = ch->db_id;
+		dbq_push(c, m);
+	}
 
 	/* unregister all the subchannels */
 	if (ch_getflags(ch) & CHANNEL_FLAG_SUBCHANNELS) {
@@ -145,144 +143,149 @@ int db_unregister_channel(struct config *c, struct channel *ch)
  */
 int db_update_channel(struct config *c, struct channel *ch)
 {
-	char *q = "UPDATE channels SET name = %s, topic = %s, description = %s, \
-		    codec = %i, maxusers = %i, ordr = %i, \
-		    flag_default = %i, flag_hierarchical = %i, flag_moderated = %i, \
-		    password = %s \
-		    WHERE id = %i;";
-	char *name_clean, *topic_clean, *desc_clean, *pass_clean;
-	int flag_default, flag_hierar, flag_mod;
-	dbi_result res;
-
 	if (ch->db_id == 0) /* does not exist in the db */
 		return 0;
 
-	/* Secure the input before inserting */
-	dbi_conn_quote_string_copy(c->conn, ch->name, &name_clean);
-	dbi_conn_quote_string_copy(c->conn, ch->topic, &topic_clean);
-	dbi_conn_quote_string_copy(c->conn, ch->desc, &desc_clean);
-	dbi_conn_quote_string_copy(c->conn, ch->password, &pass_clean);
+	dbq_push(c, channel_mutation(ch, DBM_CHAN_UPDATE));
+	return 1;
+}
 
-	/* better here than in the query function */
-	flag_default = (ch->flags & CHANNEL_FLAG_DEFAULT);
-	flag_hierar = (ch->flags & CHANNEL_FLAG_SUBCHANNELS);
-	flag_mod = (ch->flags & CHANNEL_FLAG_MODERATED);
-	
-	res = dbi_conn_queryf(c->conn, q,
-			name_clean, topic_clean, desc_clean,
-			ch->codec, ch->players->max_slots, ch->sort_order,
-			flag_default, flag_hierar, flag_mod,
-			pass_clean, ch->db_id);
-	if (res == NULL) {
-		logger(LOG_ERR, "Insertion request failed : ");
-		logger(LOG_ERR, q, name_clean, topic_clean, desc_clean,
-			ch->codec, ch->players->max_slots, ch->sort_order,
-			flag_default, flag_hierar, flag_mod,
-			pass_clean, ch->db_id);
+/**
+ * Write a channel mutation to the database.
+ *
+ * @param c the db config
+ * @param m the mutation
+ */
+void db_exec_channel(struct config *c, struct db_mutation *m)
+{
+	int flag_default, flag_hierar, flag_mod, ok;
+
+	if (m->type == DBM_CHAN_DELETE) {
+		dbs_exec(c->stmts, DBS_CHAN_DELETE, m->key[0]);
+		/* remove all the player privileges for this channel */
+		dbs_exec(c->stmts, DBS_CHAN_DEL_PRIVS, m->key[0]);
+		return;
 	}
-	free(name_clean); free(topic_clean); free(desc_clean); free(pass_clean);
 
-	return 1;
+	/* better here than in the query function */
+	flag_default = (m->flags & CHANNEL_FLAG_DEFAULT);
+	flag_hierar = (m->flags & CHANNEL_FLAG_SUBCHANNELS);
+	flag_mod = (m->flags & CHANNEL_FLAG_MODERATED);
+
+	if (m->type == DBM_CHAN_INSERT)
+		ok = dbs_exec(c->stmts, DBS_CHAN_INSERT,
+				m->key[0], m->server_id, m->str[0], m->str[1], m->str[2],
+				m->codec, m->max_users, m->sort_order,
+				flag_default, flag_hierar, flag_mod,
+				m->parent_id, m->str[3]);
+	else
+		ok = dbs_exec(c->stmts, DBS_CHAN_UPDATE,
+				m->str[0], m->str[1], m->str[2],
+				m->codec, m->max_users, m->sort_order,
+				flag_default, flag_hierar, flag_mod,
+				m->str[3], m->key[0]);
+	if (!ok)
+		logger(LOG_ERR, "db_exec_channel : %s of channel %u failed.",
+				(m->type == DBM_CHAN_INSERT) ? "insertion" : "update", m->key[0]);
 }
 
 /**
- * Go through the database, read and add to the server all the channels
- * stored.
+ * Create a channel from the current row of a result.
  *
- * @param c the configuration file containing the database connection
- * @param s the server
+ * @param res the result
+ * @param sub 1 if it is a subchannel
+ *
+ * @return the channel
  */
-int db_create_channels(struct config *c, struct server *s)
+static struct channel *channel_from_row(dbi_result res, int sub)
 {
-	char *q = "SELECT * FROM channels WHERE server_id = %i AND parent_id = -1;";
 	struct channel *ch;
-	dbi_result res;
 	char *name, *topic, *desc;
-	int flags;
-
-	res = dbi_conn_queryf(c->conn, q, s->id);
-
-	if (dbi_result_get_numrows(res) == 0) {
-		ch = new_channel("Default", "", "", CHANNEL_FLAG_DEFAULT | CHANNEL_FLAG_UNREGISTERED,
-				CODEC_SPEEX_12_3, 0, 128);
-		add_channel(s, ch);
-	}
-	if (res) {
-		while (dbi_result_next_row(res)) {
-			/* temporary variables to be readable */
-			name = dbi_result_get_string_copy(res, "name");
-			topic = dbi_result_get_string_copy(res, "topic");
-			desc = dbi_result_get_string_copy(res, "description");
-			logger(LOG_DBG, "flag_hierarchical = %i", dbi_result_get_uint(res, "flag_hierarchical"));
-			flags = (0 & ~CHANNEL_FLAG_UNREGISTERED);
-			if (dbi_result_get_uint(res, "flag_moderated"))
-				flags |= CHANNEL_FLAG_MODERATED;
-			if (dbi_result_get_uint(res, "flag_hierarchical"))
-				flags |= CHANNEL_FLAG_SUBCHANNELS;
-			if (dbi_result_get_uint(res, "flag_default"))
-				flags |= CHANNEL_FLAG_DEFAULT;
-			/* create the channel */
-			ch = new_channel(name, topic, desc, flags,
-					dbi_result_get_uint(res, "codec"),
-					dbi_result_get_int(res, "ordr"),
-					dbi_result_get_uint(res, "maxusers"));
-			ch->db_id = dbi_result_get_uint(res, "id");
-
-			add_channel(s, ch);
-			/* free temporary variables */
-			free(name); free(topic); free(desc);
-		}
-		dbi_result_free(res);
+	int flags = 0x00;
+
+	/* temporary variables to be readable */
+	name = dbi_result_get_string_copy(res, "name");
+	topic = dbi_result_get_string_copy(res, "topic");
+	desc = dbi_result_get_string_copy(res, "description");
+	if (!sub) {
+		flags = (0 & ~CHANNEL_FLAG_UNREGISTERED);
+		if (dbi_result_get_uint(res, "flag_moderated"))
+			flags |= CHANNEL_FLAG_MODERATED;
+		if (dbi_result_get_uint(res, "flag_hierarchical"))
+			flags |= CHANNEL_FLAG_SUBCHANNELS;
+		if (dbi_result_get_uint(res, "flag_default"))
+			flags |= CHANNEL_FLAG_DEFAULT;
 	}
-	return 1;
+	ch = new_channel(name, topic, desc, flags,
+			dbi_result_get_uint(res, "codec"),
+			dbi_result_get_int(res, "ordr"),
+			dbi_result_get_uint(res, "maxusers"));
+	ch->db_id = dbi_result_get_uint(res, "id");
+	/* free temporary variables */
+	free(name); free(topic); free(desc);
+	return ch;
 }
 
-int db_create_subchannels(struct config *c, struct server *s)
+/**
+ * Go through the database, read and add to the server all the channels
+ * stored, in one query. The channels come before their subchannels,
+ * whose parents are found in the map.
+ *
+ * @param conn the database connection of the loading thread
+ * @param s the server
+ * @param map filled with the channels, by database id
+ *
+ * @return 1 on success, 0 on failure
+ */
+int db_create_channels(dbi_conn conn, struct server *s, struct db_id_map *map)
 {
-	char *q = "SELECT * FROM channels WHERE server_id = %i AND parent_id != -1;";
+	char *q = "SELECT * FROM channels WHERE server_id = %i ORDER BY parent_id, id;";
 	struct channel *ch, *parent;
 	dbi_result res;
-	char *name, *topic, *desc;
 	int parent_db_id;
 
-	res = dbi_conn_queryf(c->conn, q, s->id);
-
-	if (res) {
-		while (dbi_result_next_row(res)) {
-			/* temporary variables to be readable */
-			name = dbi_result_get_string_copy(res, "name");
-			topic = dbi_result_get_string_copy(res, "topic");
-			desc = dbi_result_get_string_copy(res, "description");
-			/* create the sub channel */
-			ch = new_channel(name, topic, desc, 0x00,
-					dbi_result_get_uint(res, "codec"),
-					dbi_result_get_int(res, "ordr"),
-					dbi_result_get_uint(res, "maxusers"));
-			ch->db_id = dbi_result_get_uint(res, "id");
-
-			parent_db_id = dbi_result_get_uint(res, "parent_id");
-
-			parent = get_channel_by_db_id(s, parent_db_id);
-			if (parent == NULL) {
-				logger(LOG_WARN, "db_create_subchannels, channel with db_id %i does not exist.",
-						parent_db_id);
-				destroy_channel(ch);
-			} else if (parent->parent != NULL) {
-				logger(LOG_WARN, "db_create_subchannels, a subchannel can not have subchannels.");
-				destroy_channel(ch);
-			} else if ((parent->flags & CHANNEL_FLAG_SUBCHANNELS) == 0) {
-				logger(LOG_WARN, "db_create_subchannels, channel %s can not have subchannel.",
-						parent->name);
-				destroy_channel(ch);
-			} else {
-				add_channel(s, ch);
-				channel_add_subchannel(parent, ch);
-			}
-			/* free temporary variables */
-			free(name); free(topic); free(desc);
-		}
+	res = dbi_conn_queryf(conn, q, s->id);
+	if (res == NULL) {
+		logger(LOG_ERR, "db_create_channels : SQL query failed.");
+		return 0;
+	}
+	if (!idm_init(map, dbi_result_get_numrows(res))) {
 		dbi_result_free(res);
+		return 0;
 	}
-	return 1;
+	while (dbi_result_next_row(res)) {
+		parent_db_id = dbi_result_get_int(res, "parent_id");
+		if (parent_db_id == -1) {
+			ch = channel_from_row(res, 0);
+			add_channel(s, ch);
+			idm_put(map, ch->db_id, ch);
+			continue;
+		}
+		ch = channel_from_row(res, 1);
+		parent = (struct channel *)idm_get(map, parent_db_id);
+		if (parent == NULL) {
+			logger(LOG_WARN, "db_create_channels, channel with db_id %i does not exist.",
+					parent_db_id);
+			destroy_channel(ch);
+		} else if (parent->parent != NULL) {
+			logger(LOG_WARN, "db_create_channels, a subchannel can not have subchannels.");
+			destroy_channel(ch);
+		} else if ((parent->flags & CHANNEL_FLAG_SUBCHANNELS) == 0) {
+			logger(LOG_WARN, "db_create_channels, channel %s can not have subchannel.",
+					parent->name);
+			destroy_channel(ch);
+		} else {
+			add_channel(s, ch);
+			channel_add_subchannel(parent, ch);
+			idm_put(map, ch->db_id, ch);
+		}
+	}
+	dbi_result_free(res);
 
+	if (s->chans->used_slots == 0) {
+		ch = new_channel("Default", "", "", CHANNEL_FLAG_DEFAULT | CHANNEL_FLAG_UNREGISTERED,
+				CODEC_SPEEX_12_3, 0, 128);
+		add_channel(s, ch);
+	}
+	return 1;
 }
@@ -0,0 +1,248 @@
+/*
+ * soliloque-server, an open source implementation of the TeamSpeak protocol.
+ * Copyright (C) 2009 Hugo Camboulive <hugo.camboulive AT gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "database.h"
+#include "db_snapshot.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Create a map for a number of objects.
+ *
+ * @param m the map
+ * @param nb the number of objects it will hold
+ *
+ * @return 1 on success, 0 if the allocation failed
+ */
+int idm_init(struct db_id_map *m, size_t nb)
+{
+	size_t size = 16;
+
+	/* keep it at most half full */
+	while (size < nb * 2)
+		size <<= 1;
+	m->mask = size - 1;
+	m->keys = (uint32_t *)calloc(size, sizeof(uint32_t));
+	m->objs = (void **)calloc(size, sizeof(void *));
+	if (m->keys == NULL || m->objs == NULL) {
+		logger(LOG_ERR, "idm_init, calloc failed : %s.", strerror(errno));
+		idm_free(m);
+		return 0;
+	}
+	return 1;
+}
+
+void idm_free(struct db_id_map *m)
+{
+	free(m->keys);
+	free(m->objs);
+	m->keys = NULL;
+	m->objs = NULL;
+}
+
+static size_t idm_slot(const struct db_id_map *m, uint32_t db_id)
+{
+	size_t i = (size_t)((db_id * 0x9E3779B97F4A7C15ULL) >> 32) & m->mask;
+
+	while (m->keys[i] != 0 && m->keys[i] != db_id)
+		i = (i + 1) & m->mask;
+	return i;
+}
+
+/**
+ * Add an object to a map. The map must not be full,
+ * its size is given by idm_init().
+ *
+ * @param m the map
+ * @param db_id the id of the object in the database (not 0)
+ * @param obj the object
+ */
+void idm_put(struct db_id_map *m, uint32_t db_id, void *obj)
+{
+	size_t i = idm_slot(m, db_id);
+
+	m->keys[i] = db_id;
+	m->objs[i] = obj;
+}
+
+/**
+ * Retrieve an object of a map.
+ *
+ * @param m the map
+ * @param db_id the id of the object in the database
+ *
+ * @return the object, or NULL if it is not in the map
+ */
+void *idm_get(const struct db_id_map *m, uint32_t db_id)
+{
+	if (db_id == 0)
+		return NULL;
+	return m->objs[idm_slot(m, db_id)];
+}
+
+/**
+ * Load a server from the database : its channels, its
+ * registrations and the privileges linking them. Each table
+ * is read once, and the rows are matched through maps of
+ * the database ids.
+ *
+ * @param conn the database connection of the loading thread
+ * @param s the server
+ *
+ * @return 1 on success, 0 on failure
+ */
+int db_load_server(dbi_conn conn, struct server *s)
+{
+	struct db_id_map chans, regs;
+	uint64_t t0, t1, t2, t3, t4;
+	unsigned int nb_priv;
+	size_t nb_chans;
+
+	bzero(&chans, sizeof(struct db_id_map));
+	bzero(&regs, sizeof(struct db_id_map));
+	t0 = now_ns();
+	if (!db_create_channels(conn, s, &chans))
+		goto fail;
+	nb_chans = s->chans->used_slots;
+	t1 = now_ns();
+	if (!db_create_registrations(conn, s, &regs))
+		goto fail;
+	t2 = now_ns();
+	db_create_sv_privileges(conn, s);
+	t3 = now_ns();
+	nb_priv = db_create_pl_ch_privileges(conn, s, &chans, &regs);
+	t4 = now_ns();
+
+	logger(LOG_INFO, "Server %i : %zu channels loaded in %.1f ms, %zu registrations in %.1f ms, "
+			"server privileges in %.1f ms, %u channel privileges in %.1f ms (%.1f ms in total).",
+			s->id, nb_chans, (t1 - t0) / 1e6, s->regs->used_slots, (t2 - t1) / 1e6,
+			(t3 - t2) / 1e6, nb_priv, (t4 - t3) / 1e6, (t4 - t0) / 1e6);
+	idm_free(&chans);
+	idm_free(&regs);
+	return 1;
+
+fail:
+	logger(LOG_ERR, "Server %i : could not be loaded from the database.", s->id);
+	idm_free(&chans);
+	idm_free(&regs);
+	return 0;
+}
+
+/**
+ * A server loaded by its own thread.
+ */
+struct db_loader {
+	struct server *s;
+	dbi_conn conn;
+	pthread_t thread;
+	int started;
+	int restored;	/* from its snapshot, nothing to load */
+};
+
+static void *db_loader_thread(void *args)
+{
+	struct db_loader *l = (struct db_loader *)args;
+
+	db_load_server(l->conn, l->s);
+	return NULL;
+}
+
+/**
+ * Load all the servers : from their snapshots when they are
+ * up to date, from the database at the same time otherwise.
+ * Each server loaded from the database gets a connection and
+ * a thread for the time of the loading. The servers that can
+ * not have them are loaded one after the other with the main
+ * connection.
+ *
+ * @param c the db config
+ * @param ss the servers
+ */
+void db_load_servers(struct config *c, struct array *ss)
+{
+	struct db_loader *loaders;
+	struct server *s;
+	size_t iter, nb, i;
+	unsigned int nb_par = 0, nb_snap = 0;
+	uint64_t start;
+	int err;
+
+	start = now_ns();
+	nb = ss->used_slots;
+	if (nb == 0)
+		return;
+	loaders = (struct db_loader *)calloc(nb, sizeof(struct db_loader));
+	if (loaders == NULL) {
+		logger(LOG_ERR, "db_load_servers, calloc failed : %s.", strerror(errno));
+		ar_each(struct server *, s, iter, ss)
+			if (!db_snapshot_load(s))
+				db_load_server(c->conn, s);
+		ar_end_each;
+		return;
+	}
+
+	i = 0;
+	ar_each(struct server *, s, iter, ss)
+		loaders[i].s = s;
+		loaders[i].restored = db_snapshot_load(s);
+		nb_snap += loaders[i].restored;
+		i++;
+	ar_end_each;
+	/* a single server has the main connection to itself */
+	for (i = 0 ; i < nb && nb - nb_snap > 1 ; i++)
+		if (!loaders[i].restored)
+			loaders[i].conn = db_open_conn(c);
+
+	for (i = 0 ; i < nb ; i++) {
+		if (loaders[i].conn == NULL)
+			continue;
+		err = pthread_create(&loaders[i].thread, NULL, &db_loader_thread, &loaders[i]);
+		if (err != 0)
+			logger(LOG_WARN, "db_load_servers, pthread_create failed : %s.", strerror(err));
+		else
+			loaders[i].started = 1;
+	}
+	/* the main connection is not used by the loading threads */
+	for (i = 0 ; i < nb ; i++)
+		if (!loaders[i].started && !loaders[i].restored)
+			db_load_server(c->conn, loaders[i].s);
+	for (i = 0 ; i < nb ; i++) {
+		if (loaders[i].started) {
+			pthread_join(loaders[i].thread, NULL);
+			nb_par++;
+		}
+		if (loaders[i].conn != NULL)
+			dbi_conn_close(loaders[i].conn);
+	}
+	free(loaders);
+	logger(LOG_INFO, "%zu servers loaded in %.1f ms, %u from snapshots, %u in parallel.",
+			nb, (now_ns() - start) / 1e6, nb_snap, nb_par);
+}
@@ -30,10 +30,10 @@
  * Go through the database, read and add to the server all
  * the server permissions stored.
  *
- * @param c the configuration of the db
+ * @param conn the database connection of the loading thread
  * @param s the server
  */
-int db_create_sv_privileges(struct config *c, struct server *s)
+int db_create_sv_privileges(dbi_conn conn, struct server *s)
 {
 	char *q = "SELECT * FROM server_privileges WHERE server_id = %i;";
 	dbi_result res;
@@ -43,7 +43,7 @@ int db_create_sv_privileges(struct config *c, struct server *s)
 
 	logger(LOG_INFO, "Loading server privileges.");
 
-	res = dbi_conn_queryf(c->conn, q, s->id);
+	res = dbi_conn_queryf(conn, q, s->id);
 	if (res) {
 		while (dbi_result_next_row(res)) {
 			/* Get the id of the group from the string */
@@ -142,150 +142,160 @@ int db_create_sv_privileges(struct config *c, struct server *s)
 	return 1;
 }
 
-void db_create_pl_ch_privileges(struct config *c, struct server *s)
+/**
+ * Go through the database, read and add to the channels of
+ * the server all the player channel privileges stored, in
+ * one query.
+ *
+ * @param conn the database connection of the loading thread
+ * @param s the server
+ * @param chans the channels of the server, by database id
+ * @param regs the registrations of the server, by database id
+ *
+ * @return the number of privileges added
+ */
+unsigned int db_create_pl_ch_privileges(dbi_conn conn, struct server *s,
+		struct db_id_map *chans, struct db_id_map *regs)
 {
 	dbi_result res;
 	int flags;
-	size_t iter, iter2;
-	int reg_id;
+	unsigned int nb = 0;
 	struct channel *ch;
 	struct registration *reg;
 	struct player_channel_privilege *tmp_priv;
-	char *q = "SELECT * FROM player_channel_privileges WHERE channel_id = %i;";
-
+	char *q = "SELECT p.* FROM player_channel_privileges p, channels c \
+		   WHERE p.channel_id = c.id AND c.server_id = %i;";
 
 	logger(LOG_INFO, "Reading player channel privileges...");
-	ar_each(struct channel *, ch, iter, s->chans)
-		if (!(ch->flags & CHANNEL_FLAG_UNREGISTERED)) {
-			res = dbi_conn_queryf(c->conn, q, ch->db_id);
-			if (res) {
-				while (dbi_result_next_row(res)) {
-					tmp_priv = new_player_channel_privilege();
-					tmp_priv->ch = ch;
-					flags = 0;
-					if (dbi_result_get_uint(res, "channel_admin"))
-						flags |= CHANNEL_PRIV_CHANADMIN;
-					if (dbi_result_get_uint(res, "operator"))
-						flags |= CHANNEL_PRIV_OP;
-					if (dbi_result_get_uint(res, "voice"))
-						flags |= CHANNEL_PRIV_VOICE;
-					if (dbi_result_get_uint(res, "auto_operator"))
-						flags |= CHANNEL_PRIV_AUTOOP;
-					if (dbi_result_get_uint(res, "auto_voice"))
-						flags |= CHANNEL_PRIV_AUTOVOICE;
-					tmp_priv->flags = flags;
-					tmp_priv->reg = PL_CH_PRIV_REGISTERED;
-					reg_id = dbi_result_get_uint(res, "player_id");
-					ar_each(struct registration *, reg, iter2, s->regs)
-						if (reg->db_id == reg_id)
-							tmp_priv->pl_or_reg.reg = reg;
-					ar_end_each;
-					if (tmp_priv->pl_or_reg.reg != NULL)
-						add_player_channel_privilege(ch, tmp_priv);
-					else
-						free(tmp_priv);
-				}
-				dbi_result_free(res);
-			} else {
-				logger(LOG_WARN, "db_create_pl_ch_privileges : SQL query failed.");
-			}
-		}
-	ar_end_each;
-}
-
-void db_update_pl_chan_priv(struct config *c, struct player_channel_privilege *tmp_priv)
-{
-	dbi_result res;
-	char *q = "UPDATE player_channel_privileges \
-			SET channel_admin = %i, operator = %i, voice = %i, auto_operator = %i, auto_voice = %i \
-			WHERE player_id = %i AND channel_id = %i;" ;
-
-	logger(LOG_INFO, "db_update_pl_chan_priv");
-	if (tmp_priv->reg != PL_CH_PRIV_REGISTERED) {
-		logger(LOG_WARN, "db_update_pl_chan_priv : trying to update a pl_ch_priv that is marked as unregistered. This should not happen!");
-		return;
-	}
-	if (tmp_priv->pl_or_reg.reg == NULL) {
-		logger(LOG_WARN, "db_update_pl_chan_priv : registration is NULL. This should not happen!");
-		return;
-	}
-	if (tmp_priv->ch == NULL) {
-		logger(LOG_WARN, "db_update_pl_chan_priv : channel is NULL. This should not happen!");
-		return;
-	}
-	res = dbi_conn_queryf(c->conn, q,
-			tmp_priv->flags & CHANNEL_PRIV_CHANADMIN,
-			tmp_priv->flags & CHANNEL_PRIV_OP,
-			tmp_priv->flags & CHANNEL_PRIV_VOICE,
-			tmp_priv->flags & CHANNEL_PRIV_AUTOOP,
-			tmp_priv->flags & CHANNEL_PRIV_AUTOVOICE,
-			tmp_priv->pl_or_reg.reg->db_id,
-			tmp_priv->ch->db_id);
-			
+	res = dbi_conn_queryf(conn, q, s->id);
 	if (res == NULL) {
-		logger(LOG_WARN, "db_update_pl_chan_priv : SQL query failed.");
-		logger(LOG_WARN, q, tmp_priv->flags & CHANNEL_PRIV_CHANADMIN, tmp_priv->flags & CHANNEL_PRIV_OP,
-			tmp_priv->flags & CHANNEL_PRIV_VOICE, tmp_priv->flags & CHANNEL_PRIV_AUTOOP,
-			tmp_priv->flags & CHANNEL_PRIV_AUTOVOICE,
-			tmp_priv->pl_or_reg.reg->db_id, tmp_priv->ch->db_id);
-	} else {
-		dbi_result_free(res);
+		logger(LOG_WARN, "db_create_pl_ch_privileges : SQL query failed.");
+		return 0;
 	}
+	while (dbi_result_next_row(res)) {
+		ch = (struct channel *)idm_get(chans, dbi_result_get_uint(res, "channel_id"));
+		reg = (struct registration *)idm_get(regs, dbi_result_get_uint(res, "player_id"));
+		if (ch == NULL || reg == NULL)
+			continue;
+		tmp_priv = new_player_channel_privilege();
+		tmp_priv->ch = ch;
+		flags = 0;
+		if (dbi_result_get_uint(res, "channel_admin"))
+			flags |= CHANNEL_PRIV_CHANADMIN;
+		if (dbi_result_get_uint(res, "operator"))
+			flags |= CHANNEL_PRIV_OP;
+		if (dbi_result_get_uint(res, "voice"))
+			flags |= CHANNEL_PRIV_VOICE;
+		if (dbi_result_get_uint(res, "auto_operator"))
+			flags |= CHANNEL_PRIV_AUTOOP;
+		if (dbi_result_get_uint(res, "auto_voice"))
+			flags |= CHANNEL_PRIV_AUTOVOICE;
+		tmp_priv->flags = flags;
+		tmp_priv->reg = PL_CH_PRIV_REGISTERED;
+		tmp_priv->pl_or_reg.reg = reg;
+		add_player_channel_privilege(ch, tmp_priv);
+		nb++;
+	}
+	dbi_result_free(res);
+	return nb;
 }
 
-void db_add_pl_chan_priv(struct config *c, struct player_channel_privilege *priv)
+/**
+ * Check that a player channel privilege can be stored.
+ *
+ * @param priv the privilege
+ * @param func the name of the caller, for the logs
+ *
+ * @return 1 if it can, 0 otherwise
+ */
+static int pl_chan_priv_storable(struct player_channel_privilege *priv, const char *func)
 {
-	dbi_result res;
-	char *q = "INSERT INTO player_channel_privileges \
-		   (player_id, channel_id, channel_admin, operator, voice, auto_operator, auto_voice) \
-		   VALUES (%i, %i, %i, %i, %i, %i, %i)";
-
 	if (priv->reg != PL_CH_PRIV_REGISTERED) {
-		logger(LOG_WARN, "db_add_pl_chan_priv : trying to add a pl_ch_priv that is marked as unregistered. This should not happen!");
-		return;
+		logger(LOG_WARN, "%s : trying to store a pl_ch_priv that is marked as unregistered. This should not happen!", func);
+		return 0;
 	}
 	if (priv->pl_or_reg.reg == NULL) {
-		logger(LOG_WARN, "db_add_pl_chan_priv : registration is NULL. This should not happen!");
-		return;
+		logger(LOG_WARN, "%s : registration is NULL. This should not happen!", func);
+		return 0;
 	}
 	if (priv->ch == NULL) {
-		logger(LOG_WARN, "db_add_pl_chan_priv : channel is NULL. This should not happen!");
-		return;
+		logger(LOG_WARN, "%s : channel is NULL. This should not happen!", func);
+		return 0;
 	}
-	logger(LOG_INFO, "registering a new player channel privilege.");
-
-	res = dbi_conn_queryf(c->conn, q, priv->pl_or_reg.reg->db_id, priv->ch->db_id,
-			priv->flags & CHANNEL_PRIV_CHANADMIN, priv->flags & CHANNEL_PRIV_OP, priv->flags & CHANNEL_PRIV_VOICE,
-			priv->flags & CHANNEL_PRIV_AUTOOP, priv->flags & CHANNEL_PRIV_AUTOVOICE);
-	if (res == NULL)
-		logger(LOG_WARN, "db_add_pl_chan_priv : SQL query failed.");
-	else
-		dbi_result_free(res);
+	return 1;
 }
 
-void db_del_pl_chan_priv(struct config *c, struct player_channel_privilege *priv)
+/**
+ * Hand a player channel privilege over to the persistence worker.
+ *
+ * @param c the db config
+ * @param priv the privilege
+ * @param type DBM_PRIV_INSERT, DBM_PRIV_UPDATE or DBM_PRIV_DELETE
+ */
+static void pl_chan_priv_push(struct config *c, struct player_channel_privilege *priv, int type)
 {
-	dbi_result res;
-	char *q = "DELETE FROM player_channel_privileges \
-			WHERE player_id = %i AND channel_id = %i;";
+	struct db_mutation *m;
 
-	if (priv->reg != PL_CH_PRIV_REGISTERED) {
-		logger(LOG_WARN, "db_del_pl_chan_priv : trying to delete a pl_ch_priv that is marked as unregistered. This should not happen!");
+	m = dbq_new(type);
+	if (m == NULL)
 		return;
-	}
-	if (priv->pl_or_reg.reg == NULL) {
-		logger(LOG_WARN, "db_del_pl_chan_priv : registration is NULL. This should not happen!");
+	m->key[0] = priv->pl_or_reg.reg->db_id;
+	m->key[1] = priv->ch->db_id;
+	m->flags = priv->flags;
+	dbq_push(c, m);
+}
+
+void db_update_pl_chan_priv(struct config *c, struct player_channel_privilege *tmp_priv)
+{
+	logger(LOG_INFO, "db_update_pl_chan_priv");
+	if (pl_chan_priv_storable(tmp_priv, "db_update_pl_chan_priv"))
+		pl_chan_priv_push(c, tmp_priv, DBM_PRIV_UPDATE);
+}
+
+void db_add_pl_chan_priv(struct config *c, struct player_channel_privilege *priv)
+{
+	if (!pl_chan_priv_storable(priv, "db_add_pl_chan_priv"))
 		return;
-	}
-	if (priv->ch == NULL) {
-		logger(LOG_WARN, "db_del_pl_chan_priv : channel is NULL. This should not happen!");
+	logger(LOG_INFO, "registering a new player channel privilege.");
+	pl_chan_priv_push(c, priv, DBM_PRIV_INSERT);
+}
+
+void db_del_pl_chan_priv(struct config *c, struct player_channel_privilege *priv)
+{
+	if (!pl_chan_priv_storable(priv, "db_del_pl_chan_priv"))
 		return;
-	}
 	logger(LOG_INFO, "unregistering a player channel privilege");
+	pl_chan_priv_push(c, priv, DBM_PRIV_DELETE);
+}
 
-	res = dbi_conn_queryf(c->conn, q, priv->pl_or_reg.reg->db_id, priv->ch->db_id);
-	if (res == NULL)
-		logger(LOG_WARN, "db_del_pl_chan_priv : SQL query failed.");
-	else
-		dbi_result_free(res);
+/**
+ * Write a player channel privilege mutation to the database.
+ *
+ * @param c the db config
+ * @param m the mutation
+ */
+void db_exec_pl_chan_priv(struct config *c, struct db_mutation *m)
+{
+	int ok;
+
+	switch (m->type) {
+	case DBM_PRIV_UPDATE:
+		ok = dbs_exec(c->stmts, DBS_PRIV_UPDATE,
+				m->flags & CHANNEL_PRIV_CHANADMIN, m->flags & CHANNEL_PRIV_OP,
+				m->flags & CHANNEL_PRIV_VOICE, m->flags & CHANNEL_PRIV_AUTOOP,
+				m->flags & CHANNEL_PRIV_AUTOVOICE, m->key[0], m->key[1]);
+		break;
+	case DBM_PRIV_INSERT:
+		ok = dbs_exec(c->stmts, DBS_PRIV_INSERT, m->key[0], m->key[1],
+				m->flags & CHANNEL_PRIV_CHANADMIN, m->flags & CHANNEL_PRIV_OP,
+				m->flags & CHANNEL_PRIV_VOICE, m->flags & CHANNEL_PRIV_AUTOOP,
+				m->flags & CHANNEL_PRIV_AUTOVOICE);
+		break;
+	default:
+		ok = dbs_exec(c->stmts, DBS_PRIV_DELETE, m->key[0], m->key[1]);
+		break;
+	}
+	if (!ok)
+		logger(LOG_WARN, "db_exec_pl_chan_priv : SQL query failed (player %u, channel %u).",
+				m->key[0], m->key[1]);
 }
@@ -0,0 +1,542 @@
+/*
+ * soliloque-server, an open source implementation of the TeamSpeak protocol.
+ * Copyright (C) 2009 Hugo Camboulive <hugo.camboulive AT gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "database.h"
+#include "db_queue.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <dbi/dbi.h>
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Retrieve the highest id of a table.
+ *
+ * @param c the db config
+ * @param table the name of the table
+ *
+ * @return the id, 0 if the table is empty
+ */
+static uint32_t db_max_id(struct config *c, const char *table)
+{
+	char *q = "SELECT id FROM %s ORDER BY id DESC LIMIT 1;";
+	dbi_result res;
+	uint32_t id = 0;
+
+	res = dbi_conn_queryf(c->conn, q, table);
+	if (res == NULL) {
+		logger(LOG_WARN, "db_max_id : SQL query failed on %s.", table);
+		return 0;
+	}
+	if (dbi_result_next_row(res))
+		id = dbi_result_get_uint(res, "id");
+	dbi_result_free(res);
+	return id;
+}
+
+/**
+ * Create the persistence queue of a configuration. The
+ * ids of the rows the server will insert are taken after
+ * the highest ones in the database, so they are known
+ * without waiting for the insertion.
+ *
+ * @param c the db config, connected
+ *
+ * @return 1 on success, 0 on failure
+ */
+int dbq_init(struct config *c)
+{
+	struct db_queue *q;
+
+	q = (struct db_queue *)calloc(1, sizeof(struct db_queue));
+	if (q == NULL) {
+		logger(LOG_ERR, "dbq_init, calloc failed : %s.", strerror(errno));
+		return 0;
+	}
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->not_empty, NULL);
+	pthread_cond_init(&q->not_full, NULL);
+	pthread_cond_init(&q->idle, NULL);
+	q->next_chan_id = db_max_id(c, "channels") + 1;
+	q->next_reg_id = db_max_id(c, "registrations") + 1;
+	c->dbq = q;
+	return 1;
+}
+
+uint32_t dbq_next_chan_id(struct config *c)
+{
+	return __atomic_fetch_add(&c->dbq->next_chan_id, 1, __ATOMIC_RELAXED);
+}
+
+uint32_t dbq_next_reg_id(struct config *c)
+{
+	return __atomic_fetch_add(&c->dbq->next_reg_id, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Allocate an empty mutation.
+ *
+ * @param type the type of the mutation (DBM_*)
+ *
+ * @return the mutation, or NULL if the allocation failed
+ */
+struct db_mutation *dbq_new(int type)
+{
+	struct db_mutation *m;
+
+	m = (struct db_mutation *)calloc(1, sizeof(struct db_mutation));
+	if (m == NULL) {
+		logger(LOG_ERR, "dbq_new, calloc failed : %s.", strerror(errno));
+		return NULL;
+	}
+	m->type = type;
+	return m;
+}
+
+static void dbq_free(struct db_mutation *m)
+{
+	int i;
+
+	for (i = 0 ; i < 4 ; i++)
+		free(m->str[i]);
+	free(m);
+}
+
+/* the table of a mutation : channel, registration and privilege mutations are 0-2, 3-4 and 5-7 */
+static int row_table(const struct db_mutation *m)
+{
+	return (m->type <= DBM_CHAN_DELETE) ? 0 : (m->type <= DBM_REG_DELETE) ? 1 : 2;
+}
+
+/* the row a mutation changes, to find the updates that can be merged */
+static int same_row(const struct db_mutation *a, const struct db_mutation *b)
+{
+	return row_table(a) == row_table(b) && a->key[0] == b->key[0] && a->key[1] == b->key[1];
+}
+
+static int is_delete(const struct db_mutation *m)
+{
+	return m->type == DBM_CHAN_DELETE || m->type == DBM_REG_DELETE || m->type == DBM_PRIV_DELETE;
+}
+
+/**
+ * Find the entry of the index for the row of a mutation.
+ * The lock must be held.
+ *
+ * @param q the queue
+ * @param m the mutation
+ *
+ * @return the link to the entry, pointing to NULL if the row has none
+ */
+static struct db_mutation **index_find(struct db_queue *q, const struct db_mutation *m)
+{
+	struct db_mutation **p;
+	uint32_t h;
+
+	h = (uint32_t)row_table(m) * 0x9E3779B1u ^ m->key[0] * 0x85EBCA6Bu ^ m->key[1] * 0xC2B2AE35u;
+	p = &q->index[(h ^ (h >> 16)) & (DBQ_INDEX_SIZE - 1)];
+	while (*p != NULL && !same_row(*p, m))
+		p = &(*p)->hnext;
+	return p;
+}
+
+/**
+ * Keep the index up to date with a mutation added to the queue :
+ * it becomes the entry of its row, or the row loses its entry
+ * if it is a deletion (nothing is merged across a deletion).
+ * The lock must be held.
+ *
+ * @param q the queue
+ * @param m the mutation
+ */
+static void index_add(struct db_queue *q, struct db_mutation *m)
+{
+	struct db_mutation **p = index_find(q, m);
+
+	/* the previous entry of the row is replaced */
+	if (*p != NULL)
+		*p = (*p)->hnext;
+	if (!is_delete(m)) {
+		m->hnext = *p;
+		*p = m;
+	}
+}
+
+/**
+ * Take a mutation leaving the queue out of the index.
+ * The lock must be held.
+ *
+ * @param q the queue
+ * @param m the mutation
+ */
+static void index_remove(struct db_queue *q, struct db_mutation *m)
+{
+	struct db_mutation **p = index_find(q, m);
+
+	if (*p == m)
+		*p = m->hnext;
+}
+
+/**
+ * Merge an update into a waiting insertion or update of
+ * the same row. The lock must be held.
+ *
+ * @param q the queue
+ * @param m the update
+ *
+ * @return 1 if it was merged (and freed), 0 otherwise
+ */
+static int dbq_coalesce(struct db_queue *q, struct db_mutation *m)
+{
+	struct db_mutation *found, *next, *hnext;
+	int type, i;
+
+	found = *index_find(q, m);
+	if (found == NULL)
+		return 0;
+	/* the row gets the new values, an insertion stays one */
+	type = found->type;
+	next = found->next;
+	hnext = found->hnext;
+	for (i = 0 ; i < 4 ; i++)
+		free(found->str[i]);
+	memcpy(found, m, sizeof(struct db_mutation));
+	found->type = type;
+	found->next = next;
+	found->hnext = hnext;
+	free(m);
+	return 1;
+}
+
+/**
+ * Hand a mutation over to the persistence worker. The caller
+ * waits if too many mutations are already pending.
+ *
+ * @param c the db config
+ * @param m the mutation, freed by the worker
+ */
+void dbq_push(struct config *c, struct db_mutation *m)
+{
+	struct db_queue *q = c->dbq;
+
+	if (m == NULL)
+		return;
+	pthread_mutex_lock(&q->lock);
+	q->stats.enqueued++;
+	if ((m->type == DBM_CHAN_UPDATE || m->type == DBM_PRIV_UPDATE)
+			&& dbq_coalesce(q, m)) {
+		q->stats.coalesced++;
+		pthread_mutex_unlock(&q->lock);
+		return;
+	}
+	if (q->nb >= DBQ_MAX_PENDING && q->running) {
+		logger(LOG_WARN, "dbq_push : %u mutations waiting for the database.", q->nb);
+		while (q->nb >= DBQ_MAX_PENDING && q->running)
+			pthread_cond_wait(&q->not_full, &q->lock);
+	}
+	m->next = NULL;
+	if (q->last == NULL)
+		q->first = m;
+	else
+		q->last->next = m;
+	q->last = m;
+	index_add(q, m);
+	q->nb++;
+	if (q->nb > q->stats.max_depth)
+		q->stats.max_depth = q->nb;
+	pthread_cond_signal(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/**
+ * Write a mutation to the database.
+ *
+ * @param c the db config
+ * @param m the mutation
+ */
+static void dbq_exec(struct config *c, struct db_mutation *m)
+{
+	switch (m->type) {
+	case DBM_CHAN_INSERT:
+	case DBM_CHAN_UPDATE:
+	case DBM_CHAN_DELETE:
+		db_exec_channel(c, m);
+		break;
+	case DBM_REG_INSERT:
+	case DBM_REG_DELETE:
+		db_exec_registration(c, m);
+		break;
+	default:
+		db_exec_pl_chan_priv(c, m);
+		break;
+	}
+}
+
+static void dbq_query(struct config *c, const char *q)
+{
+	dbi_result res;
+
+	res = dbi_conn_query(c->conn, q);
+	if (res == NULL)
+		logger(LOG_WARN, "dbq_query : %s failed.", q);
+	else
+		dbi_result_free(res);
+}
+
+/**
+ * Log what the persistence worker did since the last report,
+ * if it did anything.
+ *
+ * @param st the counters now
+ * @param last the counters at the last report
+ * @param max_ns the longest transaction since the last report
+ */
+static void dbq_report(struct db_queue_stats *st, struct db_queue_stats *last, uint64_t max_ns)
+{
+	uint64_t batches = st->batches - last->batches;
+
+	if (st->enqueued == last->enqueued && st->depth == 0)
+		return;
+	logger(LOG_INFO, "Database : %llu mutations written (%llu merged) in %llu transactions over the last %i s, %u waiting (%u at most).",
+			(unsigned long long)(st->written - last->written),
+			(unsigned long long)(st->coalesced - last->coalesced),
+			(unsigned long long)batches, DBQ_REPORT, st->depth, st->max_depth);
+	if (batches != 0)
+		logger(LOG_INFO, "Database : %.2f ms per transaction on average, %.2f ms at most.",
+				(st->commit_ns - last->commit_ns) / 1e6 / batches, max_ns / 1e6);
+}
+
+/**
+ * Thread function of the persistence worker : write the
+ * pending mutations, a batch per transaction, until it is
+ * stopped and the queue is empty. Report its counters every
+ * DBQ_REPORT seconds.
+ *
+ * @param args the db config
+ */
+static void *dbq_worker(void *args)
+{
+	struct config *c = (struct config *)args;
+	struct db_queue *q = c->dbq;
+	struct db_mutation *batch, *m, *next;
+	struct db_queue_stats st, last;
+	struct timespec ts;
+	unsigned int nb;
+	uint64_t start, t, left, report, max_ns = 0;
+
+	memset(&last, 0, sizeof(struct db_queue_stats));
+	report = now_ns() + DBQ_REPORT * 1000000000ULL;
+	for (;;) {
+		pthread_mutex_lock(&q->lock);
+		while (q->first == NULL && !q->stop && (t = now_ns()) < report) {
+			left = report - t;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += left / 1000000000ULL;
+			ts.tv_nsec += left % 1000000000ULL;
+			if (ts.tv_nsec >= 1000000000L) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&q->not_empty, &q->lock, &ts);
+		}
+		if (now_ns() >= report) {
+			memcpy(&st, &q->stats, sizeof(struct db_queue_stats));
+			st.depth = q->nb;
+			pthread_mutex_unlock(&q->lock);
+			dbq_report(&st, &last, max_ns);
+			memcpy(&last, &st, sizeof(struct db_queue_stats));
+			max_ns = 0;
+			report = now_ns() + DBQ_REPORT * 1000000000ULL;
+			continue;
+		}
+		if (q->first == NULL) {
+			pthread_mutex_unlock(&q->lock);
+			break;
+		}
+		/* take a batch */
+		batch = q->first;
+		for (nb = 1, m = batch ; ; nb++) {
+			index_remove(q, m);
+			if (nb >= DBQ_BATCH || m->next == NULL)
+				break;
+			m = m->next;
+		}
+		q->first = m->next;
+		if (q->first == NULL)
+			q->last = NULL;
+		m->next = NULL;
+		q->nb -= nb;
+		q->busy = 1;
+		pthread_cond_broadcast(&q->not_full);
+		pthread_mutex_unlock(&q->lock);
+
+		start = now_ns();
+		dbq_query(c, "BEGIN;");
+		for (m = batch ; m != NULL ; m = next) {
+			next = m->next;
+			dbq_exec(c, m);
+			dbq_free(m);
+		}
+		dbq_query(c, "COMMIT;");
+		t = now_ns() - start;
+		if (t > max_ns)
+			max_ns = t;
+
+		pthread_mutex_lock(&q->lock);
+		q->stats.written += nb;
+		q->stats.batches++;
+		q->stats.commit_ns += t;
+		if (t > q->stats.max_commit_ns)
+			q->stats.max_commit_ns = t;
+		q->busy = 0;
+		if (q->first == NULL)
+			pthread_cond_broadcast(&q->idle);
+		pthread_mutex_unlock(&q->lock);
+		logger(LOG_DBG, "dbq_worker : %u mutations written in %.2f ms.", nb, t / 1e6);
+	}
+	return NULL;
+}
+
+/**
+ * Start the persistence worker. From now on, only it uses
+ * the database connection.
+ *
+ * @param c the db config
+ *
+ * @return 1 on success, 0 on failure
+ */
+int dbq_start(struct config *c)
+{
+	struct db_queue *q = c->dbq;
+	int err;
+
+	pthread_mutex_lock(&q->lock);
+	err = pthread_create(&q->worker, NULL, &dbq_worker, c);
+	if (err != 0) {
+		pthread_mutex_unlock(&q->lock);
+		logger(LOG_ERR, "dbq_start, pthread_create failed : %s.", strerror(err));
+		return 0;
+	}
+	q->running = 1;
+	pthread_mutex_unlock(&q->lock);
+	return 1;
+}
+
+/**
+ * Copy the counters of the persistence worker.
+ *
+ * @param c the db config
+ * @param st the copy
+ */
+void dbq_stats(struct config *c, struct db_queue_stats *st)
+{
+	struct db_queue *q = c->dbq;
+
+	pthread_mutex_lock(&q->lock);
+	memcpy(st, &q->stats, sizeof(struct db_queue_stats));
+	st->depth = q->nb;
+	pthread_mutex_unlock(&q->lock);
+}
+
+/**
+ * Tell if everything pushed so far has been written.
+ *
+ * @param c the db config
+ *
+ * @return 1 if nothing is waiting or being written
+ */
+int dbq_idle(struct config *c)
+{
+	struct db_queue *q = c->dbq;
+	int idle;
+
+	pthread_mutex_lock(&q->lock);
+	idle = (q->first == NULL && !q->busy);
+	pthread_mutex_unlock(&q->lock);
+	return idle;
+}
+
+/**
+ * Wait for the persistence worker to have written everything
+ * pushed so far. Returns at once if it is not running.
+ *
+ * @param c the db config
+ */
+void dbq_flush(struct config *c)
+{
+	struct db_queue *q = c->dbq;
+
+	pthread_mutex_lock(&q->lock);
+	while (q->running && (q->first != NULL || q->busy))
+		pthread_cond_wait(&q->idle, &q->lock);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/**
+ * Write the pending mutations, stop the persistence worker
+ * and free the queue.
+ *
+ * @param c the db config
+ */
+void dbq_stop(struct config *c)
+{
+	struct db_queue *q = c->dbq;
+	struct db_queue_stats st;
+	struct db_mutation *m;
+
+	if (q == NULL)
+		return;
+	pthread_mutex_lock(&q->lock);
+	q->stop = 1;
+	pthread_cond_signal(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+	if (q->running) {
+		pthread_join(q->worker, NULL);
+		q->running = 0;
+	}
+	/* never started : nothing has been written */
+	while ((m = q->first) != NULL) {
+		q->first = m->next;
+		dbq_exec(c, m);
+		dbq_free(m);
+	}
+
+	dbq_stats(c, &st);
+	logger(LOG_INFO, "Database : %llu mutations written (%llu merged) in %llu transactions, at most %u waiting.",
+			(unsigned long long)st.written, (unsigned long long)st.coalesced,
+			(unsigned long long)st.batches, st.max_depth);
+	if (st.batches != 0)
+		logger(LOG_INFO, "Database : %.2f ms per transaction on average, %.2f ms at most.",
+				st.commit_ns / 1e6 / st.batches, st.max_commit_ns / 1e6);
+	pthread_mutex_destroy(&q->lock);
+	pthread_cond_destroy(&q->not_empty);
+	pthread_cond_destroy(&q->not_full);
+	pthread_cond_destroy(&q->idle);
+	free(q);
+	c->dbq = NULL;
+}
@@ -20,6 +20,7 @@
 #include "log.h"
 #include "registration.h"
 
+#include <stdlib.h>
 #include <string.h>
 #include <dbi/dbi.h>
 
@@ -27,38 +28,48 @@
  * Go through the database, read and add to the server all
  * the registrations stored.
  *
- * @param c the configuration of the db
+ * @param conn the database connection of the loading thread
  * @param s the server
+ * @param map filled with the registrations, by database id
+ *
+ * @return 1 on success, 0 on failure
  */
-int db_create_registrations(struct config *c, struct server *s)
+int db_create_registrations(dbi_conn conn, struct server *s, struct db_id_map *map)
 {
 	char *q = "SELECT * FROM registrations WHERE server_id = %i;";
 	struct registration *r;
 	char *name, *pass;
 	dbi_result res;
 
-	res = dbi_conn_queryf(c->conn, q, s->id);
-
-	if (res) {
-		while (dbi_result_next_row(res)) {
-			r = new_registration();
-			r->db_id = dbi_result_get_uint(res, "id");
-			r->global_flags = dbi_result_get_uint(res, "serveradmin");
-			name = dbi_result_get_string_copy(res, "name");
-			strncpy(r->name, name, MIN(29, strlen(name)));
-			pass = dbi_result_get_string_copy(res, "password");
-			strcpy(r->password, pass);
-			add_registration(s, r);
-			/* free temporary variables */
-			free(pass); free(name);
-		}
+	res = dbi_conn_queryf(conn, q, s->id);
+	if (res == NULL) {
+		logger(LOG_ERR, "db_create_registrations : SQL query failed.");
+		return 0;
+	}
+	if (!idm_init(map, dbi_result_get_numrows(res))) {
 		dbi_result_free(res);
+		return 0;
+	}
+	while (dbi_result_next_row(res)) {
+		r = new_registration();
+		r->db_id = dbi_result_get_uint(res, "id");
+		r->global_flags = dbi_result_get_uint(res, "serveradmin");
+		name = dbi_result_get_string_copy(res, "name");
+		strncpy(r->name, name, MIN(29, strlen(name)));
+		pass = dbi_result_get_string_copy(res, "password");
+		strcpy(r->password, pass);
+		add_registration(s, r);
+		idm_put(map, r->db_id, r);
+		/* free temporary variables */
+		free(pass); free(name);
 	}
+	dbi_result_free(res);
 	return 1;
 }
 
 /**
- * Add a new registration to the database
+ * Add a new registration to the database. Its id is known
+ * at once, the insertion is done by the persistence worker.
  *
  * @param c the db configuration
  * @param s the server
@@ -68,25 +79,21 @@ int db_create_registrations(struct config *c, struct server *s)
  */
 int db_add_registration(struct config *c, struct server *s, struct registration *r)
 {
-	char *req = "INSERT INTO registrations (server_id, serveradmin, name, password) VALUES (%i, %i, %s, %s);";
-	char *quoted_name, *quoted_pass;
-	dbi_result res;
+	struct db_mutation *m;
 	struct channel *ch;
 	struct player_channel_privilege *priv;
 	size_t iter, iter2;
 
-	dbi_conn_quote_string_copy(c->conn, r->name, &quoted_name);
-	dbi_conn_quote_string_copy(c->conn, r->password, &quoted_pass);
-
-	res = dbi_conn_queryf(c->conn, req, s->id, r->global_flags, quoted_name, quoted_pass);
-	if (res == NULL) {
-		logger(LOG_WARN, "db_add_registration : SQL query failed");
-	} else {
-		r->db_id = dbi_conn_sequence_last(c->conn, NULL);
-		dbi_result_free(res);
+	r->db_id = dbq_next_reg_id(c);
+	m = dbq_new(DBM_REG_INSERT);
+	if (m != NULL) {
+		m->key[0] = r->db_id;
+		m->server_id = s->id;
+		m->flags = r->global_flags;
+		m->str[0] = strdup(r->name);
+		m->str[1] = strdup(r->password);
+		dbq_push(c, m);
 	}
-	free(quoted_pass);
-	free(quoted_name);
 
 	ar_each(struct channel *, ch, iter, s->chans)
 		ar_each(struct player_channel_privilege *, priv, iter2, ch->pl_privileges)
@@ -101,20 +108,33 @@ int db_add_registration(struct config *c, struct server *s, struct registration
 
 int db_del_registration(struct config *c, struct server *s, struct registration *r)
 {
-	char *q = "DELETE FROM registrations WHERE id = %i;";
-	char *q2 = "DELETE FROM player_channel_privileges WHERE player_id = %i;";
-	dbi_result res;
-
-	res = dbi_conn_queryf(c->conn, q, r->db_id);
-	if (res == NULL)
-		logger(LOG_WARN, "db_del_registration : SQL query failed");
-	else
-		dbi_result_free(res);
+	struct db_mutation *m;
 
-	res = dbi_conn_queryf(c->conn, q2, r->db_id);
-	if (res == NULL)
-		logger(LOG_WARN, "db_del_registration : SQL query failed (2)");
-	else
-		dbi_result_free(res);
+	m = dbq_new(DBM_REG_DELETE);
+	if (m != NULL) {
+		m->key[0] = r->db_id;
+		dbq_push(c, m);
+	}
 	return 1;
 }
+
+/**
+ * Write a registration mutation to the database.
+ *
+ * @param c the db config
+ * @param m the mutation
+ */
+void db_exec_registration(struct config *c, struct db_mutation *m)
+{
+	if (m->type == DBM_REG_DELETE) {
+		if (!dbs_exec(c->stmts, DBS_REG_DELETE, m->key[0]))
+			logger(LOG_WARN, "db_exec_registration : SQL query failed");
+		if (!dbs_exec(c->stmts, DBS_REG_DEL_PRIVS, m->key[0]))
+			logger(LOG_WARN, "db_exec_registration : SQL query failed (2)");
+		return;
+	}
+
+	if (!dbs_exec(c->stmts, DBS_REG_INSERT, m->key[0], m->server_id, m->flags,
+				m->str[0], m->str[1]))
+		logger(LOG_WARN, "db_exec_registration : SQL query failed");
+}
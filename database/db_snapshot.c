@@ -0,0 +1,695 @@
+/*
+ * soliloque-server, an open source implementation of the TeamSpeak protocol.
+ * Copyright (C) 2009 Hugo Camboulive <hugo.camboulive AT gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "db_snapshot.h"
+#include "database.h"
+#include "registration.h"
+#include "log.h"
+#include "crc.h"
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+/* the flags of a channel that the database keeps */
+#define SNAP_CHAN_FLAGS (CHANNEL_FLAG_MODERATED | CHANNEL_FLAG_SUBCHANNELS | CHANNEL_FLAG_DEFAULT)
+
+/* all the sections, in the order they are written */
+#define SNAP_ALL ((1 << SNAP_CHANNELS) | (1 << SNAP_REGISTRATIONS) | (1 << SNAP_SV_PRIVILEGES) \
+		| (1 << SNAP_CH_PRIVILEGES) | (1 << SNAP_BANS))
+
+/* one snapshot written at a time : a server that stops can
+ * overlap with the periodic snapshot of its control worker */
+static pthread_mutex_t write_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Body of a snapshot being written.
+ */
+struct snap_buf {
+	char *data;
+	size_t len;
+	size_t size;
+	int err;	/* an allocation failed */
+};
+
+/**
+ * Body of a snapshot being read.
+ */
+struct snap_reader {
+	const char *p;
+	const char *end;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Tell if the servers have snapshots.
+ *
+ * @param c the config
+ *
+ * @return 1 if they have, 0 otherwise
+ */
+int db_snapshot_enabled(struct config *c)
+{
+	/* only the file of a sqlite database tells if a snapshot is stale */
+	return c->snapshot.period != -1
+		&& (strcmp(c->db_type, "sqlite") == 0 || strcmp(c->db_type, "sqlite3") == 0);
+}
+
+/**
+ * Build the name of the snapshot of a server.
+ *
+ * @param s the server
+ * @param path filled with the name
+ * @param len the size of path
+ *
+ * @return 1 on success, 0 if the server has no snapshot
+ */
+static int snap_path(struct server *s, char *path, size_t len)
+{
+	struct config *c = s->conf;
+	const char *dir;
+
+	if (!db_snapshot_enabled(c))
+		return 0;
+	dir = (c->snapshot.dir != NULL) ? c->snapshot.dir : c->db.file.path;
+	if ((size_t)snprintf(path, len, "%s/server-%u.snap", dir, s->id) >= len) {
+		logger(LOG_WARN, "snap_path : the name of the snapshot of server %u is too long.", s->id);
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * Retrieve the state of the database file.
+ *
+ * @param c the config
+ * @param st filled with the state
+ *
+ * @return 1 on success, 0 if the database file can not be found
+ */
+static int snap_stamp(struct config *c, struct snap_stamp *st)
+{
+	char path[1024];
+	struct stat buf;
+
+	bzero(st, sizeof(struct snap_stamp));
+	snprintf(path, sizeof(path), "%s/%s", c->db.file.path, c->db.file.db);
+	if (stat(path, &buf) == -1) {
+		logger(LOG_WARN, "snap_stamp, stat of %s failed : %s.", path, strerror(errno));
+		return 0;
+	}
+	st->db_mtime = (uint64_t)buf.st_mtim.tv_sec * 1000000000ULL + buf.st_mtim.tv_nsec;
+	st->db_size = buf.st_size;
+	/* a write-ahead log holds changes the file does not have yet */
+	strncat(path, "-wal", sizeof(path) - strlen(path) - 1);
+	if (stat(path, &buf) == 0) {
+		st->wal_mtime = (uint64_t)buf.st_mtim.tv_sec * 1000000000ULL + buf.st_mtim.tv_nsec;
+		st->wal_size = buf.st_size;
+	}
+	return 1;
+}
+
+static void buf_put(struct snap_buf *b, const void *src, size_t len)
+{
+	char *data;
+	size_t size;
+
+	if (b->err)
+		return;
+	if (b->len + len > b->size) {
+		size = (b->size == 0) ? 4096 : b->size;
+		while (size < b->len + len)
+			size <<= 1;
+		data = (char *)realloc(b->data, size);
+		if (data == NULL) {
+			logger(LOG_ERR, "buf_put, realloc failed : %s.", strerror(errno));
+			b->err = 1;
+			return;
+		}
+		b->data = data;
+		b->size = size;
+	}
+	memcpy(b->data + b->len, src, len);
+	b->len += len;
+}
+
+static void buf_u8(struct snap_buf *b, uint8_t v)
+{
+	buf_put(b, &v, sizeof(v));
+}
+
+static void buf_u16(struct snap_buf *b, uint16_t v)
+{
+	buf_put(b, &v, sizeof(v));
+}
+
+static void buf_u32(struct snap_buf *b, uint32_t v)
+{
+	buf_put(b, &v, sizeof(v));
+}
+
+static void buf_u64(struct snap_buf *b, uint64_t v)
+{
+	buf_put(b, &v, sizeof(v));
+}
+
+/* a string : its length with the final \0, then its characters and the \0 */
+static void buf_str(struct snap_buf *b, const char *str)
+{
+	size_t len;
+
+	if (str == NULL)
+		str = "";
+	len = strlen(str) + 1;
+	if (len > 0xFFFF)
+		len = 0xFFFF;
+	buf_u16(b, len);
+	buf_put(b, str, len - 1);
+	buf_u8(b, 0);
+}
+
+/**
+ * Start a section : its number of records is filled in
+ * by end_section().
+ *
+ * @return the offset of the number of records
+ */
+static size_t start_section(struct snap_buf *b, uint32_t type)
+{
+	size_t off;
+
+	buf_u32(b, type);
+	off = b->len;
+	buf_u32(b, 0);
+	return off;
+}
+
+static void end_section(struct snap_buf *b, size_t off, uint32_t nb)
+{
+	if (!b->err)
+		memcpy(b->data + off, &nb, sizeof(nb));
+}
+
+static uint32_t parent_db_id(const struct channel *ch)
+{
+	return (ch->parent != NULL) ? ch->parent->db_id : 0;
+}
+
+/* the order of the database loader, so the channels get the same ids */
+static int chan_cmp(const void *a, const void *b)
+{
+	const struct channel *ca = *(struct channel * const *)a;
+	const struct channel *cb = *(struct channel * const *)b;
+
+	if (parent_db_id(ca) != parent_db_id(cb))
+		return (parent_db_id(ca) < parent_db_id(cb)) ? -1 : 1;
+	if (ca->db_id != cb->db_id)
+		return (ca->db_id < cb->db_id) ? -1 : 1;
+	return 0;
+}
+
+static void put_channel(struct snap_buf *b, struct channel *ch)
+{
+	buf_u32(b, ch->db_id);
+	buf_u32(b, parent_db_id(ch));
+	/* what the database would give back */
+	buf_u16(b, (ch->parent != NULL) ? 0 : (ch->flags & SNAP_CHAN_FLAGS));
+	buf_u16(b, ch->codec);
+	buf_u16(b, ch->sort_order);
+	buf_u16(b, ch->players->max_slots);
+	buf_str(b, ch->name);
+	buf_str(b, ch->topic);
+	buf_str(b, ch->desc);
+}
+
+/**
+ * Serialize the state of a server that lives in the
+ * database, and its bans.
+ *
+ * @param s the server
+ * @param b filled with the body of the snapshot
+ */
+static void snap_serialize(struct server *s, struct snap_buf *b)
+{
+	struct channel *ch, **chans;
+	struct registration *r;
+	struct player_channel_privilege *priv;
+	struct ban *ban;
+	size_t iter, iter2, off;
+	uint32_t nb, i;
+	uint64_t now;
+
+	/* the channels stored in the database, before their subchannels */
+	chans = (struct channel **)calloc(s->chans->used_slots + 1, sizeof(struct channel *));
+	if (chans == NULL) {
+		logger(LOG_ERR, "snap_serialize, calloc failed : %s.", strerror(errno));
+		b->err = 1;
+		return;
+	}
+	nb = 0;
+	ar_each(struct channel *, ch, iter, s->chans)
+		if (ch->db_id != 0 && (ch->parent == NULL || ch->parent->db_id != 0))
+			chans[nb++] = ch;
+	ar_end_each;
+	qsort(chans, nb, sizeof(struct channel *), &chan_cmp);
+	off = start_section(b, SNAP_CHANNELS);
+	for (i = 0 ; i < nb ; i++)
+		put_channel(b, chans[i]);
+	end_section(b, off, nb);
+	free(chans);
+
+	off = start_section(b, SNAP_REGISTRATIONS);
+	nb = 0;
+	ar_each(struct registration *, r, iter, s->regs)
+		buf_u32(b, r->db_id);
+		buf_u8(b, r->global_flags);
+		buf_str(b, r->name);
+		buf_str(b, r->password);
+		nb++;
+	ar_end_each;
+	end_section(b, off, nb);
+
+	off = start_section(b, SNAP_SV_PRIVILEGES);
+	buf_put(b, s->privileges->priv, sizeof(s->privileges->priv));
+	end_section(b, off, sizeof(s->privileges->priv));
+
+	/* the privileges of the registrations in the stored channels */
+	off = start_section(b, SNAP_CH_PRIVILEGES);
+	nb = 0;
+	ar_each(struct channel *, ch, iter, s->chans)
+		if (ch->db_id == 0)
+			continue;
+		ar_each(struct player_channel_privilege *, priv, iter2, ch->pl_privileges)
+			if (priv->reg == PL_CH_PRIV_REGISTERED && priv->pl_or_reg.reg != NULL) {
+				buf_u32(b, priv->pl_or_reg.reg->db_id);
+				buf_u32(b, ch->db_id);
+				buf_u32(b, priv->flags);
+				nb++;
+			}
+		ar_end_each;
+	ar_end_each;
+	end_section(b, off, nb);
+
+	/* the bans are only kept here, with the time they have left */
+	off = start_section(b, SNAP_BANS);
+	nb = 0;
+	now = tw_now();
+	pthread_mutex_lock(&s->bans->lock);
+	ar_each(struct ban *, ban, iter, s->bans)
+		buf_u16(b, ban->duration);
+		if (ban->duration == 0)
+			buf_u64(b, 0);
+		else
+			buf_u64(b, (ban->expire_timer.expires > now) ? ban->expire_timer.expires - now : 1);
+		buf_str(b, ban->ip);
+		buf_str(b, ban->reason);
+		nb++;
+	ar_end_each;
+	pthread_mutex_unlock(&s->bans->lock);
+	end_section(b, off, nb);
+}
+
+/**
+ * Write a whole buffer to a file, however many calls it takes.
+ *
+ * @param fd the file
+ * @param buf the buffer
+ * @param len its length
+ *
+ * @return 1 if everything was written, 0 otherwise (errno is set)
+ */
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(fd, p, len);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			return 0;
+		}
+		if (ret == 0) {
+			errno = ENOSPC;
+			return 0;
+		}
+		p += ret;
+		len -= ret;
+	}
+	return 1;
+}
+
+/**
+ * Write the snapshot of a server. It is written next to
+ * its final name, then renamed, so a crash never leaves
+ * half a snapshot behind.
+ *
+ * @param s the server
+ * @param wait wait for the database writes in progress, or give
+ *             up if there are some
+ *
+ * @return 1 if the snapshot was written, 0 otherwise
+ */
+int db_snapshot_write(struct server *s, int wait)
+{
+	struct snap_header h;
+	struct snap_buf b;
+	char path[1024], tmp[1040];
+	uint64_t start;
+	int fd, ok = 0;
+
+	if (!snap_path(s, path, sizeof(path)))
+		return 0;
+	start = now_ns();
+	/* the database has to hold everything the server did */
+	if (wait)
+		dbq_flush(s->conf);
+	else if (!dbq_idle(s->conf))
+		return 0;
+
+	bzero(&h, sizeof(struct snap_header));
+	bzero(&b, sizeof(struct snap_buf));
+	pthread_mutex_lock(&write_mutex);
+	if (!snap_stamp(s->conf, &h.stamp))
+		goto out;
+	memcpy(h.magic, SNAP_MAGIC, sizeof(SNAP_MAGIC));
+	h.version = SNAP_VERSION;
+	h.server_id = s->id;
+	h.created = now_ms();
+
+	snap_serialize(s, &b);
+	if (b.err)
+		goto out;
+	h.body_len = b.len;
+	h.crc = crc_32_update(crc_32(&h, offsetof(struct snap_header, crc)), b.data, b.len);
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1) {
+		logger(LOG_WARN, "db_snapshot_write, open of %s failed : %s.", tmp, strerror(errno));
+		goto out;
+	}
+	if (!write_all(fd, &h, sizeof(struct snap_header))
+			|| !write_all(fd, b.data, b.len) || fsync(fd) == -1) {
+		logger(LOG_WARN, "db_snapshot_write, write of %s failed : %s.", tmp, strerror(errno));
+		close(fd);
+		unlink(tmp);
+		goto out;
+	}
+	close(fd);
+	if (rename(tmp, path) == -1) {
+		logger(LOG_WARN, "db_snapshot_write, rename of %s failed : %s.", tmp, strerror(errno));
+		unlink(tmp);
+		goto out;
+	}
+	ok = 1;
+	logger(LOG_INFO, "Server %u : snapshot of %zu bytes written in %.1f ms.",
+			s->id, sizeof(struct snap_header) + b.len, (now_ns() - start) / 1e6);
+out:
+	pthread_mutex_unlock(&write_mutex);
+	free(b.data);
+	return ok;
+}
+
+static int rd_get(struct snap_reader *r, void *dst, size_t len)
+{
+	if ((size_t)(r->end - r->p) < len)
+		return 0;
+	memcpy(dst, r->p, len);
+	r->p += len;
+	return 1;
+}
+
+/* a string of at most max characters, pointing in the snapshot */
+static int rd_str(struct snap_reader *r, const char **str, size_t max)
+{
+	uint16_t len;
+
+	if (!rd_get(r, &len, sizeof(len)) || len == 0 || len > max + 1
+			|| (size_t)(r->end - r->p) < len || r->p[len - 1] != '\0')
+		return 0;
+	*str = r->p;
+	r->p += len;
+	return 1;
+}
+
+/**
+ * Go through the body of a snapshot and create the objects
+ * of some of its sections. It is first called with nothing
+ * to create, to check the whole body before the server is
+ * touched.
+ *
+ * @param s the server
+ * @param r the body
+ * @param created the time the snapshot was taken
+ * @param build the sections to create (1 << SNAP_*)
+ *
+ * @return 1 on success, 0 if the body is malformed
+ */
+static int snap_parse(struct server *s, struct snap_reader r, uint64_t created, int build)
+{
+	struct db_id_map chans, regs;
+	struct channel *ch, *parent;
+	struct registration *reg;
+	struct player_channel_privilege *priv;
+	struct ban *ban;
+	struct in_addr ip;
+	const char *name, *topic, *desc, *pass, *reason;
+	uint32_t type, nb, i, db_id, parent_id, flags;
+	uint16_t u16[4], duration;
+	uint64_t remaining, elapsed;
+	uint8_t gflags;
+	int ok = 0;
+
+	bzero(&chans, sizeof(struct db_id_map));
+	bzero(&regs, sizeof(struct db_id_map));
+	elapsed = now_ms();
+	elapsed = (elapsed > created) ? elapsed - created : 0;
+	for (type = SNAP_CHANNELS ; type <= SNAP_BANS ; type++) {
+		if (!rd_get(&r, &i, sizeof(i)) || i != type || !rd_get(&r, &nb, sizeof(nb)))
+			goto out;
+		/* a record is at least 4 bytes */
+		if (type != SNAP_SV_PRIVILEGES && nb > (size_t)(r.end - r.p) / 4)
+			goto out;
+		if (type == SNAP_CHANNELS && (build & (1 << type)) && !idm_init(&chans, nb))
+			goto out;
+		if (type == SNAP_REGISTRATIONS && (build & (1 << type)) && !idm_init(&regs, nb))
+			goto out;
+
+		switch (type) {
+		case SNAP_CHANNELS:
+			for (i = 0 ; i < nb ; i++) {
+				if (!rd_get(&r, &db_id, sizeof(db_id)) || !rd_get(&r, &parent_id, sizeof(parent_id))
+						|| !rd_get(&r, u16, sizeof(u16)) || !rd_str(&r, &name, 0xFFFF)
+						|| !rd_str(&r, &topic, 0xFFFF) || !rd_str(&r, &desc, 0xFFFF)
+						|| db_id == 0)
+					goto out;
+				if (!(build & (1 << type)))
+					continue;
+				ch = new_channel((char *)name, (char *)topic, (char *)desc,
+						u16[0], u16[1], u16[2], u16[3]);
+				if (ch == NULL)
+					goto out;
+				ch->db_id = db_id;
+				parent = (struct channel *)idm_get(&chans, parent_id);
+				if (parent_id != 0 && (parent == NULL || parent->parent != NULL)) {
+					logger(LOG_WARN, "snap_parse, parent %u of channel %u is not a channel.",
+							parent_id, db_id);
+					destroy_channel(ch);
+					continue;
+				}
+				add_channel(s, ch);
+				if (parent != NULL)
+					channel_add_subchannel(parent, ch);
+				idm_put(&chans, db_id, ch);
+			}
+			if ((build & (1 << type)) && s->chans->used_slots == 0) {
+				ch = new_channel("Default", "", "", CHANNEL_FLAG_DEFAULT | CHANNEL_FLAG_UNREGISTERED,
+						CODEC_SPEEX_12_3, 0, 128);
+				add_channel(s, ch);
+			}
+			break;
+		case SNAP_REGISTRATIONS:
+			for (i = 0 ; i < nb ; i++) {
+				if (!rd_get(&r, &db_id, sizeof(db_id)) || !rd_get(&r, &gflags, sizeof(gflags))
+						|| !rd_str(&r, &name, sizeof(reg->name) - 1)
+						|| !rd_str(&r, &pass, sizeof(reg->password) - 1)
+						|| db_id == 0)
+					goto out;
+				if (!(build & (1 << type)))
+					continue;
+				reg = new_registration();
+				if (reg == NULL)
+					goto out;
+				reg->db_id = db_id;
+				reg->global_flags = gflags;
+				strcpy(reg->name, name);
+				strcpy(reg->password, pass);
+				add_registration(s, reg);
+				idm_put(&regs, db_id, reg);
+			}
+			break;
+		case SNAP_SV_PRIVILEGES:
+			if (nb != sizeof(s->privileges->priv) || (size_t)(r.end - r.p) < nb)
+				goto out;
+			if (build & (1 << type))
+				memcpy(s->privileges->priv, r.p, nb);
+			r.p += nb;
+			break;
+		case SNAP_CH_PRIVILEGES:
+			for (i = 0 ; i < nb ; i++) {
+				if (!rd_get(&r, &db_id, sizeof(db_id)) || !rd_get(&r, &parent_id, sizeof(parent_id))
+						|| !rd_get(&r, &flags, sizeof(flags)))
+					goto out;
+				if (!(build & (1 << type)))
+					continue;
+				ch = (struct channel *)idm_get(&chans, parent_id);
+				reg = (struct registration *)idm_get(&regs, db_id);
+				if (ch == NULL || reg == NULL)
+					continue;
+				priv = new_player_channel_privilege();
+				priv->ch = ch;
+				priv->flags = flags;
+				priv->reg = PL_CH_PRIV_REGISTERED;
+				priv->pl_or_reg.reg = reg;
+				add_player_channel_privilege(ch, priv);
+			}
+			break;
+		case SNAP_BANS:
+			for (i = 0 ; i < nb ; i++) {
+				if (!rd_get(&r, &duration, sizeof(duration)) || !rd_get(&r, &remaining, sizeof(remaining))
+						|| !rd_str(&r, &name, 15) || !rd_str(&r, &reason, 0xFFFF)
+						|| inet_aton(name, &ip) == 0)
+					goto out;
+				if (!(build & (1 << type)))
+					continue;
+				/* the time the server was stopped counts */
+				if (duration != 0 && remaining <= elapsed)
+					continue;
+				ban = new_ban(duration, ip, (char *)reason);
+				if (ban == NULL)
+					continue;
+				if (!restore_ban(s, ban, (duration != 0) ? remaining - elapsed : 0))
+					destroy_ban(ban);
+			}
+			break;
+		}
+	}
+	ok = (r.p == r.end);
+out:
+	idm_free(&chans);
+	idm_free(&regs);
+	return ok;
+}
+
+/**
+ * Restore a server from its snapshot, instead of loading
+ * it from the database. The snapshot is only used if it is
+ * intact, and the database did not change since it was
+ * taken. Otherwise only its bans are restored (they are not
+ * in the database), and the server has to be loaded from
+ * the database.
+ *
+ * @param s the server, empty
+ *
+ * @return 1 if the server was restored, 0 if it has to be loaded
+ */
+int db_snapshot_load(struct server *s)
+{
+	const struct snap_header *h;
+	struct snap_stamp stamp;
+	struct snap_reader r;
+	struct stat buf;
+	char path[1024];
+	void *map;
+	uint64_t start;
+	int fd, fresh = 0;
+
+	if (!snap_path(s, path, sizeof(path)))
+		return 0;
+	start = now_ns();
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		if (errno != ENOENT)
+			logger(LOG_WARN, "db_snapshot_load, open of %s failed : %s.", path, strerror(errno));
+		return 0;
+	}
+	if (fstat(fd, &buf) == -1 || (size_t)buf.st_size < sizeof(struct snap_header)) {
+		logger(LOG_WARN, "Server %u : snapshot %s is truncated, ignored.", s->id, path);
+		close(fd);
+		return 0;
+	}
+	map = mmap(NULL, buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		logger(LOG_WARN, "db_snapshot_load, mmap of %s failed : %s.", path, strerror(errno));
+		return 0;
+	}
+
+	h = (const struct snap_header *)map;
+	r.p = (const char *)map + sizeof(struct snap_header);
+	r.end = (const char *)map + buf.st_size;
+	if (memcmp(h->magic, SNAP_MAGIC, sizeof(SNAP_MAGIC)) != 0 || h->version != SNAP_VERSION
+			|| h->server_id != s->id || h->body_len != (uint64_t)(r.end - r.p)
+			|| h->crc != crc_32_update(crc_32(h, offsetof(struct snap_header, crc)), r.p, h->body_len)
+			|| !snap_parse(s, r, h->created, 0)) {
+		logger(LOG_WARN, "Server %u : snapshot %s is corrupted, ignored.", s->id, path);
+		goto out;
+	}
+
+	if (snap_stamp(s->conf, &stamp) && memcmp(&stamp, &h->stamp, sizeof(struct snap_stamp)) == 0)
+		fresh = 1;
+	if (!fresh) {
+		logger(LOG_INFO, "Server %u : the database changed since the snapshot, only the bans are restored.",
+				s->id);
+		snap_parse(s, r, h->created, 1 << SNAP_BANS);
+		goto out;
+	}
+	snap_parse(s, r, h->created, SNAP_ALL);
+	logger(LOG_INFO, "Server %u : %zu channels, %zu registrations and %zu bans restored from the snapshot in %.1f ms.",
+			s->id, s->chans->used_slots, s->regs->used_slots, s->bans->used_slots,
+			(now_ns() - start) / 1e6);
+out:
+	munmap(map, buf.st_size);
+	return fresh;
+}
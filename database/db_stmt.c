@@ -0,0 +1,307 @@
+/*
+ * soliloque-server, an open source implementation of the TeamSpeak protocol.
+ * Copyright (C) 2009 Hugo Camboulive <hugo.camboulive AT gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "db_stmt.h"
+#include "log.h"
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <dbi/dbi.h>
+
+#if defined(HAVE_SQLITE3) && defined(HAVE_DBI_DEV)
+#define DBS_SQLITE3
+#include <sqlite3.h>
+#include <dbi/dbi-dev.h>
+#endif
+
+/**
+ * A statement : its SQL, with a ? for each parameter, and
+ * the types of the parameters (i : int, s : string).
+ */
+struct db_stmt_def {
+	const char *name;
+	const char *sql;
+	const char *params;
+};
+
+static const struct db_stmt_def stmt_defs[DBS_NB] = {
+	[DBS_CHAN_INSERT] = {"channel insertion",
+		"INSERT INTO channels (id, server_id, name, topic, description, "
+		"codec, maxusers, ordr, flag_default, flag_hierarchical, flag_moderated, "
+		"parent_id, password) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?);",
+		"iisssiiiiiiis"},
+	[DBS_CHAN_UPDATE] = {"channel update",
+		"UPDATE channels SET name = ?, topic = ?, description = ?, "
+		"codec = ?, maxusers = ?, ordr = ?, "
+		"flag_default = ?, flag_hierarchical = ?, flag_moderated = ?, "
+		"password = ? WHERE id = ?;",
+		"sssiiiiiisi"},
+	[DBS_CHAN_DELETE] = {"channel deletion",
+		"DELETE FROM channels WHERE id = ?;", "i"},
+	[DBS_CHAN_DEL_PRIVS] = {"channel privileges deletion",
+		"DELETE FROM player_channel_privileges WHERE channel_id = ?;", "i"},
+	[DBS_REG_INSERT] = {"registration insertion",
+		"INSERT INTO registrations (id, server_id, serveradmin, name, password) "
+		"VALUES (?, ?, ?, ?, ?);",
+		"iiiss"},
+	[DBS_REG_DELETE] = {"registration deletion",
+		"DELETE FROM registrations WHERE id = ?;", "i"},
+	[DBS_REG_DEL_PRIVS] = {"registration privileges deletion",
+		"DELETE FROM player_channel_privileges WHERE player_id = ?;", "i"},
+	[DBS_PRIV_INSERT] = {"privilege insertion",
+		"INSERT INTO player_channel_privileges (player_id, channel_id, "
+		"channel_admin, operator, voice, auto_operator, auto_voice) "
+		"VALUES (?, ?, ?, ?, ?, ?, ?);",
+		"iiiiiii"},
+	[DBS_PRIV_UPDATE] = {"privilege update",
+		"UPDATE player_channel_privileges SET channel_admin = ?, operator = ?, "
+		"voice = ?, auto_operator = ?, auto_voice = ? "
+		"WHERE player_id = ? AND channel_id = ?;",
+		"iiiiiii"},
+	[DBS_PRIV_DELETE] = {"privilege deletion",
+		"DELETE FROM player_channel_privileges WHERE player_id = ? AND channel_id = ?;",
+		"ii"},
+};
+
+struct db_param {
+	int i;
+	const char *s;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Create the statements of a connection.
+ *
+ * @param conn the connection, connected
+ * @param driver the name of its libdbi driver
+ *
+ * @return the statements, or NULL if the allocation failed
+ */
+struct db_stmts *dbs_new(dbi_conn conn, const char *driver)
+{
+	struct db_stmts *st;
+
+	st = (struct db_stmts *)calloc(1, sizeof(struct db_stmts));
+	if (st == NULL) {
+		logger(LOG_ERR, "dbs_new, calloc failed : %s.", strerror(errno));
+		return NULL;
+	}
+	st->conn = conn;
+#ifdef DBS_SQLITE3
+	/* the sqlite3 driver keeps the handle of the database in the connection */
+	if (strcmp(driver, "sqlite3") == 0)
+		st->native = ((dbi_conn_t *)conn)->connection;
+#endif
+	logger(LOG_INFO, "Database : %s statements.",
+			(st->native != NULL) ? "prepared" : "libdbi");
+	return st;
+}
+
+#ifdef DBS_SQLITE3
+/**
+ * Run a statement through sqlite3, preparing it the first time.
+ *
+ * @param st the statements of the connection
+ * @param id the statement (DBS_*)
+ * @param p the parameters
+ *
+ * @return 1 on success, 0 on failure, -1 if it could not be prepared
+ */
+static int native_exec(struct db_stmts *st, int id, const struct db_param *p)
+{
+	const struct db_stmt_def *def = &stmt_defs[id];
+	sqlite3_stmt *stmt = (sqlite3_stmt *)st->stmt[id];
+	int i, rc;
+
+	if (stmt == NULL) {
+		if (sqlite3_prepare_v2((sqlite3 *)st->native, def->sql, -1, &stmt, NULL) != SQLITE_OK) {
+			logger(LOG_WARN, "native_exec : could not prepare the %s : %s.",
+					def->name, sqlite3_errmsg((sqlite3 *)st->native));
+			st->failed[id] = 1;
+			return -1;
+		}
+		st->stmt[id] = stmt;
+	}
+	for (i = 0 ; def->params[i] != '\0' ; i++) {
+		if (def->params[i] == 's')
+			sqlite3_bind_text(stmt, i + 1, p[i].s, -1, SQLITE_STATIC);
+		else
+			sqlite3_bind_int(stmt, i + 1, p[i].i);
+	}
+	rc = sqlite3_step(stmt);
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+	if (rc != SQLITE_DONE) {
+		logger(LOG_WARN, "native_exec : %s failed : %s.",
+				def->name, sqlite3_errmsg((sqlite3 *)st->native));
+		return 0;
+	}
+	return 1;
+}
+#endif
+
+/**
+ * Run a statement through libdbi : the parameters are
+ * quoted and written in place of the ?.
+ *
+ * @param st the statements of the connection
+ * @param id the statement (DBS_*)
+ * @param p the parameters
+ *
+ * @return 1 on success, 0 on failure
+ */
+static int dbi_exec(struct db_stmts *st, int id, const struct db_param *p)
+{
+	const struct db_stmt_def *def = &stmt_defs[id];
+	char *quoted[DBS_MAX_PARAMS];
+	char *q, *dst;
+	const char *src;
+	size_t len;
+	int i, nb, ret = 0;
+	dbi_result res;
+
+	/* the quoted strings, or the integers, and the length of the query */
+	len = strlen(def->sql) + 1;
+	for (nb = 0 ; def->params[nb] != '\0' ; nb++) {
+		if (def->params[nb] == 's')
+			dbi_conn_quote_string_copy(st->conn, p[nb].s, &quoted[nb]);
+		else if (asprintf(&quoted[nb], "%i", p[nb].i) < 0)
+			quoted[nb] = NULL;
+		if (quoted[nb] == NULL)
+			goto out;
+		len += strlen(quoted[nb]);
+	}
+	q = (char *)malloc(len);
+	if (q == NULL) {
+		logger(LOG_ERR, "dbi_exec, malloc failed : %s.", strerror(errno));
+		goto out;
+	}
+	for (src = def->sql, dst = q, i = 0 ; *src != '\0' ; src++) {
+		if (*src == '?' && i < nb) {
+			strcpy(dst, quoted[i]);
+			dst += strlen(quoted[i++]);
+		} else {
+			*dst++ = *src;
+		}
+	}
+	*dst = '\0';
+	res = dbi_conn_query(st->conn, q);
+	if (res == NULL) {
+		logger(LOG_WARN, "dbi_exec : %s failed.", def->name);
+	} else {
+		dbi_result_free(res);
+		ret = 1;
+	}
+	free(q);
+out:
+	while (nb-- > 0)
+		free(quoted[nb]);
+	return ret;
+}
+
+/**
+ * Run a statement. The parameters follow the id, in the
+ * order of the ? of the statement : an int for an integer,
+ * a const char * for a string.
+ *
+ * @param st the statements of the connection
+ * @param id the statement (DBS_*)
+ *
+ * @return 1 on success, 0 on failure
+ */
+int dbs_exec(struct db_stmts *st, int id, ...)
+{
+	const struct db_stmt_def *def = &stmt_defs[id];
+	struct db_param p[DBS_MAX_PARAMS];
+	struct db_stmt_stats *stats = &st->stats[id];
+	uint64_t start, t;
+	va_list ap;
+	int i, ret = -1;
+
+	va_start(ap, id);
+	for (i = 0 ; def->params[i] != '\0' ; i++) {
+		if (def->params[i] == 's') {
+			p[i].s = va_arg(ap, const char *);
+			if (p[i].s == NULL)
+				p[i].s = "";
+		} else {
+			p[i].i = va_arg(ap, int);
+		}
+	}
+	va_end(ap);
+
+	start = now_ns();
+#ifdef DBS_SQLITE3
+	if (st->native != NULL && !st->failed[id]) {
+		ret = native_exec(st, id, p);
+		if (ret != -1)
+			stats->native++;
+	}
+#endif
+	if (ret == -1)
+		ret = dbi_exec(st, id, p);
+	t = now_ns() - start;
+
+	stats->runs++;
+	stats->ns += t;
+	if (t > stats->max_ns)
+		stats->max_ns = t;
+	if (ret == 0)
+		stats->errors++;
+	return ret;
+}
+
+/**
+ * Log the counters of the statements, and free them. This
+ * must be done before the connection is closed.
+ *
+ * @param st the statements of the connection (can be NULL)
+ */
+void dbs_free(struct db_stmts *st)
+{
+	struct db_stmt_stats *stats;
+	int i;
+
+	if (st == NULL)
+		return;
+	for (i = 0 ; i < DBS_NB ; i++) {
+		stats = &st->stats[i];
+		if (stats->runs != 0)
+			logger(LOG_INFO, "Database : %s, %llu runs (%llu prepared, %llu failed), %.1f us on average, %.1f us at most.",
+					stmt_defs[i].name, (unsigned long long)stats->runs,
+					(unsigned long long)stats->native, (unsigned long long)stats->errors,
+					stats->ns / 1e3 / stats->runs, stats->max_ns / 1e3);
+#ifdef DBS_SQLITE3
+		if (st->stmt[i] != NULL)
+			sqlite3_finalize((sqlite3_stmt *)st->stmt[i]);
+#endif
+	}
+	free(st);
+}
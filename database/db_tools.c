@@ -23,37 +23,55 @@
 #include <dbi/dbi.h>
 
 /**
- * Initialize the database from a configuration
+ * Create a connection with the options of a configuration.
  *
  * @param c the config of the db
  *
- * @return 1 on success
+ * @return the connection, not connected yet
  */
-int init_db(struct config *c)
+static dbi_conn new_conn(struct config *c)
 {
-	dbi_initialize(NULL);
-	c->conn = dbi_conn_new(c->db_type);
+	dbi_conn conn;
+
+	conn = dbi_conn_new(c->db_type);
+	if (conn == NULL)
+		return NULL;
 
 	if (strcmp(c->db_type, "sqlite") == 0 || strcmp(c->db_type, "sqlite3") == 0) {
 		if (strcmp(c->db_type, "sqlite") == 0)
-			dbi_conn_set_option(c->conn, "sqlite_dbdir", c->db.file.path);
+			dbi_conn_set_option(conn, "sqlite_dbdir", c->db.file.path);
 		else
-			dbi_conn_set_option(c->conn, "sqlite3_dbdir", c->db.file.path);
+			dbi_conn_set_option(conn, "sqlite3_dbdir", c->db.file.path);
 
-		dbi_conn_set_option(c->conn, "dbname", c->db.file.db);
+		dbi_conn_set_option(conn, "dbname", c->db.file.db);
 	} else {
-		dbi_conn_set_option(c->conn, "host", c->db.connection.host);
-		dbi_conn_set_option(c->conn, "username", c->db.connection.user);
-		dbi_conn_set_option(c->conn, "password", c->db.connection.pass);
-		dbi_conn_set_option(c->conn, "dbname", c->db.connection.db);
-		dbi_conn_set_option_numeric(c->conn, "port", c->db.connection.port);
+		dbi_conn_set_option(conn, "host", c->db.connection.host);
+		dbi_conn_set_option(conn, "username", c->db.connection.user);
+		dbi_conn_set_option(conn, "password", c->db.connection.pass);
+		dbi_conn_set_option(conn, "dbname", c->db.connection.db);
+		dbi_conn_set_option_numeric(conn, "port", c->db.connection.port);
 	}
+	return conn;
+}
+
+/**
+ * Initialize the database from a configuration
+ *
+ * @param c the config of the db
+ *
+ * @return 1 on success
+ */
+int init_db(struct config *c)
+{
+	dbi_initialize(NULL);
+	c->conn = new_conn(c);
 
 	return 1;
 }
 
 /**
- * Connect to the database before executing a query
+ * Connect to the database before executing a query, and
+ * set up the statements of the connection
  *
  * @param c the configuration of the db
  *
@@ -66,5 +84,35 @@ int connect_db(struct config *c)
 		logger(LOG_ERR, "Could not connect. Please check the option settings");
 		return 0;
 	}
+	c->stmts = dbs_new(c->conn, c->db_type);
+	if (c->stmts == NULL)
+		return 0;
 	return 1;
 }
+
+/**
+ * Open one more connection to the database, for a thread
+ * that can not share the main one. libdbi keeps a list of
+ * all the connections : only one thread may open or close
+ * connections at a time.
+ *
+ * @param c the configuration of the db
+ *
+ * @return the connection, or NULL on failure
+ */
+dbi_conn db_open_conn(struct config *c)
+{
+	dbi_conn conn;
+
+	conn = new_conn(c);
+	if (conn == NULL) {
+		logger(LOG_ERR, "db_open_conn : could not create the connection.");
+		return NULL;
+	}
+	if (dbi_conn_connect(conn) < 0) {
+		logger(LOG_ERR, "db_open_conn : could not connect.");
+		dbi_conn_close(conn);
+		return NULL;
+	}
+	return conn;
+}
@@ -0,0 +1,117 @@
+/*
+ * soliloque-server, an open source implementation of the TeamSpeak protocol.
+ * Copyright (C) 2009 Hugo Camboulive <hugo.camboulive AT gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DB_QUEUE_H__
+#define __DB_QUEUE_H__
+
+#include <stdint.h>
+#include <pthread.h>
+
+struct config;
+
+/* pending mutations before the handlers wait for the worker */
+#define DBQ_MAX_PENDING 4096
+/* mutations committed in one transaction */
+#define DBQ_BATCH 256
+/* seconds between two reports of the persistence worker */
+#define DBQ_REPORT 60
+/* buckets of the index of the waiting mutations (power of two) */
+#define DBQ_INDEX_SIZE 1024
+
+/* types of mutation */
+#define DBM_CHAN_INSERT		0
+#define DBM_CHAN_UPDATE		1
+#define DBM_CHAN_DELETE		2
+#define DBM_REG_INSERT		3
+#define DBM_REG_DELETE		4
+#define DBM_PRIV_INSERT		5
+#define DBM_PRIV_UPDATE		6
+#define DBM_PRIV_DELETE		7
+
+/**
+ * A change to a row of the database, with a copy of the
+ * values : the object it comes from can be gone by the
+ * time it is written.
+ */
+struct db_mutation {
+	int type;
+	uint32_t key[2];	/* id of the row, or (player_id, channel_id) */
+	int server_id;
+	/* channel : name, topic, description, password
+	 * registration : name, password */
+	char *str[4];
+	int codec, max_users, sort_order, parent_id;
+	int flags;		/* channel, registration or privilege flags */
+
+	struct db_mutation *next;
+	struct db_mutation *hnext;	/* next in its bucket of the index */
+};
+
+/**
+ * Counters of the persistence worker.
+ */
+struct db_queue_stats {
+	unsigned int depth;		/* mutations waiting */
+	unsigned int max_depth;
+	uint64_t enqueued;
+	uint64_t coalesced;		/* merged into a waiting update */
+	uint64_t written;
+	uint64_t batches;
+	uint64_t commit_ns;		/* total time spent in transactions */
+	uint64_t max_commit_ns;
+};
+
+/**
+ * Mutations waiting to be written by the persistence worker,
+ * the only user of the database connection once the servers
+ * have been loaded.
+ */
+struct db_queue {
+	struct db_mutation *first, *last;
+	unsigned int nb;
+	/* last waiting insertion or update of each row, the
+	 * updates that follow are merged into it */
+	struct db_mutation *index[DBQ_INDEX_SIZE];
+	int stop;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	pthread_cond_t idle;	/* nothing waiting or being written */
+	pthread_t worker;
+	int running;
+	int busy;		/* the worker is writing a batch */
+
+	/* next ids of the rows inserted by the server */
+	uint32_t next_chan_id;
+	uint32_t next_reg_id;
+
+	struct db_queue_stats stats;
+};
+
+int dbq_init(struct config *c);
+int dbq_start(struct config *c);
+void dbq_stop(struct config *c);
+void dbq_stats(struct config *c, struct db_queue_stats *st);
+int dbq_idle(struct config *c);
+void dbq_flush(struct config *c);
+struct db_mutation *dbq_new(int type);
+void dbq_push(struct config *c, struct db_mutation *m);
+uint32_t dbq_next_chan_id(struct config *c);
+uint32_t dbq_next_reg_id(struct config *c);
+
+#endif
@@ -0,0 +1,69 @@
+/*
+ * soliloque-server, an open source implementation of the TeamSpeak protocol.
+ * Copyright (C) 2009 Hugo Camboulive <hugo.camboulive AT gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DB_SNAPSHOT_H__
+#define __DB_SNAPSHOT_H__
+
+#include <stdint.h>
+
+struct server;
+struct config;
+
+#define SNAP_MAGIC "SOLSNAP"
+#define SNAP_VERSION 1
+
+/* sections of a snapshot */
+#define SNAP_CHANNELS		1
+#define SNAP_REGISTRATIONS	2
+#define SNAP_SV_PRIVILEGES	3
+#define SNAP_CH_PRIVILEGES	4
+#define SNAP_BANS		5
+
+/**
+ * State of the database file when the snapshot was taken.
+ * The snapshot only replaces the database if it did not
+ * change since.
+ */
+struct snap_stamp {
+	uint64_t db_mtime;	/* in nanoseconds */
+	uint64_t db_size;
+	uint64_t wal_mtime;	/* 0 if there is no write-ahead log */
+	uint64_t wal_size;
+};
+
+/**
+ * Header of a snapshot file. The sections follow, each one
+ * made of its type, its number of records and the records.
+ * All the integers are in the byte order of the machine.
+ */
+struct snap_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t server_id;
+	uint64_t created;	/* in milliseconds since the epoch */
+	struct snap_stamp stamp;
+	uint64_t body_len;
+	uint32_t crc;		/* of the header up to here, and the body */
+	uint32_t pad;
+};
+
+int db_snapshot_enabled(struct config *c);
+int db_snapshot_load(struct server *s);
+int db_snapshot_write(struct server *s, int wait);
+
+#endif
@@ -0,0 +1,71 @@
+/*
+ * soliloque-server, an open source implementation of the TeamSpeak protocol.
+ * Copyright (C) 2009 Hugo Camboulive <hugo.camboulive AT gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DB_STMT_H__
+#define __DB_STMT_H__
+
+#include <stdint.h>
+#include <dbi/dbi.h>
+
+/* statements of the persistence worker */
+#define DBS_CHAN_INSERT		0
+#define DBS_CHAN_UPDATE		1
+#define DBS_CHAN_DELETE		2
+#define DBS_CHAN_DEL_PRIVS	3
+#define DBS_REG_INSERT		4
+#define DBS_REG_DELETE		5
+#define DBS_REG_DEL_PRIVS	6
+#define DBS_PRIV_INSERT		7
+#define DBS_PRIV_UPDATE		8
+#define DBS_PRIV_DELETE		9
+#define DBS_NB			10
+
+/* most parameters of a statement */
+#define DBS_MAX_PARAMS		16
+
+/**
+ * Counters of a statement.
+ */
+struct db_stmt_stats {
+	uint64_t runs;
+	uint64_t native;	/* runs through a prepared statement */
+	uint64_t errors;
+	uint64_t ns;		/* total execution time */
+	uint64_t max_ns;
+};
+
+/**
+ * The statements of a database connection. When the driver
+ * allows it, each one is prepared on its first run and only
+ * its parameters are bound afterwards. Otherwise, the query
+ * is built and sent through libdbi as before.
+ * Used by one thread at a time.
+ */
+struct db_stmts {
+	dbi_conn conn;
+	void *native;			/* sqlite3 handle, NULL if not usable */
+	void *stmt[DBS_NB];		/* prepared statements */
+	int failed[DBS_NB];		/* could not be prepared, use libdbi */
+	struct db_stmt_stats stats[DBS_NB];
+};
+
+struct db_stmts *dbs_new(dbi_conn conn, const char *driver);
+int dbs_exec(struct db_stmts *st, int id, ...);
+void dbs_free(struct db_stmts *st);
+
+#endif
@@ -0,0 +1,186 @@
+/*
+ * soliloque-server, an open source implementation of the TeamSpeak protocol.
+ * Copyright (C) 2009 Hugo Camboulive <hugo.camboulive AT gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "id_alloc.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+
+#define FULL_WORD (~(uint64_t)0)
+
+/**
+ * Number of words of a level.
+ *
+ * @param ida the allocator
+ * @param level the level, 0 being the bits of the IDs
+ */
+static size_t level_words(const struct id_alloc *ida, unsigned int level)
+{
+	return (size_t)1 << (6 * (ida->nb_levels - 1 - level));
+}
+
+/**
+ * Initialize an allocator with room for 64 IDs.
+ *
+ * @param ida the allocator
+ * @param max the highest ID it may hand out, 0 for no limit
+ *
+ * @return 1 on success, 0 if the allocation failed
+ */
+int ida_init(struct id_alloc *ida, uint32_t max)
+{
+	bzero(ida, sizeof(struct id_alloc));
+	ida->max = max;
+	ida->levels[0] = (uint64_t *)calloc(1, sizeof(uint64_t));
+	if (ida->levels[0] == NULL) {
+		logger(LOG_ERR, "ida_init, calloc failed : %s.", strerror(errno));
+		return 0;
+	}
+	ida->nb_levels = 1;
+	pthread_mutex_init(&ida->lock, NULL);
+	return 1;
+}
+
+/**
+ * Free the bitmap of an allocator.
+ *
+ * @param ida the allocator
+ */
+void ida_destroy(struct id_alloc *ida)
+{
+	unsigned int i;
+
+	for (i = 0 ; i < ida->nb_levels ; i++)
+		free(ida->levels[i]);
+	ida->nb_levels = 0;
+	pthread_mutex_destroy(&ida->lock);
+}
+
+/**
+ * Add a level on top of the bitmap, multiplying the number
+ * of IDs by 64. The old top level is full, it becomes the
+ * first word of its level.
+ *
+ * @param ida the allocator
+ *
+ * @return 1 on success, 0 if it cannot grow
+ */
+static int ida_grow(struct id_alloc *ida)
+{
+	uint64_t *new_levels[IDA_MAX_LEVELS];
+	unsigned int i;
+	size_t old_words;
+
+	if (ida->nb_levels == IDA_MAX_LEVELS) {
+		logger(LOG_ERR, "ida_grow : no ID left.");
+		return 0;
+	}
+	for (i = 0 ; i <= ida->nb_levels ; i++) {
+		old_words = (i < ida->nb_levels) ? level_words(ida, i) : 0;
+		new_levels[i] = (uint64_t *)calloc(old_words ? old_words * 64 : 1, sizeof(uint64_t));
+		if (new_levels[i] == NULL) {
+			logger(LOG_ERR, "ida_grow, calloc failed : %s.", strerror(errno));
+			while (i-- > 0)
+				free(new_levels[i]);
+			return 0;
+		}
+		if (old_words != 0)
+			memcpy(new_levels[i], ida->levels[i], old_words * sizeof(uint64_t));
+	}
+	new_levels[ida->nb_levels][0] = 1;
+	for (i = 0 ; i < ida->nb_levels ; i++) {
+		free(ida->levels[i]);
+		ida->levels[i] = new_levels[i];
+	}
+	ida->levels[ida->nb_levels] = new_levels[ida->nb_levels];
+	ida->nb_levels++;
+	return 1;
+}
+
+/**
+ * Allocate the lowest free ID.
+ *
+ * @param ida the allocator
+ *
+ * @return the ID (starting at 1), or 0 if there is none left
+ */
+uint32_t ida_get(struct id_alloc *ida)
+{
+	size_t idx = 0, id;
+	int level;
+	uint64_t *w;
+
+	pthread_mutex_lock(&ida->lock);
+	if (ida->levels[ida->nb_levels - 1][0] == FULL_WORD && !ida_grow(ida)) {
+		pthread_mutex_unlock(&ida->lock);
+		return 0;
+	}
+	/* go down, following the first word that is not full */
+	for (level = ida->nb_levels - 1 ; level >= 0 ; level--)
+		idx = idx * 64 + __builtin_ctzll(~ida->levels[level][idx]);
+	id = idx;
+	if (ida->max != 0 && id >= ida->max) {
+		pthread_mutex_unlock(&ida->lock);
+		logger(LOG_WARN, "ida_get : all the %u IDs are in use.", ida->max);
+		return 0;
+	}
+	/* mark it, and the words that became full on the way up */
+	for (level = 0 ; level < (int)ida->nb_levels ; level++) {
+		w = &ida->levels[level][idx / 64];
+		*w |= (uint64_t)1 << (idx % 64);
+		if (*w != FULL_WORD)
+			break;
+		idx /= 64;
+	}
+	pthread_mutex_unlock(&ida->lock);
+	return (uint32_t)id + 1;	/* ID start at 1 */
+}
+
+/**
+ * Release an ID, it will be handed out again.
+ *
+ * @param ida the allocator
+ * @param id the ID
+ */
+void ida_put(struct id_alloc *ida, uint32_t id)
+{
+	size_t idx = id - 1;	/* ID start at 1 */
+	unsigned int level;
+	uint64_t *w, bit;
+
+	pthread_mutex_lock(&ida->lock);
+	if (id == 0 || idx >= level_words(ida, 0) * 64
+			|| !(ida->levels[0][idx / 64] & ((uint64_t)1 << (idx % 64)))) {
+		pthread_mutex_unlock(&ida->lock);
+		logger(LOG_WARN, "ida_put : ID %u is not in use.", id);
+		return;
+	}
+	/* unmark it, and the words that are not full anymore */
+	for (level = 0 ; level < ida->nb_levels ; level++) {
+		w = &ida->levels[level][idx / 64];
+		bit = (uint64_t)1 << (idx % 64);
+		if (level > 0 && !(*w & bit))
+			break;
+		*w &= ~bit;
+		idx /= 64;
+	}
+	pthread_mutex_unlock(&ida->lock);
+}
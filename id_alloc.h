@@ -0,0 +1,50 @@
+/*
+ * soliloque-server, an open source implementation of the TeamSpeak protocol.
+ * Copyright (C) 2009 Hugo Camboulive <hugo.camboulive AT gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __ID_ALLOC_H__
+#define __ID_ALLOC_H__
+
+#include <stdint.h>
+#include <pthread.h>
+
+/* a word of a level covers 64 words of the level below */
+#define IDA_MAX_LEVELS 5
+
+/**
+ * Allocator of small integer IDs, starting at 1. The lowest
+ * free ID is always handed out.
+ *
+ * The IDs in use are bits of a hierarchical bitmap : a bit of
+ * levels[0] is set when its ID is used, a bit of levels[i] is
+ * set when the matching word of levels[i - 1] is full. The
+ * top level is a single word.
+ */
+struct id_alloc {
+	uint64_t *levels[IDA_MAX_LEVELS];
+	unsigned int nb_levels;
+	uint32_t max;		/* highest ID handed out, 0 for no limit */
+
+	pthread_mutex_t lock;
+};
+
+int ida_init(struct id_alloc *ida, uint32_t max);
+void ida_destroy(struct id_alloc *ida);
+uint32_t ida_get(struct id_alloc *ida);
+void ida_put(struct id_alloc *ida, uint32_t id);
+
+#endif
@@ -17,63 +17,383 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
 #include <pthread.h>
 #include <string.h>
 #include <time.h>
+#include <errno.h>
 
 #include "log.h"
 #include "configuration.h"
 
 #define LOG_COLOR_CANCEL "\x1b[0;37;40m"
 
+/* number of messages a thread can have pending */
+#define LOG_RING_SIZE 1024
+/* longer messages are truncated */
+#define LOG_MSG_SIZE 256
+/* the writer sleeps this long between two batches (ms) */
+#define LOG_BATCH_DELAY 10
+
+/**
+ * A formatted message waiting for the writer.
+ */
+struct log_rec
+{
+	time_t t;
+	int level;
+	int len;
+	char msg[LOG_MSG_SIZE];
+};
+
+/**
+ * Single producer (its thread), single consumer (the writer)
+ * ring of pending messages.
+ */
+struct log_ring
+{
+	unsigned int head;	/* next slot written by the producer */
+	unsigned int tail;	/* next slot read by the writer */
+	uint64_t dropped;	/* messages lost because the ring was full */
+	uint64_t dropped_seen;	/* part of dropped already reported */
+	int dead;		/* the thread exited, free once drained */
+	struct log_ring *next;
+	struct log_rec recs[LOG_RING_SIZE];
+};
+
+int log_level = LOG_INFO;
+
 static struct config *c = NULL;
 static char *log_header[5] = {"", "(ERR)", "(WRN)", "(INF)", "(DBG)"};
 static char *log_color[5] = {"", "\x1b[0;31;40m", "\x1b[0;33;40m",
 	"\x1b[0;32;40m", "\x1b[0;34;40m"};
 static char *log_color_dim[5] = {"", "\x1b[2;31;40m", "\x1b[2;33;40m",
 	"\x1b[2;32;40m", "\x1b[2;34;40m"};
+
+/* protects the list of rings, the configuration and the output */
 static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static struct log_ring *rings = NULL;
+static uint64_t dropped_total = 0;
+static int writer_idle = 0;
+static int writer_started = 0;
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+static __thread struct log_ring *my_ring = NULL;
+
+/* cached formatting of the last timestamp */
+static time_t cached_t = 0;
+static char cached_fmt[26];
 
-void logger(int loglevel, char *str, ...)
+/* output buffer of the writer */
+static char out_buf[64 * 1024];
+
+/**
+ * Format a timestamp, reusing the previous result
+ * if we are still in the same second.
+ *
+ * @param t the timestamp
+ *
+ * @return the formatted time
+ */
+static const char *format_time(time_t t)
 {
-	va_list args;
-	FILE *dst;
-	int lvl;
-	time_t t;
-	char time_fmt[26];
-	char *str2 = (char *)calloc(sizeof(char), strlen(str) + 41 + 30);
+	if (t != cached_t) {
+		ctime_r(&t, cached_fmt);
+		cached_fmt[24] = '\0';	/* remove the trailing \n */
+		cached_t = t;
+	}
+	return cached_fmt;
+}
+
+/**
+ * Append a message with its header to the output buffer,
+ * writing the buffer out if it is full.
+ * Must be called with the mutex locked.
+ *
+ * @param dst the output stream
+ * @param used the bytes already in the buffer
+ * @param level the level of the message
+ * @param t the time of the message
+ * @param msg the message
+ * @param len the length of the message
+ *
+ * @return the bytes in the buffer
+ */
+static size_t append_rec(FILE *dst, size_t used, int level, time_t t, const char *msg, int len)
+{
+	int n;
+
+	if (used + LOG_MSG_SIZE + 128 > sizeof(out_buf)) {
+		fwrite(out_buf, 1, used, dst);
+		used = 0;
+	}
+	n = snprintf(out_buf + used, sizeof(out_buf) - used, "%s%s %s%s"LOG_COLOR_CANCEL" %.*s\n",
+			log_color[level], log_header[level], log_color_dim[level],
+			format_time(t), len, msg);
+	if (n > 0)
+		used += ((size_t)n < sizeof(out_buf) - used) ? (size_t)n : sizeof(out_buf) - used - 1;
+	return used;
+}
+
+/**
+ * Write all the pending messages of all the threads.
+ * Must be called with the mutex locked.
+ *
+ * @return the number of messages written
+ */
+static int drain(void)
+{
+	struct log_ring *r, **prev;
+	struct log_rec *rec;
+	unsigned int head, tail;
+	uint64_t dropped;
+	size_t used = 0;
+	int nb = 0;
+	FILE *dst = (c != NULL) ? c->log.output : stderr;
+
+	prev = &rings;
+	while ((r = *prev) != NULL) {
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		for (tail = r->tail ; tail != head ; tail++, nb++) {
+			rec = &r->recs[tail % LOG_RING_SIZE];
+			used = append_rec(dst, used, rec->level, rec->t, rec->msg, rec->len);
+		}
+		__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+
+		dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+		if (dropped != r->dropped_seen) {
+			char msg[64];
+			int len = snprintf(msg, sizeof(msg), "%llu log messages dropped.",
+					(unsigned long long)(dropped - r->dropped_seen));
+			used = append_rec(dst, used, LOG_WARN, time(NULL), msg, len);
+			r->dropped_seen = dropped;
+			nb++;
+		}
+
+		/* the thread is gone and will not log anymore */
+		if (__atomic_load_n(&r->dead, __ATOMIC_ACQUIRE)
+				&& __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == tail) {
+			*prev = r->next;
+			free(r);
+		} else {
+			prev = &r->next;
+		}
+	}
+	if (used > 0) {
+		fwrite(out_buf, 1, used, dst);
+		fflush(dst);
+	}
+	return nb;
+}
+
+/**
+ * Check if a thread has messages pending.
+ * Must be called with the mutex locked.
+ */
+static int pending(void)
+{
+	struct log_ring *r;
+
+	for (r = rings ; r != NULL ; r = r->next)
+		if (__atomic_load_n(&r->head, __ATOMIC_SEQ_CST) != r->tail)
+			return 1;
+	return 0;
+}
+
+/**
+ * Background thread that writes the messages in batches.
+ */
+static void *log_writer(void *args)
+{
+	struct timespec ts;
+	int nb;
 
 	pthread_mutex_lock(&mutex);
-	if (c != NULL) {
-		lvl = c->log.level;
-		dst = c->log.output;
-	} else {
-		lvl = LOG_INFO;
-		dst = stderr;
+	while (1) {
+		nb = drain();
+		if (nb > 0) {
+			/* busy : let the messages accumulate a bit */
+			pthread_mutex_unlock(&mutex);
+			ts.tv_sec = 0;
+			ts.tv_nsec = LOG_BATCH_DELAY * 1000000L;
+			nanosleep(&ts, NULL);
+			pthread_mutex_lock(&mutex);
+			continue;
+		}
+		/* idle : sleep until a producer wakes us up */
+		__atomic_store_n(&writer_idle, 1, __ATOMIC_SEQ_CST);
+		if (!pending()) {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += 1;
+			pthread_cond_timedwait(&wake, &mutex, &ts);
+		}
+		__atomic_store_n(&writer_idle, 0, __ATOMIC_SEQ_CST);
 	}
+	return NULL;
+}
+
+/**
+ * Mark the ring of an exiting thread so the writer
+ * frees it once it is drained.
+ */
+static void ring_release(void *ring)
+{
+	struct log_ring *r = (struct log_ring *)ring;
+
+	__atomic_store_n(&r->dead, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Write everything still pending when the process exits.
+ */
+static void log_atexit(void)
+{
+	log_flush();
+}
+
+static void log_init(void)
+{
+	pthread_t writer;
+	pthread_attr_t attr;
+
+	pthread_key_create(&ring_key, ring_release);
+	atexit(log_atexit);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&writer, &attr, log_writer, NULL) == 0)
+		writer_started = 1;
+	else
+		fprintf(stderr, "log_init, could not start the log writer : %s.\n", strerror(errno));
+	pthread_attr_destroy(&attr);
+}
+
+/**
+ * Retrieve the ring of the current thread, creating it
+ * the first time the thread logs something.
+ *
+ * @return the ring or NULL if the allocation failed
+ */
+static struct log_ring *get_ring(void)
+{
+	struct log_ring *r;
+
+	if (my_ring != NULL)
+		return my_ring;
+
+	r = (struct log_ring *)calloc(1, sizeof(struct log_ring));
+	if (r == NULL)
+		return NULL;
+	pthread_setspecific(ring_key, r);
+	pthread_mutex_lock(&mutex);
+	r->next = rings;
+	rings = r;
+	pthread_mutex_unlock(&mutex);
+	my_ring = r;
+	return r;
+}
+
+/**
+ * Format a message and queue it for the writer thread.
+ * This never blocks : if the ring of the thread is full,
+ * the message is dropped and counted.
+ * Use the logger() macro instead of calling this directly.
+ *
+ * @param loglevel the level of the message
+ * @param str the format of the message
+ */
+void log_write(int loglevel, const char *str, ...)
+{
+	va_list args;
+	struct log_ring *r;
+	struct log_rec *rec;
+	unsigned int head;
+	int len;
+
+	pthread_once(&init_once, log_init);
 
 	if (loglevel > 4)
 		loglevel = 4;
+	if (loglevel < 1)
+		loglevel = 1;
 
-	va_start(args, str);
-	if (loglevel <= lvl) {
-		time(&t);
-		ctime_r(&t, time_fmt);
-		time_fmt[24] = '\0';	/* remove the trailing \n */
-		sprintf(str2, "%s%s %s%s"LOG_COLOR_CANCEL" %s\n", log_color[loglevel], log_header[loglevel], log_color_dim[loglevel], time_fmt, str);
-		vfprintf(dst, str2, args);
-		fflush(dst);
+	r = get_ring();
+	if (r == NULL || !writer_started) {
+		/* no asynchronous path, write it ourselves */
+		char msg[LOG_MSG_SIZE];
+
+		va_start(args, str);
+		len = vsnprintf(msg, sizeof(msg), str, args);
+		va_end(args);
+		if (len >= LOG_MSG_SIZE)
+			len = LOG_MSG_SIZE - 1;
+		pthread_mutex_lock(&mutex);
+		drain();
+		len = append_rec((c != NULL) ? c->log.output : stderr, 0, loglevel, time(NULL), msg, len);
+		fwrite(out_buf, 1, len, (c != NULL) ? c->log.output : stderr);
+		fflush((c != NULL) ? c->log.output : stderr);
+		pthread_mutex_unlock(&mutex);
+		return;
+	}
+
+	head = r->head;
+	if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= LOG_RING_SIZE) {
+		__atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&dropped_total, 1, __ATOMIC_RELAXED);
+		return;
 	}
+	rec = &r->recs[head % LOG_RING_SIZE];
+	rec->t = time(NULL);
+	rec->level = loglevel;
+	va_start(args, str);
+	len = vsnprintf(rec->msg, LOG_MSG_SIZE, str, args);
 	va_end(args);
+	rec->len = (len >= LOG_MSG_SIZE) ? LOG_MSG_SIZE - 1 : len;
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_SEQ_CST);
+
+	/* only pay for the wake up when the writer went to sleep */
+	if (__atomic_load_n(&writer_idle, __ATOMIC_SEQ_CST)
+			&& __atomic_exchange_n(&writer_idle, 0, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&mutex);
+		pthread_cond_signal(&wake);
+		pthread_mutex_unlock(&mutex);
+	}
+}
 
-	free(str2);
+/**
+ * Synchronously write all the pending messages.
+ */
+void log_flush(void)
+{
+	pthread_mutex_lock(&mutex);
+	drain();
 	pthread_mutex_unlock(&mutex);
 }
 
+/**
+ * Total number of messages dropped because a ring was full.
+ *
+ * @return the number of dropped messages
+ */
+uint64_t log_dropped(void)
+{
+	return __atomic_load_n(&dropped_total, __ATOMIC_RELAXED);
+}
+
+/**
+ * Change the configuration used by the logger. The messages
+ * pending are written with the previous configuration.
+ *
+ * @param cfg the new configuration (NULL for the defaults)
+ */
 void set_config(struct config *cfg)
 {
 	pthread_mutex_lock(&mutex);
+	drain();
 	c = cfg;
+	__atomic_store_n(&log_level, (cfg != NULL) ? cfg->log.level : LOG_INFO, __ATOMIC_RELAXED);
 	pthread_mutex_unlock(&mutex);
 }
@@ -20,6 +20,7 @@
 #define __LOG_H__
 
 #include <stdarg.h>
+#include <stdint.h>
 
 #include "configuration.h"
 
@@ -28,7 +29,30 @@
 #define LOG_INFO 3
 #define LOG_DBG 4
 
-void logger(int loglevel, char *str, ...);
+/* Messages above this level are removed at compile time
+ * (./waf configure --log-level=N) */
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL LOG_DBG
+#endif
+
+/* level of the current configuration, messages above it
+ * are discarded before being formatted */
+extern int log_level;
+
+/**
+ * Log a message. The level is checked before the arguments
+ * are evaluated, and a constant level above LOG_MAX_LEVEL
+ * makes the whole call disappear.
+ */
+#define logger(loglevel, ...) \
+	do { \
+		if ((loglevel) <= LOG_MAX_LEVEL && (loglevel) <= log_level) \
+			log_write((loglevel), __VA_ARGS__); \
+	} while (0)
+
+void log_write(int loglevel, const char *str, ...);
+void log_flush(void);
+uint64_t log_dropped(void);
 void set_config(struct config *cfg);
 
 #endif
@@ -42,16 +42,14 @@
 #include "config.h"
 #include "log.h"
 #include "queue.h"
+#include "packet_sender.h"
+#include "packet_pool.h"
 
 #define MAX_MSG 1024
 
 int nb_serv;
 struct array *ss;
 
-/* forced to be put as a global variable because
- * it's used in main AND a signal interrupt */
-static int reload;
-
 /* functions */
 typedef void *(*packet_function)(char *data, unsigned int len, struct player *pl);
 packet_function f0_callbacks[2][255];
@@ -95,7 +93,7 @@ static void init_callbacks(void)
 	/* callbacks[0] = myfunc1; ... */
 }
 
-static void handle_connection_type_packet(char *data, int len, struct sockaddr_in *cli_addr, unsigned int cli_len, struct server *s)
+static void handle_connection_type_packet(char *data, int len, struct sockaddr_in *cli_addr, unsigned int cli_len, struct server *s, struct player *pl)
 {
 	char *ptr = data + 2;
 	uint16_t code = ru16(&ptr);
@@ -107,7 +105,7 @@ static void handle_connection_type_packet(char *data, int len, struct sockaddr_i
 		handle_player_connect(data, len, cli_addr, cli_len, s);
 		break;
 	case 1:
-		handle_player_keepalive(data, len, s);
+		handle_player_keepalive(data, len, pl);
 		break;
 	default:
 		logger(LOG_WARN, "Unknown connection packet : 0xf4be%x.", ((uint16_t *)data)[1]);
@@ -125,13 +123,10 @@ static packet_function get_f0_function(unsigned char * code)
 
 
 
-static void handle_control_type_packet(char *data, int len, struct sockaddr_in *cli_addr, unsigned int cli_len, struct server *s)
+static void handle_control_type_packet(char *data, int len, struct player *pl)
 {
 	packet_function func;
 	uint8_t code[4] = {0,0,0,0};
-	uint32_t public_id, private_id;
-	struct player *pl;
-	char *ptr;
 
 	/* Valid code (no overflow) */
 	memcpy(code, data, MIN(4, len));
@@ -149,12 +144,7 @@ static void handle_control_type_packet(char *data, int len, struct sockaddr_in *
 			logger(LOG_WARN, "Control packet (0x%x) has invalid CRC", *(uint32_t *)data);
 			return;
 		}
-		/* Check if player exists */
-		ptr = data + 4;
-		private_id = ru32(&ptr);
-		public_id = ru32(&ptr);
-		pl = get_player_by_ids(s, public_id, private_id);
-		/* Execute */
+		/* Execute if the player exists */
 		if (pl != NULL) {
 			pl->stats->activ_time = time(NULL);	/* update idle time */
 			(*func)(data, len, pl);
@@ -164,79 +154,137 @@ static void handle_control_type_packet(char *data, int len, struct sockaddr_in *
 	}
 }
 
-static void handle_ack_type_packet(char *data, int len, struct sockaddr_in *cli_addr, struct server *s)
+static void handle_ack_type_packet(char *data, int len, struct server *s, struct player *pl)
 {
-	struct player *pl;
 	uint16_t sent_version, ack_version;
 	uint32_t sent_counter, ack_counter;
-	uint32_t public_id, private_id;
-	char *sent, *ptr;
+	struct q_elem *q_e;
+	unsigned int i;
+	char *ptr;
 
 	logger(LOG_INFO, "Packet : ACK.");
+	if (len < 16) {
+		logger(LOG_WARN, "ACK packet too small to be valid.");
+		return;
+	}
 	/* parse ACK packet */
 	ptr = data + 2;
 	ack_version = ru16(&ptr);
-	private_id = ru32(&ptr);
-	public_id = ru32(&ptr);
+	ptr += 8;	/* private and public ID, already resolved */
 	ack_counter = ru32(&ptr);
 
-	pl = get_player_by_ids(s, public_id, private_id);
-	if (pl == NULL)
-		pl = get_leaving_player_by_ids(s, public_id, private_id);
 	if (pl != NULL) {
-		pthread_mutex_lock(&pl->packets->mutex);
+		pthread_mutex_lock(&pl->packets.mutex);
 
-		sent = peek_at_queue(pl->packets);
-		if (sent != NULL) {
-			ptr = sent + 12;
+		/* the ack can retire any packet of the send window,
+		 * that is any packet that has already been sent */
+		for (i = 0 ; (q_e = queue_at(&pl->packets, i)) != NULL && timerisset(&q_e->last_sent) ; i++) {
+			ptr = (char *)q_e->elem + 12;
 			sent_counter = ru32(&ptr);
 			sent_version = ru16(&ptr);
 
-			if (sent_counter == ack_counter && ack_version <= sent_version)
-				free(get_from_queue(pl->packets));
+			if (sent_counter == ack_counter && ack_version <= sent_version) {
+				pkt_free(queue_remove_at(&pl->packets, i));
+				/* the window moved, send the next packet */
+				q_e = queue_last(&pl->packets);
+				if (q_e != NULL && !timerisset(&q_e->last_sent))
+					packet_sender_notify(s, pl);
+				break;
+			}
 		}
-		pthread_mutex_unlock(&pl->packets->mutex);
+		pthread_mutex_unlock(&pl->packets.mutex);
 	}
 }
 
-static void handle_data_type_packet(char *data, int len, struct sockaddr_in *cli_addr, struct server *s)
+static void handle_data_type_packet(char *data, int len, struct server *s)
 {
+	const struct voice_entry *sender;
+	uint32_t pub, priv;
 	int res;
+
 	logger(LOG_INFO, "Packet : Audio data.");
-	res = audio_received(data, len, s);
+	priv = GUINT32_FROM_LE(*(uint32_t *)(data + 4));
+	pub = GUINT32_FROM_LE(*(uint32_t *)(data + 8));
+	sender = voice_lookup(&s->voice, pub, priv);
+	if (sender == NULL) {
+		logger(LOG_ERR, "Wrong public/private ID pair : %x/%x.", pub, priv);
+		return;
+	}
+	sender->pl->stats->pkt_sent++;
+	sender->pl->stats->size_sent += len;
+	res = audio_received(data, len, s, sender);
 	logger(LOG_INFO, "Return value : %i.", res);
 }
 
-/* Manage an incoming packet */
+/**
+ * Classify a datagram on a receive thread : audio is forwarded
+ * right away, everything else is queued for the control worker.
+ * The receive thread must be a voice reader that is not offline.
+ *
+ * @param data the datagram
+ * @param len the length of data
+ * @param cli_addr the address of the sender
+ * @param cli_len the length of cli_addr
+ * @param rcv the receiver that read the datagram
+ *
+ * @return 1 if the datagram has been queued for the control worker
+ */
+int dispatch_packet(char *data, int len, struct sockaddr_in *cli_addr, unsigned int cli_len, struct receiver *rcv)
+{
+	struct server *s = rcv->s;
+
+	if (len >= 12 && GUINT16_FROM_LE(((uint16_t *)data)[0]) == 0xbef2) {
+		sstat_add_packet(s->stats, len, 0);
+		handle_data_type_packet(data, len, s);
+		return 0;
+	}
+	if (!ctl_enqueue(&rcv->ctl_queue, data, len, cli_addr, cli_len)) {
+		logger(LOG_WARN, "Control queue full, datagram dropped.");
+		return 0;
+	}
+	return 1;
+}
+
+/* Manage an incoming packet (control plane) */
 void handle_packet(char *data, int len, struct sockaddr_in *cli_addr, unsigned int cli_len, struct server *s)
 {
 	uint32_t pub, priv;
-	struct player *pl;
+	uint16_t type;
+	struct player *pl = NULL;
 
 	/* add some stats */
 	sstat_add_packet(s->stats, len, 0);
-	/* add some stats for the player if he exists */
+	if (len < 12) {
+		logger(LOG_WARN, "Packet too small to be valid.");
+		return;
+	}
+	type = GUINT16_FROM_LE(((uint16_t *)data)[0]);
+	/* every packet type carries the private and public ID
+	 * at the same offsets : resolve the player only once */
 	priv = GUINT32_FROM_LE(*(uint32_t *)(data + 4));
 	pub = GUINT32_FROM_LE(*(uint32_t *)(data + 8));
 	pl = get_player_by_ids(s, pub, priv);
+	/* add some stats for the player if he exists */
 	if (pl != NULL) {
 		pl->stats->pkt_sent++;
 		pl->stats->size_sent += len;
+	} else if (type == 0xbef1) {
+		/* leaving players still acknowledge their last packets */
+		pl = get_leaving_player_by_ids(s, pub, priv);
 	}
 
 	/* first a few tests */
-	switch (GUINT16_FROM_LE(((uint16_t *)data)[0])) {
+	switch (type) {
 	case 0xbef0:		/* commands */
-		handle_control_type_packet(data, len, cli_addr, cli_len, s);
+		handle_control_type_packet(data, len, pl);
 		break;
 	case 0xbef1:		/* acknowledge */
-		handle_ack_type_packet(data, len, cli_addr, s);
+		handle_ack_type_packet(data, len, s, pl);
 		break;
-	case 0xbef2: 		/* audio data */
-		handle_data_type_packet(data, len, cli_addr, s);
+	case 0xbef2: 		/* audio data, handled by dispatch_packet */
 		break;
 	case 0xbef4:		/* connection and keepalives */
-		handle_connection_type_packet(data, len, cli_addr, cli_len, s);
+		handle_connection_type_packet(data, len, cli_addr, cli_len, s, pl);
 		break;
 	default:
 		logger(LOG_WARN, "Unvalid packet type field : 0x%x.", ((uint16_t *)data)[0]);
@@ -258,11 +306,11 @@ static void print_version()
 }
 
 /**
- * Makes the main function reach the end of the
- * pthread_joins cleanly. This is used by sigint
- * to exit cleanly, and sigusr1 to reload config
+ * Stop the servers, once their threads are done write their
+ * snapshots, then close the database. Called by main when it
+ * receives SIGINT (exit) or SIGUSR1 (reload the config).
  */
-void cleanup()
+static void cleanup()
 {
 	size_t iter;
 	struct server *s;
@@ -272,9 +320,14 @@ void cleanup()
 		cfg = s->conf;
 		ar_remove(ss, s);
 		server_stop(s);
+		free(s->receivers);
+		free(s);
 	ar_end_each;
+	ar_free(ss);
 
-	/* cleanup database */
+	/* cleanup database, once everything has been written */
+	dbq_stop(cfg);
+	dbs_free(cfg->stmts);
 	dbi_conn_close(cfg->conn);
 	dbi_shutdown();
 
@@ -282,27 +335,6 @@ void cleanup()
 	destroy_config(cfg);
 }
 
-/**
- * signal function to exit cleanly
- */
-void sigint()
-{
-	logger(LOG_INFO, "SIGINT received - clean exit");
-	cleanup();
-	signal(SIGINT, sigint);
-}
-
-/**
- * signal function to reload the config file
- */
-void sigusr1()
-{
-	logger(LOG_INFO, "SIGUSR1 received - reloading configuration");
-	reload = 1;
-	cleanup();
-	signal(SIGUSR1, sigusr1);
-}
-
 
 int main(int argc, char **argv)
 {
@@ -310,7 +342,8 @@ int main(int argc, char **argv)
 	size_t iter;
 	struct server *s;
 	int i = 0;
-	int val;
+	int val, sig, reload;
+	sigset_t sigs;
 	int terminate = 0, wrongopt = 0, helpshown = 0;
 	char *configfile = NULL;
 
@@ -346,8 +379,12 @@ int main(int argc, char **argv)
 	if (configfile == NULL)
 		configfile = "sol-server.cfg";
 
-	signal(SIGINT, sigint);
-	signal(SIGUSR1, sigusr1);
+	/* the signals are blocked in every thread and taken by main
+	 * alone, so none of them interrupts a thread in its work */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
 	reload = 1; /* first launch, always load */
 	while(reload) {
 		/* default is only one launch then exit
@@ -366,28 +403,33 @@ int main(int argc, char **argv)
 			logger(LOG_ERR, "Unable to connect to the database. Exiting.");
 			exit(0);
 		}
+		if (!dbq_init(c)) {
+			logger(LOG_ERR, "Unable to create the database queue. Exiting.");
+			exit(0);
+		}
 		ss = ar_new(2);
 		db_create_servers(c, ss);
 
+		db_load_servers(c, ss);
 		ar_each(struct server *, s, iter, ss)
-			db_create_channels(c, s);
-			db_create_subchannels(c, s);
-			db_create_registrations(c, s);
-			db_create_sv_privileges(c, s);
 			sp_print(s->privileges);
-			db_create_pl_ch_privileges(c, s);
 			logger(LOG_INFO, "Launching server %i", i);
 			server_start(s);
 			i++;
 		ar_end_each;
 		logger(LOG_INFO, "Servers initialized.");
-
-		ar_each(struct server *, s, iter, ss)
-			pthread_join(s->main_thread, NULL);
-			pthread_join(s->packet_sender, NULL);
-			free(s);
-		ar_end_each;
-		ar_free(ss);
+		/* the servers are loaded, the connection is the worker's now */
+		dbq_start(c);
+
+		/* the servers run until a signal comes */
+		sigwait(&sigs, &sig);
+		if (sig == SIGUSR1) {
+			logger(LOG_INFO, "SIGUSR1 received - reloading configuration");
+			reload = 1;
+		} else {
+			logger(LOG_INFO, "SIGINT received - clean exit");
+		}
+		cleanup();
 	}
 	logger(LOG_INFO, "All server threads ended. Exiting.");
 	/* exit */
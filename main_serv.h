@@ -23,5 +23,6 @@
 #include <sys/socket.h>
 
 void handle_packet(char *data, int len, struct sockaddr_in *cli_addr, unsigned int cli_len, struct server *s);
+int dispatch_packet(char *data, int len, struct sockaddr_in *cli_addr, unsigned int cli_len, struct receiver *rcv);
 
 #endif
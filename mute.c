@@ -0,0 +1,226 @@
+/*
+ * soliloque-server, an open source implementation of the TeamSpeak protocol.
+ * Copyright (C) 2009 Hugo Camboulive <hugo.camboulive AT gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mute.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+
+#define BIT(idx) ((uint64_t)1 << ((idx) % 64))
+
+/**
+ * Initialize an empty matrix.
+ *
+ * @param m the matrix
+ */
+void mute_init(struct mute_matrix *m)
+{
+	bzero(m, sizeof(struct mute_matrix));
+	pthread_mutex_init(&m->lock, NULL);
+}
+
+void mute_destroy(struct mute_matrix *m)
+{
+	free(m->mutes);
+	free(m->muted_by);
+	m->mutes = m->muted_by = NULL;
+	m->size = m->words = 0;
+	pthread_mutex_destroy(&m->lock);
+}
+
+/**
+ * Copy a matrix into a larger one.
+ *
+ * @param old the matrix
+ * @param size the number of rows of old
+ * @param new_size the number of rows of the new matrix
+ *
+ * @return the new matrix, or NULL if the allocation failed
+ */
+static uint64_t *grow_bits(uint64_t *old, size_t size, size_t new_size)
+{
+	uint64_t *bits;
+	size_t i;
+
+	bits = (uint64_t *)calloc(new_size * (new_size / 64), sizeof(uint64_t));
+	if (bits == NULL) {
+		logger(LOG_ERR, "grow_bits, calloc failed : %s.", strerror(errno));
+		return NULL;
+	}
+	for (i = 0 ; i < size ; i++)
+		memcpy(bits + i * (new_size / 64), old + i * (size / 64), (size / 64) * sizeof(uint64_t));
+	return bits;
+}
+
+/**
+ * Make room for an ID. The lock must be held.
+ *
+ * @param m the matrix
+ * @param id the public ID
+ *
+ * @return 1 on success, 0 if the allocation failed
+ */
+static int mute_grow(struct mute_matrix *m, uint32_t id)
+{
+	size_t new_size = (m->size == 0) ? 64 : m->size;
+	uint64_t *mutes, *muted_by;
+
+	while (new_size < id)
+		new_size *= 2;
+	mutes = grow_bits(m->mutes, m->size, new_size);
+	muted_by = grow_bits(m->muted_by, m->size, new_size);
+	if (mutes == NULL || muted_by == NULL) {
+		free(mutes);
+		free(muted_by);
+		return 0;
+	}
+	free(m->mutes);
+	free(m->muted_by);
+	m->mutes = mutes;
+	m->muted_by = muted_by;
+	m->size = new_size;
+	m->words = new_size / 64;
+	return 1;
+}
+
+/**
+ * Record that a player muted another one.
+ *
+ * @param m the matrix
+ * @param by the public ID of the player who muted
+ * @param tgt the public ID of the muted player
+ *
+ * @return 1 if it was not muted yet, 0 if it was or on failure
+ */
+int mute_set(struct mute_matrix *m, uint32_t by, uint32_t tgt)
+{
+	uint64_t *w;
+	int res = 0;
+
+	if (by == 0 || tgt == 0)
+		return 0;
+	pthread_mutex_lock(&m->lock);
+	if ((by > m->size || tgt > m->size) && !mute_grow(m, by > tgt ? by : tgt)) {
+		pthread_mutex_unlock(&m->lock);
+		return 0;
+	}
+	by--; tgt--;	/* ID start at 1 */
+	w = &m->mutes[by * m->words + tgt / 64];
+	if (!(*w & BIT(tgt))) {
+		*w |= BIT(tgt);
+		m->muted_by[tgt * m->words + by / 64] |= BIT(by);
+		res = 1;
+	}
+	pthread_mutex_unlock(&m->lock);
+	return res;
+}
+
+/**
+ * Record that a player unmuted another one.
+ *
+ * @param m the matrix
+ * @param by the public ID of the player who unmuted
+ * @param tgt the public ID of the unmuted player
+ *
+ * @return 1 if it was muted, 0 if it was not
+ */
+int mute_clear(struct mute_matrix *m, uint32_t by, uint32_t tgt)
+{
+	uint64_t *w;
+	int res = 0;
+
+	pthread_mutex_lock(&m->lock);
+	if (by != 0 && tgt != 0 && by <= m->size && tgt <= m->size) {
+		by--; tgt--;	/* ID start at 1 */
+		w = &m->mutes[by * m->words + tgt / 64];
+		if (*w & BIT(tgt)) {
+			*w &= ~BIT(tgt);
+			m->muted_by[tgt * m->words + by / 64] &= ~BIT(by);
+			res = 1;
+		}
+	}
+	pthread_mutex_unlock(&m->lock);
+	return res;
+}
+
+/**
+ * Forget all the mutes of a player, and all the mutes of others
+ * on him, before his ID is given to someone else. Only the
+ * players he muted and the players who muted him are visited.
+ *
+ * @param m the matrix
+ * @param id the public ID of the player
+ */
+void mute_forget(struct mute_matrix *m, uint32_t id)
+{
+	uint64_t *row, bits;
+	size_t w, other;
+
+	pthread_mutex_lock(&m->lock);
+	if (id == 0 || id > m->size) {
+		pthread_mutex_unlock(&m->lock);
+		return;
+	}
+	id--;	/* ID start at 1 */
+	/* his row, and his column of the other matrix */
+	row = m->mutes + id * m->words;
+	for (w = 0 ; w < m->words ; w++) {
+		for (bits = row[w] ; bits != 0 ; bits &= bits - 1) {
+			other = w * 64 + __builtin_ctzll(bits);
+			m->muted_by[other * m->words + id / 64] &= ~BIT(id);
+		}
+		row[w] = 0;
+	}
+	row = m->muted_by + id * m->words;
+	for (w = 0 ; w < m->words ; w++) {
+		for (bits = row[w] ; bits != 0 ; bits &= bits - 1) {
+			other = w * 64 + __builtin_ctzll(bits);
+			m->mutes[other * m->words + id / 64] &= ~BIT(id);
+		}
+		row[w] = 0;
+	}
+	pthread_mutex_unlock(&m->lock);
+}
+
+/**
+ * Call a function on each player muted by a player.
+ * The matrix is locked during the calls.
+ *
+ * @param m the matrix
+ * @param by the public ID of the player
+ * @param fn the function, called with the public ID of a muted player
+ * @param arg the second argument of fn
+ */
+void mute_each(struct mute_matrix *m, uint32_t by,
+		void (*fn)(uint32_t tgt, void *arg), void *arg)
+{
+	uint64_t *row, bits;
+	size_t w;
+
+	pthread_mutex_lock(&m->lock);
+	if (by != 0 && by <= m->size) {
+		row = m->mutes + (by - 1) * m->words;
+		for (w = 0 ; w < m->words ; w++)
+			for (bits = row[w] ; bits != 0 ; bits &= bits - 1)
+				fn(w * 64 + __builtin_ctzll(bits) + 1, arg);
+	}
+	pthread_mutex_unlock(&m->lock);
+}
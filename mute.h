@@ -0,0 +1,49 @@
+/*
+ * soliloque-server, an open source implementation of the TeamSpeak protocol.
+ * Copyright (C) 2009 Hugo Camboulive <hugo.camboulive AT gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __MUTE_H__
+#define __MUTE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+/**
+ * Who muted who on a server, as two bit matrices indexed
+ * by public ID - 1 : bit j of row i of mutes is set when
+ * player i muted player j, and the same bit of row j of
+ * muted_by. Both grow with the IDs in use.
+ */
+struct mute_matrix {
+	size_t size;		/* number of rows, a multiple of 64 */
+	size_t words;		/* size of a row */
+	uint64_t *mutes;
+	uint64_t *muted_by;
+
+	pthread_mutex_t lock;
+};
+
+void mute_init(struct mute_matrix *m);
+void mute_destroy(struct mute_matrix *m);
+int mute_set(struct mute_matrix *m, uint32_t by, uint32_t tgt);
+int mute_clear(struct mute_matrix *m, uint32_t by, uint32_t tgt);
+void mute_forget(struct mute_matrix *m, uint32_t id);
+void mute_each(struct mute_matrix *m, uint32_t by,
+		void (*fn)(uint32_t tgt, void *arg), void *arg);
+
+#endif
@@ -0,0 +1,59 @@
+/*
+ * soliloque-server, an open source implementation of the TeamSpeak protocol.
+ * Copyright (C) 2009 Hugo Camboulive <hugo.camboulive AT gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "net_backend.h"
+#include "server.h"
+#include "server_stat.h"
+#include "send_batch.h"
+#include "control_worker.h"
+#include "configuration.h"
+#include "config.h"
+
+/**
+ * Retrieve the backend configured with net.backend.
+ *
+ * @param type NET_BACKEND_POLL or NET_BACKEND_URING
+ *
+ * @return the backend
+ */
+const struct net_backend *net_backend_get(int type)
+{
+#ifdef HAVE_IO_URING
+	if (type == NET_BACKEND_URING)
+		return &net_uring_backend;
+#endif
+	return &net_poll_backend;
+}
+
+/**
+ * What every backend does after having dispatched a batch
+ * of datagrams : account for the batch, send the audio
+ * forwarded in the pass and hand the rest over.
+ *
+ * @param rcv the receiver
+ * @param nb the number of datagrams in the batch
+ * @param queued set if datagrams were queued for the control worker
+ */
+void net_end_pass(struct receiver *rcv, unsigned int nb, int queued)
+{
+	if (nb > 0)
+		sstat_add_rx_batch(rcv->s->stats, nb);
+	sb_flush();
+	if (queued)
+		ctl_worker_wakeup(rcv->s);
+}
@@ -0,0 +1,50 @@
+/*
+ * soliloque-server, an open source implementation of the TeamSpeak protocol.
+ * Copyright (C) 2009 Hugo Camboulive <hugo.camboulive AT gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __NET_BACKEND_H__
+#define __NET_BACKEND_H__
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+struct receiver;
+
+/* largest datagram read from the network */
+#define NET_MAX_MSG 1024
+
+/**
+ * A way of receiving datagrams. Each receiver is driven
+ * by one backend, in its own thread.
+ */
+struct net_backend {
+	const char *name;
+	/* allocate what the receiver needs, in the calling thread */
+	int (*init)(struct receiver *rcv);
+	/* thread function : receive and dispatch datagrams forever */
+	void *(*run)(void *rcv);
+	/* free what init allocated, the thread must be stopped */
+	void (*destroy)(struct receiver *rcv);
+};
+
+extern const struct net_backend net_poll_backend;
+extern const struct net_backend net_uring_backend;
+
+const struct net_backend *net_backend_get(int type);
+void net_end_pass(struct receiver *rcv, unsigned int nb, int queued);
+
+#endif
@@ -0,0 +1,176 @@
+/*
+ * soliloque-server, an open source implementation of the TeamSpeak protocol.
+ * Copyright (C) 2009 Hugo Camboulive <hugo.camboulive AT gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "net_backend.h"
+#include "server.h"
+#include "main_serv.h"
+#include "voice_plane.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <poll.h>
+#include <netinet/in.h>
+
+/**
+ * Preallocated buffers used to read a batch of datagrams
+ * with a single recvmmsg() call.
+ */
+struct recv_ring {
+	unsigned int size;	/* number of slots */
+	struct pollfd socket_poll;
+	char *bufs;		/* size * NET_MAX_MSG bytes */
+	struct mmsghdr *msgs;
+	struct iovec *iovs;
+	struct sockaddr_in *addrs;
+};
+
+static void poll_destroy(struct receiver *rcv)
+{
+	struct recv_ring *r = (struct recv_ring *)rcv->backend_data;
+
+	if (r == NULL)
+		return;
+	free(r->bufs);
+	free(r->msgs);
+	free(r->iovs);
+	free(r->addrs);
+	free(r);
+	rcv->backend_data = NULL;
+}
+
+/**
+ * Allocate the receive ring of a receiver : one NET_MAX_MSG buffer
+ * per datagram we can read with a single recvmmsg().
+ *
+ * @param rcv the receiver
+ *
+ * @return 1 on success, 0 on failure
+ */
+static int poll_init(struct receiver *rcv)
+{
+	struct recv_ring *r;
+	unsigned int size = rcv->s->conf->net.recv_batch;
+
+	r = (struct recv_ring *)calloc(1, sizeof(struct recv_ring));
+	if (r == NULL) {
+		logger(LOG_ERR, "poll_init, allocation failed : %s.", strerror(errno));
+		return 0;
+	}
+	rcv->backend_data = r;
+	r->size = size;
+	r->bufs = (char *)calloc(size, NET_MAX_MSG);
+	r->msgs = (struct mmsghdr *)calloc(size, sizeof(struct mmsghdr));
+	r->iovs = (struct iovec *)calloc(size, sizeof(struct iovec));
+	r->addrs = (struct sockaddr_in *)calloc(size, sizeof(struct sockaddr_in));
+	if (r->bufs == NULL || r->msgs == NULL || r->iovs == NULL || r->addrs == NULL) {
+		logger(LOG_ERR, "poll_init, allocation failed : %s.", strerror(errno));
+		poll_destroy(rcv);
+		return 0;
+	}
+	/* initialize for polling */
+	r->socket_poll.fd = rcv->socket_desc;
+	r->socket_poll.events = POLLIN;
+	r->socket_poll.revents = 0;
+	return 1;
+}
+
+/**
+ * Read as many datagrams as possible (up to the size of the ring)
+ * with one recvmmsg() call, forward the audio ones and queue the
+ * others for the control worker.
+ *
+ * @param rcv the receiver
+ *
+ * @return the number of datagrams read, or -1 on error
+ */
+static int poll_recv_batch(struct receiver *rcv)
+{
+	struct recv_ring *r = (struct recv_ring *)rcv->backend_data;
+	unsigned int i;
+	int n, queued = 0;
+
+	/* the kernel overwrites the lengths, reset them */
+	for (i = 0 ; i < r->size ; i++) {
+		r->iovs[i].iov_base = r->bufs + i * NET_MAX_MSG;
+		r->iovs[i].iov_len = NET_MAX_MSG;
+		r->msgs[i].msg_hdr.msg_iov = &r->iovs[i];
+		r->msgs[i].msg_hdr.msg_iovlen = 1;
+		r->msgs[i].msg_hdr.msg_name = &r->addrs[i];
+		r->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+	}
+
+	n = recvmmsg(rcv->socket_desc, r->msgs, r->size, MSG_DONTWAIT, NULL);
+	if (n == -1) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			logger(LOG_ERR, "poll_recv_batch : %s", strerror(errno));
+		return -1;
+	}
+
+	for (i = 0 ; i < (unsigned int)n ; i++) {
+		logger(LOG_INFO, "%i bytes received.", r->msgs[i].msg_len);
+		queued |= dispatch_packet(r->iovs[i].iov_base, r->msgs[i].msg_len, &r->addrs[i],
+				r->msgs[i].msg_hdr.msg_namelen, rcv);
+	}
+	net_end_pass(rcv, n, queued);
+	return n;
+}
+
+/**
+ * Receive loop of the poll backend : wait for the socket
+ * to be readable, then drain it with recvmmsg().
+ *
+ * @param args the receiver
+ */
+static void *poll_run(void *args)
+{
+	struct receiver *rcv = (struct receiver *)args;
+	struct server *s = rcv->s;
+	struct recv_ring *r = (struct recv_ring *)rcv->backend_data;
+	struct voice_reader *reader = &s->voice.readers[rcv->idx];
+	int pollres;
+
+	while (1) {
+		/* do not hold back the reclamation of snapshots while blocked */
+		voice_offline(reader);
+		pollres = poll(&r->socket_poll, 1, -1);
+		voice_quiescent(&s->voice, reader);
+		switch(pollres) {
+		case 0:
+			logger(LOG_ERR, "Time limit expired");
+			break;
+		case -1:
+			logger(LOG_ERR, "Error occured while polling : %s", strerror(errno));
+			break;
+		default:
+			/* drain the socket before polling again */
+			while (poll_recv_batch(rcv) == (int)r->size)
+				voice_quiescent(&s->voice, reader);
+		}
+	}
+	return NULL;
+}
+
+const struct net_backend net_poll_backend = {
+	.name = "poll",
+	.init = poll_init,
+	.run = poll_run,
+	.destroy = poll_destroy,
+};
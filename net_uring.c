@@ -0,0 +1,540 @@
+/*
+ * soliloque-server, an open source implementation of the TeamSpeak protocol.
+ * Copyright (C) 2009 Hugo Camboulive <hugo.camboulive AT gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#ifdef HAVE_IO_URING
+
+#include "net_backend.h"
+#include "server.h"
+#include "main_serv.h"
+#include "voice_plane.h"
+#include "send_batch.h"
+#include "log.h"
+#include "compat.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <linux/io_uring.h>
+
+/* number of buffers the kernel picks from to store datagrams */
+#define URING_NB_BUFS 512
+/* a datagram, its address and the header describing them */
+#define URING_BUF_SIZE 2048
+/* entries of the receive ring */
+#define URING_SQ_SIZE 8
+#define URING_CQ_SIZE 1024
+/* the group of the provided buffers */
+#define URING_BGID 0
+
+/**
+ * An io_uring and its mappings.
+ */
+struct uring {
+	int fd;
+	unsigned int sq_entries, cq_entries;
+	void *sq_map, *cq_map;
+	size_t sq_map_len, cq_map_len;
+	struct io_uring_sqe *sqes;
+	size_t sqes_len;
+
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	int fixed_fd;		/* socket registered at index 0, or -1 */
+};
+
+/**
+ * What a receiver using io_uring needs.
+ */
+struct uring_rx {
+	struct uring ring;
+	/* provided buffers : the kernel picks one for each datagram */
+	struct io_uring_buf_ring *br;
+	char *bufs;
+	unsigned short br_tail;
+	/* template of the multishot recvmsg, only the lengths are used */
+	struct msghdr msg;
+	int armed;		/* the multishot recvmsg is active */
+	/* the sends of the receive thread */
+	struct uring tx;
+};
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+		unsigned int flags)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args)
+{
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_close(struct uring *u)
+{
+	if (u->sqes != NULL && u->sqes != MAP_FAILED)
+		munmap(u->sqes, u->sqes_len);
+	if (u->cq_map != NULL && u->cq_map != MAP_FAILED && u->cq_map != u->sq_map)
+		munmap(u->cq_map, u->cq_map_len);
+	if (u->sq_map != NULL && u->sq_map != MAP_FAILED)
+		munmap(u->sq_map, u->sq_map_len);
+	if (u->fd >= 0)
+		close(u->fd);
+	bzero(u, sizeof(struct uring));
+	u->fd = -1;
+}
+
+/**
+ * Create an io_uring and map its rings, then register
+ * the socket so that the requests skip the file lookup.
+ *
+ * @param u the ring
+ * @param sq_size the number of submission entries
+ * @param cq_size the number of completion entries
+ * @param sock the socket
+ *
+ * @return 1 on success, 0 on failure (errno is set)
+ */
+static int uring_open(struct uring *u, unsigned int sq_size, unsigned int cq_size, int sock)
+{
+	struct io_uring_params p;
+	int err;
+
+	bzero(u, sizeof(struct uring));
+	bzero(&p, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+	p.cq_entries = cq_size;
+	u->fd = sys_io_uring_setup(sq_size, &p);
+	if (u->fd < 0 && errno == EINVAL) {
+		/* older kernel, without cooperative task running */
+		p.flags &= ~IORING_SETUP_COOP_TASKRUN;
+		u->fd = sys_io_uring_setup(sq_size, &p);
+	}
+	if (u->fd < 0)
+		return 0;
+	u->sq_entries = p.sq_entries;
+	u->cq_entries = p.cq_entries;
+
+	u->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	u->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_map_len > u->sq_map_len)
+			u->sq_map_len = u->cq_map_len;
+		u->cq_map_len = u->sq_map_len;
+	}
+	u->sq_map = mmap(NULL, u->sq_map_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_map == MAP_FAILED)
+		goto fail;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		u->cq_map = u->sq_map;
+	} else {
+		u->cq_map = mmap(NULL, u->cq_map_len, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+		if (u->cq_map == MAP_FAILED)
+			goto fail;
+	}
+	u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = (struct io_uring_sqe *)mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED)
+		goto fail;
+
+	u->sq_head = (unsigned int *)((char *)u->sq_map + p.sq_off.head);
+	u->sq_tail = (unsigned int *)((char *)u->sq_map + p.sq_off.tail);
+	u->sq_mask = (unsigned int *)((char *)u->sq_map + p.sq_off.ring_mask);
+	u->sq_array = (unsigned int *)((char *)u->sq_map + p.sq_off.array);
+	u->cq_head = (unsigned int *)((char *)u->cq_map + p.cq_off.head);
+	u->cq_tail = (unsigned int *)((char *)u->cq_map + p.cq_off.tail);
+	u->cq_mask = (unsigned int *)((char *)u->cq_map + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)((char *)u->cq_map + p.cq_off.cqes);
+
+	/* not fatal, the requests use the descriptor instead */
+	u->fixed_fd = -1;
+	if (sys_io_uring_register(u->fd, IORING_REGISTER_FILES, &sock, 1) == 0)
+		u->fixed_fd = sock;
+	return 1;
+
+fail:
+	err = errno;
+	uring_close(u);
+	errno = err;
+	return 0;
+}
+
+/**
+ * Retrieve the next free submission entry. The caller
+ * must not queue more than sq_entries requests per submission.
+ *
+ * @param u the ring
+ * @param sock the socket the request is about
+ *
+ * @return the entry, cleared
+ */
+static struct io_uring_sqe *uring_get_sqe(struct uring *u, int sock)
+{
+	unsigned int tail = *u->sq_tail;
+	unsigned int idx = tail & *u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[idx];
+
+	bzero(sqe, sizeof(struct io_uring_sqe));
+	if (sock == u->fixed_fd) {
+		sqe->fd = 0;
+		sqe->flags = IOSQE_FIXED_FILE;
+	} else {
+		sqe->fd = sock;
+	}
+	u->sq_array[idx] = idx;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	return sqe;
+}
+
+/**
+ * Give a buffer back to the kernel. It becomes visible
+ * with the next call to uring_publish_bufs().
+ *
+ * @param rx the receiver data
+ * @param bid the ID of the buffer
+ */
+static void uring_recycle_buf(struct uring_rx *rx, unsigned short bid)
+{
+	struct io_uring_buf *buf = &rx->br->bufs[rx->br_tail & (URING_NB_BUFS - 1)];
+
+	buf->addr = (unsigned long)(rx->bufs + (size_t)bid * URING_BUF_SIZE);
+	buf->len = URING_BUF_SIZE;
+	buf->bid = bid;
+	rx->br_tail++;
+}
+
+static void uring_publish_bufs(struct uring_rx *rx)
+{
+	__atomic_store_n(&rx->br->tail, rx->br_tail, __ATOMIC_RELEASE);
+}
+
+/**
+ * Queue the multishot recvmsg : it stays active and produces
+ * one completion per datagram, until it runs out of buffers.
+ *
+ * @param rcv the receiver
+ * @param rx the receiver data
+ */
+static void uring_arm_recv(struct receiver *rcv, struct uring_rx *rx)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(&rx->ring, rcv->socket_desc);
+
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->addr = (unsigned long)&rx->msg;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags |= IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	rx->armed = 1;
+}
+
+static void uring_destroy(struct receiver *rcv)
+{
+	struct uring_rx *rx = (struct uring_rx *)rcv->backend_data;
+	struct io_uring_buf_reg reg;
+
+	if (rx == NULL)
+		return;
+	if (rx->br != NULL && rx->ring.fd >= 0) {
+		bzero(&reg, sizeof(reg));
+		reg.bgid = URING_BGID;
+		sys_io_uring_register(rx->ring.fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+	}
+	uring_close(&rx->ring);
+	uring_close(&rx->tx);
+	free(rx->br);
+	free(rx->bufs);
+	free(rx);
+	rcv->backend_data = NULL;
+}
+
+/**
+ * Create the io_uring of a receiver and register its buffers.
+ * If io_uring is not usable, the receiver uses poll instead.
+ *
+ * @param rcv the receiver
+ *
+ * @return 1 on success, 0 on failure
+ */
+static int uring_init(struct receiver *rcv)
+{
+	struct uring_rx *rx;
+	struct io_uring_buf_reg reg;
+	unsigned int i;
+
+	rx = (struct uring_rx *)calloc(1, sizeof(struct uring_rx));
+	if (rx == NULL) {
+		logger(LOG_ERR, "uring_init, allocation failed : %s.", strerror(errno));
+		return 0;
+	}
+	rcv->backend_data = rx;
+	rx->tx.fd = -1;
+	if (!uring_open(&rx->ring, URING_SQ_SIZE, URING_CQ_SIZE, rcv->socket_desc)) {
+		logger(LOG_WARN, "uring_init, io_uring is not available : %s.", strerror(errno));
+		goto fallback;
+	}
+	/* the buffer ring has to be page aligned */
+	if (posix_memalign((void **)&rx->br, sysconf(_SC_PAGESIZE),
+				URING_NB_BUFS * sizeof(struct io_uring_buf)) != 0
+			|| posix_memalign((void **)&rx->bufs, 64, (size_t)URING_NB_BUFS * URING_BUF_SIZE) != 0) {
+		logger(LOG_ERR, "uring_init, allocation failed.");
+		uring_destroy(rcv);
+		return 0;
+	}
+	bzero(rx->br, URING_NB_BUFS * sizeof(struct io_uring_buf));
+	bzero(&reg, sizeof(reg));
+	reg.ring_addr = (unsigned long)rx->br;
+	reg.ring_entries = URING_NB_BUFS;
+	reg.bgid = URING_BGID;
+	if (sys_io_uring_register(rx->ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+		logger(LOG_WARN, "uring_init, could not register the buffers : %s.", strerror(errno));
+		goto fallback;
+	}
+	for (i = 0 ; i < URING_NB_BUFS ; i++)
+		uring_recycle_buf(rx, i);
+	uring_publish_bufs(rx);
+
+	/* room for the address of the sender in front of each datagram */
+	rx->msg.msg_namelen = sizeof(struct sockaddr_in);
+	rx->msg.msg_controllen = 0;
+	return 1;
+
+fallback:
+	uring_destroy(rcv);
+	logger(LOG_WARN, "Server %i : receiver %u falls back to the poll backend.", rcv->s->id, rcv->idx);
+	rcv->backend = &net_poll_backend;
+	return rcv->backend->init(rcv);
+}
+
+/**
+ * Send a batch with one SENDMSG request per datagram and a
+ * single system call. Every request is completed when this
+ * returns, so the batch can be reused.
+ * If the ring fails, the thread goes back to sendmmsg() : the
+ * requests already submitted are left to the kernel, the others
+ * are sent by the next call of sb_flush().
+ *
+ * @param ctx the send ring of the thread
+ * @param sock the socket
+ * @param msgs the datagrams
+ * @param n the number of datagrams
+ * @param done set to the number of datagrams completed or submitted
+ *
+ * @return the number of datagrams sent
+ */
+static int uring_sendmmsg(void *ctx, int sock, struct mmsghdr *msgs, unsigned int n,
+		unsigned int *done)
+{
+	struct uring *u = (struct uring *)ctx;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	unsigned int i, head, tail, submitted = 0, completed = 0;
+	int ret, nb_sent = 0;
+
+	if (n > u->sq_entries)
+		n = u->sq_entries;
+	for (i = 0 ; i < n ; i++) {
+		sqe = uring_get_sqe(u, sock);
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->addr = (unsigned long)&msgs[i].msg_hdr;
+		sqe->user_data = i;
+	}
+	while (completed < n) {
+		ret = sys_io_uring_enter(u->fd, n - submitted, n - completed, IORING_ENTER_GETEVENTS);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			/* requests may be stuck in the ring : stop using it,
+			 * and do not send the submitted ones a second time */
+			logger(LOG_ERR, "uring_sendmmsg, io_uring_enter failed : %s.", strerror(errno));
+			sb_set_transport(NULL, NULL);
+			*done = submitted;
+			return nb_sent;
+		}
+		submitted += ret;
+		head = *u->cq_head;
+		tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+		for ( ; head != tail ; head++, completed++) {
+			cqe = &u->cqes[head & *u->cq_mask];
+			if (cqe->res < 0) {
+				logger(LOG_WARN, "uring_sendmmsg, datagram not sent : %s.", strerror(-cqe->res));
+			} else {
+				msgs[cqe->user_data].msg_len = cqe->res;
+				nb_sent++;
+			}
+		}
+		__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+	}
+	*done = n;
+	return nb_sent;
+}
+
+/**
+ * Handle one completion of the multishot recvmsg.
+ *
+ * @param rcv the receiver
+ * @param rx the receiver data
+ * @param cqe the completion
+ * @param queued set if the datagram was queued for the control worker
+ *
+ * @return 1 if a datagram was received, 0 otherwise
+ */
+static int uring_handle_cqe(struct receiver *rcv, struct uring_rx *rx,
+		struct io_uring_cqe *cqe, int *queued)
+{
+	struct io_uring_recvmsg_out *out;
+	unsigned short bid;
+	char *buf, *data;
+	int ret = 0;
+
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		rx->armed = 0;
+	if (cqe->res < 0) {
+		/* ENOBUFS : the datagrams came faster than we gave the buffers back */
+		if (cqe->res != -ENOBUFS)
+			logger(LOG_ERR, "uring_handle_cqe : %s", strerror(-cqe->res));
+		return 0;
+	}
+	if (!(cqe->flags & IORING_CQE_F_BUFFER))
+		return 0;
+	bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	buf = rx->bufs + (size_t)bid * URING_BUF_SIZE;
+	out = (struct io_uring_recvmsg_out *)buf;
+	data = buf + sizeof(struct io_uring_recvmsg_out) + rx->msg.msg_namelen + rx->msg.msg_controllen;
+	if (out->flags & MSG_TRUNC) {
+		logger(LOG_INFO, "uring_handle_cqe : datagram too long, dropped.");
+	} else {
+		logger(LOG_INFO, "%i bytes received.", out->payloadlen);
+		*queued |= dispatch_packet(data, out->payloadlen,
+				(struct sockaddr_in *)(out + 1),
+				MIN(out->namelen, rx->msg.msg_namelen), rcv);
+		ret = 1;
+	}
+	/* the data has been forwarded or copied */
+	uring_recycle_buf(rx, bid);
+	return ret;
+}
+
+/**
+ * Replace the io_uring backend by the poll one in the
+ * receive thread, after a fatal error.
+ *
+ * @param rcv the receiver
+ */
+static void *uring_fall_back(struct receiver *rcv)
+{
+	sb_flush();
+	sb_set_transport(NULL, NULL);
+	uring_destroy(rcv);
+	logger(LOG_WARN, "Server %i : receiver %u falls back to the poll backend.", rcv->s->id, rcv->idx);
+	rcv->backend = &net_poll_backend;
+	if (!rcv->backend->init(rcv))
+		return NULL;
+	return rcv->backend->run(rcv);
+}
+
+/**
+ * Receive loop of the io_uring backend : a single multishot
+ * recvmsg fills the provided buffers, and each pass handles
+ * every completion before waiting with one system call.
+ *
+ * @param args the receiver
+ */
+static void *uring_run(void *args)
+{
+	struct receiver *rcv = (struct receiver *)args;
+	struct server *s = rcv->s;
+	struct uring_rx *rx = (struct uring_rx *)rcv->backend_data;
+	struct voice_reader *reader = &s->voice.readers[rcv->idx];
+	struct io_uring_cqe *cqe;
+	unsigned int head, tail, nb;
+	int ret, old, queued, to_submit, received_once = 0;
+
+	/* the sends of this thread go through their own ring */
+	if (uring_open(&rx->tx, SB_MAX_MSGS, 2 * SB_MAX_MSGS, s->socket_desc))
+		sb_set_transport(uring_sendmmsg, &rx->tx);
+	else
+		logger(LOG_WARN, "uring_run, no send ring, using sendmmsg : %s.", strerror(errno));
+
+	uring_arm_recv(rcv, rx);
+	to_submit = 1;
+	while (1) {
+		/* do not hold back the reclamation of snapshots while blocked */
+		voice_offline(reader);
+		/* io_uring_enter() is not a cancellation point */
+		pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, &old);
+		ret = sys_io_uring_enter(rx->ring.fd, to_submit, 1, IORING_ENTER_GETEVENTS);
+		pthread_setcanceltype(old, NULL);
+		voice_quiescent(&s->voice, reader);
+		if (ret < 0) {
+			if (errno != EINTR) {
+				logger(LOG_ERR, "uring_run, io_uring_enter failed : %s", strerror(errno));
+				break;
+			}
+			ret = 0;
+		}
+		to_submit -= ret;
+
+		nb = 0;
+		queued = 0;
+		head = *rx->ring.cq_head;
+		tail = __atomic_load_n(rx->ring.cq_tail, __ATOMIC_ACQUIRE);
+		for ( ; head != tail ; head++) {
+			cqe = &rx->ring.cqes[head & *rx->ring.cq_mask];
+			/* multishot recvmsg not supported by this kernel */
+			if (cqe->res == -EINVAL && !received_once)
+				return uring_fall_back(rcv);
+			nb += uring_handle_cqe(rcv, rx, cqe, &queued);
+		}
+		__atomic_store_n(rx->ring.cq_head, head, __ATOMIC_RELEASE);
+		if (nb > 0)
+			received_once = 1;
+		uring_publish_bufs(rx);
+		net_end_pass(rcv, nb, queued);
+
+		if (!rx->armed) {
+			uring_arm_recv(rcv, rx);
+			to_submit++;
+		}
+	}
+	return uring_fall_back(rcv);
+}
+
+const struct net_backend net_uring_backend = {
+	.name = "io_uring",
+	.init = uring_init,
+	.run = uring_run,
+	.destroy = uring_destroy,
+};
+
+#endif /* HAVE_IO_URING */
@@ -0,0 +1,311 @@
+/*
+ * soliloque-server, an open source implementation of the TeamSpeak protocol.
+ * Copyright (C) 2009 Hugo Camboulive <hugo.camboulive AT gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "packet_pool.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+/* class of the buffers too large for the pool */
+#define PKT_LARGE 0xFF
+
+/**
+ * Header in front of every buffer. The data that follows
+ * is aligned on 16 bytes.
+ */
+struct pkt_hdr {
+	struct pkt_hdr *next;	/* next free buffer of the class */
+	uint32_t cls;		/* size class, or PKT_LARGE */
+	uint32_t pad;
+};
+
+struct pkt_list {
+	struct pkt_hdr *first;
+	unsigned int nb;
+};
+
+/**
+ * Free buffers of a thread. Only that thread touches
+ * the lists, the counters are read by pkt_pool_stats().
+ */
+struct pkt_cache {
+	struct pkt_list free[PKT_POOL_CLASSES];
+	uint64_t hits;		/* allocations served without the heap */
+	uint64_t misses;	/* allocations that went to the heap */
+	struct pkt_cache *prev, *next;
+};
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+/* buffers given back by threads that had too many, or exited */
+static struct pkt_list depot[PKT_POOL_CLASSES];
+static struct pkt_cache *caches = NULL;
+/* counters of the threads that exited */
+static uint64_t old_hits = 0, old_misses = 0;
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+static __thread struct pkt_cache *my_cache = NULL;
+
+static unsigned int size_class(size_t len)
+{
+	unsigned int cls = 0;
+
+	while (((size_t)1 << (PKT_POOL_MIN_SHIFT + cls)) < len)
+		cls++;
+	return cls;
+}
+
+/**
+ * Move some buffers of a list to the depot, or to the
+ * heap if the depot is full. The mutex must be held.
+ *
+ * @param l the list
+ * @param cls its size class
+ * @param nb the number of buffers to move
+ */
+static void give_to_depot(struct pkt_list *l, unsigned int cls, unsigned int nb)
+{
+	struct pkt_hdr *h;
+
+	while (nb-- > 0 && (h = l->first) != NULL) {
+		l->first = h->next;
+		l->nb--;
+		if (depot[cls].nb < PKT_POOL_DEPOT) {
+			h->next = depot[cls].first;
+			depot[cls].first = h;
+			depot[cls].nb++;
+		} else {
+			free(h);
+		}
+	}
+}
+
+/**
+ * Called when a thread exits : its free buffers go to
+ * the depot, its counters to the totals.
+ */
+static void cache_release(void *ptr)
+{
+	struct pkt_cache *c = (struct pkt_cache *)ptr;
+	unsigned int i;
+
+	pthread_mutex_lock(&mutex);
+	for (i = 0 ; i < PKT_POOL_CLASSES ; i++)
+		give_to_depot(&c->free[i], i, c->free[i].nb);
+	old_hits += c->hits;
+	old_misses += c->misses;
+	if (c->prev != NULL)
+		c->prev->next = c->next;
+	else
+		caches = c->next;
+	if (c->next != NULL)
+		c->next->prev = c->prev;
+	pthread_mutex_unlock(&mutex);
+	free(c);
+	my_cache = NULL;
+}
+
+static void pool_init(void)
+{
+	pthread_key_create(&cache_key, cache_release);
+}
+
+/**
+ * Retrieve the cache of the current thread, creating it
+ * the first time.
+ *
+ * @return the cache, or NULL if the allocation failed
+ */
+static struct pkt_cache *get_cache(void)
+{
+	struct pkt_cache *c;
+
+	if (my_cache != NULL)
+		return my_cache;
+	pthread_once(&init_once, pool_init);
+	c = (struct pkt_cache *)calloc(1, sizeof(struct pkt_cache));
+	if (c == NULL) {
+		logger(LOG_ERR, "get_cache, calloc failed : %s.", strerror(errno));
+		return NULL;
+	}
+	pthread_mutex_lock(&mutex);
+	c->next = caches;
+	if (caches != NULL)
+		caches->prev = c;
+	caches = c;
+	pthread_mutex_unlock(&mutex);
+	pthread_setspecific(cache_key, c);
+	my_cache = c;
+	return c;
+}
+
+/**
+ * Take up to half a cache of buffers from the depot.
+ *
+ * @param l the list of the thread
+ * @param cls the size class
+ */
+static void take_from_depot(struct pkt_list *l, unsigned int cls)
+{
+	struct pkt_hdr *h;
+	unsigned int nb = PKT_POOL_CACHE / 2;
+
+	if (__atomic_load_n(&depot[cls].nb, __ATOMIC_RELAXED) == 0)
+		return;
+	pthread_mutex_lock(&mutex);
+	while (nb-- > 0 && (h = depot[cls].first) != NULL) {
+		depot[cls].first = h->next;
+		depot[cls].nb--;
+		h->next = l->first;
+		l->first = h;
+		l->nb++;
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * Take a buffer from the pool of the current thread,
+ * or from the heap if the pool is empty.
+ *
+ * @param len the size of the packet
+ *
+ * @return the buffer, uninitialized, or NULL if the allocation failed
+ */
+static void *pool_get(size_t len)
+{
+	struct pkt_cache *c = get_cache();
+	struct pkt_list *l;
+	struct pkt_hdr *h = NULL;
+	unsigned int cls;
+
+	if (len > PKT_POOL_MAX_SIZE) {
+		cls = PKT_LARGE;
+	} else {
+		cls = size_class(len);
+		if (c != NULL) {
+			l = &c->free[cls];
+			if (l->first == NULL)
+				take_from_depot(l, cls);
+			if ((h = l->first) != NULL) {
+				l->first = h->next;
+				l->nb--;
+				__atomic_store_n(&c->hits, c->hits + 1, __ATOMIC_RELAXED);
+				return h + 1;
+			}
+		}
+	}
+	h = (struct pkt_hdr *)malloc(sizeof(struct pkt_hdr)
+			+ (cls == PKT_LARGE ? len : (size_t)1 << (PKT_POOL_MIN_SHIFT + cls)));
+	if (h == NULL) {
+		logger(LOG_ERR, "pool_get, malloc failed : %s.", strerror(errno));
+		return NULL;
+	}
+	h->cls = cls;
+	if (c != NULL)
+		__atomic_store_n(&c->misses, c->misses + 1, __ATOMIC_RELAXED);
+	return h + 1;
+}
+
+/**
+ * Allocate a buffer to build a packet in, from the pool of
+ * the current thread if possible. Like calloc(), the buffer
+ * is zeroed. It must be freed with pkt_free(), by any thread.
+ *
+ * @param len the size of the packet
+ *
+ * @return the buffer, or NULL if the allocation failed
+ */
+void *pkt_alloc(size_t len)
+{
+	void *buf = pool_get(len);
+
+	if (buf != NULL)
+		bzero(buf, len);
+	return buf;
+}
+
+/**
+ * Copy a packet into a buffer of the pool.
+ *
+ * @param buf the packet
+ * @param len the size of the packet
+ *
+ * @return the copy, or NULL if the allocation failed
+ */
+void *pkt_dup(const void *buf, size_t len)
+{
+	void *copy = pool_get(len);
+
+	if (copy != NULL)
+		memcpy(copy, buf, len);
+	return copy;
+}
+
+/**
+ * Give a buffer back to the pool of the current thread.
+ *
+ * @param buf the buffer, allocated with pkt_alloc() (can be NULL)
+ */
+void pkt_free(void *buf)
+{
+	struct pkt_hdr *h;
+	struct pkt_cache *c;
+	struct pkt_list *l;
+
+	if (buf == NULL)
+		return;
+	h = (struct pkt_hdr *)buf - 1;
+	c = get_cache();
+	if (h->cls == PKT_LARGE || c == NULL) {
+		free(h);
+		return;
+	}
+	l = &c->free[h->cls];
+	h->next = l->first;
+	l->first = h;
+	l->nb++;
+	/* keep half of them for the next packets */
+	if (l->nb > PKT_POOL_CACHE) {
+		pthread_mutex_lock(&mutex);
+		give_to_depot(l, h->cls, PKT_POOL_CACHE / 2);
+		pthread_mutex_unlock(&mutex);
+	}
+}
+
+/**
+ * Retrieve the counters of the pool, for all the threads.
+ *
+ * @param hits the number of allocations served by the pool
+ * @param misses the number of allocations that went to the heap
+ */
+void pkt_pool_stats(uint64_t *hits, uint64_t *misses)
+{
+	struct pkt_cache *c;
+
+	pthread_mutex_lock(&mutex);
+	*hits = old_hits;
+	*misses = old_misses;
+	for (c = caches ; c != NULL ; c = c->next) {
+		*hits += __atomic_load_n(&c->hits, __ATOMIC_RELAXED);
+		*misses += __atomic_load_n(&c->misses, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&mutex);
+}
@@ -0,0 +1,39 @@
+/*
+ * soliloque-server, an open source implementation of the TeamSpeak protocol.
+ * Copyright (C) 2009 Hugo Camboulive <hugo.camboulive AT gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __PACKET_POOL_H__
+#define __PACKET_POOL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* size classes of the pool : 64, 128, ... 4096 bytes */
+#define PKT_POOL_MIN_SHIFT 6
+#define PKT_POOL_CLASSES 7
+#define PKT_POOL_MAX_SIZE (1 << (PKT_POOL_MIN_SHIFT + PKT_POOL_CLASSES - 1))
+/* free buffers a thread keeps per class before giving some to the depot */
+#define PKT_POOL_CACHE 64
+/* free buffers the depot keeps per class before giving them to the heap */
+#define PKT_POOL_DEPOT 1024
+
+void *pkt_alloc(size_t len);
+void *pkt_dup(const void *buf, size_t len);
+void pkt_free(void *buf);
+void pkt_pool_stats(uint64_t *hits, uint64_t *misses);
+
+#endif
@@ -24,111 +24,316 @@
 #include "server_stat.h"
 #include "packet_tools.h"
 #include "control_packet.h"
+#include "send_batch.h"
+#include "packet_pool.h"
 
 #include <pthread.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <strings.h>
+#include <stdint.h>
 
-static void send_curr_packet(struct player *p, struct server *s)
+/**
+ * Send (or resend) one packet of a player's queue.
+ *
+ * @param p the player
+ * @param q_e the container of the packet
+ * @param s the server
+ */
+static void send_packet(struct player *p, struct q_elem *q_e, struct server *s)
+{
+	char *packet = (char *)q_e->elem;
+	uint16_t version;
+
+	gettimeofday(&q_e->last_sent, NULL);
+	q_e->version++;
+	/* add packet to server statistics */
+	sstat_add_packet(s->stats, q_e->size, 1);
+	logger(LOG_INFO, "Really sending packet type 0x%x", *(uint32_t *)packet);
+	sb_send(s, packet, q_e->size, p->cli_addr, p->cli_len);
+	/* update packet version counter, and patch the checksum */
+	memcpy(&version, packet + 16, 2);
+	version = GUINT16_TO_LE(GUINT16_FROM_LE(version) + 1);
+	packet_patch_crc(packet, q_e->size, 20, 16, &version, 2);
+}
+
+/**
+ * Send the packets of the send window of a player that were
+ * never sent, and resend those that have not been acknowledged
+ * within 0.5s.
+ * NB : the queue mutex has to be locked MANUALLY.
+ *
+ * @param p the player
+ * @param s the server
+ * @param delay set to the number of ms before the next retransmission,
+ * 	or -1 if there is nothing waiting for an acknowledgement
+ *
+ * @return 1 if a packet has been resent too many times, 0 else
+ */
+static int send_window(struct player *p, struct server *s, int64_t *delay)
+{
+	struct q_elem *q_e;
+	struct timeval now, diff;
+	int64_t remaining;
+	int i;
+
+	gettimeofday(&now, NULL);
+	*delay = -1;
+	for (i = 0 ; i < s->conf->net.send_window && (q_e = queue_at(&p->packets, i)) != NULL ; i++) {
+		if (q_e->version > 50)
+			return 1;
+		if (timerisset(&q_e->last_sent)) {
+			timersub(&now, &q_e->last_sent, &diff);
+			remaining = 500 - ((int64_t)diff.tv_sec * 1000 + diff.tv_usec / 1000);
+		} else {
+			remaining = 0;
+		}
+		if (remaining <= 0) {
+			send_packet(p, q_e, s);
+			remaining = 500;
+		}
+		if (*delay == -1 || remaining < *delay)
+			*delay = remaining;
+	}
+	return 0;
+}
+
+/**
+ * A player stopped answering : notify everyone and remove
+ * him if he was still active, or give up on its last packets
+ * if he was already leaving.
+ *
+ * @param s the server
+ * @param p the player
+ */
+static void player_timed_out(struct server *s, struct player *p)
 {
 	char *packet;
-	size_t p_size;
-	int ret;
-
-	packet = peek_at_queue(p->packets);
-	if (packet != NULL) {
-		p_size = peek_at_size(p->packets);
-
-		/* add packet to server statistics */
-		sstat_add_packet(s->stats, p_size, 1);
-		logger(LOG_INFO, "Really sending packet type 0x%x", *(uint32_t *)packet);
-		ret = sendto(s->socket_desc, packet, p_size, 0,
-				(struct sockaddr *)p->cli_addr, p->cli_len);
-		if (ret == -1)
-			logger(LOG_WARN, "send_curr_packet failed : %s", strerror(errno));
-		/* update packet version counter */
-		(*(uint16_t *)(packet + 16))++;
-		/* update checksum */
-		packet_add_crc_d(packet, p_size);
+
+	if (p->in_chan != NULL) {
+		logger(LOG_INFO, "Player 0x%x seems to have timed out, removing him", p);
+		/* do whateverittakes to notify that the player has left */
+		s_notify_player_left(p);
+		/* then remove him */
+		remove_player(s, p);
+	} else {
+		/* player is marked as leaving - we empty
+		 * his queue so he will be removed */
+		logger(LOG_INFO, "Emptying the player 0x%x 's packet queue.", p);
+		pthread_mutex_lock(&p->packets.mutex);
+		while ((packet = get_from_queue(&p->packets))) {
+			pkt_free(packet);
+		}
+		pthread_mutex_unlock(&p->packets.mutex);
+		logger(LOG_INFO, "Queue empty.", p);
+		destroy_leaving_player(s, p);
+	}
+}
+
+/**
+ * Called when the resend timer of a player fires : send what
+ * the send window allows, re-arm the timer for the next
+ * retransmission, and destroy leaving players that have
+ * nothing left to send.
+ *
+ * @param owner the server
+ * @param data the player
+ */
+static void resend_timer_fired(void *owner, void *data)
+{
+	struct server *s = (struct server *)owner;
+	struct player *p = (struct player *)data;
+	int64_t delay;
+	int timed_out;
+
+	pthread_mutex_lock(&p->packets.mutex);
+	timed_out = send_window(p, s, &delay);
+	if (!timed_out && delay >= 0)
+		tw_add(&s->timers, &p->resend_timer, tw_now() + delay);
+	pthread_mutex_unlock(&p->packets.mutex);
+
+	if (timed_out)
+		player_timed_out(s, p);
+	else if (p->in_chan == NULL && p->packets.nb_elem == 0)
+		destroy_leaving_player(s, p);
+}
+
+/**
+ * Called 10s after the last keepalive we knew of : time the player
+ * out, or wait again if a keepalive has been received since.
+ *
+ * @param owner the server
+ * @param data the player
+ */
+static void timeout_timer_fired(void *owner, void *data)
+{
+	struct server *s = (struct server *)owner;
+	struct player *p = (struct player *)data;
+	struct timeval now, diff;
+	int64_t elapsed;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, &p->last_ping, &diff);
+	elapsed = (int64_t)diff.tv_sec * 1000 + diff.tv_usec / 1000;
+	if (elapsed > 10000)
+		player_timed_out(s, p);
+	else
+		tw_add(&s->timers, &p->timeout_timer, tw_now() + 10000 - elapsed + 1);
+}
+
+/**
+ * Set up the timers of a player that joined the server.
+ *
+ * @param s the server
+ * @param p the player
+ */
+void packet_sender_add_player(struct server *s, struct player *p)
+{
+	tw_init_timer(&p->resend_timer, &resend_timer_fired, p);
+	tw_init_timer(&p->timeout_timer, &timeout_timer_fired, p);
+	tw_add(&s->timers, &p->timeout_timer, tw_now() + 10001);
+}
+
+/**
+ * Stop the timers of a player that is going to be destroyed.
+ *
+ * @param s the server
+ * @param p the player
+ */
+void packet_sender_del_player(struct server *s, struct player *p)
+{
+	tw_cancel(&s->timers, &p->resend_timer);
+	tw_cancel(&s->timers, &p->timeout_timer);
+}
+
+/**
+ * Create the eventfd and timerfd the packet sender
+ * waits on, and the epoll instance watching them.
+ *
+ * @param s the server
+ *
+ * @return 1 on success, 0 on failure
+ */
+int init_packet_sender(struct server *s)
+{
+	struct epoll_event ev;
+
+	s->sender_event = eventfd(0, EFD_NONBLOCK);
+	s->sender_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	s->sender_epoll = epoll_create(2);
+	if (s->sender_event == -1 || s->sender_timer == -1 || s->sender_epoll == -1) {
+		logger(LOG_ERR, "init_packet_sender, could not create events : %s.", strerror(errno));
+		return 0;
+	}
+	bzero(&ev, sizeof(struct epoll_event));
+	ev.events = EPOLLIN;
+	ev.data.fd = s->sender_event;
+	if (epoll_ctl(s->sender_epoll, EPOLL_CTL_ADD, s->sender_event, &ev) == -1) {
+		logger(LOG_ERR, "init_packet_sender, epoll_ctl failed : %s.", strerror(errno));
+		return 0;
+	}
+	ev.data.fd = s->sender_timer;
+	if (epoll_ctl(s->sender_epoll, EPOLL_CTL_ADD, s->sender_timer, &ev) == -1) {
+		logger(LOG_ERR, "init_packet_sender, epoll_ctl failed : %s.", strerror(errno));
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * Close the events of the packet sender.
+ * The packet sender thread must have been stopped.
+ *
+ * @param s the server
+ */
+void destroy_packet_sender(struct server *s)
+{
+	close(s->sender_epoll);
+	close(s->sender_timer);
+	close(s->sender_event);
+}
+
+/**
+ * Wake the packet sender up so it takes a new timer into account.
+ *
+ * @param s the server
+ */
+void packet_sender_wakeup(struct server *s)
+{
+	uint64_t one = 1;
+
+	if (write(s->sender_event, &one, sizeof(one)) == -1 && errno != EAGAIN)
+		logger(LOG_WARN, "packet_sender_wakeup, write failed : %s.", strerror(errno));
+}
+
+/**
+ * Have the packet sender look at a player right away, because
+ * a packet has been queued or acknowledged, or he is leaving.
+ *
+ * @param s the server
+ * @param p the player
+ */
+void packet_sender_notify(struct server *s, struct player *p)
+{
+	tw_add(&s->timers, &p->resend_timer, 0);
+	packet_sender_wakeup(s);
+}
+
+/**
+ * Arm the timer of the packet sender for the next expiry
+ * of the timer wheel, or disarm it if there is none.
+ *
+ * @param s the server
+ */
+static void arm_timer(struct server *s)
+{
+	struct itimerspec its;
+	int64_t next, now;
+
+	bzero(&its, sizeof(struct itimerspec));
+	next = tw_next_expiry(&s->timers);
+	if (next != -1) {
+		now = tw_now();
+		/* already late : fire as soon as possible */
+		if (next <= now)
+			next = now + 1;
+		its.it_value.tv_sec = (next - now) / 1000;
+		its.it_value.tv_nsec = ((next - now) % 1000) * 1000000;
 	}
+	if (timerfd_settime(s->sender_timer, 0, &its, NULL) == -1)
+		logger(LOG_WARN, "arm_timer, timerfd_settime failed : %s.", strerror(errno));
 }
 
 void *packet_sender_thread(void *args)
 {
 	struct server *s;
-	struct player *p;
-	struct timeval now, diff, *last_sent, diff2;
-	size_t iter;
-	char *packet, *packet2;
+	struct epoll_event evs[2];
+	uint64_t count;
+	int i, nb_evs;
 
 	s = (struct server *)args;
 	while(1) {
-		gettimeofday(&now, NULL);
-		/* Can we */
-		/* sending their packet to active players */
-		ar_each(struct player *, p, iter, s->players)
-			pthread_mutex_lock(&p->packets->mutex);
-			last_sent = queue_get_time(p->packets);
-			if (last_sent != NULL) {
-				timersub(&now, last_sent, &diff);
-				timersub(&now, &p->last_ping, &diff2);
-				packet = peek_at_queue(p->packets);
-				if (diff2.tv_sec > 10 || (packet != NULL && *(uint16_t *)(packet+16) > 50)) {
-					/* player seems to have timedout */
-					logger(LOG_INFO, "Player 0x%x seems to have timed out, removing him", p);
-					/* do whateverittakes to notify that the player has left */
-					pthread_mutex_unlock(&p->packets->mutex);
-					s_notify_player_left(p);
-					pthread_mutex_lock(&p->packets->mutex);
-					/* then remove him */
-					remove_player(s, p);
-				} else {
-					/* resend a packet every 0.5s */
-					if (diff.tv_sec > 0 || diff.tv_usec > 500000) {
-						queue_update_time(p->packets);
-						send_curr_packet(p, s);
-					}
-				}
-			}
-			pthread_mutex_unlock(&p->packets->mutex);
-		ar_end_each;
-
-		/* sending their last packets to leaving players */
-		ar_each(struct player *, p, iter, s->leaving_players)
-			pthread_mutex_lock(&p->packets->mutex);
-			last_sent = queue_get_time(p->packets);
-			if (last_sent != NULL) {
-				timersub(&now, last_sent, &diff);
-				timersub(&now, &p->last_ping, &diff2);
-				packet = peek_at_queue(p->packets);
-				if (diff2.tv_sec > 10 || (packet != NULL && *(uint16_t *)(packet+16) > 50)) {
-					/* player seems to have timedout and is
-					 * marked as leaving - we empty his queue
-					 * so he will be removed */
-					logger(LOG_INFO, "Emptying the player 0x%x 's packet queue.", p);
-					while ((packet2 = get_from_queue(p->packets))) {
-						free(packet2);
-					}
-					logger(LOG_INFO, "Queue empty.", p);
-				} else {
-					if (diff.tv_sec > 0 || diff.tv_usec > 500000) {
-						queue_update_time(p->packets);
-						send_curr_packet(p, s);
-					}
-				}
-			}
-			pthread_mutex_unlock(&p->packets->mutex);
-			/* if there is no more packets in the queue,
-			 * we can safely destroy this player */
-			if (p->packets->first == NULL) {
-				ar_remove(s->leaving_players, p);
-				destroy_player(p);
-			}
-		ar_end_each;
-
-		usleep(50000);
+		/* only the players whose timers fired are looked at */
+		tw_run(&s->timers, tw_now());
+
+		/* end of the pass : send everything at once */
+		sb_flush();
+		arm_timer(s);
+
+		/* sleep until a timer is added or expires */
+		nb_evs = epoll_wait(s->sender_epoll, evs, 2, -1);
+		if (nb_evs == -1 && errno != EINTR)
+			logger(LOG_WARN, "packet_sender_thread, epoll_wait failed : %s.", strerror(errno));
+		for (i = 0 ; i < nb_evs ; i++) {
+			/* reset the event counters */
+			if (read(evs[i].data.fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+				logger(LOG_WARN, "packet_sender_thread, read failed : %s.", strerror(errno));
+		}
 	}
 }
-
@@ -19,6 +19,15 @@
 #ifndef __PACKET_SENDER_H__
 #define __PACKET_SENDER_H__
 
+struct server;
+struct player;
+
+int init_packet_sender(struct server *s);
+void destroy_packet_sender(struct server *s);
+void packet_sender_wakeup(struct server *s);
+void packet_sender_notify(struct server *s, struct player *p);
+void packet_sender_add_player(struct server *s, struct player *p);
+void packet_sender_del_player(struct server *s, struct player *p);
 void *packet_sender_thread(void *args);
 
 #endif
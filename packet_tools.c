@@ -35,17 +35,15 @@
  */
 void packet_add_crc(char *data, size_t len, unsigned int offset)
 {
-	char *ptr = data + offset;
 	uint32_t new_crc;
-	uint32_t *crc_ptr = (uint32_t *)ptr;
-	
-	*crc_ptr = 0x00000000;
-	new_crc = GUINT32_TO_LE(crc_32(data, len, 0xEDB88320));
-	*crc_ptr = new_crc;
+
+	new_crc = GUINT32_TO_LE(crc_32_zeroed(data, len, offset));
+	memcpy(data + offset, &new_crc, 4);
 }
 
 /**
- * Check the crc of a packet
+ * Check the crc of a packet. The checksum field is
+ * read as zeros, the packet is not modified.
  *
  * @param data the packet
  * @param len the length of the packet
@@ -53,25 +51,14 @@ void packet_add_crc(char *data, size_t len, unsigned int offset)
  */
 int packet_check_crc(char *data, size_t len, unsigned int offset)
 {
-	char *buff, *ptr;
 	uint32_t old_crc;
 	uint32_t new_crc;
-	uint32_t *crc_ptr;
 
-	buff = (char *)calloc(len, sizeof(char));
-	if (buff == NULL) {
-		logger(LOG_WARN, "packet_check_crc, buffer allocation failed : %s.", strerror(errno));
+	if (len < offset + 4)
 		return 0;
-	}
-	memcpy(buff, data, len);
-	ptr = buff + offset;
-	crc_ptr = (uint32_t *)ptr;
+	memcpy(&old_crc, data + offset, 4);
+	new_crc = GUINT32_TO_LE(crc_32_zeroed(data, len, offset));
 
-	old_crc = *crc_ptr;
-	*crc_ptr = 0x00000000;
-	new_crc = GUINT32_TO_LE(crc_32(buff, len, 0xEDB88320));
-	
-	free(buff);
 	return new_crc == old_crc;
 }
 
@@ -100,3 +87,49 @@ int packet_check_crc_d(char *data, size_t len)
 {
 	return packet_check_crc(data, len, 20);
 }
+
+/**
+ * Overwrite a few bytes of a packet whose checksum is up
+ * to date, and patch the checksum instead of computing it again
+ * over the whole packet.
+ *
+ * @param data the packet
+ * @param len the length of the packet
+ * @param crc_offset the offset where the checksum is located
+ * @param offset the offset of the bytes to overwrite (outside of the checksum)
+ * @param bytes the new bytes
+ * @param n the number of bytes
+ */
+void packet_patch_crc(char *data, size_t len, unsigned int crc_offset,
+		size_t offset, const void *bytes, size_t n)
+{
+	uint32_t crc;
+
+	memcpy(&crc, data + crc_offset, 4);
+	crc = GUINT32_TO_LE(crc_32_patch(GUINT32_FROM_LE(crc), len, offset, data + offset, bytes, n));
+	memcpy(data + offset, bytes, n);
+	memcpy(data + crc_offset, &crc, 4);
+}
+
+/**
+ * Address a control packet whose checksum is up to date to
+ * another player : write the private ID, public ID and packet
+ * counter, and patch the checksum (at the default offset).
+ *
+ * @param data the packet
+ * @param len the length of the packet
+ * @param private_id the private ID of the recipient
+ * @param public_id the public ID of the recipient
+ * @param counter the packet counter
+ */
+void packet_patch_header_d(char *data, size_t len, uint32_t private_id,
+		uint32_t public_id, uint32_t counter)
+{
+	char header[12];
+	char *ptr = header;
+
+	wu32(private_id, &ptr);
+	wu32(public_id, &ptr);
+	wu32(counter, &ptr);
+	packet_patch_crc(data, len, 20, 4, header, 12);
+}
@@ -19,9 +19,16 @@
 #ifndef __PACKET_TOOLS_H__
 #define __PACKET_TOOLS_H__
 
+#include <stdint.h>
+#include <sys/types.h>
+
 void packet_add_crc(char *data, size_t len, unsigned int offset);
 int packet_check_crc(char *data, size_t len, unsigned int offset);
 void packet_add_crc_d(char *data, size_t len);
 int packet_check_crc_d(char *data, size_t len);
+void packet_patch_crc(char *data, size_t len, unsigned int crc_offset,
+		size_t offset, const void *bytes, size_t n);
+void packet_patch_header_d(char *data, size_t len, uint32_t private_id,
+		uint32_t public_id, uint32_t counter);
 
 #endif
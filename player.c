@@ -42,10 +42,8 @@ void destroy_player(struct player *p)
 		free(p->cli_addr);
 	if (p->stats)
 		free(p->stats);
-	if (p->packets)
-		destroy_queue(p->packets);
-	if (p->muted)
-		ar_free(p->muted);
+	if (p->packets.ring)
+		destroy_queue(&p->packets);
 	free(p);
 }
 
@@ -68,8 +66,10 @@ struct player *new_player(char *nickname, char *login, char *machine)
 		return NULL;
 	}
 	/* create packet queue */
-	p->packets = new_queue();
-	p->muted = ar_new(2);
+	if (!init_queue(&p->packets)) {
+		free(p);
+		return NULL;
+	}
 	p->stats = new_plstat();
 	strcpy(p->name, nickname);
 	strcpy(p->machine, machine);
@@ -207,6 +207,7 @@ void print_player(struct player *pl)
 	logger(LOG_INFO, "\tprivate ID : 0x%x", pl->private_id);
 	logger(LOG_INFO, "\tmachine    : %s", pl->machine);
 	logger(LOG_INFO, "\tclient     : %s", pl->client);
+	logger(LOG_INFO, "\tsend queue : %u packets (%u max)", pl->packets.nb_elem, pl->packets.max_elem);
 }
 
 /**
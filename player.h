@@ -23,6 +23,8 @@
 #include "channel.h"
 #include "configuration.h"
 #include "player_stat.h"
+#include "timer_wheel.h"
+#include "queue.h"
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -69,8 +71,8 @@ struct player {
 	
 	/* the channel the player is in */
 	struct channel *in_chan;
+	unsigned int audio_idx;		/* index in the audio plan of in_chan */
 	struct registration *reg;
-	struct array *muted;
 	struct timeval last_ping;
 
 	/* communication */
@@ -78,7 +80,9 @@ struct player {
 	unsigned int cli_len;
 
 	/* packet queue */
-	struct queue *packets;
+	struct queue packets;
+	struct tw_timer resend_timer;	/* next (re)transmission */
+	struct tw_timer timeout_timer;	/* 10s after the last keepalive */
 
 	/* packet counters */
 	unsigned int f0_c_counter;
@@ -21,27 +21,64 @@
 
 #include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <sys/time.h>
 
 /**
- * Create a new queue
+ * Initialize a queue.
  *
- * @return the newly allocated queue
+ * @param q the queue
+ *
+ * @return 1 on success, 0 on failure
  */
-struct queue *new_queue()
+int init_queue(struct queue *q)
 {
-	struct queue *q = (struct queue *)calloc(sizeof(struct queue), 1);
+	bzero(q, sizeof(struct queue));
+	q->ring = (struct q_elem *)calloc(QUEUE_INIT_SIZE, sizeof(struct q_elem));
+	if (q->ring == NULL) {
+		logger(LOG_ERR, "init_queue, calloc failed : %s.", strerror(errno));
+		return 0;
+	}
+	q->size = QUEUE_INIT_SIZE;
 	pthread_mutex_init(&q->mutex, NULL);
-
-	return q;
+	return 1;
 }
 
 void destroy_queue(struct queue *q)
 {
-	if (q->first != NULL)
+	if (q->nb_elem != 0)
 		logger(LOG_ERR, "destroy_queue : destroyed a queue that was NOT empty! That should not happen!");
 	pthread_mutex_destroy(&q->mutex);
-	free(q);
+	free(q->ring);
+	q->ring = NULL;
+}
+
+/**
+ * Double the size of the ring of a queue, moving
+ * the elements to the beginning of the new ring.
+ *
+ * @param q the queue
+ *
+ * @return 1 on success, 0 on failure
+ */
+static int queue_grow(struct queue *q)
+{
+	struct q_elem *ring;
+	unsigned int i;
+
+	ring = (struct q_elem *)calloc(q->size * 2, sizeof(struct q_elem));
+	if (ring == NULL) {
+		logger(LOG_ERR, "queue_grow, calloc failed : %s.", strerror(errno));
+		return 0;
+	}
+	for (i = 0 ; i < q->nb_elem ; i++)
+		ring[i] = *queue_at(q, i);
+	free(q->ring);
+	q->ring = ring;
+	q->size *= 2;
+	q->first = 0;
+	return 1;
 }
 
 /**
@@ -50,108 +87,73 @@ void destroy_queue(struct queue *q)
  *
  * @param q the queue
  * @param elem the element
+ * @param size the size of the element
+ *
+ * @return 1 on success, 0 if the queue could not grow
  */
-void add_to_queue(struct queue *q, void *elem, size_t size)
+int add_to_queue(struct queue *q, void *elem, size_t size)
 {
 	struct q_elem *q_e;
 
-	q_e = (struct q_elem *)calloc(sizeof(struct q_elem), 1);
+	pthread_mutex_lock(&q->mutex);
+	if (q->nb_elem == q->size && !queue_grow(q)) {
+		pthread_mutex_unlock(&q->mutex);
+		return 0;
+	}
+	q_e = &q->ring[(q->first + q->nb_elem) & (q->size - 1)];
 	q_e->elem = elem;
 	q_e->size = size;
+	q_e->version = 0;
 	timerclear(&q_e->last_sent);
-
-	pthread_mutex_lock(&q->mutex);
-	if(q->first == NULL) {
-		q->first = q_e;
-	} else {
-		q_e->prev = q->last;
-		q->last->next = q_e;
-	}
-	q->last = q_e;
+	q->nb_elem++;
+	if (q->nb_elem > q->max_elem)
+		q->max_elem = q->nb_elem;
 	pthread_mutex_unlock(&q->mutex);
-}
-
-void queue_update_time(struct queue *q)
-{
-	if (q->first != NULL)
-		gettimeofday(&q->first->last_sent, NULL);
-}
-
-struct timeval * queue_get_time(struct queue *q)
-{
-	if (q->first != NULL)
-		return &q->first->last_sent;
-	return NULL;
+	return 1;
 }
 
 /**
  * Get an element from the beginning of the
  * queue and remove it.
- * Should be thread-safe.
+ * NB : the queue mutex has to be locked MANUALLY.
  *
  * @param q the queue
  *
- * @return the element
+ * @return the element, or NULL if the queue is empty
  */
 void *get_from_queue(struct queue *q)
 {
 	void *elem;
-	struct q_elem *new_first;
-	struct q_elem *old_first;
-
-	old_first = q->first;
-
-	if(old_first == NULL) {	/* empty queue */
-		elem = NULL;
-	} else {
-		new_first = old_first->next; /* NULL or the n-1th element */
-		if(new_first == NULL) {
-		/* only one element */
-			q->last = NULL;
-			q->first = NULL;
-		} else {
-			/* retrieve the data and free the container */
-			q->first = new_first;
-			new_first->prev = NULL;
-		}
-		elem = old_first->elem;
-		free(old_first);
-	}
 
+	if (q->nb_elem == 0)
+		return NULL;
+	elem = q->ring[q->first].elem;
+	q->first = (q->first + 1) & (q->size - 1);
+	q->nb_elem--;
 	return elem;
 }
 
 /**
- * Peek at the first element of the queue.
- * NB : the queue mutex has to be locked MANUALLY
- * when using the peek function.
+ * Remove an element from anywhere in the queue. The elements
+ * before it are moved, so this is cheap near the beginning
+ * of the queue, where the send window is.
+ * NB : the queue mutex has to be locked MANUALLY.
  *
  * @param q the queue
+ * @param i the position of the element
  *
- * @return the element
+ * @return the element, or NULL if i is out of the queue
  */
-void *peek_at_queue(struct queue *q)
+void *queue_remove_at(struct queue *q, unsigned int i)
 {
 	void *elem;
 
-	if(q->first == 0) {	/* empty queue */
-		elem = NULL;
-	} else {
-		elem = q->first->elem; /* retrieve the data */
-	}
-
+	if (i >= q->nb_elem)
+		return NULL;
+	elem = queue_at(q, i)->elem;
+	for ( ; i > 0 ; i--)
+		*queue_at(q, i) = *queue_at(q, i - 1);
+	q->first = (q->first + 1) & (q->size - 1);
+	q->nb_elem--;
 	return elem;
 }
-
-size_t peek_at_size(struct queue *q)
-{
-	size_t size;
-
-	if(q->first == 0) {	/* empty queue */
-		size = 0;
-	} else {
-		size = q->first->size; /* retrieve the data */
-	}
-
-	return size;
-}
@@ -20,34 +20,72 @@
 #define __QUEUE_H__
 
 #include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <sys/time.h>
 
+/* initial number of entries of a queue, a power of two */
+#define QUEUE_INIT_SIZE 8
+
+/**
+ * A packet waiting in a queue.
+ */
 struct q_elem
 {
-	size_t size;
-	struct timeval last_sent;
-
 	void *elem;
-
-	struct q_elem *prev;
-	struct q_elem *next;
+	size_t size;
+	struct timeval last_sent;	/* cleared until the element is first sent */
+	uint16_t version;		/* number of times it has been sent */
 };
 
+/**
+ * First in, first out queue stored in a ring of entries
+ * that grows (by doubling) when it is full, and never shrinks.
+ */
 struct queue
 {
-	struct q_elem *first;
-	struct q_elem *last;
-	int nb_elem;
+	struct q_elem *ring;
+	unsigned int size;	/* number of entries of ring, a power of two */
+	unsigned int first;	/* index in ring of the first element */
+	unsigned int nb_elem;
+	unsigned int max_elem;	/* highest nb_elem seen */
 
 	pthread_mutex_t mutex;
 };
 
-void queue_update_time(struct queue *q);
-struct timeval *queue_get_time(struct queue *q);
-struct queue *new_queue();
+int init_queue(struct queue *q);
 void destroy_queue(struct queue *q);
-void add_to_queue(struct queue *q, void *elem, size_t size);
+int add_to_queue(struct queue *q, void *elem, size_t size);
 void *get_from_queue(struct queue *q);
-void *peek_at_queue(struct queue *q);
-size_t peek_at_size(struct queue *q);
+void *queue_remove_at(struct queue *q, unsigned int i);
+
+/**
+ * Retrieve an element of the queue by its position.
+ * NB : the queue mutex has to be locked MANUALLY.
+ *
+ * @param q the queue
+ * @param i the position, 0 is the first element
+ *
+ * @return the container of the element, or NULL if i is out of the queue
+ */
+static inline struct q_elem *queue_at(struct queue *q, unsigned int i)
+{
+	if (i >= q->nb_elem)
+		return NULL;
+	return &q->ring[(q->first + i) & (q->size - 1)];
+}
+
+/**
+ * Retrieve the last element of the queue.
+ * NB : the queue mutex has to be locked MANUALLY.
+ *
+ * @param q the queue
+ *
+ * @return the container of the element, or NULL if the queue is empty
+ */
+static inline struct q_elem *queue_last(struct queue *q)
+{
+	return q->nb_elem == 0 ? NULL : queue_at(q, q->nb_elem - 1);
+}
+
 #endif
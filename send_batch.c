@@ -0,0 +1,248 @@
+/*
+ * soliloque-server, an open source implementation of the TeamSpeak protocol.
+ * Copyright (C) 2009 Hugo Camboulive <hugo.camboulive AT gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "send_batch.h"
+#include "server.h"
+#include "server_stat.h"
+#include "log.h"
+#include "compat.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+static __thread struct send_batch *thread_batch = NULL;
+
+/**
+ * Retrieve the batch of the current thread, allocating
+ * it the first time.
+ *
+ * @return the batch, or NULL if the allocation failed
+ */
+static struct send_batch *get_batch(void)
+{
+	if (thread_batch == NULL) {
+		thread_batch = (struct send_batch *)calloc(1, sizeof(struct send_batch));
+		if (thread_batch == NULL)
+			logger(LOG_ERR, "get_batch, calloc failed : %s.", strerror(errno));
+	}
+	return thread_batch;
+}
+
+/**
+ * Queue a datagram to be sent at the end of the current
+ * processing pass. The data is copied, so the caller can
+ * reuse or free buf as soon as this returns.
+ * The batch is flushed first if it is full, or if the datagram
+ * has to go through the socket of another server.
+ *
+ * @param s the server whose socket will be used
+ * @param buf the datagram
+ * @param len the length of buf
+ * @param addr the destination address
+ * @param addr_len the length of addr
+ */
+void sb_send(struct server *s, const void *buf, size_t len,
+		const struct sockaddr_in *addr, socklen_t addr_len)
+{
+	struct send_batch *b = get_batch();
+	struct mmsghdr *m;
+	struct iovec *iov;
+	ssize_t err;
+
+	/* datagram does not fit in the arena : keep the order and send it now */
+	if (b == NULL || len > SB_ARENA_SIZE) {
+		sb_flush();
+		err = sendto(s->socket_desc, buf, len, 0, (struct sockaddr *)addr, addr_len);
+		if (err == -1)
+			logger(LOG_WARN, "sb_send, sendto failed : %s.", strerror(errno));
+		return;
+	}
+	if (b->s != s || b->nb_msgs == SB_MAX_MSGS || b->arena_used + len > SB_ARENA_SIZE)
+		sb_flush();
+
+	b->s = s;
+	memcpy(b->arena + b->arena_used, buf, len);
+	memcpy(&b->addrs[b->nb_msgs], addr, MIN(addr_len, sizeof(struct sockaddr_in)));
+	iov = &b->iovs[b->nb_msgs * SB_MAX_IOVS];
+	iov->iov_base = b->arena + b->arena_used;
+	iov->iov_len = len;
+
+	m = &b->msgs[b->nb_msgs];
+	bzero(m, sizeof(struct mmsghdr));
+	m->msg_hdr.msg_name = &b->addrs[b->nb_msgs];
+	m->msg_hdr.msg_namelen = MIN(addr_len, sizeof(struct sockaddr_in));
+	m->msg_hdr.msg_iov = iov;
+	m->msg_hdr.msg_iovlen = 1;
+
+	b->arena_used += len;
+	b->bytes += len;
+	b->nb_msgs++;
+}
+
+/**
+ * Copy the shared parts of the current fan-out in the arena.
+ *
+ * @param b the batch of the thread
+ */
+static void copy_fanout_shared(struct send_batch *b)
+{
+	b->fan_shared[0].iov_base = b->arena + b->arena_used;
+	b->fan_shared[0].iov_len = b->fan_head_len;
+	memcpy(b->arena + b->arena_used, b->fan_head, b->fan_head_len);
+	b->arena_used += b->fan_head_len;
+
+	b->fan_shared[1].iov_base = b->arena + b->arena_used;
+	b->fan_shared[1].iov_len = b->fan_tail_len;
+	memcpy(b->arena + b->arena_used, b->fan_tail, b->fan_tail_len);
+	b->arena_used += b->fan_tail_len;
+}
+
+/**
+ * Start sending the same datagram to several players.
+ * Each datagram is made of head, a per-recipient header given
+ * to sb_fanout_add(), and tail. head and tail are copied once in
+ * the arena and shared by all the datagrams of the fan-out.
+ * head and tail must stay valid until the last sb_fanout_add().
+ *
+ * @param s the server whose socket will be used
+ * @param head the part before the per-recipient header
+ * @param head_len the length of head
+ * @param tail the part after the per-recipient header
+ * @param tail_len the length of tail
+ *
+ * @return 1 on success, 0 if the datagram cannot be batched
+ */
+int sb_fanout_begin(struct server *s, const void *head, size_t head_len,
+		const void *tail, size_t tail_len)
+{
+	struct send_batch *b = get_batch();
+
+	if (b == NULL || head_len + tail_len > SB_ARENA_SIZE / 2)
+		return 0;
+	if (b->s != s || b->nb_msgs == SB_MAX_MSGS
+			|| b->arena_used + head_len + tail_len > SB_ARENA_SIZE)
+		sb_flush();
+
+	b->s = s;
+	b->fan_head = head;
+	b->fan_head_len = head_len;
+	b->fan_tail = tail;
+	b->fan_tail_len = tail_len;
+	copy_fanout_shared(b);
+	return 1;
+}
+
+/**
+ * Queue one datagram of the current fan-out.
+ * Only the header is copied.
+ *
+ * @param hdr the per-recipient header
+ * @param hdr_len the length of hdr
+ * @param addr the destination address
+ * @param addr_len the length of addr
+ */
+void sb_fanout_add(const void *hdr, size_t hdr_len,
+		const struct sockaddr_in *addr, socklen_t addr_len)
+{
+	struct send_batch *b = thread_batch;
+	struct mmsghdr *m;
+	struct iovec *iov;
+
+	if (b->nb_msgs == SB_MAX_MSGS || b->arena_used + hdr_len > SB_ARENA_SIZE) {
+		sb_flush();
+		copy_fanout_shared(b);
+	}
+
+	memcpy(b->arena + b->arena_used, hdr, hdr_len);
+	memcpy(&b->addrs[b->nb_msgs], addr, MIN(addr_len, sizeof(struct sockaddr_in)));
+	iov = &b->iovs[b->nb_msgs * SB_MAX_IOVS];
+	iov[0] = b->fan_shared[0];
+	iov[1].iov_base = b->arena + b->arena_used;
+	iov[1].iov_len = hdr_len;
+	iov[2] = b->fan_shared[1];
+
+	m = &b->msgs[b->nb_msgs];
+	bzero(m, sizeof(struct mmsghdr));
+	m->msg_hdr.msg_name = &b->addrs[b->nb_msgs];
+	m->msg_hdr.msg_namelen = MIN(addr_len, sizeof(struct sockaddr_in));
+	m->msg_hdr.msg_iov = iov;
+	m->msg_hdr.msg_iovlen = 3;
+
+	b->arena_used += hdr_len;
+	b->bytes += b->fan_head_len + hdr_len + b->fan_tail_len;
+	b->nb_msgs++;
+}
+
+/**
+ * Send the datagrams of the current thread with something else
+ * than sendmmsg(), e.g. the io_uring of a receiver.
+ * This takes effect with the next flush.
+ *
+ * @param fn the function sending a batch, NULL for sendmmsg()
+ * @param ctx passed to fn
+ */
+void sb_set_transport(sb_transport_fn fn, void *ctx)
+{
+	struct send_batch *b = get_batch();
+
+	if (b == NULL)
+		return;
+	b->transport = fn;
+	b->transport_ctx = ctx;
+}
+
+/**
+ * Send all the datagrams queued by the current thread
+ * with as few sendmmsg() calls as possible.
+ */
+void sb_flush(void)
+{
+	struct send_batch *b = thread_batch;
+	unsigned int sent = 0, done;
+	int ret;
+
+	if (b == NULL || b->nb_msgs == 0)
+		return;
+
+	while (sent < b->nb_msgs) {
+		if (b->transport != NULL) {
+			ret = b->transport(b->transport_ctx, b->s->socket_desc, b->msgs + sent,
+					b->nb_msgs - sent, &done);
+		} else {
+			ret = sendmmsg(b->s->socket_desc, b->msgs + sent, b->nb_msgs - sent, 0);
+			done = ret;
+		}
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			/* the first datagram failed, drop it and go on */
+			logger(LOG_WARN, "sb_flush, sendmmsg failed : %s.", strerror(errno));
+			sent++;
+		} else {
+			sent += done;
+		}
+	}
+	sstat_add_tx_batch(b->s->stats, b->nb_msgs, b->bytes);
+	logger(LOG_DBG, "sb_flush : %u datagrams (%zu bytes) sent.", b->nb_msgs, b->bytes);
+
+	b->nb_msgs = 0;
+	b->arena_used = 0;
+	b->bytes = 0;
+}
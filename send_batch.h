@@ -0,0 +1,79 @@
+/*
+ * soliloque-server, an open source implementation of the TeamSpeak protocol.
+ * Copyright (C) 2009 Hugo Camboulive <hugo.camboulive AT gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SEND_BATCH_H__
+#define __SEND_BATCH_H__
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "server.h"
+
+/* maximum number of datagrams sent with one sendmmsg() */
+#define SB_MAX_MSGS 64
+/* size of the buffer the datagrams are copied into */
+#define SB_ARENA_SIZE (64 * 1024)
+/* maximum number of iovecs of one datagram */
+#define SB_MAX_IOVS 3
+
+/**
+ * Something able to send several datagrams at once. Like
+ * sendmmsg(), it returns the number of datagrams sent, or -1
+ * if the first one failed. It also sets done to the number of
+ * datagrams it is over with, sent or not : the next call
+ * starts after them.
+ */
+typedef int (*sb_transport_fn)(void *ctx, int sock, struct mmsghdr *msgs, unsigned int n,
+		unsigned int *done);
+
+/**
+ * Datagrams waiting to be sent by the current thread.
+ * There is one of those per thread, and it is only
+ * accessed by that thread.
+ */
+struct send_batch {
+	struct server *s;	/* server owning the socket of the queued datagrams */
+	unsigned int nb_msgs;
+	size_t arena_used;
+	size_t bytes;		/* size of the queued datagrams */
+
+	/* fan-out in progress : parts shared by all its datagrams */
+	const char *fan_head, *fan_tail;
+	size_t fan_head_len, fan_tail_len;
+	struct iovec fan_shared[2];	/* their copies in the arena */
+
+	sb_transport_fn transport;	/* NULL for sendmmsg() */
+	void *transport_ctx;
+
+	struct mmsghdr msgs[SB_MAX_MSGS];
+	struct iovec iovs[SB_MAX_MSGS * SB_MAX_IOVS];
+	struct sockaddr_in addrs[SB_MAX_MSGS];
+	char arena[SB_ARENA_SIZE];
+};
+
+void sb_send(struct server *s, const void *buf, size_t len,
+		const struct sockaddr_in *addr, socklen_t addr_len);
+void sb_flush(void);
+void sb_set_transport(sb_transport_fn fn, void *ctx);
+int sb_fanout_begin(struct server *s, const void *head, size_t head_len,
+		const void *tail, size_t tail_len);
+void sb_fanout_add(const void *hdr, size_t hdr_len,
+		const struct sockaddr_in *addr, socklen_t addr_len);
+
+#endif
@@ -25,6 +25,10 @@
 #include "packet_sender.h"
 #include "queue.h"
 #include "control_packet.h"
+#include "send_batch.h"
+#include "net_backend.h"
+#include "packet_pool.h"
+#include "db_snapshot.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -35,8 +39,8 @@
 #include <poll.h>
 #include <errno.h>
 #include <sys/utsname.h>
+#include <linux/filter.h>
 #include <stdio.h>
-#include <semaphore.h>
 #include <openssl/sha.h>
 #include <unistd.h>
 #include <dbi/dbi.h>
@@ -45,8 +49,6 @@
 #include <bsd/bsd.h>
 #endif
 
-#define MAX_MSG 1024
-
 static void get_machine_name(struct server *s)
 {
 	struct utsname mc;
@@ -75,6 +77,25 @@ static void get_machine_name(struct server *s)
 	}
 }
 
+/**
+ * Allocate a player table with a slot for each public ID.
+ *
+ * @param t the table
+ * @param size the number of slots
+ *
+ * @return 1 on success, 0 if the allocation failed
+ */
+static int pt_init(struct player_table *t, size_t size)
+{
+	t->slots = (struct player **)calloc(size, sizeof(struct player *));
+	if (t->slots == NULL) {
+		logger(LOG_WARN, "pt_init, calloc failed : %s.", strerror(errno));
+		return 0;
+	}
+	t->size = size;
+	return 1;
+}
+
 /**
  * Create and initialize a new server
  * The default number of channels if 4, 
@@ -97,13 +118,19 @@ struct server *new_server()
 	serv->bans = ar_new(4);
 	serv->regs = ar_new(8);
 	serv->leaving_players = ar_new(8);
+	if (!ida_init(&serv->player_ids, MAX_PLAYER_ID) || !ida_init(&serv->chan_ids, 0)
+			|| !ida_init(&serv->ban_ids, 0)) {
+		logger(LOG_WARN, "new_server, ID allocators initialization failed.");
+		return NULL;
+	}
+	if (!pt_init(&serv->pl_by_id, MAX_PLAYER_ID) || !pt_init(&serv->leaving_by_id, MAX_PLAYER_ID))
+		return NULL;
+	mute_init(&serv->mutes);
 
 	serv->stats = new_sstat();
 	serv->privileges = new_sp();
 	get_machine_name(serv);
-
-	/* Initialize the semaphore for packets that have to be sent */
-	sem_init(&serv->send_packets, 0, 0);
+	tw_init(&serv->timers, serv);
 
 	return serv;
 }
@@ -122,14 +149,12 @@ int add_channel(struct server *serv, struct channel *chan)
 {
 	uint32_t new_id;
 	struct channel *tmp_chan;
-	char *used_ids;
 	size_t iter;
 	
-	used_ids = (char *)calloc(serv->chans->total_slots, sizeof(char));
-	if (used_ids == NULL) {
-		logger(LOG_WARN, "add_channel, used_ids allocation failed : %s.", strerror(errno));
+	/* Find the next available ID */
+	new_id = ida_get(&serv->chan_ids);
+	if (new_id == 0)
 		return 0;
-	}
 
 	/* If there is no channel, make this channel the default one */
 	if (serv->chans->used_slots == 0)
@@ -143,26 +168,28 @@ int add_channel(struct server *serv, struct channel *chan)
 		ar_end_each;
 	}
 	
-	/* Find the next available ID */
-	ar_each(struct channel *, tmp_chan, iter, serv->chans)
-		used_ids[tmp_chan->id - 1] = 1;	/* id -1  -> ID start at 1 */
-	ar_end_each;
-
-	new_id = 0;
-	while(new_id < serv->chans->total_slots && used_ids[new_id] == 1)
-		new_id++;
-	new_id += 1;	/* ID start at 1 */
-	
 	/* set ID and insert into that slot */
 	chan->id = new_id;
 	ar_insert(serv->chans, chan);
 	chan->in_server = serv;
-	
-	free(used_ids);
+	chan_list_changed(serv);
 	
 	return 1;
 }
 
+/**
+ * Tell that the channel list sent to the players who join
+ * has to be rebuilt : a channel was added, removed, or one
+ * of the fields sent in the list changed.
+ *
+ * @param s the server (can be NULL)
+ */
+void chan_list_changed(struct server *s)
+{
+	if (s != NULL)
+		__atomic_add_fetch(&s->chan_list.version, 1, __ATOMIC_RELEASE);
+}
+
 
 /**
  * Retrieve a channel with a given ID
@@ -203,6 +230,8 @@ int destroy_channel_by_id(struct server *serv, uint32_t id)
 		if(tmp_chan->id == id) {
 			destroy_channel(tmp_chan);
 			ar_remove(serv->chans, tmp_chan);
+			ida_put(&serv->chan_ids, id);
+			chan_list_changed(serv);
 			return 1;
 		}
 	ar_end_each;
@@ -248,6 +277,38 @@ struct channel *get_channel_by_db_id(struct server *s, uint32_t db_id)
 	return NULL;
 }
 
+/**
+ * Retrieve the player stored in a player table.
+ *
+ * @param t the table
+ * @param pub_id the public ID of the player
+ *
+ * @return the player, or NULL if the slot is empty
+ */
+static struct player *pt_get(struct player_table *t, uint32_t pub_id)
+{
+	if (pub_id == 0 || pub_id > t->size)
+		return NULL;
+	return t->slots[pub_id - 1];	/* ID start at 1 */
+}
+
+/**
+ * Store a player (or NULL to clear the slot) in a player table.
+ *
+ * @param t the table
+ * @param pub_id the public ID of the player
+ * @param pl the player
+ *
+ * @return 1 on success, 0 if the ID is out of the table
+ */
+static int pt_set(struct player_table *t, uint32_t pub_id, struct player *pl)
+{
+	if (pub_id == 0 || pub_id > t->size)
+		return 0;
+	t->slots[pub_id - 1] = pl;	/* ID start at 1 */
+	return 1;
+}
+
 /**
  * Add a player to the server and put it into the default channel.
  *
@@ -259,27 +320,21 @@ struct channel *get_channel_by_db_id(struct server *s, uint32_t db_id)
 int add_player(struct server *serv, struct player *pl)
 {
 	struct channel *def_chan;
-	char *used_ids;
-	int new_id;
-	struct player *tmp_pl;
-	size_t iter;
+	uint32_t new_id;
 	
 	def_chan = get_default_channel(serv);
 	
-	/* Find the next available public ID */
-	used_ids = (char *)calloc(serv->players->total_slots, sizeof(char));
-	if (used_ids == NULL) {
-		logger(LOG_WARN, "add_player, used_ids allocation failed : %s.", strerror(errno));
+	/* Find the next available public ID. The IDs of leaving
+	 * players are not reused until they are destroyed, so their
+	 * last acknowledgements cannot be mistaken for a new player's. */
+	new_id = ida_get(&serv->player_ids);
+	if (new_id == 0)
+		return 0;
+	if (!pt_set(&serv->pl_by_id, new_id, pl)) {
+		ida_put(&serv->player_ids, new_id);
 		return 0;
 	}
-	ar_each(struct player *, tmp_pl, iter, serv->players)
-		used_ids[tmp_pl->public_id - 1] = 1;	/* ID start at 1 */
-	ar_end_each;
-
-	new_id = 0;
-	while (used_ids[new_id] == 1)
-		new_id++;
-	pl->public_id = new_id + 1;	/* ID start at 1 */
+	pl->public_id = new_id;
 
 	/* Find the next available private ID */
 #ifdef HAVE_ARC4RANDOM
@@ -289,10 +344,10 @@ int add_player(struct server *serv, struct player *pl)
 #endif
 	/* Find next slot in the array */
 	ar_insert(serv->players, pl);
+	packet_sender_add_player(serv, pl);
 
-	serv->stats->total_logins++;
+	sstat_add_login(serv->stats);
 
-	free(used_ids);
 	return add_player_to_channel(def_chan, pl);
 }
 
@@ -308,27 +363,31 @@ int add_player(struct server *serv, struct player *pl)
 struct player *get_player_by_ids(struct server *s, uint32_t pub_id, uint32_t priv_id)
 {
 	struct player *pl;
-	size_t iter;
 
-	ar_each(struct player *, pl, iter, s->players)
-		if (pl->public_id == pub_id && pl->private_id == priv_id) {
-			return pl;
-		}
-	ar_end_each;
+	pl = pt_get(&s->pl_by_id, pub_id);
+	if (pl != NULL && pl->private_id == priv_id)
+		return pl;
 
 	return NULL;
 }
 
+/**
+ * Retrieve a player that is leaving the server (waiting for
+ * its last packets to be acknowledged) with its public and private ids.
+ *
+ * @param s the server
+ * @param pub_id the public id of the player
+ * @param priv_id the private id of the player
+ *
+ * @return the player if it was found (both ids have to be valid), a NULL pointer if it failed.
+ */
 struct player *get_leaving_player_by_ids(struct server *s, uint32_t pub_id, uint32_t priv_id)
 {
 	struct player *pl;
-	size_t iter;
 
-	ar_each(struct player *, pl, iter, s->leaving_players)
-		if (pl->public_id == pub_id && pl->private_id == priv_id) {
-			return pl;
-		}
-	ar_end_each;
+	pl = pt_get(&s->leaving_by_id, pub_id);
+	if (pl != NULL && pl->private_id == priv_id)
+		return pl;
 
 	return NULL;
 }
@@ -343,16 +402,7 @@ struct player *get_leaving_player_by_ids(struct server *s, uint32_t pub_id, uint
  */
 struct player *get_player_by_public_id(struct server *s, uint32_t pub_id)
 {
-	struct player *pl;
-	size_t iter;
-
-	ar_each(struct player *, pl, iter, s->players)
-		if (pl->public_id == pub_id) {
-			return pl;
-		}
-	ar_end_each;
-
-	return NULL;
+	return pt_get(&s->pl_by_id, pub_id);
 }
 
 /**
@@ -366,14 +416,16 @@ void remove_player(struct server *s, struct player *p)
 	size_t iter, iter2;
 	struct player_channel_privilege *priv;
 	struct channel *ch;
-	struct player *tmp_pl;
 
 	/* remove from the server */
 	ar_remove(s->players, (void *)p);
+	pt_set(&s->pl_by_id, p->public_id, NULL);
 	/* add to a temporary "leaving" list */
 	ar_insert(s->leaving_players, (void *)p);
+	pt_set(&s->leaving_by_id, p->public_id, p);
 	/* remove from the channel */
 	ar_remove(p->in_chan->players, (void *)p);
+	audio_plan_invalidate(p->in_chan);
 	p->in_chan = NULL;
 	/* remove the channel privileges */
 	ar_each(struct channel *, ch, iter, s->chans)
@@ -388,18 +440,31 @@ void remove_player(struct server *s, struct player *p)
 		}
 	ar_end_each;
 
-	/* remove from all the people who muted him */
-	ar_each(struct player *, tmp_pl, iter, s->players)
-		if (ar_has(tmp_pl->muted, p))
-			ar_remove(tmp_pl->muted, p);
-	ar_end_each;
-
-	/* remove from him all the people he muted */
-	ar_each(struct player *, tmp_pl, iter, p->muted)
-		ar_remove(p->muted, tmp_pl);
-	ar_end_each;
+	/* forget his mutes, and the mutes on him */
+	mute_forget(&s->mutes, p->public_id);
 
 	/* memory will be fred when their packet queue is empty */
+	packet_sender_notify(s, p);
+}
+
+/**
+ * Destroy a leaving player once all its packets have been
+ * sent, and release its public ID.
+ *
+ * @param s the server
+ * @param p the leaving player
+ */
+void destroy_leaving_player(struct server *s, struct player *p)
+{
+	logger(LOG_INFO, "Player %s : at most %u packets were waiting in its send queue.",
+			p->name, p->packets.max_elem);
+	ar_remove(s->leaving_players, (void *)p);
+	if (pt_get(&s->leaving_by_id, p->public_id) == p)
+		pt_set(&s->leaving_by_id, p->public_id, NULL);
+	ida_put(&s->player_ids, p->public_id);
+	packet_sender_del_player(s, p);
+	/* the data plane may still be reading it */
+	voice_retire(s, p, (void (*)(void *))destroy_player);
 }
 
 /**
@@ -427,6 +492,8 @@ int move_player(struct player *p, struct channel *to)
 	if (ar_insert(to->players, (void *)p) == AR_OK) {
 		ar_remove(old->players, (void *)p);
 		p->in_chan = to;
+		audio_plan_invalidate(old);
+		audio_plan_invalidate(to);
 		return 1;
 	}
 
@@ -435,40 +502,101 @@ int move_player(struct player *p, struct channel *to)
 }
 
 /**
- * Add a new ban to the server.
+ * Called by the packet sender when a timed ban is over. The
+ * bans belong to the control worker : it lifts the ban, and
+ * the ban is not touched here since it may already be gone.
  *
- * @param s the server
- * @param b the ban
+ * @param owner the server
+ * @param data the ban
+ */
+static void ban_expired(void *owner, void *data)
+{
+	struct server *s = (struct server *)owner;
+
+	(void)data;
+	if (__atomic_exchange_n(&s->bans_expired, 1, __ATOMIC_ACQ_REL) == 0)
+		ctl_worker_wakeup(s);
+}
+
+/**
+ * Lift the timed bans that are over. Run by the control worker
+ * after ban_expired() signaled one.
  *
- * @return 1 on success
+ * @param s the server
  */
-int add_ban(struct server *s, struct ban *b)
+void lift_expired_bans(struct server *s)
 {
-	struct ban *tmp_b;
-	char *used_ids;
-	int new_id;
+	struct ban *b;
 	size_t iter;
+	uint64_t now = tw_now();
 
-	/* Find the next available public ID */
-	used_ids = (char *)calloc(s->bans->total_slots, sizeof(char));
-	if (used_ids == NULL) {
-		logger(LOG_WARN, "add_player, used_ids allocation failed : %s.", strerror(errno));
-		return 0;
-	}
-	ar_each(struct ban *, tmp_b, iter, s->bans)
-		used_ids[tmp_b->id - 1] = 1;	/* ID start at 1 */
+	ar_each(struct ban *, b, iter, s->bans)
+		if (b->duration != 0 && b->expire_timer.expires <= now) {
+			logger(LOG_INFO, "Ban of %s expired after %i minutes.", b->ip, b->duration);
+			remove_ban(s, b);
+			destroy_ban(b);
+		}
 	ar_end_each;
+}
 
-	new_id = 0;
-	while (used_ids[new_id] == 1)
-		new_id++;
-	b->id = new_id + 1;	/* ID start at 1 */
-	free(used_ids);
+/**
+ * Insert a ban in the list of the server.
+ *
+ * @param s the server
+ * @param b the ban
+ * @param delay milliseconds before it is lifted (if it has a duration)
+ *
+ * @return 1 on success
+ */
+static int insert_ban(struct server *s, struct ban *b, uint64_t delay)
+{
+	/* Find the next available ID */
+	b->id = ida_get(&s->ban_ids);
+	if (b->id == 0)
+		return 0;
 
 	ar_insert(s->bans, (void *)b);
+	/* lift the ban when it is over */
+	if (b->duration != 0) {
+		tw_init_timer(&b->expire_timer, &ban_expired, b);
+		tw_add(&s->timers, &b->expire_timer, tw_now() + delay);
+	}
 	return 1;
 }
 
+/**
+ * Add a new ban to the server.
+ *
+ * @param s the server
+ * @param b the ban
+ *
+ * @return 1 on success
+ */
+int add_ban(struct server *s, struct ban *b)
+{
+	if (!insert_ban(s, b, (uint64_t)b->duration * 60 * 1000))
+		return 0;
+	if (b->duration != 0)
+		packet_sender_wakeup(s);
+	return 1;
+}
+
+/**
+ * Put back a ban saved when the server stopped. The server
+ * is not started yet : its packet sender arms the timer of
+ * the ban when it starts.
+ *
+ * @param s the server
+ * @param b the ban
+ * @param remaining milliseconds before it is lifted (if it has a duration)
+ *
+ * @return 1 on success
+ */
+int restore_ban(struct server *s, struct ban *b, uint64_t remaining)
+{
+	return insert_ban(s, b, remaining);
+}
+
 /**
  * Retrieves a ban with its ID.
  *
@@ -521,7 +649,9 @@ struct ban *get_ban_by_ip(struct server *s, struct in_addr ip)
  */
 void remove_ban(struct server *s, struct ban *b)
 {
+	tw_cancel(&s->timers, &b->expire_timer);
 	ar_remove(s->bans, (void *)b);
+	ida_put(&s->ban_ids, b->id);
 }
 
 struct registration *get_registration(struct server *s, char *login, char *pass)
@@ -571,68 +701,117 @@ void print_server(struct server *s)
 	ar_end_each;
 }
 
-static void *server_run(void *args)
-{
-	struct server *s = (struct server *)args;
-	struct sockaddr_in cli_addr;
-	int n, pollres;
-	unsigned int cli_len;
-	char data[MAX_MSG];
-
-	while (1) {
-		pollres = poll(&s->socket_poll, 1, -1);
-		switch(pollres) {
-		case 0:
-			logger(LOG_ERR, "Time limit expired");
-			break;
-		case -1:
-			logger(LOG_ERR, "Error occured while polling : %s", strerror(errno));
-			break;
-		default:
-			cli_len = sizeof(cli_addr);
-			n = recvfrom(s->socket_desc, data, MAX_MSG, 0,
-					(struct sockaddr *) &cli_addr, &cli_len);
-			if (n == -1) {
-				logger(LOG_ERR, "%s", strerror(errno));
-			} else {
-				logger(LOG_INFO, "%i bytes received.", n);
-				handle_packet(data, n, &cli_addr, cli_len, s);
-			}
-		}
+/**
+ * Have the kernel send the datagrams of a client to the same
+ * socket of the group : hash its address and port, modulo
+ * the number of sockets.
+ * Without this program, the kernel hashes the 4-tuple, which
+ * is also stable as long as the group does not change.
+ *
+ * @param sock a socket of the group
+ * @param nb the number of sockets in the group
+ *
+ * @return 1 on success, 0 on failure
+ */
+static int attach_steering(int sock, unsigned int nb)
+{
+	/* a reuseport program sees the UDP payload at offset 0,
+	 * the headers are reached relative to the network header */
+	struct sock_filter code[] = {
+		BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, SKF_NET_OFF),	/* IP header length */
+		BPF_STMT(BPF_LD | BPF_H | BPF_IND, SKF_NET_OFF),	/* source port */
+		BPF_STMT(BPF_ST, 0),
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 12),	/* source address */
+		BPF_STMT(BPF_LDX | BPF_W | BPF_MEM, 0),
+		BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+		BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, 0x9e3779b1),
+		BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),
+		BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, nb),
+		BPF_STMT(BPF_RET | BPF_A, 0),
+	};
+	struct sock_fprog prog = {
+		.len = sizeof(code) / sizeof(code[0]),
+		.filter = code,
+	};
+
+	if (setsockopt(sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == -1) {
+		logger(LOG_WARN, "attach_steering, could not attach the reuseport program : %s.", strerror(errno));
+		return 0;
 	}
-	return NULL;
+	return 1;
 }
 
-void server_start(struct server *s)
+/**
+ * Create and bind the socket of a receiver.
+ *
+ * @param s the server
+ * @param rcv the receiver
+ * @param reuseport set SO_REUSEPORT on the socket
+ */
+static void open_receiver_socket(struct server *s, struct receiver *rcv, int reuseport)
 {
 	struct sockaddr_in serv_addr;
 	int rc, on;
 
 	/* socket creation */
-	s->socket_desc = socket(AF_INET, SOCK_DGRAM, 0);
-	ERROR_IF(s->socket_desc < 0);
+	rcv->socket_desc = socket(AF_INET, SOCK_DGRAM, 0);
+	ERROR_IF(rcv->socket_desc < 0);
 	/* make the socket reusable */
 	on = 1;
-	setsockopt(s->socket_desc, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	setsockopt(rcv->socket_desc, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (reuseport) {
+		rc = setsockopt(rcv->socket_desc, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+		ERROR_IF(rc < 0);
+	}
 	/* bind local server port */
 	serv_addr.sin_family = AF_INET;
 	serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
 	serv_addr.sin_port = htons(s->port);
-	rc = bind(s->socket_desc, (struct sockaddr *)&serv_addr, sizeof(serv_addr));
+	rc = bind(rcv->socket_desc, (struct sockaddr *)&serv_addr, sizeof(serv_addr));
 	ERROR_IF(rc < 0);
+}
 
-	/* initialize for polling */
-	s->socket_poll.fd = s->socket_desc;
-	s->socket_poll.events = POLLIN;
-	s->socket_poll.revents = 0;
-
-
-	pthread_create(&s->main_thread, NULL, &server_run, (void *)s);
+void server_start(struct server *s)
+{
+	struct receiver *rcv;
+	unsigned int i, nb = s->conf->net.recv_threads;
+
+	s->receivers = (struct receiver *)calloc(nb, sizeof(struct receiver));
+	ERROR_IF(s->receivers == NULL);
+	s->nb_receivers = nb;
+	for (i = 0 ; i < nb ; i++) {
+		rcv = &s->receivers[i];
+		rcv->s = s;
+		rcv->idx = i;
+		/* the order of the bind()s is the index in the group */
+		open_receiver_socket(s, rcv, nb > 1);
+		rcv->backend = net_backend_get(s->conf->net.backend);
+		if (!rcv->backend->init(rcv))
+			exit(1);
+	}
+	if (nb > 1 && attach_steering(s->receivers[0].socket_desc, nb))
+		logger(LOG_INFO, "Server %i : %u receive threads, steered by client address.", s->id, nb);
+	logger(LOG_INFO, "Server %i : using the %s network backend.", s->id, s->receivers[0].backend->name);
+	/* every socket can send, use the first one */
+	s->socket_desc = s->receivers[0].socket_desc;
+
+	/* create the events the packet sender waits on */
+	if (!init_packet_sender(s))
+		exit(1);
+	/* each receiver is a reader of the voice snapshots */
+	if (!init_voice_plane(s, nb) || !init_control_worker(s))
+		exit(1);
+
+	pthread_create(&s->ctl_worker, NULL, &control_worker_thread, (void *)s);
+	for (i = 0 ; i < nb ; i++)
+		pthread_create(&s->receivers[i].thread, NULL, s->receivers[i].backend->run, (void *)&s->receivers[i]);
 	pthread_create(&s->packet_sender, NULL, &packet_sender_thread, (void *)s);
 }
 
 void server_stop(struct server *s)
 {
+	uint64_t pool_hits, pool_misses;
+	unsigned int i;
 	size_t iter;
 	struct player *tmp_pl;
 	void *el;
@@ -646,10 +825,22 @@ void server_stop(struct server *s)
 	/* wait for all players to have been destroyed */
 	while(s->leaving_players->used_slots != 0);
 
-	/* cancel the main thread */
-	pthread_cancel(s->main_thread);
+	/* cancel the receive threads */
+	for (i = 0 ; i < s->nb_receivers ; i++)
+		pthread_cancel(s->receivers[i].thread);
+	/* cancel the control worker */
+	pthread_cancel(s->ctl_worker);
 	/* cancel the packet sender thread */
 	pthread_cancel(s->packet_sender);
+	for (i = 0 ; i < s->nb_receivers ; i++)
+		pthread_join(s->receivers[i].thread, NULL);
+	pthread_join(s->ctl_worker, NULL);
+	pthread_join(s->packet_sender, NULL);
+	/* the state of the server, for a fast restart : nothing
+	 * changes it anymore */
+	db_snapshot_write(s, 1);
+	destroy_packet_sender(s);
+	tw_destroy(&s->timers);
 
 	set_config(NULL);
 
@@ -659,17 +850,25 @@ void server_stop(struct server *s)
 		destroy_channel(el);
 	ar_end_each;
 	ar_free(s->chans);
+	ida_destroy(&s->chan_ids);
+	free(s->chan_list.body);
 
 	/* destroy player list */
 	ar_free(s->players);
 	/* destroy leaving player list */
 	ar_free(s->leaving_players);
+	/* destroy the player indexes */
+	free(s->pl_by_id.slots);
+	free(s->leaving_by_id.slots);
+	ida_destroy(&s->player_ids);
+	mute_destroy(&s->mutes);
 	/* destroy bans and ban list */
 	ar_each(void *, el, iter, s->bans)
 		ar_remove(s->bans, el);
 		destroy_ban(el);
 	ar_end_each;
 	ar_free(s->bans);
+	ida_destroy(&s->ban_ids);
 
 	/* destroy registrations and registration list */
 	ar_each(void *, el, iter, s->regs)
@@ -678,11 +877,25 @@ void server_stop(struct server *s)
 	ar_end_each;
 	ar_free(s->regs);
 
+	logger(LOG_INFO, "Server %i : average receive batch fill : %.2f / %u datagrams.",
+			s->id, sstat_rx_batch_fill(s->stats), s->conf->net.recv_batch);
+	logger(LOG_INFO, "Server %i : average send batch fill : %.2f / %u datagrams.",
+			s->id, sstat_tx_batch_fill(s->stats), SB_MAX_MSGS);
+	pkt_pool_stats(&pool_hits, &pool_misses);
+	logger(LOG_INFO, "Packet pool : %llu buffers reused, %llu allocated.",
+			(unsigned long long)pool_hits, (unsigned long long)pool_misses);
+	/* after the channels, which retire their audio plans */
+	destroy_voice_plane(s);
+	destroy_control_worker(s);
+
 	/* destroy server stats */
 	destroy_sstat(s->stats);
 	/* destroy server privileges */
 	destroy_sp(s->privileges);
 
-	/* close the socket */
-	close(s->socket_desc);
+	/* close the sockets */
+	for (i = 0 ; i < s->nb_receivers ; i++) {
+		s->receivers[i].backend->destroy(&s->receivers[i]);
+		close(s->receivers[i].socket_desc);
+	}
 }
@@ -24,10 +24,16 @@
 #include "player.h"
 #include "array.h"
 #include "server_privileges.h"
+#include "timer_wheel.h"
+#include "voice_plane.h"
+#include "control_worker.h"
+#include "id_alloc.h"
+#include "mute.h"
 
 #include <pthread.h>
 #include <poll.h>
-#include <semaphore.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 
 #define ERROR_IF(cond) \
 	if(cond) { \
@@ -40,13 +46,65 @@
 		printf("(WW) %s", strerror(errno)); \
 	}
 
+/* public IDs of a server, the leaving players keep theirs
+ * until they are destroyed */
+#define MAX_PLAYER_ID 4096
+
+struct net_backend;
+
+/**
+ * A receive thread of a server. When a server uses several of
+ * them, each has its own socket bound with SO_REUSEPORT, and
+ * the datagrams of a client always go to the same one.
+ */
+struct receiver {
+	struct server *s;
+	unsigned int idx;		/* also the index of its voice reader */
+	int socket_desc;
+	const struct net_backend *backend;	/* how it receives datagrams */
+	void *backend_data;
+	struct ctl_queue ctl_queue;	/* datagrams for the control worker */
+	pthread_t thread;
+};
+
+/**
+ * The channel list sent to the players who join, serialized
+ * once and rebuilt only after a channel changed.
+ */
+struct chan_list_cache {
+	char *body;		/* number of channels, then the channels */
+	size_t len;
+	uint32_t crc;		/* crc of body */
+	uint64_t version;	/* incremented at each change */
+	uint64_t built;		/* version body was built from */
+};
+
+/**
+ * Players of a server indexed directly by their
+ * public ID (slot = public_id - 1). It is allocated once
+ * for every possible ID and never moves, the control worker
+ * and the packet sender both use it.
+ */
+struct player_table {
+	size_t size;		/* number of slots */
+	struct player **slots;
+};
+
 struct server {
 	uint32_t id;
 
 	struct array *chans;
+	struct chan_list_cache chan_list;
 	struct array *players;
 	struct array *leaving_players;
+	struct player_table pl_by_id;		/* index of players */
+	struct player_table leaving_by_id;	/* index of leaving_players */
+	struct id_alloc player_ids;	/* held until the player is destroyed */
+	struct id_alloc chan_ids;
+	struct id_alloc ban_ids;
+	struct mute_matrix mutes;
 	struct array *bans;
+	int bans_expired;	/* set by the packet sender, see lift_expired_bans() */
 	struct array *regs;
 	struct server_stat *stats;
 
@@ -56,19 +114,28 @@ struct server {
 	char welcome_msg[256];
 	uint16_t version[4]/* = {2,0,20,1}*/;
 
-	int socket_desc;
+	int socket_desc;	/* used to send, socket of the first receiver */
 	int port;
 	int codecs;
 
 	struct server_privileges *privileges;
 
-	struct pollfd socket_poll;
-	pthread_t main_thread;
+	unsigned int nb_receivers;
+	struct receiver *receivers;
 
 	struct config *conf;
 
-	sem_t send_packets;
+	int sender_epoll;	/* the packet sender waits on these two */
+	int sender_event;	/* eventfd, posted when there is something to send */
+	int sender_timer;	/* timerfd, armed for the next expiry of timers */
+	struct timer_wheel timers;	/* retransmissions, timeouts, ban expiry */
 	pthread_t packet_sender;
+
+	/* control plane, fed by the receivers */
+	int ctl_event;		/* eventfd, posted when there is work */
+	pthread_t ctl_worker;
+	/* what the receivers need to forward audio */
+	struct voice_plane voice;
 };
 
 
@@ -80,6 +147,7 @@ struct channel *get_channel_by_db_id(struct server *s, uint32_t db_id);
 int add_channel(struct server *serv, struct channel *chan);
 int destroy_channel_by_id(struct server *serv, uint32_t id);
 struct channel *get_default_channel(struct server *serv);
+void chan_list_changed(struct server *s);
 
 /* Server - player functions */
 struct player *get_player_by_ids(struct server *s, uint32_t pub_id, uint32_t priv_id);
@@ -87,11 +155,14 @@ struct player *get_leaving_player_by_ids(struct server *s, uint32_t pub_id, uint
 struct player *get_player_by_public_id(struct server *s, uint32_t pub_id);
 int add_player(struct server *serv, struct player *pl);
 void remove_player(struct server *s, struct player *p);
+void destroy_leaving_player(struct server *s, struct player *p);
 int move_player(struct player *p, struct channel *to);
 
 /* Server - ban functions */
 int add_ban(struct server *s, struct ban *b);
+int restore_ban(struct server *s, struct ban *b, uint64_t remaining);
 void remove_ban(struct server *s, struct ban *b);
+void lift_expired_bans(struct server *s);
 struct ban *get_ban_by_id(struct server *s, uint16_t id);
 struct ban *get_ban_by_ip(struct server *s, struct in_addr ip);
 
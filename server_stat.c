@@ -22,6 +22,8 @@
 #include "log.h"
 #include "compat.h"
 #include "queue.h"
+#include "packet_sender.h"
+#include "packet_pool.h"
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -36,33 +38,44 @@
 
 
 /**
- * Wrapper around the sendto function that handles timed statistics
+ * Queue a control packet for a player. The queue takes
+ * ownership of buf, which is given back to the packet pool
+ * when the player acknowledges it.
  *
  * @param s the server
- * @param buf the data
+ * @param buf the packet, allocated with pkt_alloc() or pkt_dup()
  * @param len the length of buf
- * @param flags sendto flags (see man(2) sendto)
- * @param dest_addr the destination address
- * @param addrlen the length of dest_addr
+ * @param flags unused
+ * @param pl the player
  *
- * @return the number of characters sent, or -1
+ * @return the number of characters queued, or -1
  */
-ssize_t send_to(struct server *s, const void *buf, size_t len, int flags,
+ssize_t send_to(struct server *s, void *buf, size_t len, int flags,
 		struct player *pl)
 {
-	char *buf_copy = (char *)calloc(len, sizeof(char));
-
+	if (buf == NULL) {
+		logger(LOG_WARN, "send_to, packet allocation failed.");
+		return -1;
+	}
 	logger(LOG_INFO, "Adding to queue packet type 0x%x", *(uint32_t *)buf);
-	memcpy(buf_copy, buf, len);
-	add_to_queue(pl->packets, buf_copy, len);
+	if (!add_to_queue(&pl->packets, buf, len)) {
+		pkt_free(buf);
+		return -1;
+	}
+	/* send it right away */
+	packet_sender_notify(s, pl);
 	return len;
 }
 
 void destroy_sstat(struct server_stat *st)
 {
-	free(st->pkt_sizes);
-	free(st->pkt_timestamps);
-	free(st->pkt_io);
+	struct sstat_shard *sh, *next;
+
+	for (sh = st->shards ; sh != NULL ; sh = next) {
+		next = sh->next;
+		free(sh);
+	}
+	pthread_mutex_destroy(&st->shards_mutex);
 	free(st);
 }
 
@@ -73,6 +86,7 @@ void destroy_sstat(struct server_stat *st)
  */
 struct server_stat *new_sstat()
 {
+	static uint64_t next_id = 1;
 	struct server_stat *st;
 
 	st = (struct server_stat *)calloc(1, sizeof(struct server_stat));
@@ -80,31 +94,65 @@ struct server_stat *new_sstat()
 		logger(LOG_WARN, "new_sstat, calloc of st failed : %s.", strerror(errno));
 		return NULL;
 	}
-	st->pkt_max = 10000;
-	st->pkt_sizes = (size_t *)calloc(st->pkt_max, sizeof(size_t));
-	st->pkt_timestamps = (struct timeval *)calloc(st->pkt_max, sizeof(struct timeval));
-	st->pkt_io = (char *)calloc(st->pkt_max, sizeof(char));
+	st->id = __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED);
 	st->start_time = time(NULL);
+	pthread_mutex_init(&st->shards_mutex, NULL);
+	return st;
+}
 
-	if (st->pkt_sizes == NULL || st->pkt_timestamps == NULL || st->pkt_io == NULL) {
-		logger(LOG_WARN, "new_sstat, calloc failed : %s.", strerror(errno));
-		if (st->pkt_sizes != NULL)
-			free(st->pkt_sizes);
-		if (st->pkt_timestamps != NULL)
-			free(st->pkt_timestamps);
-		if (st->pkt_io != NULL)
-			free(st->pkt_io);
-		free(st);
-		return NULL;
+/* shard of the last statistics the current thread recorded into */
+static __thread uint64_t cached_id = 0;
+static __thread struct sstat_shard *cached_shard = NULL;
+
+/**
+ * Retrieve the shard of the current thread, creating it
+ * the first time the thread records something.
+ *
+ * @param st the server statistics
+ *
+ * @return the shard, or NULL if the allocation failed
+ */
+static struct sstat_shard *get_shard(struct server_stat *st)
+{
+	struct sstat_shard *sh;
+	pthread_t self = pthread_self();
+
+	if (cached_id == st->id)
+		return cached_shard;
+
+	pthread_mutex_lock(&st->shards_mutex);
+	for (sh = st->shards ; sh != NULL ; sh = sh->next)
+		if (pthread_equal(sh->owner, self))
+			break;
+	if (sh == NULL) {
+		if (posix_memalign((void **)&sh, 64, sizeof(struct sstat_shard)) != 0) {
+			logger(LOG_WARN, "get_shard, allocation failed.");
+			pthread_mutex_unlock(&st->shards_mutex);
+			return NULL;
+		}
+		bzero(sh, sizeof(struct sstat_shard));
+		sh->owner = self;
+		sh->next = st->shards;
+		/* publish the initialized shard to the readers */
+		__atomic_store_n(&st->shards, sh, __ATOMIC_RELEASE);
 	}
-	return st;
+	pthread_mutex_unlock(&st->shards_mutex);
+
+	cached_id = st->id;
+	cached_shard = sh;
+	return sh;
 }
 
+/* only the owner writes, a relaxed load/store pair is enough */
+#define SHARD_ADD(field, val) \
+	__atomic_store_n(&(field), __atomic_load_n(&(field), __ATOMIC_RELAXED) + (val), __ATOMIC_RELAXED)
+#define SHARD_GET(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
 /**
  * Add a packet to the statistics :
  * - add its size to the total size
  * - increment the counter
- * - insert it into the timed statistics
+ * - add its size to the bucket of the current second
  *
  * @param st the server statistics
  * @param size the size of the packet
@@ -112,92 +160,172 @@ struct server_stat *new_sstat()
  */
 void sstat_add_packet(struct server_stat *st, size_t size, char in_out)
 {
-	struct timeval now, res;
-	size_t *tmp_sizes;
-	char *tmp_io;
-	struct timeval *tmp_timestamps;
-	int i;
+	struct sstat_shard *sh = get_shard(st);
+	struct sstat_bucket *b;
+	time_t now;
+
+	if (sh == NULL)
+		return;
 
 	if (in_out == 1) {
-		st->pkt_sent++;
-		st->size_sent += size;
+		SHARD_ADD(sh->c.pkt_sent, 1);
+		SHARD_ADD(sh->c.size_sent, size);
 	} else if (in_out == 0) {
-		st->pkt_rec++;
-		st->size_rec += size;
-	}
-
-	gettimeofday(&now, NULL);
-
-	/* Insert in the table if possible */
-	for (i = 0 ; i < st->pkt_max ; i++) {
-		timersub(&now, &st->pkt_timestamps[i], &res);
-		if (st->pkt_sizes[i] == 0 || res.tv_sec > 60) {
-			st->pkt_sizes[i] = size;
-			gettimeofday(&st->pkt_timestamps[i], NULL);
-			st->pkt_io[i] = in_out;
-			return;
-		}
-	}
-	st->pkt_max *= 2;
-	/* reallocate and clean */
-	tmp_sizes = (size_t *)realloc(st->pkt_sizes, sizeof(size_t) * st->pkt_max);
-	if (tmp_sizes == NULL) {
-		logger(LOG_WARN, "sstat_add_packet, pkt_sizes realloc failed : %s.", strerror(errno));
-		st->pkt_max /= 2;	/* restore the old size */
+		SHARD_ADD(sh->c.pkt_rec, 1);
+		SHARD_ADD(sh->c.size_rec, size);
+	} else {
 		return;
 	}
-	st->pkt_sizes = tmp_sizes;
-	bzero(st->pkt_sizes + (st->pkt_max / 2), sizeof(size_t) * st->pkt_max / 2); /* realloc does not set to zero! */
-
-	/* reallocate */
-	tmp_timestamps = (struct timeval *)realloc(st->pkt_timestamps, sizeof(struct timeval) * st->pkt_max);
-	if (tmp_timestamps == NULL) {
-		logger(LOG_WARN, "sstat_add_packet, pkt_timestamps realloc failed : %s.", strerror(errno));
-		st->pkt_max /= 2;
-		return;
-	}
-	st->pkt_timestamps = tmp_timestamps;
 
-	tmp_io = (char *)realloc(st->pkt_io, sizeof(char) * st->pkt_max);
-	if (tmp_io == NULL) {
-		logger(LOG_WARN, "sstat_add_packet, pkt_io realloc failed : %s.", strerror(errno));
-		st->pkt_max /= 2;
-		return;
+	now = time(NULL);
+	b = &sh->buckets[now % SSTAT_BUCKETS];
+	if (SHARD_GET(b->sec) != now) {
+		/* this bucket is a minute old, recycle it */
+		__atomic_store_n(&b->size[0], 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&b->size[1], 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&b->sec, now, __ATOMIC_RELAXED);
 	}
-	st->pkt_io = tmp_io;
-
-	/* insert */
-	st->pkt_sizes[(st->pkt_max / 2) + 1] = size;
-	gettimeofday(&st->pkt_timestamps[(st->pkt_max / 2) + 1], NULL);
-	st->pkt_io[i] = in_out;
+	SHARD_ADD(b->size[(int)in_out], size);
 }
 
 /**
  * Compute time relative statistics (bytes/sec or bytes/min)
+ * from the buckets of every thread.
  *
  * @param st the server statistics
  * @param stats the results
  */
 void compute_timed_stats(struct server_stat *st, uint32_t *stats)
 {
-	struct timeval now, res;
-	int i;
+	struct sstat_shard *sh;
+	struct sstat_bucket *b;
+	time_t now, sec;
+	int i, io;
 
-	gettimeofday(&now, NULL);
-	/* res[0] = Rx / sec
+	now = time(NULL);
+	/* res[0] = Rx / sec (last complete second)
 	 * res[1] = Tx / sec
 	 * res[2] = Rx / min
-	 * res[3] = Tx / sec */
-	for (i = 0 ; i < st->pkt_max ; i++) {
-		timersub(&now, &st->pkt_timestamps[i], &res);
-		if (res.tv_sec < 60) {
-			stats[2 + st->pkt_io[i]] += st->pkt_sizes[i];
-			if (res.tv_sec < 1) {
-				stats[0 + st->pkt_io[i]] += st->pkt_sizes[i];
+	 * res[3] = Tx / min */
+	for (sh = __atomic_load_n(&st->shards, __ATOMIC_ACQUIRE) ; sh != NULL ; sh = sh->next) {
+		for (i = 0 ; i < SSTAT_BUCKETS ; i++) {
+			b = &sh->buckets[i];
+			sec = SHARD_GET(b->sec);
+			if (now - sec >= SSTAT_BUCKETS)
+				continue;
+			for (io = 0 ; io < 2 ; io++) {
+				stats[2 + io] += SHARD_GET(b->size[io]);
+				if (sec == now - 1)
+					stats[io] += SHARD_GET(b->size[io]);
 			}
-		} else {
-			/* clear */
-			st->pkt_sizes[i] = 0;
 		}
 	}
 }
+
+/**
+ * Sum the counters of every thread.
+ *
+ * @param st the server statistics
+ * @param res the sum
+ */
+void sstat_sum(struct server_stat *st, struct sstat_counters *res)
+{
+	struct sstat_shard *sh;
+
+	bzero(res, sizeof(struct sstat_counters));
+	for (sh = __atomic_load_n(&st->shards, __ATOMIC_ACQUIRE) ; sh != NULL ; sh = sh->next) {
+		res->pkt_sent += SHARD_GET(sh->c.pkt_sent);
+		res->pkt_rec += SHARD_GET(sh->c.pkt_rec);
+		res->size_sent += SHARD_GET(sh->c.size_sent);
+		res->size_rec += SHARD_GET(sh->c.size_rec);
+		res->rx_batches += SHARD_GET(sh->c.rx_batches);
+		res->rx_batched_pkts += SHARD_GET(sh->c.rx_batched_pkts);
+		res->tx_batches += SHARD_GET(sh->c.tx_batches);
+		res->tx_batched_pkts += SHARD_GET(sh->c.tx_batched_pkts);
+		res->tx_batched_bytes += SHARD_GET(sh->c.tx_batched_bytes);
+		res->total_logins += SHARD_GET(sh->c.total_logins);
+	}
+}
+
+/**
+ * Account for a player login.
+ *
+ * @param st the server statistics
+ */
+void sstat_add_login(struct server_stat *st)
+{
+	struct sstat_shard *sh = get_shard(st);
+
+	if (sh != NULL)
+		SHARD_ADD(sh->c.total_logins, 1);
+}
+
+/**
+ * Account for one batched read from the socket.
+ *
+ * @param st the server statistics
+ * @param nb_pkts the number of datagrams returned by this read
+ */
+void sstat_add_rx_batch(struct server_stat *st, unsigned int nb_pkts)
+{
+	struct sstat_shard *sh = get_shard(st);
+
+	if (sh == NULL)
+		return;
+	SHARD_ADD(sh->c.rx_batches, 1);
+	SHARD_ADD(sh->c.rx_batched_pkts, nb_pkts);
+}
+
+/**
+ * Compute the average number of datagrams returned by
+ * each batched read since the server started.
+ *
+ * @param st the server statistics
+ *
+ * @return the average batch fill
+ */
+double sstat_rx_batch_fill(struct server_stat *st)
+{
+	struct sstat_counters c;
+
+	sstat_sum(st, &c);
+	if (c.rx_batches == 0)
+		return 0;
+	return (double)c.rx_batched_pkts / c.rx_batches;
+}
+
+/**
+ * Account for one flush of the send batch.
+ *
+ * @param st the server statistics
+ * @param nb_pkts the number of datagrams sent by this flush
+ * @param size the total size of those datagrams
+ */
+void sstat_add_tx_batch(struct server_stat *st, unsigned int nb_pkts, size_t size)
+{
+	struct sstat_shard *sh = get_shard(st);
+
+	if (sh == NULL)
+		return;
+	SHARD_ADD(sh->c.tx_batches, 1);
+	SHARD_ADD(sh->c.tx_batched_pkts, nb_pkts);
+	SHARD_ADD(sh->c.tx_batched_bytes, size);
+}
+
+/**
+ * Compute the average number of datagrams sent by each
+ * flush of the send batch since the server started.
+ *
+ * @param st the server statistics
+ *
+ * @return the average batch fill
+ */
+double sstat_tx_batch_fill(struct server_stat *st)
+{
+	struct sstat_counters c;
+
+	sstat_sum(st, &c);
+	if (c.tx_batches == 0)
+		return 0;
+	return (double)c.tx_batched_pkts / c.tx_batches;
+}
@@ -23,34 +23,78 @@
 #include <sys/socket.h>
 #include <stdint.h>
 #include <time.h>
+#include <pthread.h>
 #include "server.h"
 
-struct server_stat
-{
-	/* array */
-	size_t *pkt_sizes;
-	struct timeval *pkt_timestamps;
-	char *pkt_io;
-	long pkt_max;
+/* number of per-second buckets, for the per-minute rates */
+#define SSTAT_BUCKETS 60
 
+/**
+ * Counters of a server, also used to return their sum.
+ */
+struct sstat_counters
+{
 	/* bytes/packets received/sent */
 	uint64_t pkt_sent;
 	uint64_t pkt_rec;
 	uint64_t size_sent;
 	uint64_t size_rec;
 
-	time_t start_time;
+	/* number of recvmmsg calls and datagrams they returned */
+	uint64_t rx_batches;
+	uint64_t rx_batched_pkts;
+	/* number of sendmmsg flushes and datagrams they sent */
+	uint64_t tx_batches;
+	uint64_t tx_batched_pkts;
+	uint64_t tx_batched_bytes;
 
 	uint64_t total_logins;
 };
 
+/**
+ * Bytes received and sent during one second.
+ */
+struct sstat_bucket
+{
+	time_t sec;
+	uint64_t size[2];	/* 0 = in, 1 = out */
+};
+
+/**
+ * The statistics recorded by one thread. Only that thread
+ * writes them, other threads read them with relaxed loads.
+ */
+struct sstat_shard
+{
+	pthread_t owner;
+	struct sstat_counters c;
+	struct sstat_bucket buckets[SSTAT_BUCKETS];	/* indexed by sec % SSTAT_BUCKETS */
+	struct sstat_shard *next;
+} __attribute__((aligned(64)));
+
+struct server_stat
+{
+	uint64_t id;		/* unique, identifies the stats in thread caches */
+	time_t start_time;
+
+	/* one shard per thread that recorded something */
+	struct sstat_shard *shards;
+	pthread_mutex_t shards_mutex;
+};
+
 
-ssize_t send_to(struct server *s, const void *buf, size_t len, int flags,
+ssize_t send_to(struct server *s, void *buf, size_t len, int flags,
 		struct player *pl);
 void destroy_sstat(struct server_stat *st);
 struct server_stat *new_sstat(void);
 void sstat_add_packet(struct server_stat *st, size_t size, char in_out);
 void compute_timed_stats(struct server_stat *st, uint32_t *res);
+void sstat_add_rx_batch(struct server_stat *st, unsigned int nb_pkts);
+double sstat_rx_batch_fill(struct server_stat *st);
+void sstat_add_tx_batch(struct server_stat *st, unsigned int nb_pkts, size_t size);
+double sstat_tx_batch_fill(struct server_stat *st);
+void sstat_add_login(struct server_stat *st);
+void sstat_sum(struct server_stat *st, struct sstat_counters *res);
 /*
  * void timersub(struct timeval *a, struct timeval *b,
                      struct timeval *res);
@@ -0,0 +1,301 @@
+/*
+ * soliloque-server, an open source implementation of the TeamSpeak protocol.
+ * Copyright (C) 2009 Hugo Camboulive <hugo.camboulive AT gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "timer_wheel.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <time.h>
+#include <pthread.h>
+
+/**
+ * Current time in ticks (milliseconds) of the monotonic clock.
+ *
+ * @return the current tick
+ */
+uint64_t tw_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Initialize an empty wheel, starting at the current time.
+ *
+ * @param w the wheel
+ * @param owner passed as the first argument of the callbacks
+ */
+void tw_init(struct timer_wheel *w, void *owner)
+{
+	bzero(w, sizeof(struct timer_wheel));
+	w->now = tw_now();
+	w->owner = owner;
+	pthread_mutex_init(&w->mutex, NULL);
+}
+
+/**
+ * Release the resources of a wheel. Pending timers are
+ * simply forgotten, they belong to their callers.
+ *
+ * @param w the wheel
+ */
+void tw_destroy(struct timer_wheel *w)
+{
+	pthread_mutex_destroy(&w->mutex);
+}
+
+/**
+ * Initialize a timer.
+ *
+ * @param t the timer
+ * @param func the function called when the timer fires
+ * @param data passed as the second argument of func
+ */
+void tw_init_timer(struct tw_timer *t, void (*func)(void *, void *), void *data)
+{
+	bzero(t, sizeof(struct tw_timer));
+	t->func = func;
+	t->data = data;
+}
+
+static uint64_t ror64(uint64_t x, unsigned int n)
+{
+	n &= 63;
+	return n ? (x >> n) | (x << (64 - n)) : x;
+}
+
+static void link_timer(struct tw_timer *t, struct tw_timer **head, uint64_t *bitmap, int slot)
+{
+	t->prev = NULL;
+	t->next = *head;
+	if (*head != NULL)
+		(*head)->prev = t;
+	*head = t;
+	t->head = head;
+	t->bitmap = bitmap;
+	t->slot = slot;
+	if (bitmap != NULL)
+		*bitmap |= 1ULL << slot;
+}
+
+static void unlink_timer(struct tw_timer *t)
+{
+	if (t->prev != NULL)
+		t->prev->next = t->next;
+	else
+		*t->head = t->next;
+	if (t->next != NULL)
+		t->next->prev = t->prev;
+	if (*t->head == NULL && t->bitmap != NULL)
+		*t->bitmap &= ~(1ULL << t->slot);
+	t->prev = NULL;
+	t->next = NULL;
+	t->head = NULL;
+}
+
+/**
+ * Put a timer in the level and slot matching its expiry.
+ * The wheel mutex has to be locked.
+ */
+static void place_timer(struct timer_wheel *w, struct tw_timer *t)
+{
+	uint64_t expires, delta;
+	int level, slot;
+
+	/* late timers fire on the next processed tick */
+	expires = (t->expires < w->now) ? w->now : t->expires;
+	delta = expires - w->now;
+	if (delta > TW_MAX_DELAY) {
+		delta = TW_MAX_DELAY;
+		expires = w->now + delta;
+	}
+	level = 0;
+	while (level < TW_LEVELS - 1 && delta >= (1ULL << ((level + 1) * TW_SLOT_BITS)))
+		level++;
+	slot = (expires >> (level * TW_SLOT_BITS)) & TW_SLOT_MASK;
+	link_timer(t, &w->slots[level][slot], &w->bitmaps[level], slot);
+}
+
+/**
+ * Move the timers of the current slot of a level
+ * to the levels below.
+ *
+ * @return the index of the slot
+ */
+static int cascade(struct timer_wheel *w, int level)
+{
+	int slot = (w->now >> (level * TW_SLOT_BITS)) & TW_SLOT_MASK;
+	struct tw_timer *t, *next;
+
+	t = w->slots[level][slot];
+	w->slots[level][slot] = NULL;
+	w->bitmaps[level] &= ~(1ULL << slot);
+	for ( ; t != NULL ; t = next) {
+		next = t->next;
+		t->head = NULL;
+		place_timer(w, t);
+	}
+	return slot;
+}
+
+/**
+ * Arm (or re-arm) a timer. Can be called from any thread.
+ *
+ * @param w the wheel
+ * @param t the timer
+ * @param expires the tick at which it should fire (see tw_now)
+ */
+void tw_add(struct timer_wheel *w, struct tw_timer *t, uint64_t expires)
+{
+	pthread_mutex_lock(&w->mutex);
+	if (t->head != NULL)
+		unlink_timer(t);
+	t->expires = expires;
+	place_timer(w, t);
+	pthread_mutex_unlock(&w->mutex);
+}
+
+/**
+ * Disarm a timer, if it is pending. Can be called from any thread.
+ *
+ * @param w the wheel
+ * @param t the timer
+ */
+void tw_cancel(struct timer_wheel *w, struct tw_timer *t)
+{
+	pthread_mutex_lock(&w->mutex);
+	if (t->head != NULL)
+		unlink_timer(t);
+	pthread_mutex_unlock(&w->mutex);
+}
+
+/**
+ * Tell if a timer is armed.
+ *
+ * @param t the timer
+ *
+ * @return 1 if the timer is waiting to fire, 0 else
+ */
+int tw_pending(struct tw_timer *t)
+{
+	return t->head != NULL;
+}
+
+/**
+ * Advance the wheel up to a given tick, and call the
+ * function of every timer that expired. The callbacks are
+ * called without the wheel lock, one at a time, so they can
+ * re-arm or cancel any timer (including the ones that are due).
+ *
+ * @param w the wheel
+ * @param now the current tick
+ */
+void tw_run(struct timer_wheel *w, uint64_t now)
+{
+	struct tw_timer *t, *next;
+	void (*func)(void *, void *);
+	void *data;
+	uint64_t bits;
+	int idx, level;
+
+	pthread_mutex_lock(&w->mutex);
+	while (w->now <= now) {
+		idx = w->now & TW_SLOT_MASK;
+		/* the lowest level wrapped, bring the next timers down */
+		if (idx == 0) {
+			for (level = 1 ; level < TW_LEVELS && cascade(w, level) == 0 ; level++)
+				;
+		}
+		/* everything in the current slot is due */
+		t = w->slots[0][idx];
+		w->slots[0][idx] = NULL;
+		w->bitmaps[0] &= ~(1ULL << idx);
+		for ( ; t != NULL ; t = next) {
+			next = t->next;
+			link_timer(t, &w->expired, NULL, 0);
+		}
+		/* skip the empty slots, but stop at the next wrap */
+		bits = (idx == TW_SLOT_MASK) ? 0 : w->bitmaps[0] >> (idx + 1);
+		if (bits != 0)
+			w->now += __builtin_ctzll(bits) + 1;
+		else
+			w->now += TW_SLOTS - idx;
+		if (w->now > now + 1)
+			w->now = now + 1;
+	}
+
+	while ((t = w->expired) != NULL) {
+		unlink_timer(t);
+		/* once unlocked, another thread can free the timer */
+		func = t->func;
+		data = t->data;
+		pthread_mutex_unlock(&w->mutex);
+		func(w->owner, data);
+		pthread_mutex_lock(&w->mutex);
+	}
+	pthread_mutex_unlock(&w->mutex);
+}
+
+/**
+ * Compute when tw_run has to be called next : the expiry of
+ * the earliest timer of the lowest level, or the next time a
+ * non-empty slot of an upper level has to be cascaded.
+ *
+ * @param w the wheel
+ *
+ * @return the tick, or -1 if there is no pending timer
+ */
+int64_t tw_next_expiry(struct timer_wheel *w)
+{
+	uint64_t cur, bits, next;
+	int64_t res = -1;
+	int level, shift;
+
+	pthread_mutex_lock(&w->mutex);
+	if (w->expired != NULL) {
+		pthread_mutex_unlock(&w->mutex);
+		return w->now;
+	}
+	for (level = 0 ; level < TW_LEVELS ; level++) {
+		if (w->bitmaps[level] == 0)
+			continue;
+		shift = level * TW_SLOT_BITS;
+		cur = w->now >> shift;
+		if (level == 0) {
+			/* the current slot is due now */
+			bits = ror64(w->bitmaps[0], cur & TW_SLOT_MASK);
+			next = w->now + __builtin_ctzll(bits);
+		} else if ((w->now & ((1ULL << shift) - 1)) == 0) {
+			/* the current slot will be cascaded on the next tick */
+			bits = ror64(w->bitmaps[level], cur & TW_SLOT_MASK);
+			next = (cur + __builtin_ctzll(bits)) << shift;
+		} else {
+			/* the current slot is a whole turn away */
+			bits = ror64(w->bitmaps[level], (cur + 1) & TW_SLOT_MASK);
+			next = (cur + __builtin_ctzll(bits) + 1) << shift;
+		}
+		if (res == -1 || next < (uint64_t)res)
+			res = next;
+	}
+	pthread_mutex_unlock(&w->mutex);
+	return res;
+}
@@ -0,0 +1,78 @@
+/*
+ * soliloque-server, an open source implementation of the TeamSpeak protocol.
+ * Copyright (C) 2009 Hugo Camboulive <hugo.camboulive AT gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __TIMER_WHEEL_H__
+#define __TIMER_WHEEL_H__
+
+#include <stdint.h>
+#include <pthread.h>
+
+/* a tick is one millisecond */
+#define TW_LEVELS 6
+#define TW_SLOT_BITS 6
+#define TW_SLOTS (1 << TW_SLOT_BITS)
+#define TW_SLOT_MASK (TW_SLOTS - 1)
+/* timers further away than that are clamped (~2 years) */
+#define TW_MAX_DELAY ((1ULL << (TW_LEVELS * TW_SLOT_BITS)) - 1)
+
+/**
+ * A timer, usually embedded in the structure it works for.
+ * It has to be initialized with tw_init_timer before use.
+ */
+struct tw_timer {
+	uint64_t expires;	/* tick at which the timer fires */
+	/* called with the owner of the wheel and data */
+	void (*func)(void *owner, void *data);
+	void *data;
+
+	/* list of the slot the timer is in, NULL if not pending */
+	struct tw_timer *prev;
+	struct tw_timer *next;
+	struct tw_timer **head;
+	uint64_t *bitmap;	/* occupancy bitmap of that list's level */
+	int slot;
+};
+
+/**
+ * Hierarchical timing wheel : TW_LEVELS levels of TW_SLOTS
+ * slots, level l covering ticks in [64^l, 64^(l+1)) from now.
+ * Inserting and cancelling are O(1), timers cascade to the
+ * level below when their slot comes up.
+ */
+struct timer_wheel {
+	uint64_t now;		/* next tick to process */
+	void *owner;
+	struct tw_timer *slots[TW_LEVELS][TW_SLOTS];
+	uint64_t bitmaps[TW_LEVELS];	/* bit n set = slot n not empty */
+	struct tw_timer *expired;	/* timers due, waiting for their callback */
+
+	pthread_mutex_t mutex;
+};
+
+uint64_t tw_now(void);
+void tw_init(struct timer_wheel *w, void *owner);
+void tw_destroy(struct timer_wheel *w);
+void tw_init_timer(struct tw_timer *t, void (*func)(void *, void *), void *data);
+void tw_add(struct timer_wheel *w, struct tw_timer *t, uint64_t expires);
+void tw_cancel(struct timer_wheel *w, struct tw_timer *t);
+int tw_pending(struct tw_timer *t);
+void tw_run(struct timer_wheel *w, uint64_t now);
+int64_t tw_next_expiry(struct timer_wheel *w);
+
+#endif
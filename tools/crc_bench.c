@@ -0,0 +1,106 @@
+/*
+ * Microbenchmark of the CRC32 engines of crc.c, on the sizes of the
+ * packets the server checksums (keepalive, connection, accept, lists).
+ * Build and run it with tools/crc_bench.sh.
+ */
+#include "../crc.c"
+
+#include <time.h>
+
+#define BUF_SIZE 4096
+
+/* what crc_32 used to do : rebuild the table, then one byte at a time */
+static uint32_t crc_legacy(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	uint32_t table[256];
+	uint32_t i, j, c;
+
+	for (i = 0 ; i < 256 ; i++) {
+		c = i;
+		for (j = 8 ; j > 0 ; j--)
+			c = (c & 1) ? (c >> 1) ^ CRC_POLY : c >> 1;
+		table[i] = c;
+	}
+	for (i = 0 ; i < len ; i++)
+		crc = (crc >> 8) ^ table[(buf[i] ^ crc) & 0xFF];
+	return crc;
+}
+
+/* table driven, one byte at a time */
+static uint32_t crc_bytewise(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	while (len-- > 0)
+		crc = (crc >> 8) ^ crc_table[0][(crc ^ *buf++) & 0xFF];
+	return crc;
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void bench(const char *name, uint32_t (*f)(uint32_t, const uint8_t *, size_t),
+		const uint8_t *buf, size_t len)
+{
+	volatile uint32_t sink = 0;
+	size_t iters = (64 * 1024 * 1024) / len;
+	double start, ns;
+	size_t i;
+
+	if (f == &crc_legacy)
+		iters /= 16;
+	start = now_ns();
+	for (i = 0 ; i < iters ; i++)
+		sink ^= f(~0U, buf, len);
+	ns = (now_ns() - start) / iters;
+	printf("  %-14s %9.1f ns/packet %8.2f GB/s\n", name, ns, len / ns);
+	(void)sink;
+}
+
+int main(void)
+{
+	static const size_t sizes[] = {24, 180, 436, 1400};
+	uint8_t buf[BUF_SIZE];
+	size_t i, len;
+	uint32_t ref;
+
+	pthread_once(&crc_once, &crc_init);
+	srand(42);
+	for (i = 0 ; i < BUF_SIZE ; i++)
+		buf[i] = rand();
+
+	/* check the engines against each other first */
+	if (crc_32("123456789", 9) != 0xCBF43926) {
+		printf("crc_32 check value is wrong\n");
+		return 1;
+	}
+	for (len = 0 ; len < BUF_SIZE ; len += 1 + len / 8) {
+		for (i = 0 ; i < 8 && i < BUF_SIZE - len ; i++) {
+			ref = crc_bytewise(~0U, buf + i, len);
+			if (crc_slice8(~0U, buf + i, len) != ref
+#ifdef CRC_HAVE_PCLMUL
+					|| (crc_engine == &crc_pclmul && crc_pclmul(~0U, buf + i, len) != ref)
+#endif
+					) {
+				printf("mismatch for len %zu, offset %zu\n", len, i);
+				return 1;
+			}
+		}
+	}
+	printf("engines agree, selected engine : %s\n", crc_32_engine());
+
+	for (i = 0 ; i < sizeof(sizes) / sizeof(sizes[0]) ; i++) {
+		printf("%zu bytes\n", sizes[i]);
+		bench("legacy", &crc_legacy, buf, sizes[i]);
+		bench("bytewise", &crc_bytewise, buf, sizes[i]);
+		bench("slicing-by-8", &crc_slice8, buf, sizes[i]);
+#ifdef CRC_HAVE_PCLMUL
+		if (crc_engine == &crc_pclmul)
+			bench("pclmulqdq", &crc_pclmul, buf, sizes[i]);
+#endif
+	}
+	return 0;
+}
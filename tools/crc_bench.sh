@@ -0,0 +1,3 @@
+#!/bin/sh
+# build the CRC32 microbenchmark against the configured tree and run it
+gcc -O2 -Wall -I. -Ioutput/default -o output/crc_bench tools/crc_bench.c -lpthread && ./output/crc_bench
@@ -0,0 +1,272 @@
+/*
+ * Load generator for the network backends : connects players to a
+ * running server, has some of them talk in the default channel and
+ * measures the audio the others receive, and the CPU time the
+ * server used for it. Build and run it with tools/net_bench.sh.
+ *
+ * usage : net_bench port players talkers pkts_per_talker_per_sec seconds [server_pid]
+ */
+#include "../crc.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/* codec 10 (speex 16.3) : 189 bytes of audio per packet */
+#define AUDIO_CODEC 10
+#define AUDIO_BODY 189
+#define AUDIO_LEN (16 + AUDIO_BODY)
+
+struct bench_player {
+	int sock;
+	uint32_t priv, pub;
+	uint32_t keepalive;
+	uint16_t audio_counter;
+	uint64_t audio_rx;
+};
+
+static struct sockaddr_in serv_addr;
+
+static double now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* user + system time of a process, in seconds */
+static double proc_cpu(int pid)
+{
+	char path[64], buf[1024], *p;
+	unsigned long utime, stime;
+	FILE *f;
+
+	if (pid <= 0)
+		return 0;
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	f = fopen(path, "r");
+	if (f == NULL || fgets(buf, sizeof(buf), f) == NULL) {
+		if (f != NULL)
+			fclose(f);
+		return 0;
+	}
+	fclose(f);
+	/* the name can contain spaces, skip it */
+	p = strrchr(buf, ')');
+	if (p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+				&utime, &stime) != 2)
+		return 0;
+	return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static void put_string(char *dst, const char *s, size_t n)
+{
+	size_t len = strlen(s);
+
+	bzero(dst, n + 1);
+	dst[0] = len;
+	memcpy(dst + 1, s, len);
+}
+
+static void send_connect(struct bench_player *p, int i)
+{
+	char pkt[180], name[30];
+	uint32_t crc;
+
+	bzero(pkt, sizeof(pkt));
+	*(uint16_t *)pkt = 0xbef4;
+	*(uint16_t *)(pkt + 2) = 3;
+	*(uint32_t *)(pkt + 12) = 1;
+	put_string(pkt + 20, "TeamSpeak", 29);
+	put_string(pkt + 50, "Linux", 29);
+	*(uint16_t *)(pkt + 80) = 2;
+	*(uint16_t *)(pkt + 84) = 32;
+	*(uint16_t *)(pkt + 86) = 60;
+	snprintf(name, sizeof(name), "bench%d", i);
+	put_string(pkt + 150, name, 29);
+	crc = crc_32_zeroed(pkt, sizeof(pkt), 16);
+	memcpy(pkt + 16, &crc, 4);
+	sendto(p->sock, pkt, sizeof(pkt), 0, (struct sockaddr *)&serv_addr, sizeof(serv_addr));
+}
+
+static void send_keepalive(struct bench_player *p)
+{
+	char pkt[24];
+	uint32_t crc;
+
+	bzero(pkt, sizeof(pkt));
+	*(uint16_t *)pkt = 0xbef4;
+	*(uint16_t *)(pkt + 2) = 1;
+	*(uint32_t *)(pkt + 4) = p->priv;
+	*(uint32_t *)(pkt + 8) = p->pub;
+	*(uint32_t *)(pkt + 12) = p->keepalive;
+	*(uint32_t *)(pkt + 20) = p->keepalive;
+	p->keepalive++;
+	crc = crc_32_zeroed(pkt, sizeof(pkt), 16);
+	memcpy(pkt + 16, &crc, 4);
+	sendto(p->sock, pkt, sizeof(pkt), 0, (struct sockaddr *)&serv_addr, sizeof(serv_addr));
+}
+
+static void send_audio(struct bench_player *p)
+{
+	char pkt[AUDIO_LEN];
+
+	bzero(pkt, sizeof(pkt));
+	*(uint16_t *)pkt = 0xbef2;
+	pkt[3] = AUDIO_CODEC;
+	*(uint32_t *)(pkt + 4) = p->priv;
+	*(uint32_t *)(pkt + 8) = p->pub;
+	*(uint16_t *)(pkt + 14) = p->audio_counter++;
+	sendto(p->sock, pkt, sizeof(pkt), 0, (struct sockaddr *)&serv_addr, sizeof(serv_addr));
+}
+
+/* read everything a player received, acknowledge the control packets */
+static void pump(struct bench_player *p)
+{
+	char buf[2048], ack[16];
+	ssize_t len;
+
+	while ((len = recv(p->sock, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+		switch (*(uint16_t *)buf) {
+		case 0xbef4:
+			if (len >= 12 && *(uint16_t *)(buf + 2) == 4) {
+				p->priv = *(uint32_t *)(buf + 4);
+				p->pub = *(uint32_t *)(buf + 8);
+			}
+			break;
+		case 0xbef0:
+			if (len < 20)
+				break;
+			*(uint16_t *)ack = 0xbef1;
+			memcpy(ack + 2, buf + 16, 2);	/* version */
+			*(uint32_t *)(ack + 4) = p->priv;
+			*(uint32_t *)(ack + 8) = p->pub;
+			memcpy(ack + 12, buf + 12, 4);	/* counter */
+			send(p->sock, ack, sizeof(ack), 0);
+			break;
+		case 0xbef3:
+			p->audio_rx++;
+			break;
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_player *pl;
+	struct epoll_event ev, evs[64];
+	int port, nb, talkers, rate, secs, pid = 0, ep, i, n, connected;
+	double start, end, t, next_tick, next_ka, cpu0, cpu1, credit = 0;
+	uint64_t sent = 0, rx0 = 0, rx1 = 0;
+
+	if (argc < 6) {
+		fprintf(stderr, "usage : %s port players talkers pkts_per_talker_per_sec seconds [server_pid]\n", argv[0]);
+		return 1;
+	}
+	port = atoi(argv[1]);
+	nb = atoi(argv[2]);
+	talkers = atoi(argv[3]);
+	rate = atoi(argv[4]);
+	secs = atoi(argv[5]);
+	if (argc > 6)
+		pid = atoi(argv[6]);
+	if (nb < 2 || talkers < 1 || talkers > nb || rate < 1 || secs < 1) {
+		fprintf(stderr, "bad arguments\n");
+		return 1;
+	}
+
+	serv_addr.sin_family = AF_INET;
+	serv_addr.sin_port = htons(port);
+	serv_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	pl = (struct bench_player *)calloc(nb, sizeof(struct bench_player));
+	ep = epoll_create1(0);
+	for (i = 0 ; i < nb ; i++) {
+		int rcvbuf = 4 * 1024 * 1024;
+
+		pl[i].sock = socket(AF_INET, SOCK_DGRAM, 0);
+		setsockopt(pl[i].sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+		connect(pl[i].sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr));
+		pl[i].keepalive = 1;
+		ev.events = EPOLLIN;
+		ev.data.u32 = i;
+		epoll_ctl(ep, EPOLL_CTL_ADD, pl[i].sock, &ev);
+		send_connect(&pl[i], i);
+	}
+
+	/* wait for every player to be accepted and to get the lists */
+	end = now_s() + 5;
+	do {
+		n = epoll_wait(ep, evs, 64, 10);
+		for (i = 0 ; i < n ; i++)
+			pump(&pl[evs[i].data.u32]);
+		for (i = 0, connected = 0 ; i < nb ; i++)
+			connected += (pl[i].pub != 0);
+	} while (connected < nb && now_s() < end);
+	if (connected < nb) {
+		fprintf(stderr, "only %d players out of %d connected\n", connected, nb);
+		return 1;
+	}
+	end = now_s() + 1;
+	while (now_s() < end) {
+		n = epoll_wait(ep, evs, 64, 10);
+		for (i = 0 ; i < n ; i++)
+			pump(&pl[evs[i].data.u32]);
+	}
+
+	/* talk : the talkers send every millisecond, enough to keep the rate */
+	start = now_s();
+	end = start + secs;
+	next_tick = start;
+	next_ka = start;
+	cpu0 = proc_cpu(pid);
+	for (i = 0 ; i < nb ; i++)
+		rx0 += pl[i].audio_rx;
+	while ((t = now_s()) < end) {
+		if (t >= next_ka) {
+			for (i = 0 ; i < nb ; i++)
+				send_keepalive(&pl[i]);
+			next_ka += 1;
+		}
+		if (t >= next_tick) {
+			credit += rate * (t - next_tick + 0.001);
+			while (credit >= 1) {
+				for (i = 0 ; i < talkers ; i++)
+					send_audio(&pl[i]);
+				sent += talkers;
+				credit -= 1;
+			}
+			next_tick = t + 0.001;
+		}
+		n = epoll_wait(ep, evs, 64, 1);
+		for (i = 0 ; i < n ; i++)
+			pump(&pl[evs[i].data.u32]);
+	}
+	cpu1 = proc_cpu(pid);
+	/* the audio still in flight */
+	t = now_s() + 0.2;
+	while (now_s() < t) {
+		n = epoll_wait(ep, evs, 64, 10);
+		for (i = 0 ; i < n ; i++)
+			pump(&pl[evs[i].data.u32]);
+	}
+	for (i = 0 ; i < nb ; i++)
+		rx1 += pl[i].audio_rx;
+
+	printf("players %d, talkers %d, %d pkts/s each, %d s\n", nb, talkers, rate, secs);
+	printf("  audio sent        %10llu (%.0f pkts/s)\n", (unsigned long long)sent, sent / (double)secs);
+	printf("  audio forwarded   %10llu (%.0f pkts/s), %.1f%% of expected\n",
+			(unsigned long long)(rx1 - rx0), (rx1 - rx0) / (double)secs,
+			100.0 * (rx1 - rx0) / ((double)sent * (nb - 1)));
+	if (pid > 0)
+		printf("  server cpu        %10.1f %%, %.2f us per forwarded packet\n",
+				100 * (cpu1 - cpu0) / secs, 1e6 * (cpu1 - cpu0) / (rx1 - rx0 ? rx1 - rx0 : 1));
+	return 0;
+}
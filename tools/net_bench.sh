@@ -0,0 +1,6 @@
+#!/bin/sh
+# build the network load generator and run it against a running server
+# usage : tools/net_bench.sh [port players talkers pkts_per_talker_per_sec seconds]
+gcc -O2 -Wall -I. -Ioutput/default -o output/net_bench tools/net_bench.c -lpthread || exit 1
+PID=$(pgrep -x soliloque-serve | head -n 1)
+./output/net_bench ${1:-8767} ${2:-40} ${3:-4} ${4:-2000} ${5:-10} $PID
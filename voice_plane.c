@@ -0,0 +1,283 @@
+/*
+ * soliloque-server, an open source implementation of the TeamSpeak protocol.
+ * Copyright (C) 2009 Hugo Camboulive <hugo.camboulive AT gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "voice_plane.h"
+#include "server.h"
+#include "channel.h"
+#include "player.h"
+#include "audio_packet.h"
+#include "control_worker.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/**
+ * Initialize the voice plane of a server.
+ *
+ * @param s the server
+ * @param nb_readers the number of threads reading the snapshots
+ *
+ * @return 1 on success, 0 on failure
+ */
+int init_voice_plane(struct server *s, unsigned int nb_readers)
+{
+	struct voice_plane *v = &s->voice;
+	unsigned int i;
+
+	bzero(v, sizeof(struct voice_plane));
+	pthread_mutex_init(&v->retire_mutex, NULL);
+	if (posix_memalign((void **)&v->readers, 64, nb_readers * sizeof(struct voice_reader)) != 0) {
+		logger(LOG_ERR, "init_voice_plane, allocation of the readers failed.");
+		return 0;
+	}
+	for (i = 0 ; i < nb_readers ; i++)
+		v->readers[i].seen = VOICE_OFFLINE;
+	v->nb_readers = nb_readers;
+	/* the first snapshot is built by the control worker */
+	v->dirty = 1;
+	return 1;
+}
+
+static void free_retired_list(struct voice_retired *r)
+{
+	struct voice_retired *next;
+
+	for ( ; r != NULL ; r = next) {
+		next = r->next;
+		r->free_fn(r->ptr);
+		free(r);
+	}
+}
+
+static void destroy_voice_snapshot(void *ptr)
+{
+	struct voice_snapshot *snap = (struct voice_snapshot *)ptr;
+
+	free(snap->by_id);
+	free(snap);
+}
+
+/**
+ * Free everything the voice plane holds. The readers and
+ * the control worker must have been stopped.
+ *
+ * @param s the server
+ */
+void destroy_voice_plane(struct server *s)
+{
+	struct voice_plane *v = &s->voice;
+
+	free_retired_list(v->pending);
+	free_retired_list(v->limbo);
+	if (v->snap != NULL)
+		destroy_voice_snapshot(v->snap);
+	free(v->readers);
+	pthread_mutex_destroy(&v->retire_mutex);
+	bzero(v, sizeof(struct voice_plane));
+}
+
+/**
+ * Signal that the players or the channels of the server changed,
+ * so that the control worker publishes a new snapshot.
+ *
+ * @param s the server
+ */
+void voice_changed(struct server *s)
+{
+	if (__atomic_exchange_n(&s->voice.dirty, 1, __ATOMIC_ACQ_REL) == 0)
+		ctl_worker_wakeup(s);
+}
+
+/**
+ * Add some memory to the list of the memory retired
+ * since the last publication.
+ *
+ * @param v the voice plane
+ * @param ptr the memory
+ * @param free_fn the function freeing it
+ *
+ * @return 1 on success, 0 if the memory has been leaked
+ */
+static int add_pending(struct voice_plane *v, void *ptr, void (*free_fn)(void *))
+{
+	struct voice_retired *r;
+
+	r = (struct voice_retired *)calloc(1, sizeof(struct voice_retired));
+	if (r == NULL) {
+		/* leaking is better than freeing memory that is in use */
+		logger(LOG_ERR, "add_pending, calloc failed : %s.", strerror(errno));
+		return 0;
+	}
+	r->ptr = ptr;
+	r->free_fn = free_fn;
+	pthread_mutex_lock(&v->retire_mutex);
+	r->next = v->pending;
+	v->pending = r;
+	pthread_mutex_unlock(&v->retire_mutex);
+	return 1;
+}
+
+/**
+ * Free some memory the data plane might still be using, as soon
+ * as the snapshots it can see do not reference it anymore.
+ *
+ * @param s the server
+ * @param ptr the memory
+ * @param free_fn the function freeing it
+ */
+void voice_retire(struct server *s, void *ptr, void (*free_fn)(void *))
+{
+	/* the current snapshot may reference it : publish another one */
+	if (add_pending(&s->voice, ptr, free_fn))
+		voice_changed(s);
+}
+
+/**
+ * Rebuild the outdated audio plans of a server.
+ *
+ * @param s the server
+ */
+static void refresh_audio_plans(struct server *s)
+{
+	struct channel *ch;
+	struct audio_plan *plan;
+	size_t iter;
+
+	ar_each(struct channel *, ch, iter, s->chans)
+		if (ch->audio_plan != NULL && !__atomic_load_n(&ch->audio_plan_dirty, __ATOMIC_ACQUIRE))
+			continue;
+		__atomic_store_n(&ch->audio_plan_dirty, 0, __ATOMIC_RELAXED);
+		plan = build_audio_plan(ch);
+		if (plan == NULL) {
+			/* keep the old one and try again later */
+			__atomic_store_n(&ch->audio_plan_dirty, 1, __ATOMIC_RELAXED);
+			__atomic_store_n(&s->voice.dirty, 1, __ATOMIC_RELAXED);
+			continue;
+		}
+		/* the snapshot being built does not reference the old one */
+		if (ch->audio_plan != NULL)
+			add_pending(&s->voice, ch->audio_plan, (void (*)(void *))destroy_audio_plan);
+		ch->audio_plan = plan;
+	ar_end_each;
+}
+
+/**
+ * Build a new snapshot of the players of a server and make
+ * it visible to the data plane. Only the control worker
+ * may call this.
+ *
+ * @param s the server
+ */
+void voice_publish(struct server *s)
+{
+	struct voice_plane *v = &s->voice;
+	struct voice_snapshot *snap, *old;
+	struct voice_retired *r, *pending;
+	struct voice_entry *e;
+	struct player *pl;
+	size_t iter, size = 0;
+
+	refresh_audio_plans(s);
+
+	/* the slots up to the highest public ID in use */
+	ar_each(struct player *, pl, iter, s->players)
+		if (pl->public_id > size)
+			size = pl->public_id;
+	ar_end_each;
+	snap = (struct voice_snapshot *)calloc(1, sizeof(struct voice_snapshot));
+	if (snap != NULL) {
+		snap->size = size;
+		snap->by_id = (struct voice_entry *)calloc(snap->size + 1, sizeof(struct voice_entry));
+	}
+	if (snap == NULL || snap->by_id == NULL) {
+		logger(LOG_ERR, "voice_publish, calloc failed : %s.", strerror(errno));
+		free(snap);
+		__atomic_store_n(&v->dirty, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	ar_each(struct player *, pl, iter, s->players)
+		if (pl->in_chan == NULL || pl->public_id == 0 || pl->public_id > snap->size)
+			continue;
+		e = &snap->by_id[pl->public_id - 1];
+		e->pl = pl;
+		e->private_id = pl->private_id;
+		e->audio_idx = pl->audio_idx;
+		e->codec = pl->in_chan->codec;
+		e->plan = pl->in_chan->audio_plan;
+	ar_end_each;
+
+	old = v->snap;
+	if (old != NULL)
+		add_pending(v, old, destroy_voice_snapshot);
+	/* what was retired until now is not in the new snapshot */
+	pthread_mutex_lock(&v->retire_mutex);
+	pending = v->pending;
+	v->pending = NULL;
+	pthread_mutex_unlock(&v->retire_mutex);
+
+	snap->gen = v->gen + 1;
+	__atomic_store_n(&v->snap, snap, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&v->gen, snap->gen, __ATOMIC_SEQ_CST);
+
+	/* wait until every reader has seen the new generation */
+	while (pending != NULL) {
+		r = pending;
+		pending = r->next;
+		r->gen = snap->gen;
+		r->next = v->limbo;
+		v->limbo = r;
+	}
+}
+
+/**
+ * Free the retired memory no reader can see anymore.
+ * Only the control worker may call this.
+ *
+ * @param s the server
+ *
+ * @return 1 if some memory is still waiting for the readers
+ */
+int voice_reclaim(struct server *s)
+{
+	struct voice_plane *v = &s->voice;
+	struct voice_retired *r, **prev, *done = NULL;
+	uint64_t min_seen = VOICE_OFFLINE, seen;
+	unsigned int i;
+
+	if (v->limbo == NULL)
+		return 0;
+	for (i = 0 ; i < v->nb_readers ; i++) {
+		seen = __atomic_load_n(&v->readers[i].seen, __ATOMIC_SEQ_CST);
+		if (seen < min_seen)
+			min_seen = seen;
+	}
+	prev = &v->limbo;
+	while ((r = *prev) != NULL) {
+		if (r->gen <= min_seen) {
+			*prev = r->next;
+			r->next = done;
+			done = r;
+		} else {
+			prev = &r->next;
+		}
+	}
+	free_retired_list(done);
+	return v->limbo != NULL;
+}
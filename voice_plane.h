@@ -0,0 +1,139 @@
+/*
+ * soliloque-server, an open source implementation of the TeamSpeak protocol.
+ * Copyright (C) 2009 Hugo Camboulive <hugo.camboulive AT gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __VOICE_PLANE_H__
+#define __VOICE_PLANE_H__
+
+#include <stdint.h>
+#include <pthread.h>
+
+struct server;
+struct player;
+struct audio_plan;
+
+/* a reader that is blocked outside of the data plane */
+#define VOICE_OFFLINE UINT64_MAX
+
+/**
+ * What the data plane needs to know about a player.
+ */
+struct voice_entry {
+	struct player *pl;		/* NULL if the slot is free */
+	uint32_t private_id;
+	unsigned int audio_idx;		/* index of the player in plan */
+	uint8_t codec;			/* codec of its channel */
+	struct audio_plan *plan;	/* audio plan of its channel */
+};
+
+/**
+ * Immutable view of the players and channels of a server,
+ * published by the control worker and read by the receive
+ * thread(s) without locking.
+ */
+struct voice_snapshot {
+	uint64_t gen;
+	size_t size;			/* number of slots */
+	struct voice_entry *by_id;	/* slot = public_id - 1 */
+};
+
+/**
+ * A thread that reads the snapshot. It publishes the generation
+ * it has seen each time it holds no reference to the snapshot.
+ */
+struct voice_reader {
+	uint64_t seen;
+} __attribute__((aligned(64)));
+
+/**
+ * Memory freed once no reader can see it anymore.
+ */
+struct voice_retired {
+	void *ptr;
+	void (*free_fn)(void *);
+	uint64_t gen;		/* first generation without ptr */
+	struct voice_retired *next;
+};
+
+struct voice_plane {
+	struct voice_snapshot *snap;	/* current snapshot */
+	uint64_t gen;			/* generation of snap */
+	int dirty;			/* snap needs to be rebuilt */
+
+	pthread_mutex_t retire_mutex;
+	struct voice_retired *pending;	/* waiting for the next publication */
+	struct voice_retired *limbo;	/* waiting for the readers */
+
+	unsigned int nb_readers;
+	struct voice_reader *readers;
+};
+
+int init_voice_plane(struct server *s, unsigned int nb_readers);
+void destroy_voice_plane(struct server *s);
+void voice_changed(struct server *s);
+void voice_retire(struct server *s, void *ptr, void (*free_fn)(void *));
+void voice_publish(struct server *s);
+int voice_reclaim(struct server *s);
+
+/**
+ * Tell the writer that a reader does not hold any reference
+ * to a snapshot it loaded before this call.
+ *
+ * @param v the voice plane
+ * @param r the reader
+ */
+static inline void voice_quiescent(struct voice_plane *v, struct voice_reader *r)
+{
+	__atomic_store_n(&r->seen, __atomic_load_n(&v->gen, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Tell the writer that a reader is going to block, and will not
+ * look at the snapshot until voice_quiescent() is called again.
+ *
+ * @param r the reader
+ */
+static inline void voice_offline(struct voice_reader *r)
+{
+	__atomic_store_n(&r->seen, VOICE_OFFLINE, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Retrieve the entry of a player in the current snapshot.
+ * The caller must be between voice_quiescent() and voice_offline().
+ *
+ * @param v the voice plane
+ * @param pub_id the public ID of the player
+ * @param priv_id the private ID of the player
+ *
+ * @return the entry, or NULL if the IDs do not match a player
+ */
+static inline const struct voice_entry *voice_lookup(struct voice_plane *v,
+		uint32_t pub_id, uint32_t priv_id)
+{
+	struct voice_snapshot *snap = __atomic_load_n(&v->snap, __ATOMIC_SEQ_CST);
+	const struct voice_entry *e;
+
+	if (snap == NULL || pub_id == 0 || pub_id > snap->size)
+		return NULL;
+	e = &snap->by_id[pub_id - 1];
+	if (e->pl == NULL || e->private_id != priv_id)
+		return NULL;
+	return e;
+}
+
+#endif